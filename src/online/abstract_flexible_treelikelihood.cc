@@ -1,12 +1,14 @@
 #include "abstract_flexible_treelikelihood.h"
 
+#include <stdexcept>
+
 using namespace std;
 using namespace bpp;
 
 namespace sts {
     namespace online {
         
-        size_t AbstractFlexibleTreeLikelihood::operationCallCount = 0;
+        std::atomic<size_t> AbstractFlexibleTreeLikelihood::operationCallCount(0);
         
         AbstractFlexibleTreeLikelihood::AbstractFlexibleTreeLikelihood(const bpp::SitePatterns& patterns, const bpp::SubstitutionModel &model, const bpp::DiscreteDistribution& rateDist, bool useAmbiguities):
 			_model(&model), _rateDist(&rateDist), _tree(nullptr), _useAmbiguities(useAmbiguities){
@@ -14,6 +16,9 @@ namespace sts {
             std::unique_ptr<bpp::SiteContainer> sc(patterns.getSites());
             _taxa = sc->getSequencesNames();
             _sequenceCount = _taxa.size();
+            for(size_t i = 0; i < _taxa.size(); i++){
+                _taxonIndexes[_taxa[i]] = i;
+            }
             _totalNodeCount = (_sequenceCount * 2) - 1;
             _rateCount = rateDist.getNumberOfCategories();
             _patternCount = patterns.getWeights().size();
@@ -33,8 +38,30 @@ namespace sts {
         }
         
         
+        size_t AbstractFlexibleTreeLikelihood::taxonIndex(const std::string& taxonName) const{
+            auto it = _taxonIndexes.find(taxonName);
+            if(it == _taxonIndexes.end()){
+                throw std::invalid_argument("Unknown taxon: " + taxonName);
+            }
+            return it->second;
+        }
+        
+        void AbstractFlexibleTreeLikelihood::updateTree(){
+            initialize(*_model, *_rateDist, *_tree);
+        }
+        
+        void AbstractFlexibleTreeLikelihood::updateNode(const bpp::Node& node){
+            if(node.hasFather()){
+                _flatTree.setBranchLength(node.getId(), node.getDistanceToFather());
+            }
+            _needNodeUpdate[node.getId()] = true;
+            _updatePartials = true;
+            _updateUpperPartials = true;
+        }
+        
         void AbstractFlexibleTreeLikelihood::initialize(const bpp::SubstitutionModel &model, const bpp::DiscreteDistribution& rateDist, bpp::TreeTemplate<bpp::Node>& tree){
             _tree = &tree;
+            _flatTree.assign(tree);
             _model = &model;
             _rateDist = &rateDist;
             
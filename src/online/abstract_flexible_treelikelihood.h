@@ -2,6 +2,9 @@
 #define AbstractFlexibleTreeLikelihood_hpp
 
 #include <stdio.h>
+#include <atomic>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
 #include <Bpp/Phyl/TreeTemplate.h>
@@ -9,6 +12,7 @@
 #include <Bpp/Phyl/Model/SubstitutionModel.h>
 #include <Bpp/Numeric/Prob/DiscreteDistribution.h>
 
+#include "flat_tree.h"
 #include "flexible_tree_likelihood.h"
 
 namespace sts {
@@ -23,20 +27,33 @@ namespace sts {
             
             virtual void initialize(const bpp::SubstitutionModel &model,const  bpp::DiscreteDistribution& rateDist, bpp::TreeTemplate<bpp::Node>& tree);
             
+            // Initializes again with the same tree
+            virtual void updateTree();
+            
+            virtual void updateNode(const bpp::Node& node);
+            
+            virtual size_t taxonIndex(const std::string& taxonName) const;
+            
             virtual double calculateLogLikelihood() = 0;
             
-            virtual double calculateLogLikelihood(const bpp::Node& distal, std::string taxonName, double pendantLength, double distalLength, double proximalLength) = 0;
+            virtual double calculateLogLikelihood(const bpp::Node& distal, size_t taxonIndex, double pendantLength, double distalLength, double proximalLength) = 0;
             
             // Compute derivatives at node node with current tree
 //            virtual void calculateDerivatives(const bpp::Node& node, double* d1, double* d2) = 0;
             
-            // Compute derivatives of pendant branch with taxon taxonName
-            virtual void calculatePendantDerivatives(const bpp::Node& distal, std::string taxonName, double pendantLength, double distalLength, double proximalLength, double* d1, double* d2) = 0;
+            // Compute derivatives of pendant branch with taxon taxonIndex
+            virtual double calculatePendantDerivatives(const bpp::Node& distal, size_t taxonIndex, double pendantLength, double distalLength, double proximalLength, double* d1, double* d2) = 0;
+            
+            virtual double calculateDistalDerivatives(const bpp::Node& distal, size_t taxonIndex, double pendantLength, double distalLength, double proximalLength, double* d1, double* d2) = 0;
             
-            virtual void calculateDistalDerivatives(const bpp::Node& distal, std::string taxonName, double pendantLength, double distalLength, double proximalLength, double* d1, double* d2) = 0;
+            using FlexibleTreeLikelihood::initialize;
+            using FlexibleTreeLikelihood::calculateLogLikelihood;
+            using FlexibleTreeLikelihood::calculatePendantDerivatives;
+            using FlexibleTreeLikelihood::calculateDistalDerivatives;
             
         public:
-            static size_t operationCallCount;
+            // Shared by the calculators of all the workers
+            static std::atomic<size_t> operationCallCount;
             
         protected:
 	        
@@ -48,8 +65,11 @@ namespace sts {
             bpp::SubstitutionModel const* _model;
             bpp::DiscreteDistribution const* _rateDist;
             bpp::TreeTemplate<bpp::Node>* _tree;
+            // Copy of _tree traversed by the calculations, branch lengths are refreshed by updateNode
+            FlatTree _flatTree;
             
             std::vector<std::string> _taxa;
+            std::unordered_map<std::string, size_t> _taxonIndexes;
             
             bool _useAmbiguities;
             
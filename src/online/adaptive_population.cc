@@ -0,0 +1,63 @@
+#include "adaptive_population.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+namespace sts { namespace online {
+
+AdaptivePopulation::AdaptivePopulation(size_t minimum, size_t maximum, double growBelow, double shrinkAbove) :
+    _minimum(minimum),
+    _maximum(maximum),
+    _growBelow(growBelow),
+    _shrinkAbove(shrinkAbove)
+{
+    if(minimum == 0 || maximum < minimum)
+        throw std::invalid_argument("Population bounds must satisfy 0 < minimum <= maximum");
+    if(!(growBelow <= shrinkAbove))
+        throw std::invalid_argument("The population cannot grow above the fraction at which it shrinks");
+}
+
+size_t AdaptivePopulation::next(size_t count, double ess, size_t uniqueParticles) const
+{
+    const double health = std::min(ess, static_cast<double>(uniqueParticles)) / count;
+    size_t result = count;
+    if(health < _growBelow)
+        result = 2 * count;
+    else if(health > _shrinkAbove)
+        result = count / 2;
+    return std::max(_minimum, std::min(_maximum, result));
+}
+
+std::vector<size_t> systematicResample(const std::vector<double>& logWeights, size_t count, double u)
+{
+    const double maxLogWeight = *std::max_element(logWeights.begin(), logWeights.end());
+    if(!std::isfinite(maxLogWeight))
+        throw std::invalid_argument("At least one weight must be positive and finite");
+
+    double sum = 0;
+    for(double logWeight : logWeights)
+        sum += std::exp(logWeight - maxLogWeight);
+
+    // Evenly spaced points through the cumulative weights, all shifted by u
+    std::vector<size_t> indexes;
+    indexes.reserve(count);
+    const double step = sum / count;
+    double point = u * step;
+    double cumulative = 0;
+    size_t last = 0;
+    for(size_t i = 0; i < logWeights.size() && indexes.size() < count; i++) {
+        const double weight = std::exp(logWeights[i] - maxLogWeight);
+        if(weight > 0)
+            last = i;
+        cumulative += weight;
+        for(; point < cumulative && indexes.size() < count; point += step)
+            indexes.push_back(i);
+    }
+    // Rounding may leave the last points past the end
+    while(indexes.size() < count)
+        indexes.push_back(last);
+    return indexes;
+}
+
+}} // namespaces
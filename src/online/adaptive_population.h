@@ -0,0 +1,48 @@
+#ifndef STS_ONLINE_ADAPTIVE_POPULATION_H
+#define STS_ONLINE_ADAPTIVE_POPULATION_H
+
+#include <cstddef>
+#include <vector>
+
+namespace sts { namespace online {
+
+/// \brief Chooses the number of particles of the next generation from how the last one went
+///
+/// A generation is judged by the smaller of its ESS and of its number of distinct particles, as a fraction of the
+/// population: the population doubles when it falls below \c growBelow, so that hard insertions get more particles,
+/// and halves when it stays above \c shrinkAbove, so that easy ones do not carry redundant copies.
+/// The result is always within <c>[minimum, maximum]</c>.
+class AdaptivePopulation
+{
+public:
+    /// \param minimum Smallest population, at least one particle
+    /// \param maximum Largest population, no smaller than \c minimum
+    /// \param growBelow Fraction of the population under which it grows
+    /// \param shrinkAbove Fraction of the population over which it shrinks, no smaller than \c growBelow
+    AdaptivePopulation(size_t minimum, size_t maximum, double growBelow = 0.5, double shrinkAbove = 0.9);
+
+    /// Number of particles after a generation of \c count particles
+    /// \param count Current number of particles
+    /// \param ess Effective sample size of the last generation
+    /// \param uniqueParticles Number of distinct particles of the last generation
+    size_t next(size_t count, double ess, size_t uniqueParticles) const;
+
+    size_t minimum() const { return _minimum; }
+    size_t maximum() const { return _maximum; }
+private:
+    size_t _minimum;
+    size_t _maximum;
+    double _growBelow;
+    double _shrinkAbove;
+};
+
+/// Systematic resampling of \c count indexes into \c logWeights, each index appearing in proportion to its weight
+/// \param logWeights Unnormalized log weights, at least one of them finite
+/// \param count Number of indexes to draw
+/// \param u Uniform draw in [0, 1), shared by all the indexes
+/// \returns Indexes in increasing order
+std::vector<size_t> systematicResample(const std::vector<double>& logWeights, size_t count, double u);
+
+}} // namespaces
+
+#endif // STS_ONLINE_ADAPTIVE_POPULATION_H
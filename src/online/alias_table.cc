@@ -0,0 +1,74 @@
+#include "alias_table.h"
+
+#include <cmath>
+#include <stdexcept>
+
+#include <smctc.hh>
+
+namespace sts { namespace online {
+
+AliasTable::AliasTable()
+{}
+
+AliasTable::AliasTable(const std::vector<double>& weights)
+{
+    assign(weights);
+}
+
+void AliasTable::assign(const std::vector<double>& weights)
+{
+    _probabilities.assign(weights.begin(), weights.end());
+    build();
+}
+
+void AliasTable::build()
+{
+    const size_t n = _probabilities.size();
+    double sum = 0;
+    for(double weight : _probabilities) {
+        if(weight < 0)
+            throw std::invalid_argument("Weights must be non-negative");
+        sum += weight;
+    }
+    if(!(sum > 0) || !std::isfinite(sum))
+        throw std::invalid_argument("Weights must have a positive and finite sum");
+
+    // Columns of average height 1, those below are topped up by one above
+    _aliases.resize(n);
+    _small.clear();
+    _large.clear();
+    for(size_t i = 0; i < n; i++) {
+        _probabilities[i] *= n / sum;
+        _aliases[i] = i;
+        (_probabilities[i] < 1 ? _small : _large).push_back(i);
+    }
+    while(!_small.empty() && !_large.empty()) {
+        const size_t s = _small.back();
+        _small.pop_back();
+        const size_t l = _large.back();
+        _aliases[s] = l;
+        _probabilities[l] = (_probabilities[l] + _probabilities[s]) - 1;
+        if(_probabilities[l] < 1) {
+            _large.pop_back();
+            _small.push_back(l);
+        }
+    }
+    // Left over from rounding errors, full up to them
+    for(size_t i : _large)
+        _probabilities[i] = 1;
+    for(size_t i : _small)
+        _probabilities[i] = 1;
+}
+
+size_t AliasTable::draw(smc::rng& rng) const
+{
+    const size_t n = _probabilities.size();
+    // The integer part picks the column, the fractional part whether to keep it
+    const double x = rng.UniformS() * n;
+    size_t i = static_cast<size_t>(x);
+    if(i >= n)
+        i = n - 1;
+    return x - i < _probabilities[i] ? i : _aliases[i];
+}
+
+}} // namespaces
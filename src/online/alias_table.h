@@ -0,0 +1,63 @@
+#ifndef STS_ONLINE_ALIAS_TABLE_H
+#define STS_ONLINE_ALIAS_TABLE_H
+
+#include <cstddef>
+#include <vector>
+
+namespace smc {
+class rng;
+}
+
+namespace sts { namespace online {
+
+/// \brief Walker's alias table, drawing indexes with probabilities proportional to a set of weights
+///
+/// Built in linear time with Vose's method, after which each draw takes a single uniform variate and no allocation,
+/// so that one table serves any number of draws from the same distribution.
+class AliasTable
+{
+public:
+    AliasTable();
+
+    /// \param weights Non-negative, with a positive sum
+    explicit AliasTable(const std::vector<double>& weights);
+
+    /// Replace the distribution with \c weights, reusing the storage
+    void assign(const std::vector<double>& weights);
+
+    /// Same as above, for \c count weights read through \c weight(i)
+    template<typename Weight>
+    void assign(size_t count, Weight weight);
+
+    /// Index \c i with probability proportional to its weight
+    size_t draw(smc::rng& rng) const;
+
+    size_t size() const { return _probabilities.size(); }
+
+    bool empty() const { return _probabilities.empty(); }
+
+private:
+    /// Fill the table from the weights in #_probabilities
+    void build();
+
+    /// Probability of keeping each column rather than going to its alias
+    std::vector<double> _probabilities;
+    std::vector<size_t> _aliases;
+
+    // Reused by build
+    std::vector<size_t> _small;
+    std::vector<size_t> _large;
+};
+
+template<typename Weight>
+void AliasTable::assign(size_t count, Weight weight)
+{
+    _probabilities.resize(count);
+    for(size_t i = 0; i < count; i++)
+        _probabilities[i] = weight(i);
+    build();
+}
+
+}} // namespaces
+
+#endif // STS_ONLINE_ALIAS_TABLE_H
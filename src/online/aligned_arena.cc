@@ -0,0 +1,83 @@
+#include "aligned_arena.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+namespace sts { namespace online {
+
+namespace {
+// Size of a huge page on x86-64 and most ARM64 kernels
+const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+}
+
+const size_t AlignedArena::ALIGNMENT;
+
+AlignedArena::AlignedArena() :
+    _data(nullptr),
+    _size(0),
+    _hugePages(false)
+{}
+
+AlignedArena::~AlignedArena()
+{
+    release();
+}
+
+size_t AlignedArena::reserveBytes(size_t bytes)
+{
+    const size_t offset = _size;
+    _size += (bytes + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+    return offset;
+}
+
+void AlignedArena::allocate(bool hugePages)
+{
+    release();
+
+    size_t alignment = ALIGNMENT;
+    size_t size = _size;
+    _hugePages = false;
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    // Huge pages are only worth it for blocks spanning several of them
+    if(hugePages && _size >= HUGE_PAGE_SIZE) {
+        alignment = HUGE_PAGE_SIZE;
+        size = (_size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+        _hugePages = true;
+    }
+#else
+    (void)hugePages;
+#endif
+
+    void* data = nullptr;
+    if(posix_memalign(&data, alignment, size == 0 ? ALIGNMENT : size) != 0)
+        throw std::bad_alloc();
+    _data = static_cast<char*>(data);
+
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    // Advisory only: the kernel falls back to regular pages when transparent huge pages are disabled
+    if(_hugePages)
+        madvise(_data, size, MADV_HUGEPAGE);
+#endif
+
+    std::memset(_data, 0, size);
+}
+
+void AlignedArena::clear()
+{
+    release();
+    _size = 0;
+    _hugePages = false;
+}
+
+void AlignedArena::release()
+{
+    std::free(_data);
+    _data = nullptr;
+}
+
+}} // namespaces
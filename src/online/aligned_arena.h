@@ -0,0 +1,71 @@
+#ifndef STS_ONLINE_ALIGNED_ARENA_H
+#define STS_ONLINE_ALIGNED_ARENA_H
+
+#include <cstddef>
+
+namespace sts { namespace online {
+
+/// \brief A single block of memory holding many buffers, each aligned on a cache line
+///
+/// Buffers are laid out in two steps: #reserve is called for each buffer and returns its offset, then #allocate
+/// obtains the whole block at once. Pointers to the buffers are only valid after #allocate.
+///
+/// On Linux, the block may be backed by transparent huge pages, which cuts TLB misses when the buffers span many
+/// megabytes.
+class AlignedArena
+{
+public:
+    /// Alignment of every buffer, in bytes
+    static const size_t ALIGNMENT = 64;
+
+    AlignedArena();
+
+    ~AlignedArena();
+
+    AlignedArena(const AlignedArena&) = delete;
+    AlignedArena& operator=(const AlignedArena&) = delete;
+
+    /// \brief Reserve a buffer of \c count elements of type \c T
+    ///
+    /// \return Offset of the buffer in bytes, to be passed to #at
+    template<typename T>
+    size_t reserve(size_t count)
+    {
+        return reserveBytes(count * sizeof(T));
+    }
+
+    /// \brief Allocate the reserved buffers, zero-initialized
+    ///
+    /// Any block allocated previously is released.
+    /// \param hugePages Request huge pages; ignored where they are not available.
+    void allocate(bool hugePages=false);
+
+    /// Release the block and forget the reserved buffers
+    void clear();
+
+    /// Pointer to the buffer reserved at \c offset
+    template<typename T>
+    T* at(size_t offset) const
+    {
+        return reinterpret_cast<T*>(_data + offset);
+    }
+
+    /// Size of the arena in bytes
+    size_t size() const { return _size; }
+
+    /// Whether the block is backed by huge pages, when the kernel provides them
+    bool hugePages() const { return _hugePages; }
+
+private:
+    size_t reserveBytes(size_t bytes);
+
+    void release();
+
+    char* _data;
+    size_t _size;
+    bool _hugePages;
+};
+
+}} // namespaces
+
+#endif // STS_ONLINE_ALIGNED_ARENA_H
@@ -0,0 +1,33 @@
+#ifndef STS_ONLINE_ATTACHMENT_CONTEXT_H
+#define STS_ONLINE_ATTACHMENT_CONTEXT_H
+
+namespace sts { namespace online {
+
+/// \brief Repeated evaluations of the attachment of one taxon on one edge
+///
+/// Obtained from #sts::online::FlexibleTreeLikelihood::createAttachmentContext for the edge above a node. Only the
+/// pendant and distal branch lengths vary between calls, the proximal length being the rest of the edge.
+/// Implementations keep whatever does not depend on the branch length that changed since the previous call, so sweeps
+/// over a single length, as done by optimizers, are cheap.
+///
+/// A context must not outlive the calculator it was obtained from.
+class AttachmentContext
+{
+public:
+    virtual ~AttachmentContext() {}
+
+    /// Log likelihood of the tree with the taxon attached
+    virtual double logLikelihood(double pendantLength, double distalLength) = 0;
+
+    /// First and second derivatives of the log likelihood with respect to the pendant branch length
+    /// \return The log likelihood
+    virtual double pendantDerivatives(double pendantLength, double distalLength, double* d1, double* d2) = 0;
+
+    /// First and second derivatives of the log likelihood with respect to the distal branch length
+    /// \return The log likelihood
+    virtual double distalDerivatives(double pendantLength, double distalLength, double* d1, double* d2) = 0;
+};
+
+}} // namespaces
+
+#endif // STS_ONLINE_ATTACHMENT_CONTEXT_H
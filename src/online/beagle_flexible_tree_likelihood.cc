@@ -95,39 +95,41 @@ namespace sts {
             }
         }
         
-        void BeagleFlexibleTreeLikelihood::traverseUpper(const bpp::Node* node){
-            
-            if(node->hasFather()){
-                const bpp::Node* parent = node->getFather();
-                const bpp::Node* sibling = parent->getSon(0);
-                if (sibling == node) {
-                    sibling = parent->getSon(1);
+        void BeagleFlexibleTreeLikelihood::traverseUpper(){
+            const std::vector<int>& order = _flatTree.postOrder();
+            
+            // Parents before their children
+            for(auto it = order.rbegin(); it != order.rend(); ++it){
+                const int nodeId = *it;
+                const int parentId = _flatTree.parent(nodeId);
+                if(parentId == FlatTree::NONE){
+                    continue;
                 }
                 
-                if(parent->hasFather()){
-                    const bpp::Node* grandParent = parent->getFather();
-                    const int idSibling = sibling->getId();
+                const int grandParentId = _flatTree.parent(parentId);
+                if(grandParentId != FlatTree::NONE){
+                    const int idSibling = _flatTree.sibling(nodeId);
                     
-                    int idMatrix = parent->getId();
+                    int idMatrix = parentId;
                     
                     // The sons of the right node of the root are going to use the lower partials of the left node of the root
-                    if(!grandParent->hasFather() && grandParent->getSon(1) == parent){
-                        idMatrix = grandParent->getSon(0)->getId();
+                    if(_flatTree.parent(grandParentId) == FlatTree::NONE && _flatTree.child(grandParentId, 1) == parentId){
+                        idMatrix = _flatTree.child(grandParentId, 0);
                     }
                     
-                    _upperPartialsIndexes[node->getId()] = node->getId()+_totalNodeCount;
+                    _upperPartialsIndexes[nodeId] = nodeId+_totalNodeCount;
 
                     _operations.push_back(BeagleOperation(
-                                                          {_upperPartialsIndexes[node->getId()],      // Destination buffer
+                                                          {_upperPartialsIndexes[nodeId],      // Destination buffer
                                                               BEAGLE_OP_NONE,    // (output) scaling buffer index
                                                               BEAGLE_OP_NONE,    // (input) scaling buffer index
-                                                              _upperPartialsIndexes[parent->getId()],     // Index of first child partials buffer
+                                                              _upperPartialsIndexes[parentId],     // Index of first child partials buffer
                                                               idMatrix,          // Index of first child transition matrix
                                                               idSibling,         // Index of second child partials buffer
                                                               idSibling}));
                     if (_useScaleFactors) {
                         // get the index of this scaling buffer
-                        const int indexInternal = node->getId() - _leafCount + _internalNodeCount+1;
+                        const int indexInternal = nodeId - _leafCount + _internalNodeCount+1;
                         _scaleBufferUpperIndices[indexInternal] = indexInternal;
                         
                         if (_recomputeScaleFactors) {
@@ -143,51 +145,38 @@ namespace sts {
                         }
                     }
                 }
-                // We dont need to calculate upper partials for the left son of the root as it is using the lower partials of its sibling
-                // Left node of the root (function should never be called on theright node of the root)
-                else if(parent->getSon(0) == node){
-                    _upperPartialsIndexes[node->getId()] = parent->getSon(1)->getId();
-                    if (_useScaleFactors) {
-                        const int indexInternal = node->getId() - _leafCount + _internalNodeCount+1;
-                        _scaleBufferUpperIndices[indexInternal] = parent->getSon(1)->getId() - _sequenceCount;
-                    }
-                }
+                // We dont need to calculate upper partials for the children of the root as they use the lower partials of their sibling
                 else{
-                    _upperPartialsIndexes[node->getId()] = parent->getSon(0)->getId();
+                    const int idSibling = _flatTree.sibling(nodeId);
+                    _upperPartialsIndexes[nodeId] = idSibling;
                     if (_useScaleFactors) {
-                        const int indexInternal = node->getId() - _leafCount + _internalNodeCount+1;
-                        _scaleBufferUpperIndices[indexInternal] = parent->getSon(0)->getId() - _sequenceCount;
+                        const int indexInternal = nodeId - _leafCount + _internalNodeCount+1;
+                        _scaleBufferUpperIndices[indexInternal] = idSibling - _sequenceCount;
                     }
                 }
             }
-            
-            if(node->getNumberOfSons() > 0){
-                traverseUpper(node->getSon(0));
-                traverseUpper(node->getSon(1));
-            }
         }
 
         
-        bool BeagleFlexibleTreeLikelihood::traverse(const bpp::Node* node){
-            bool update = _needNodeUpdate[node->getId()];
-            
-            if(node->hasFather() && update){
-                _matrixUpdateIndices.push_back(node->getId());
-                _branchLengths.push_back(node->getDistanceToFather());
-            }
-            
-            if(node->getNumberOfSons() > 0){
+        void BeagleFlexibleTreeLikelihood::traverse(){
+            for(int nodeId : _flatTree.postOrder()){
+                if(_needNodeUpdate[nodeId] && _flatTree.parent(nodeId) != FlatTree::NONE){
+                    _matrixUpdateIndices.push_back(nodeId);
+                    _branchLengths.push_back(_flatTree.branchLength(nodeId));
+                }
                 
-                bool update1 = traverse(node->getSon(0));
-                bool update2 = traverse(node->getSon(1));
+                if(_flatTree.isLeaf(nodeId)){
+                    continue;
+                }
                 
-                if( update1 || update2 ){
-                    
-                    int id1 = node->getSon(0)->getId();
-                    int id2 = node->getSon(1)->getId();
+                const int id1 = _flatTree.child(nodeId, 0);
+                const int id2 = _flatTree.child(nodeId, 1);
+                
+                // Children come first in the post-order, their flags already include their own subtree
+                if( _needNodeUpdate[id1] || _needNodeUpdate[id2] ){
         
                     _operations.push_back(BeagleOperation(
-                                                          {node->getId(),      // Destination buffer
+                                                          {nodeId,      // Destination buffer
                                                               BEAGLE_OP_NONE,    // (output) scaling buffer index
                                                               BEAGLE_OP_NONE,    // (input) scaling buffer index
                                                               id1,               // Index of first child partials buffer
@@ -197,7 +186,7 @@ namespace sts {
                     
                     if (_useScaleFactors) {
                         // get the index of this scaling buffer
-                        int indexInternal = node->getId() - _leafCount;
+                        int indexInternal = nodeId - _leafCount;
                         
                         if (_recomputeScaleFactors) {
                             // store the index
@@ -211,26 +200,25 @@ namespace sts {
                         }
                     }
                     
-                    update |= (update1 | update2);
+                    _needNodeUpdate[nodeId] = true;
                 }
             }
-            return update;
         }
         
-        double BeagleFlexibleTreeLikelihood::calculateLogLikelihood(const bpp::Node& distal, std::string taxonName, double pendantLength, double distalLength, double proximalLength){
+        double BeagleFlexibleTreeLikelihood::calculateLogLikelihood(const bpp::Node& distal, size_t taxonIndex, double pendantLength, double distalLength, double proximalLength){
             
             _branchLengths.clear();
             _matrixUpdateIndices.clear();
             _operations.clear();
             
             if(_updatePartials){
-                traverse(_tree->getRootNode());
-                traverseUpper(_tree->getRootNode());
+                traverse();
+                traverseUpper();
                 _updatePartials = _updateUpperPartials = false;
                 _needNodeUpdate.assign(_totalNodeCount, false);
             }
             else if(_updateUpperPartials){
-            	traverseUpper(_tree->getRootNode());
+            	traverseUpper();
                 _updateUpperPartials = false;
             }
             
@@ -239,7 +227,7 @@ namespace sts {
             int cumulateScaleBufferIndex = BEAGLE_OP_NONE;
 
             const int distalIndex = distal.getId();
-            const int indexTaxon = std::find(_taxa.begin(), _taxa.end(), taxonName) - _taxa.begin();
+            const int indexTaxon = taxonIndex;
             const int tmpPartialsIndex = _totalNodeCount*2;
             
             // Temporary transition matrices
@@ -341,7 +329,7 @@ namespace sts {
                     _useScaleFactors = true;
                     _recomputeScaleFactors = true;
                     
-                    traverse(_tree->getRootNode());
+                    traverse();
                 }
                 else{
                     break;
@@ -362,8 +350,8 @@ namespace sts {
             const int category_weight_index = 0;
             const int state_frequency_index = 0;
             
-            int rootIndex = _tree->getRootNode()->getId();
-            traverse(_tree->getRootNode());
+            int rootIndex = _flatTree.root();
+            traverse();
             
             _logLnl = 0;
             
@@ -419,7 +407,7 @@ namespace sts {
                     _recomputeScaleFactors = true;
                     _operations.clear();
                     
-                    traverse(_tree->getRootNode());
+                    traverse();
                 }
                 else{
                     break;
@@ -434,26 +422,26 @@ namespace sts {
             return _logLnl;
         }
         
-        // Compute derivatives of pendant branch with taxon taxonName
-        void BeagleFlexibleTreeLikelihood::calculateDistalDerivatives(const bpp::Node& distal, std::string taxonName, double pendantLength, double distalLength, double proximalLength, double* d1, double* d2){
+        // Compute derivatives of pendant branch with taxon taxonIndex
+        double BeagleFlexibleTreeLikelihood::calculateDistalDerivatives(const bpp::Node& distal, size_t taxonIndex, double pendantLength, double distalLength, double proximalLength, double* d1, double* d2){
             
             _branchLengths.clear();
             _matrixUpdateIndices.clear();
             _operations.clear();
             
             if(_updatePartials){
-                traverse(_tree->getRootNode());
-                traverseUpper(_tree->getRootNode());
+                traverse();
+                traverseUpper();
                 _updatePartials = _updateUpperPartials = false;
                 _needNodeUpdate.assign(_totalNodeCount, false);
             }
             else if(_updateUpperPartials){
-                traverseUpper(_tree->getRootNode());
+                traverseUpper();
                 _updateUpperPartials = false;
             }
             
             const int distalIndex = distal.getId();
-            const int indexTaxon = std::find(_taxa.begin(), _taxa.end(), taxonName) - _taxa.begin();
+            const int indexTaxon = taxonIndex;
             const int tmpPartialsIndex = _totalNodeCount*2;
             
             // Temporary transition matrices
@@ -525,27 +513,28 @@ namespace sts {
 
             *d1 = dd1;
             *d2 = dd2;
+            return logLike;
         }
         
-        void BeagleFlexibleTreeLikelihood::calculatePendantDerivatives(const bpp::Node& distal, std::string taxonName, double pendantLength, double distalLength, double proximalLength, double* d1, double* d2){
+        double BeagleFlexibleTreeLikelihood::calculatePendantDerivatives(const bpp::Node& distal, size_t taxonIndex, double pendantLength, double distalLength, double proximalLength, double* d1, double* d2){
             
             _branchLengths.clear();
             _matrixUpdateIndices.clear();
             _operations.clear();
             
             if(_updatePartials){
-                traverse(_tree->getRootNode());
-                traverseUpper(_tree->getRootNode());
+                traverse();
+                traverseUpper();
                 _updatePartials = _updateUpperPartials = false;
                 _needNodeUpdate.assign(_totalNodeCount, false);
             }
             else if(_updateUpperPartials){
-                traverseUpper(_tree->getRootNode());
+                traverseUpper();
                 _updateUpperPartials = false;
             }
             
             const int distalIndex = distal.getId();
-            const int indexTaxon = std::find(_taxa.begin(), _taxa.end(), taxonName) - _taxa.begin();
+            const int indexTaxon = taxonIndex;
             const int tmpPartialsIndex = _totalNodeCount*2;
             
             // Temporary transition matrices
@@ -617,6 +606,7 @@ namespace sts {
             
             *d1 = dd1;
             *d2 = dd2;
+            return logLike;
         }
         
         void BeagleFlexibleTreeLikelihood::updateSiteModel(){
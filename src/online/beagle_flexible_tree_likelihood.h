@@ -28,14 +28,19 @@ namespace sts {
             
             virtual double calculateLogLikelihood();
             
-            virtual double calculateLogLikelihood(const bpp::Node& distal, std::string taxonName, double pendantLength, double distalLength, double proximalLength);
+            virtual double calculateLogLikelihood(const bpp::Node& distal, size_t taxonIndex, double pendantLength, double distalLength, double proximalLength);
             
 //            virtual void calculateDerivatives(const bpp::Node& node, double* d1, double* d2);
             
-            // Compute derivatives of pendant branch with taxon taxonName
-            virtual void calculatePendantDerivatives(const bpp::Node& distal, std::string taxonName, double pendantLength, double distalLength, double proximalLength, double* d1, double* d2);
+            // Compute derivatives of pendant branch with taxon taxonIndex
+            virtual double calculatePendantDerivatives(const bpp::Node& distal, size_t taxonIndex, double pendantLength, double distalLength, double proximalLength, double* d1, double* d2);
             
-            virtual void calculateDistalDerivatives(const bpp::Node& distal, std::string taxonName, double pendantLength, double distalLength, double proximalLength, double* d1, double* d2);
+            virtual double calculateDistalDerivatives(const bpp::Node& distal, size_t taxonIndex, double pendantLength, double distalLength, double proximalLength, double* d1, double* d2);
+            
+            using FlexibleTreeLikelihood::initialize;
+            using FlexibleTreeLikelihood::calculateLogLikelihood;
+            using FlexibleTreeLikelihood::calculatePendantDerivatives;
+            using FlexibleTreeLikelihood::calculateDistalDerivatives;
             
         protected:
             
@@ -43,9 +48,9 @@ namespace sts {
             
             void updateSiteModel();
             
-            bool traverse(const bpp::Node* node);
+            void traverse();
             
-            void traverseUpper(const bpp::Node* node);
+            void traverseUpper();
             
             void setStates(const bpp::SiteContainer& sites);
             
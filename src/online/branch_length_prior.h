@@ -2,11 +2,15 @@
 #define STS_ONLINE_EXPONENTIAL_BRANCH_LENGTH_PRIOR_H
 
 #include <Bpp/Phyl/TreeTemplate.h>
+#include <cstddef>
 #include <functional>
 
 namespace sts { namespace online {
 
 /// \brief Generic prior density on branch lengths
+///
+/// The log density of a tree is the sum of the log densities of its branches, so that
+/// #sts::online::CompositeTreeLikelihood can update it with the terms of the branches that changed.
 class BranchLengthPrior
 {
 public:
@@ -15,10 +19,28 @@ public:
     /// \param logPriorDensity a function of one parameter, which given a branch length, returns the prior density.
     BranchLengthPrior(std::function<double(double)> logPriorDensity);
 
+    /// \brief Construct with a prior density function and its sum over an array of branch lengths
+    ///
+    /// \param logPriorDensity a function of one parameter, which given a branch length, returns the prior density.
+    /// \param sumLogPriorDensity a function of an array of branch lengths and its size, which returns the sum of
+    /// \c logPriorDensity over them in a single pass.
+    BranchLengthPrior(std::function<double(double)> logPriorDensity,
+                      std::function<double(const double*, size_t)> sumLogPriorDensity);
+
+    /// \brief Exponential prior with mean \c mean, summed over a tree in closed form
+    static BranchLengthPrior exponential(double mean);
+
     /// \brief log prior density of \c tree
     double operator()(const bpp::TreeTemplate<bpp::Node>& tree) const;
+
+    /// \brief log prior density of a branch of length \c branchLength
+    double operator()(double branchLength) const { return logPriorDensity(branchLength); }
+
+    /// \brief Sum of the log prior densities of \c count branch lengths
+    double operator()(const double* branchLengths, size_t count) const;
 private:
     std::function<double(double)> logPriorDensity;
+    std::function<double(const double*, size_t)> sumLogPriorDensity;
 };
 
 }}  // Namespaces
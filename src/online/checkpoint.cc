@@ -0,0 +1,321 @@
+#include "checkpoint.h"
+#include "flat_tree.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <unordered_map>
+#include <unordered_set>
+
+using namespace bpp;
+
+namespace sts { namespace online {
+
+namespace {
+
+const char MAGIC[8] = {'S', 'T', 'S', 'C', 'K', 'P', 'T', '\0'};
+const uint32_t VERSION = 1;
+
+/// Appends fixed-size values and length-prefixed arrays to a stream
+class Writer
+{
+public:
+    explicit Writer(std::ostream& out) : out(out) {}
+
+    template<typename T>
+    void put(const T& value) { out.write(reinterpret_cast<const char*>(&value), sizeof(T)); }
+
+    void put(const std::string& value)
+    {
+        put<uint64_t>(value.size());
+        out.write(value.data(), value.size());
+    }
+
+    template<typename T>
+    void putArray(const std::vector<T>& values)
+    {
+        put<uint64_t>(values.size());
+        out.write(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(T));
+    }
+private:
+    std::ostream& out;
+};
+
+/// Reads back what a #Writer wrote, from memory
+class Reader
+{
+public:
+    Reader(const char* begin, const char* end) : position(begin), end(end) {}
+
+    template<typename T>
+    T get()
+    {
+        T value;
+        std::memcpy(&value, take(sizeof(T)), sizeof(T));
+        return value;
+    }
+
+    std::string getString()
+    {
+        const uint64_t size = get<uint64_t>();
+        return std::string(take(size), size);
+    }
+
+    /// Number of elements that follow, checked against the bytes left before anything is allocated for them
+    /// \param elementSize Fewest bytes taken by each element
+    uint64_t getCount(size_t elementSize)
+    {
+        const uint64_t count = get<uint64_t>();
+        if(count > static_cast<uint64_t>(end - position) / elementSize)
+            throw std::runtime_error("Truncated checkpoint");
+        return count;
+    }
+
+    template<typename T>
+    std::vector<T> getArray()
+    {
+        const uint64_t size = getCount(sizeof(T));
+        std::vector<T> values(size);
+        std::memcpy(values.data(), take(size * sizeof(T)), size * sizeof(T));
+        return values;
+    }
+private:
+    const char* take(uint64_t size)
+    {
+        if(size > static_cast<uint64_t>(end - position))
+            throw std::runtime_error("Truncated checkpoint");
+        const char* result = position;
+        position += size;
+        return result;
+    }
+
+    const char* position;
+    const char* end;
+};
+
+/// Read-only mapping of a whole file
+class MappedFile
+{
+public:
+    explicit MappedFile(const std::string& path) : data(nullptr), size(0)
+    {
+        const int fd = open(path.c_str(), O_RDONLY);
+        if(fd < 0)
+            throw std::runtime_error("Cannot open " + path + ": " + std::strerror(errno));
+        struct stat status;
+        if(fstat(fd, &status) == 0 && status.st_size > 0) {
+            size = status.st_size;
+            void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(mapped != MAP_FAILED)
+                data = static_cast<const char*>(mapped);
+        }
+        close(fd);
+        if(!data)
+            throw std::runtime_error("Cannot map " + path);
+    }
+
+    ~MappedFile() { munmap(const_cast<char*>(data), size); }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data;
+    size_t size;
+};
+
+/// Nodes of a tree being built, deleted unless a tree takes them over
+struct PendingNodes
+{
+    ~PendingNodes()
+    {
+        // Unlinked first, whether or not a node deletes its sons
+        for(Node* node : nodes)
+            node->removeSons();
+        for(Node* node : nodes)
+            delete node;
+    }
+
+    std::vector<Node*> nodes;
+};
+
+} // namespace
+
+void writeCheckpoint(const std::string& path, const Checkpoint& checkpoint)
+{
+    const std::string tmpPath = path + ".tmp";
+    {
+        std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+        Writer writer(out);
+        out.write(MAGIC, sizeof(MAGIC));
+        writer.put(VERSION);
+        writer.put(checkpoint.generation);
+        writer.put<uint64_t>(checkpoint.sequenceNames.size());
+        for(const std::string& name : checkpoint.sequenceNames)
+            writer.put(name);
+
+        // Distinct trees, each as its nodes in post-order
+        std::unordered_map<const TreeTemplate<Node>*, uint32_t> treeIndexes;
+        std::vector<const TreeTemplate<Node>*> trees;
+        std::vector<uint32_t> particleTrees;
+        for(const TreeParticle& particle : checkpoint.particles) {
+            auto inserted = treeIndexes.emplace(&particle.tree(), static_cast<uint32_t>(trees.size()));
+            if(inserted.second)
+                trees.push_back(&particle.tree());
+            particleTrees.push_back(inserted.first->second);
+        }
+        writer.put<uint64_t>(trees.size());
+        FlatTree flat;
+        std::vector<int32_t> nodes;
+        std::vector<double> branchLengths;
+        for(const TreeTemplate<Node>* tree : trees) {
+            flat.assign(*tree);
+            nodes.clear();
+            branchLengths.clear();
+            for(int id : flat.postOrder()) {
+                nodes.push_back(id);
+                nodes.push_back(flat.isLeaf(id) ? FlatTree::NONE : flat.child(id, 0));
+                nodes.push_back(flat.isLeaf(id) ? FlatTree::NONE : flat.child(id, 1));
+                branchLengths.push_back(flat.branchLength(id));
+            }
+            writer.putArray(nodes);
+            writer.putArray(branchLengths);
+        }
+
+        std::vector<uint64_t> particleIDs;
+        for(const TreeParticle& particle : checkpoint.particles)
+            particleIDs.push_back(particle.particleID);
+        writer.putArray(particleTrees);
+        writer.putArray(particleIDs);
+        writer.putArray(checkpoint.logWeights);
+        writer.put(checkpoint.ess);
+        writer.put(checkpoint.uniqueParticles);
+
+        writer.putArray(checkpoint.rngState);
+        writer.putArray(checkpoint.mcmcTunings);
+
+        writer.put<uint64_t>(checkpoint.proposalRecords.size());
+        for(const ProposalRecord& record : checkpoint.proposalRecords) {
+            const AttachmentProposal& proposal = record.proposal;
+            writer.put<int64_t>(record.T);
+            for(double value : { record.originalLogLike, record.newLogLike, record.originalLogWeight,
+                                 record.newLogWeight, proposal.edgeLogProposalDensity, proposal.distalBranchLength,
+                                 proposal.distalLogProposalDensity, proposal.pendantBranchLength,
+                                 proposal.pendantLogProposalDensity, proposal.mlDistalBranchLength,
+                                 proposal.mlPendantBranchLength })
+                writer.put(value);
+            writer.put(proposal.proposalMethodName);
+        }
+        writer.put(checkpoint.output);
+
+        if(!out.flush())
+            throw std::runtime_error("Cannot write " + tmpPath);
+    }
+    if(std::rename(tmpPath.c_str(), path.c_str()) != 0)
+        throw std::runtime_error("Cannot replace " + path + ": " + std::strerror(errno));
+}
+
+Checkpoint readCheckpoint(const std::string& path,
+                          const std::vector<std::string>& names,
+                          std::shared_ptr<const SubstitutionModel> model,
+                          std::shared_ptr<const DiscreteDistribution> rateDist,
+                          const SiteContainer* sites)
+{
+    const MappedFile file(path);
+    Reader reader(file.data, file.data + file.size);
+    char magic[sizeof(MAGIC)];
+    for(char& c : magic)
+        c = reader.get<char>();
+    if(std::memcmp(magic, MAGIC, sizeof(MAGIC)) != 0 || reader.get<uint32_t>() != VERSION)
+        throw std::runtime_error(path + " is not a checkpoint of this version");
+
+    Checkpoint checkpoint;
+    checkpoint.generation = reader.get<uint64_t>();
+    checkpoint.sequenceNames.resize(reader.getCount(sizeof(uint64_t)));
+    for(std::string& name : checkpoint.sequenceNames)
+        name = reader.getString();
+
+    // One particle per tree, copied by the particles that share it
+    std::vector<TreeParticle> treeParticles(reader.getCount(2 * sizeof(uint64_t)));
+    for(TreeParticle& treeParticle : treeParticles) {
+        const std::vector<int32_t> nodes = reader.getArray<int32_t>();
+        const std::vector<double> branchLengths = reader.getArray<double>();
+        if(nodes.size() != 3 * branchLengths.size() || branchLengths.empty())
+            throw std::runtime_error("Invalid tree in checkpoint");
+
+        // Roots of the subtrees built so far, by id
+        PendingNodes created;
+        std::unordered_set<int> ids;
+        std::unordered_map<int, Node*> byId;
+        Node* node = nullptr;
+        for(size_t i = 0; i < branchLengths.size(); i++) {
+            const int id = nodes[3 * i];
+            const bool leaf = nodes[3 * i + 1] == FlatTree::NONE;
+            if(!ids.insert(id).second)
+                throw std::runtime_error("Invalid tree in checkpoint");
+            if(leaf && (id < 0 || static_cast<size_t>(id) >= names.size()))
+                throw std::runtime_error("Unknown leaf in checkpoint");
+            node = leaf ? new Node(id, names[id]) : new Node(id);
+            created.nodes.push_back(node);
+            for(size_t j = 1; !leaf && j <= 2; j++) {
+                auto son = byId.find(nodes[3 * i + j]);
+                if(son == byId.end())
+                    throw std::runtime_error("Invalid tree in checkpoint");
+                node->addSon(son->second);
+                byId.erase(son);
+            }
+            // The root comes last and has no branch
+            if(i + 1 < branchLengths.size())
+                node->setDistanceToFather(branchLengths[i]);
+            byId[id] = node;
+        }
+        if(byId.size() != 1)
+            throw std::runtime_error("Invalid tree in checkpoint");
+        std::unique_ptr<TreeTemplate<Node>> tree(new TreeTemplate<Node>(node));
+        created.nodes.clear();
+        treeParticle = TreeParticle(model, std::move(tree), rateDist, sites);
+    }
+
+    const std::vector<uint32_t> particleTrees = reader.getArray<uint32_t>();
+    const std::vector<uint64_t> particleIDs = reader.getArray<uint64_t>();
+    checkpoint.logWeights = reader.getArray<double>();
+    if(particleIDs.size() != particleTrees.size() || checkpoint.logWeights.size() != particleTrees.size())
+        throw std::runtime_error("Invalid particles in checkpoint");
+    checkpoint.particles.reserve(particleTrees.size());
+    for(size_t i = 0; i < particleTrees.size(); i++) {
+        if(particleTrees[i] >= treeParticles.size())
+            throw std::runtime_error("Invalid particles in checkpoint");
+        checkpoint.particles.push_back(treeParticles[particleTrees[i]]);
+        checkpoint.particles.back().particleID = particleIDs[i];
+    }
+    checkpoint.ess = reader.get<double>();
+    checkpoint.uniqueParticles = reader.get<uint64_t>();
+
+    checkpoint.rngState = reader.getArray<char>();
+    checkpoint.mcmcTunings = reader.getArray<OnlineMCMCMove::Tuning>();
+
+    // Time, 11 values and the length of the method name
+    checkpoint.proposalRecords.resize(reader.getCount(sizeof(int64_t) + 11 * sizeof(double) + sizeof(uint64_t)));
+    for(ProposalRecord& record : checkpoint.proposalRecords) {
+        AttachmentProposal& proposal = record.proposal;
+        record.T = reader.get<int64_t>();
+        for(double* value : { &record.originalLogLike, &record.newLogLike, &record.originalLogWeight,
+                              &record.newLogWeight, &proposal.edgeLogProposalDensity, &proposal.distalBranchLength,
+                              &proposal.distalLogProposalDensity, &proposal.pendantBranchLength,
+                              &proposal.pendantLogProposalDensity, &proposal.mlDistalBranchLength,
+                              &proposal.mlPendantBranchLength })
+            *value = reader.get<double>();
+        proposal.edge = nullptr;
+        proposal.proposalMethodName = reader.getString();
+    }
+    checkpoint.output = reader.getString();
+    return checkpoint;
+}
+
+}} // namespaces
@@ -0,0 +1,61 @@
+#ifndef STS_ONLINE_CHECKPOINT_H
+#define STS_ONLINE_CHECKPOINT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "online_add_sequence_move.h"
+#include "online_mcmc_move.h"
+#include "tree_particle.h"
+
+namespace sts { namespace online {
+
+/// \brief State of a run at the start of a generation, enough to continue it in another process
+///
+/// Written to a compact binary file, in the byte order of the machine: trees shared by several particles are written
+/// once, as arrays of node ids and branch lengths. The file is mapped in memory to be read back.
+struct Checkpoint
+{
+    /// Generation to run next, the first of a sequence addition
+    uint64_t generation;
+    /// Query sequences, in the order they are added
+    std::vector<std::string> sequenceNames;
+
+    /// Particles, copies sharing their tree, with their log weights
+    std::vector<TreeParticle> particles;
+    std::vector<double> logWeights;
+
+    /// ESS and number of distinct particles of the last generation
+    double ess;
+    uint64_t uniqueParticles;
+
+    /// State of the random number generator of the driver, as given by \c gsl_rng_state
+    std::vector<char> rngState;
+    /// Tuning of each MCMC move, in the order they were added
+    std::vector<OnlineMCMCMove::Tuning> mcmcTunings;
+    /// Proposal records so far, without their edges
+    std::vector<ProposalRecord> proposalRecords;
+    /// JSON output of the generations run so far
+    std::string output;
+};
+
+/// Write \c checkpoint to \c path, replacing it at once so that an interrupted write leaves the previous one
+void writeCheckpoint(const std::string& path, const Checkpoint& checkpoint);
+
+/// \brief Read a checkpoint written by #writeCheckpoint
+///
+/// \param names Names of the sequences by index, for the leaves
+/// \param model, rateDist, sites Shared by the particles read
+/// \throws std::runtime_error when the file cannot be read or is not a checkpoint
+Checkpoint readCheckpoint(const std::string& path,
+                          const std::vector<std::string>& names,
+                          std::shared_ptr<const bpp::SubstitutionModel> model,
+                          std::shared_ptr<const bpp::DiscreteDistribution> rateDist,
+                          const bpp::SiteContainer* sites);
+
+}} // namespaces
+
+#endif // STS_ONLINE_CHECKPOINT_H
@@ -1,4 +1,5 @@
 #include "composite_tree_likelihood.h"
+#include "parallel.h"
 #include "tripod_optimizer.h"
 
 #include <Bpp/Numeric/Prob/DiscreteDistribution.h>
@@ -10,27 +11,72 @@ using namespace bpp;
 namespace sts { namespace online {
 
 CompositeTreeLikelihood::CompositeTreeLikelihood(std::shared_ptr<FlexibleTreeLikelihood> calculator) :
-    calculator_(calculator),
-    tree_(nullptr)
+    calculators_(1, calculator),
+    priorSums_(1),
+    trees_(1, nullptr)
 {}
 
 CompositeTreeLikelihood::CompositeTreeLikelihood(std::shared_ptr<FlexibleTreeLikelihood> calculator,
                                                  std::vector<TreeLogLikelihood> additionalLogLikes) :
-    calculator_(calculator),
+    calculators_(1, calculator),
     additionalLogLikes_(additionalLogLikes),
-    tree_(nullptr)
+    priorSums_(1),
+    trees_(1, nullptr)
 {}
 
+CompositeTreeLikelihood::CompositeTreeLikelihood(std::vector<std::shared_ptr<FlexibleTreeLikelihood>> calculators) :
+    calculators_(calculators),
+    priorSums_(calculators.size()),
+    trees_(calculators.size(), nullptr)
+{
+    assert(!calculators_.empty() && "No calculator!");
+}
+
+FlexibleTreeLikelihood& CompositeTreeLikelihood::calculator() const
+{
+    assert(currentWorker() < calculators_.size() && "No calculator for this worker!");
+    return *calculators_[currentWorker()];
+}
+
+CompositeTreeLikelihood::BranchLengthPriorSums& CompositeTreeLikelihood::priorSums()
+{
+    assert(currentWorker() < priorSums_.size() && "No calculator for this worker!");
+    return priorSums_[currentWorker()];
+}
+
+const CompositeTreeLikelihood::BranchLengthPriorSums& CompositeTreeLikelihood::priorSums() const
+{
+    assert(currentWorker() < priorSums_.size() && "No calculator for this worker!");
+    return priorSums_[currentWorker()];
+}
+
+bpp::TreeTemplate<bpp::Node>*& CompositeTreeLikelihood::tree()
+{
+    assert(currentWorker() < trees_.size() && "No calculator for this worker!");
+    return trees_[currentWorker()];
+}
+
+bpp::TreeTemplate<bpp::Node>* CompositeTreeLikelihood::tree() const
+{
+    assert(currentWorker() < trees_.size() && "No calculator for this worker!");
+    return trees_[currentWorker()];
+}
+
 double CompositeTreeLikelihood::operator()()
 {
-    assert(tree_ != nullptr && "Uninitialized tree!");
-    return calculator_->calculateLogLikelihood() + sumAdditionalLogLikes();
+    assert(tree() != nullptr && "Uninitialized tree!");
+    return calculator().calculateLogLikelihood() + sumAdditionalLogLikes();
 }
 
-double CompositeTreeLikelihood::operator()(const bpp::Node& distal, std::string taxonName, double pendantLength, double distalLength, double proximalLength)
+double CompositeTreeLikelihood::operator()(const bpp::Node& distal, size_t taxonIndex, double pendantLength, double distalLength, double proximalLength)
 {
-    assert(tree_ != nullptr && "Uninitialized tree!");
-    return calculator_->calculateLogLikelihood(distal, taxonName, pendantLength, distalLength, proximalLength);// + sumAdditionalLogLikes();
+    assert(tree() != nullptr && "Uninitialized tree!");
+    return calculator().calculateLogLikelihood(distal, taxonIndex, pendantLength, distalLength, proximalLength);// + sumAdditionalLogLikes();
+}
+    
+double CompositeTreeLikelihood::operator()(const bpp::Node& distal, const std::string& taxonName, double pendantLength, double distalLength, double proximalLength)
+{
+    return this->operator()(distal, taxonIndex(taxonName), pendantLength, distalLength, proximalLength);
 }
     
 double CompositeTreeLikelihood::logLikelihood()
@@ -38,17 +84,152 @@ double CompositeTreeLikelihood::logLikelihood()
     return this->operator()();
 }
 
-double CompositeTreeLikelihood::logLikelihood(const bpp::Node& distal, std::string taxonName, double pendantLength, double distalLength, double proximalLength)
+double CompositeTreeLikelihood::logLikelihood(const bpp::Node& distal, size_t taxonIndex, double pendantLength, double distalLength, double proximalLength)
+{
+    return this->operator()(distal, taxonIndex, pendantLength, distalLength, proximalLength);
+}
+    
+double CompositeTreeLikelihood::logLikelihood(const bpp::Node& distal, const std::string& taxonName, double pendantLength, double distalLength, double proximalLength)
+{
+    return this->operator()(distal, taxonIndex(taxonName), pendantLength, distalLength, proximalLength);
+}
+    
+size_t CompositeTreeLikelihood::taxonIndex(const std::string& taxonName) const
+{
+    return calculator().taxonIndex(taxonName);
+}
+    
+std::vector<std::vector<double> > CompositeTreeLikelihood::calculateAttachmentLogLikelihoods(const std::vector<AttachmentLocation>& locations, size_t taxonIndex, const std::vector<double>& pendantLengths)
+{
+    assert(tree() != nullptr && "Uninitialized tree!");
+    return calculator().calculateAttachmentLogLikelihoods(locations, taxonIndex, pendantLengths);
+}
+    
+std::vector<std::vector<double> > CompositeTreeLikelihood::calculateAttachmentLogLikelihoods(const std::vector<AttachmentLocation>& locations, const std::string& taxonName, const std::vector<double>& pendantLengths)
+{
+    return calculateAttachmentLogLikelihoods(locations, taxonIndex(taxonName), pendantLengths);
+}
+    
+std::unique_ptr<AttachmentContext> CompositeTreeLikelihood::createAttachmentContext(const bpp::Node& distal, size_t taxonIndex)
+{
+    assert(tree() != nullptr && "Uninitialized tree!");
+    return calculator().createAttachmentContext(distal, taxonIndex);
+}
+    
+std::unique_ptr<AttachmentContext> CompositeTreeLikelihood::createAttachmentContext(const bpp::Node& distal, const std::string& taxonName)
 {
-    return this->operator()(distal, taxonName, pendantLength, distalLength, proximalLength);
+    return createAttachmentContext(distal, taxonIndex(taxonName));
 }
     
 void CompositeTreeLikelihood::initialize(const SubstitutionModel& model,
                                          const DiscreteDistribution& rate_dist,
                                          TreeTemplate<Node>& tree)
 {
-    calculator_->initialize(model, rate_dist, tree);
-    this->tree_ = &tree;
+    calculator().initialize(model, rate_dist, tree);
+    this->tree() = &tree;
+    loadBranchLengths();
+}
+
+void CompositeTreeLikelihood::initialize(const SubstitutionModel& model,
+                                         const DiscreteDistribution& rate_dist,
+                                         TreeTemplate<Node>& tree,
+                                         const std::shared_ptr<const LikelihoodState>& state)
+{
+    calculator().initialize(model, rate_dist, tree, state);
+    this->tree() = &tree;
+    loadBranchLengths();
+}
+
+void CompositeTreeLikelihood::updateTree()
+{
+    assert(tree() != nullptr && "Uninitialized tree!");
+    calculator().updateTree();
+    loadBranchLengths();
+}
+
+void CompositeTreeLikelihood::updateNode(const Node& node)
+{
+    assert(tree() != nullptr && "Uninitialized tree!");
+    calculator().updateNode(node);
+
+    BranchLengthPriorSums& sums = priorSums();
+    if(branchLengthPriors_.empty() || !node.hasDistanceToFather())
+        return;
+    const int id = node.getId();
+    assert(id >= 0 && static_cast<size_t>(id) < sums.branchLengths.size() && "Node not in the initialized tree!");
+    const double previous = sums.branchLengths[id];
+    const double branchLength = node.getDistanceToFather();
+    for(size_t i = 0; i < branchLengthPriors_.size(); i++) {
+        sums.logDensities[i] += branchLengthPriors_[i](branchLength) - branchLengthPriors_[i](previous);
+    }
+    if(sums.checkpoint)
+        sums.checkpointBranchLengths.emplace_back(id, previous);
+    sums.branchLengths[id] = branchLength;
+}
+
+void CompositeTreeLikelihood::checkpoint()
+{
+    assert(tree() != nullptr && "Uninitialized tree!");
+    calculator().checkpoint();
+
+    BranchLengthPriorSums& sums = priorSums();
+    sums.checkpointLogDensities = sums.logDensities;
+    sums.checkpointBranchLengths.clear();
+    sums.checkpoint = true;
+}
+
+void CompositeTreeLikelihood::rollback()
+{
+    assert(tree() != nullptr && "Uninitialized tree!");
+    calculator().rollback();
+
+    BranchLengthPriorSums& sums = priorSums();
+    if(!sums.checkpoint) {
+        loadBranchLengths();
+        return;
+    }
+    // Restored rather than updated, so that rejected moves do not accumulate rounding errors
+    sums.logDensities = sums.checkpointLogDensities;
+    for(auto it = sums.checkpointBranchLengths.rbegin(); it != sums.checkpointBranchLengths.rend(); ++it)
+        sums.branchLengths[it->first] = it->second;
+    sums.checkpointBranchLengths.clear();
+    sums.checkpoint = false;
+}
+
+void CompositeTreeLikelihood::loadBranchLengths()
+{
+    BranchLengthPriorSums& sums = priorSums();
+    sums.checkpoint = false;
+    sums.checkpointBranchLengths.clear();
+    if(branchLengthPriors_.empty())
+        return;
+
+    // Lengths are gathered in an array, so that each prior is summed in a single pass
+    sums.treeBranchLengths.clear();
+    sums.stack.assign(1, tree()->getRootNode());
+    while(!sums.stack.empty()) {
+        const Node* node = sums.stack.back();
+        sums.stack.pop_back();
+        if(node->hasDistanceToFather()) {
+            const size_t id = node->getId();
+            if(id >= sums.branchLengths.size())
+                sums.branchLengths.resize(id + 1);
+            sums.branchLengths[id] = node->getDistanceToFather();
+            sums.treeBranchLengths.push_back(node->getDistanceToFather());
+        }
+        for(size_t i = 0; i < node->getNumberOfSons(); i++)
+            sums.stack.push_back(node->getSon(i));
+    }
+    sums.logDensities.resize(branchLengthPriors_.size());
+    for(size_t i = 0; i < branchLengthPriors_.size(); i++) {
+        sums.logDensities[i] = branchLengthPriors_[i](sums.treeBranchLengths.data(), sums.treeBranchLengths.size());
+    }
+}
+
+std::shared_ptr<const LikelihoodState> CompositeTreeLikelihood::saveState()
+{
+    assert(tree() != nullptr && "Uninitialized tree!");
+    return calculator().saveState();
 }
 
 void CompositeTreeLikelihood::add(TreeLogLikelihood like)
@@ -56,20 +237,36 @@ void CompositeTreeLikelihood::add(TreeLogLikelihood like)
     this->additionalLogLikes_.push_back(like);
 }
 
+void CompositeTreeLikelihood::add(BranchLengthPrior prior)
+{
+    this->branchLengthPriors_.push_back(prior);
+}
+
 double CompositeTreeLikelihood::sumAdditionalLogLikes() const
 {
     double sum = 0.0;
     for (const TreeLogLikelihood& like : additionalLogLikes_) {
-        sum += like(*tree_);
+        sum += like(*tree());
+    }
+    for (double logDensity : priorSums().logDensities) {
+        sum += logDensity;
     }
     return sum;
 }
 
-void CompositeTreeLikelihood::calculatePendantDerivatives(const bpp::Node& distal, std::string taxonName, double pendantLength, double distalLength, double proximalLength, double* d1, double* d2){
-    return calculator_->calculatePendantDerivatives(distal, taxonName, pendantLength, distalLength, proximalLength, d1, d2);
+double CompositeTreeLikelihood::calculatePendantDerivatives(const bpp::Node& distal, size_t taxonIndex, double pendantLength, double distalLength, double proximalLength, double* d1, double* d2){
+    return calculator().calculatePendantDerivatives(distal, taxonIndex, pendantLength, distalLength, proximalLength, d1, d2);
+}
+
+double CompositeTreeLikelihood::calculatePendantDerivatives(const bpp::Node& distal, const std::string& taxonName, double pendantLength, double distalLength, double proximalLength, double* d1, double* d2){
+    return calculatePendantDerivatives(distal, taxonIndex(taxonName), pendantLength, distalLength, proximalLength, d1, d2);
+}
+
+double CompositeTreeLikelihood::calculateDistalDerivatives(const bpp::Node& distal, size_t taxonIndex, double pendantLength, double distalLength, double proximalLength, double* d1, double* d2){
+    return calculator().calculateDistalDerivatives(distal, taxonIndex, pendantLength, distalLength, proximalLength, d1, d2);
 }
 
-void CompositeTreeLikelihood::calculateDistalDerivatives(const bpp::Node& distal, std::string taxonName, double pendantLength, double distalLength, double proximalLength, double* d1, double* d2){
-    return calculator_->calculateDistalDerivatives(distal, taxonName, pendantLength, distalLength, proximalLength, d1, d2);
+double CompositeTreeLikelihood::calculateDistalDerivatives(const bpp::Node& distal, const std::string& taxonName, double pendantLength, double distalLength, double proximalLength, double* d1, double* d2){
+    return calculateDistalDerivatives(distal, taxonIndex(taxonName), pendantLength, distalLength, proximalLength, d1, d2);
 }
 }} // Namespaces
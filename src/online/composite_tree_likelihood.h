@@ -5,8 +5,11 @@
 
 #include <functional>
 #include <memory>
+#include <string>
+#include <utility>
 #include <vector>
 
+#include "branch_length_prior.h"
 #include "flexible_tree_likelihood.h"
 
 namespace bpp {
@@ -28,47 +31,145 @@ typedef std::function<double(bpp::TreeTemplate<bpp::Node>&)> TreeLogLikelihood;
 /// Composite tree likelihood, consisting of a #sts::online::BeagleTreeLikelihood, and additional likelihoods (e.g.,
 /// priors).
 /// #sts::online::BeagleTreeLikelihood is treated differently due to additional functionality available.
+///
+/// Several calculators can be given, one for each worker of #sts::online::parallelFor. Every call is then forwarded to
+/// the calculator of the calling worker, with the tree that worker last initialized, so that particles can be
+/// evaluated concurrently.
 class CompositeTreeLikelihood
 {
 public:
     explicit CompositeTreeLikelihood(std::shared_ptr<FlexibleTreeLikelihood> calculator);
     CompositeTreeLikelihood(std::shared_ptr<FlexibleTreeLikelihood> calculator,
                             std::vector<TreeLogLikelihood> additionalLogLikes);
+    /// One calculator per worker
+    explicit CompositeTreeLikelihood(std::vector<std::shared_ptr<FlexibleTreeLikelihood>> calculators);
+
+    /// Number of workers that can use this instance concurrently
+    size_t workerCount() const { return calculators_.size(); }
 
     /// Add a tree likelihood function
     void add(TreeLogLikelihood like);
 
-    /// Sum additional log-likelihood functions
+    /// \brief Add a prior on branch lengths
+    ///
+    /// Its log density is summed over the tree by #initialize and #updateTree, then updated with the terms of the
+    /// branches notified by #updateNode, instead of being evaluated over the whole tree on each call.
+    void add(BranchLengthPrior prior);
+
+    /// Sum additional log-likelihood functions and branch length priors
     double sumAdditionalLogLikes() const;
 
     /// \brief Initialize for a {model, rate_dist, tree}
     ///
-    /// <b>Must be called before #CompositeTreeLikelihood::operator()()</b>
+    /// <b>Must be called before #CompositeTreeLikelihood::operator()()</b>, by each worker
     void initialize(const bpp::SubstitutionModel& model,
                     const bpp::DiscreteDistribution& rate_dist,
                     bpp::TreeTemplate<bpp::Node>& tree);
 
+    /// \brief Initialize for a {model, rate_dist, tree}, reusing the partials of \c state that still hold for \c tree
+    ///
+    /// \param state From #saveState, possibly on another worker, or null
+    void initialize(const bpp::SubstitutionModel& model,
+                    const bpp::DiscreteDistribution& rate_dist,
+                    bpp::TreeTemplate<bpp::Node>& tree,
+                    const std::shared_ptr<const LikelihoodState>& state);
+
+    /// \brief Notify that the tree of the calling worker was modified since #initialize
+    ///
+    /// Nodes may have been added or moved, and branch lengths changed. Cheaper than initializing again when only part
+    /// of the tree changed.
+    void updateTree();
+
+    /// \brief Notify that the branch above \c node changed length, in the tree of the calling worker
+    ///
+    /// Only the partials on the path from \c node to the root are recomputed by the next evaluation.
+    void updateNode(const bpp::Node& node);
+
+    /// \brief Start recording the changes notified by #updateNode, so that #rollback can undo them
+    ///
+    /// Meant for moves that change a few branch lengths and may be rejected.
+    void checkpoint();
+
+    /// Return to the log likelihood as of #checkpoint, once the branch lengths of the tree have been restored
+    void rollback();
+
+    /// Partials of the tree of the calling worker as of its last evaluation, null unless the calculator keeps them
+    std::shared_ptr<const LikelihoodState> saveState();
+
     /// Calculate the sum of log-likelihoods. Alias for #logLikelihood
     double operator()();
     
-    double operator()(const bpp::Node& distal, std::string taxonName, double pendantLength, double distalLength, double proximalLength);
+    /// Log-likelihood of the tree with taxon \c taxonIndex attached above \c distal
+    double operator()(const bpp::Node& distal, size_t taxonIndex, double pendantLength, double distalLength, double proximalLength);
+    
+    double operator()(const bpp::Node& distal, const std::string& taxonName, double pendantLength, double distalLength, double proximalLength);
 
     /// Calculate the sum of log likelihoods
     double logLikelihood();
     
-    double logLikelihood(const bpp::Node& distal, std::string taxonName, double pendantLength, double distalLength, double proximalLength);
+    double logLikelihood(const bpp::Node& distal, size_t taxonIndex, double pendantLength, double distalLength, double proximalLength);
+    
+    double logLikelihood(const bpp::Node& distal, const std::string& taxonName, double pendantLength, double distalLength, double proximalLength);
+    
+    /// Index of \c taxonName in the alignment, to use with the overloads taking a taxon index
+    size_t taxonIndex(const std::string& taxonName) const;
+    
+    /// Log likelihoods of attaching \c taxonIndex at each location with each pendant length, indexed
+    /// <c>[location][pendant length]</c>
+    std::vector<std::vector<double> > calculateAttachmentLogLikelihoods(const std::vector<AttachmentLocation>& locations, size_t taxonIndex, const std::vector<double>& pendantLengths);
+    
+    std::vector<std::vector<double> > calculateAttachmentLogLikelihoods(const std::vector<AttachmentLocation>& locations, const std::string& taxonName, const std::vector<double>& pendantLengths);
+    
+    /// Context for repeated evaluations of the attachment of \c taxonIndex on the edge above \c distal
+    std::unique_ptr<AttachmentContext> createAttachmentContext(const bpp::Node& distal, size_t taxonIndex);
+    
+    std::unique_ptr<AttachmentContext> createAttachmentContext(const bpp::Node& distal, const std::string& taxonName);
+    
+    double calculatePendantDerivatives(const bpp::Node& distal, size_t taxonIndex, double pendantLength, double distalLength, double proximalLength, double* d1, double* d2);
+    
+    double calculatePendantDerivatives(const bpp::Node& distal, const std::string& taxonName, double pendantLength, double distalLength, double proximalLength, double* d1, double* d2);
     
-    void calculatePendantDerivatives(const bpp::Node& distal, std::string taxonName, double pendantLength, double distalLength, double proximalLength, double* d1, double* d2);
+    double calculateDistalDerivatives(const bpp::Node& distal, size_t taxonIndex, double pendantLength, double distalLength, double proximalLength, double* d1, double* d2);
     
-    void calculateDistalDerivatives(const bpp::Node& distal, std::string taxonName, double pendantLength, double distalLength, double proximalLength, double* d1, double* d2);
+    double calculateDistalDerivatives(const bpp::Node& distal, const std::string& taxonName, double pendantLength, double distalLength, double proximalLength, double* d1, double* d2);
 
 private:
     friend class sts::online::AttachmentLikelihood;
 
-    std::shared_ptr<FlexibleTreeLikelihood> calculator_;
+    /// Calculator of the calling worker
+    FlexibleTreeLikelihood& calculator() const;
+    /// Tree of the calling worker
+    bpp::TreeTemplate<bpp::Node>*& tree();
+    bpp::TreeTemplate<bpp::Node>* tree() const;
+
+    /// Branch lengths of the tree of a worker, and the log densities of the branch length priors for them
+    struct BranchLengthPriorSums
+    {
+        /// Indexed by node id
+        std::vector<double> branchLengths;
+        /// Indexed like #branchLengthPriors_
+        std::vector<double> logDensities;
+        /// Log densities as of #checkpoint, and the branch lengths before each #updateNode since
+        std::vector<double> checkpointLogDensities;
+        std::vector<std::pair<int, double>> checkpointBranchLengths;
+        bool checkpoint = false;
+        /// Reused when summing over a whole tree
+        std::vector<double> treeBranchLengths;
+        std::vector<const bpp::Node*> stack;
+    };
+
+    /// Sum the branch length priors over the tree of the calling worker
+    void loadBranchLengths();
+    BranchLengthPriorSums& priorSums();
+    const BranchLengthPriorSums& priorSums() const;
+
+    std::vector<std::shared_ptr<FlexibleTreeLikelihood>> calculators_;
     std::vector<TreeLogLikelihood> additionalLogLikes_;
+    std::vector<BranchLengthPrior> branchLengthPriors_;
+    /// One per worker
+    std::vector<BranchLengthPriorSums> priorSums_;
 
-    bpp::TreeTemplate<bpp::Node>* tree_;
+    std::vector<bpp::TreeTemplate<bpp::Node>*> trees_;
 };
 
 }} // Namespace
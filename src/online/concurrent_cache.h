@@ -0,0 +1,104 @@
+#ifndef STS_ONLINE_CONCURRENT_CACHE_H
+#define STS_ONLINE_CONCURRENT_CACHE_H
+
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace sts { namespace online {
+
+/// \brief Memoization shared by concurrent workers
+///
+/// Entries are spread over shards with a lock each, so that workers looking up different keys rarely contend. A value
+/// is computed once per key: a worker missing a key that another worker is computing waits for that value instead of
+/// computing it again.
+///
+/// Entries belong to an epoch; #newEpoch turns every existing entry into a miss in constant time, shards dropping their
+/// stale entries the next time they are used. #newEpoch must not be called while other workers use the cache.
+template<typename Key, typename Value, typename Hash = std::hash<Key>>
+class ConcurrentCache
+{
+public:
+    explicit ConcurrentCache(size_t shardCount = 64);
+
+    /// Value of \c key, obtained from \c compute() when missing
+    ///
+    /// \param computed Set to whether \c compute was called by this call
+    template<typename Compute>
+    Value getOrCompute(const Key& key, Compute compute, bool* computed = nullptr);
+
+    /// Drop every entry
+    void newEpoch() { _epoch++; }
+
+    size_t epoch() const { return _epoch; }
+
+private:
+    struct Shard
+    {
+        std::mutex mutex;
+        size_t epoch = 0;
+        std::unordered_map<Key, std::shared_future<Value>, Hash> entries;
+    };
+
+    std::vector<Shard> _shards;
+    Hash _hash;
+    std::atomic<size_t> _epoch;
+};
+
+template<typename Key, typename Value, typename Hash>
+ConcurrentCache<Key, Value, Hash>::ConcurrentCache(size_t shardCount) :
+    _shards(shardCount > 0 ? shardCount : 1),
+    _epoch(0)
+{}
+
+template<typename Key, typename Value, typename Hash>
+template<typename Compute>
+Value ConcurrentCache<Key, Value, Hash>::getOrCompute(const Key& key, Compute compute, bool* computed)
+{
+    Shard& shard = _shards[_hash(key) % _shards.size()];
+    std::promise<Value> promise;
+    std::shared_future<Value> found;
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if(shard.epoch != _epoch) {
+            shard.entries.clear();
+            shard.epoch = _epoch;
+        }
+        auto it = shard.entries.find(key);
+        if(it != shard.entries.end())
+            found = it->second;
+        else
+            shard.entries.emplace(key, promise.get_future().share());
+    }
+
+    if(found.valid()) {
+        if(computed != nullptr)
+            *computed = false;
+        // Waits, outside of the lock, if the value is still being computed
+        return found.get();
+    }
+
+    if(computed != nullptr)
+        *computed = true;
+    try {
+        Value value = compute();
+        promise.set_value(value);
+        return value;
+    } catch(...) {
+        // Waiting workers get the exception, later ones try again
+        promise.set_exception(std::current_exception());
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if(shard.epoch == _epoch)
+            shard.entries.erase(key);
+        throw;
+    }
+}
+
+}} // namespaces
+
+#endif // STS_ONLINE_CONCURRENT_CACHE_H
@@ -0,0 +1,87 @@
+#include "flat_tree.h"
+#include "online_util.h"
+
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+
+namespace sts { namespace online {
+
+const int FlatTree::NONE;
+
+FlatTree::FlatTree()
+{}
+
+FlatTree::FlatTree(const bpp::TreeTemplate<bpp::Node>& tree)
+{
+    assign(tree);
+}
+
+void FlatTree::assign(const bpp::TreeTemplate<bpp::Node>& tree)
+{
+    const std::vector<const bpp::Node*> nodes = postorder(tree.getRootNode());
+
+    int maxId = 0;
+    for(const bpp::Node* node : nodes)
+        maxId = std::max(maxId, node->getId());
+    const size_t capacity = maxId + 1;
+
+    _parents.assign(capacity, NONE);
+    _children.assign(2 * capacity, NONE);
+    _branchLengths.assign(capacity, 0.0);
+    _present.assign(capacity, false);
+    _postOrder.clear();
+    _postOrder.reserve(nodes.size());
+
+    for(const bpp::Node* node : nodes) {
+        const int id = node->getId();
+        if(id < 0 || _present[id])
+            throw std::invalid_argument("Node ids must be unique and non-negative");
+        _present[id] = true;
+        _postOrder.push_back(id);
+
+        const size_t sonCount = node->getNumberOfSons();
+        if(sonCount != 0 && sonCount != 2)
+            throw std::invalid_argument("Tree is not bifurcating");
+        for(size_t i = 0; i < sonCount; i++) {
+            const int son = node->getSon(i)->getId();
+            _children[2 * id + i] = son;
+            _parents[son] = id;
+        }
+        if(node->hasFather() && node->hasDistanceToFather())
+            _branchLengths[id] = node->getDistanceToFather();
+    }
+}
+
+bpp::TreeTemplate<bpp::Node>* FlatTree::toTree(const std::vector<std::string>& names) const
+{
+    std::vector<bpp::Node*> nodes(capacity(), nullptr);
+    for(int id : _postOrder) {
+        bpp::Node* node = isLeaf(id) ? new bpp::Node(id, names.at(id)) : new bpp::Node(id);
+        if(!isLeaf(id)) {
+            node->addSon(nodes[child(id, 0)]);
+            node->addSon(nodes[child(id, 1)]);
+        }
+        if(_parents[id] != NONE)
+            node->setDistanceToFather(_branchLengths[id]);
+        nodes[id] = node;
+    }
+    return new bpp::TreeTemplate<bpp::Node>(nodes[root()]);
+}
+
+bool FlatTree::operator==(const FlatTree& other) const
+{
+    return _present == other._present && _parents == other._parents && _branchLengths == other._branchLengths;
+}
+
+size_t FlatTree::hash() const
+{
+    size_t h = capacity();
+    for(size_t id = 0; id < capacity(); id++) {
+        if(_present[id])
+            h = (h * 31 + std::hash<int>()(_parents[id])) * 31 + std::hash<double>()(_branchLengths[id]);
+    }
+    return h;
+}
+
+}} // namespaces
@@ -0,0 +1,86 @@
+#ifndef STS_ONLINE_FLAT_TREE_H
+#define STS_ONLINE_FLAT_TREE_H
+
+#include <string>
+#include <vector>
+
+#include <Bpp/Phyl/TreeTemplate.h>
+
+namespace sts { namespace online {
+
+/// \brief Rooted bifurcating tree stored in arrays indexed by node id
+///
+/// Parents, children and branch lengths are contiguous, and a post-order is computed once, so that traversals do not
+/// chase the pointers of a #bpp::TreeTemplate. Node ids follow the convention of the rest of the program: leaves are
+/// numbered by their index in the alignment and internal nodes from the number of sequences upwards. Ids may be
+/// missing while taxa are being added.
+class FlatTree
+{
+public:
+    /// Parent of the root, children of leaves
+    static const int NONE = -1;
+
+    FlatTree();
+    explicit FlatTree(const bpp::TreeTemplate<bpp::Node>& tree);
+
+    /// Copy the topology and branch lengths of \c tree, reusing the storage
+    void assign(const bpp::TreeTemplate<bpp::Node>& tree);
+
+    /// Bio++ tree with the same topology and branch lengths, leaves named \c names[id]
+    bpp::TreeTemplate<bpp::Node>* toTree(const std::vector<std::string>& names) const;
+
+    /// Number of nodes in the tree
+    size_t size() const { return _postOrder.size(); }
+
+    /// One more than the largest node id
+    size_t capacity() const { return _parents.size(); }
+
+    bool contains(int id) const { return id >= 0 && id < static_cast<int>(capacity()) && _present[id]; }
+
+    int root() const { return _postOrder.back(); }
+
+    int parent(int id) const { return _parents[id]; }
+
+    /// Child \c i, 0 or 1, of \c id
+    int child(int id, int i) const { return _children[2 * id + i]; }
+
+    /// The other child of the parent of \c id
+    int sibling(int id) const
+    {
+        const int p = _parents[id];
+        return _children[2 * p] == id ? _children[2 * p + 1] : _children[2 * p];
+    }
+
+    bool isLeaf(int id) const { return _children[2 * id] == NONE; }
+
+    /// Length of the branch above \c id, 0 for the root
+    double branchLength(int id) const { return _branchLengths[id]; }
+
+    void setBranchLength(int id, double length) { _branchLengths[id] = length; }
+
+    /// Node ids, children before their parent and the root last
+    const std::vector<int>& postOrder() const { return _postOrder; }
+
+    /// Same node ids, with the same parents and branch lengths, whatever the order of the children
+    bool operator==(const FlatTree& other) const;
+    bool operator!=(const FlatTree& other) const { return !(*this == other); }
+
+    /// Consistent with operator==, so that trees can key hash tables
+    size_t hash() const;
+
+    struct Hash
+    {
+        size_t operator()(const FlatTree& tree) const { return tree.hash(); }
+    };
+
+private:
+    std::vector<int> _parents;
+    std::vector<int> _children;
+    std::vector<double> _branchLengths;
+    std::vector<char> _present;
+    std::vector<int> _postOrder;
+};
+
+}} // namespaces
+
+#endif // STS_ONLINE_FLAT_TREE_H
@@ -70,27 +70,32 @@ namespace sts {
             _updateNode.assign(_updateNode.size(), true);
             
             if ( _updateScores ) {
-                first_pass(*tree.getRootNode());
+                _flatTree.assign(tree);
+                first_pass();
                 
                 _score = 0;
-                const std::vector<int32_t>& root_scores =_local_scores[tree.getRootNode()->getId()];
+                const std::vector<int32_t>& root_scores =_local_scores[_flatTree.root()];
                 for ( int i = 0; i < _patternCount; i++ ) {
                     _score += root_scores[i] * _weights[i];
                 }
-                _updateNode.assign(tree.getNumberOfNodes(), false);
+                _updateNode.assign(_nodeCount, false);
                 _updateScores = false;
                 _updateUpperScores = true;
             }
             return _score;
         }
         
-        double FlexibleParsimony::getScore(const bpp::TreeTemplate<bpp::Node>& tree, const bpp::Node& distal, std::string taxon){
+        double FlexibleParsimony::getScore(const bpp::TreeTemplate<bpp::Node>& tree, const bpp::Node& distal, const std::string& taxon){
+            size_t indexTaxon = find(_taxa.begin(), _taxa.end(), taxon) - _taxa.begin();
+            return getScore(tree, distal, indexTaxon);
+        }
+        
+        double FlexibleParsimony::getScore(const bpp::TreeTemplate<bpp::Node>& tree, const bpp::Node& distal, size_t indexTaxon){
             if(_updateUpperScores){
-                traverseUpper(tree.getRootNode());
+                traverseUpper();
                 _updateUpperScores = false;
             }
             
-            size_t indexTaxon = find(_taxa.begin(), _taxa.end(), taxon) - _taxa.begin();
             assert(tree.getRootNode()->getId() != _local_scores.size()-1);
             
             
@@ -117,17 +122,16 @@ namespace sts {
             return _score;
         }
         
-        bool FlexibleParsimony::first_pass( const bpp::Node& node ){
-            bool updated = _updateNode[node.getId()];
-            
-            if( node.getNumberOfSons() > 0 ) {
-                bool updated_child = first_pass(*node.getSon(0));
-                updated_child |= first_pass(*node.getSon(1));
+        void FlexibleParsimony::first_pass(){
+            for(int nodeId : _flatTree.postOrder()){
+                if(_flatTree.isLeaf(nodeId)){
+                    continue;
+                }
+                const int idx0 = _flatTree.child(nodeId, 0);
+                const int idx1 = _flatTree.child(nodeId, 1);
                 
-                if( updated_child ){
-                    int nodeId = node.getId();
-                    size_t idx0 = node.getSon(0)->getId();
-                    size_t idx1 = node.getSon(1)->getId();
+                // Children come first in the post-order, their flags already include their own subtree
+                if( _updateNode[idx0] || _updateNode[idx1] ){
                     std::vector<int8_t>& states = _stateSets[nodeId];
                     
                     for ( int i = 0; i < _patternCount; i++ ) {
@@ -157,64 +161,49 @@ namespace sts {
                     
                     std::vector<int32_t>& local_score = _local_scores[nodeId];
                     
-                    if( !node.getSon(0)->isLeaf() ){
+                    if( !_flatTree.isLeaf(idx0) ){
                         for ( int i = 0; i < _patternCount; i++ ){
                             local_score[i] += _local_scores[idx0][i];
                         }
                     }
-                    if( !node.getSon(1)->isLeaf() ){
+                    if( !_flatTree.isLeaf(idx1) ){
                         for ( int i = 0; i < _patternCount; i++ ){
                             local_score[i] += _local_scores[idx1][i];
                         }
                     }
                     
-                    updated = true;
+                    _updateNode[nodeId] = true;
                 }
             }
-            return updated;
         }
 
-        void FlexibleParsimony::traverseUpper(const bpp::Node* node){
+        void FlexibleParsimony::traverseUpper(){
+            const std::vector<int>& order = _flatTree.postOrder();
             
-            if(node->hasFather()){
-                const bpp::Node* parent = node->getFather();
-                const bpp::Node* sibling = parent->getSon(0);
-                if (sibling == node) {
-                    sibling = parent->getSon(1);
+            // Parents before their children
+            for(auto it = order.rbegin(); it != order.rend(); ++it){
+                const int nodeId = *it;
+                const int parentId = _flatTree.parent(nodeId);
+                if(parentId == FlatTree::NONE){
+                    continue;
                 }
                 
-                if(parent->hasFather()){
-                    const bpp::Node* grandParent = parent->getFather();
-                    const int idSibling = sibling->getId();
+                const int grandParentId = _flatTree.parent(parentId);
+                if(grandParentId != FlatTree::NONE){
+                    const int idSibling = _flatTree.sibling(nodeId);
                     
-                    int idMatrix = parent->getId();
-                    
-                    // The sons of the right node of the root are going to use the lower partials of the left node of the root
-                    if(!grandParent->hasFather() && grandParent->getSon(1) == parent){
-                        idMatrix = grandParent->getSon(0)->getId();
-                    }
+                    _upperPartialsIndexes[nodeId] = nodeId + _nodeCount;
                     
-                    _upperPartialsIndexes[node->getId()] = node->getId() + _nodeCount;
-                    
-                    calculateLocalScore(_stateSets[_upperPartialsIndexes[node->getId()]].data(), _local_scores[_upperPartialsIndexes[node->getId()]].data(),
-                                        _stateSets[_upperPartialsIndexes[parent->getId()]].data(), _stateSets[idSibling].data(),
-                                        _local_scores[_upperPartialsIndexes[parent->getId()]].data(), _local_scores[idSibling].data(),
-                                        _local_scores[_upperPartialsIndexes[parent->getId()]].size() == 0, _local_scores[idSibling].size() == 0);
+                    calculateLocalScore(_stateSets[_upperPartialsIndexes[nodeId]].data(), _local_scores[_upperPartialsIndexes[nodeId]].data(),
+                                        _stateSets[_upperPartialsIndexes[parentId]].data(), _stateSets[idSibling].data(),
+                                        _local_scores[_upperPartialsIndexes[parentId]].data(), _local_scores[idSibling].data(),
+                                        _local_scores[_upperPartialsIndexes[parentId]].size() == 0, _local_scores[idSibling].size() == 0);
                 }
                 // We dont need to calculate upper partials for the children of the root as it is using the lower partials of its sibling
-                // Left node of the root
-                else if(parent->getSon(0) == node){
-                    _upperPartialsIndexes[node->getId()] = parent->getSon(1)->getId();
-                }
                 else{
-                    _upperPartialsIndexes[node->getId()] = parent->getSon(0)->getId();
+                    _upperPartialsIndexes[nodeId] = _flatTree.sibling(nodeId);
                 }
             }
-            
-            if(node->getNumberOfSons() > 0){
-                traverseUpper(node->getSon(0));
-                traverseUpper(node->getSon(1));
-            }
         }
         
         
@@ -6,6 +6,8 @@
 #include <Bpp/Phyl/TreeTemplate.h>
 #include <Bpp/Phyl/SitePatterns.h>
 
+#include "flat_tree.h"
+
 namespace sts {
     namespace online{
         
@@ -24,7 +26,10 @@ namespace sts {
             
             double getScore(const bpp::TreeTemplate<bpp::Node>& tree);
             
-            double getScore(const bpp::TreeTemplate<bpp::Node>& tree, const bpp::Node& distal, std::string taxon);
+            /// Score of the tree with taxon \c indexTaxon of the alignment attached above \c distal
+            double getScore(const bpp::TreeTemplate<bpp::Node>& tree, const bpp::Node& distal, size_t indexTaxon);
+            
+            double getScore(const bpp::TreeTemplate<bpp::Node>& tree, const bpp::Node& distal, const std::string& taxon);
             
             void updateAllNodes();
             
@@ -32,11 +37,12 @@ namespace sts {
             
         protected:
             
-            bool first_pass( const bpp::Node& node );
+            /// Update the state sets of the nodes of #_flatTree above a flagged node
+            void first_pass();
             
             bool first_pass( const bpp::Node& node, const bpp::Node& distal, size_t indexAttachment, size_t indexTaxon );
             
-            void traverseUpper(const bpp::Node* node);
+            void traverseUpper();
             
             void calculateLocalScore(int8_t* states, int32_t* local_scores,
                                                         const int8_t* states1, const int8_t* states2,
@@ -57,6 +63,9 @@ namespace sts {
             
             std::vector<std::string> _taxa;
             
+            // Tree of the last call to getScore(tree)
+            FlatTree _flatTree;
+            
             double _score;
             bool _updateScores;
             bool _updateUpperScores;
@@ -2,6 +2,8 @@
 #define FlexibleTreeLikelihood_hpp
 
 #include <stdio.h>
+#include <memory>
+#include <string>
 #include <vector>
 
 #include <Bpp/Phyl/TreeTemplate.h>
@@ -9,6 +11,10 @@
 #include <Bpp/Phyl/Model/SubstitutionModel.h>
 #include <Bpp/Numeric/Prob/DiscreteDistribution.h>
 
+#include "attachment_context.h"
+#include "attachment_location.h"
+#include "likelihood_state.h"
+
 namespace sts {
     namespace online {
         
@@ -20,18 +26,116 @@ namespace sts {
             
             virtual void initialize(const bpp::SubstitutionModel &model, const bpp::DiscreteDistribution& rateDist, bpp::TreeTemplate<bpp::Node>& tree) = 0;
             
+            // Same as above, reusing the partials of state that still hold for tree
+            // state may be null, or come from a calculator that is not able to restore it
+            virtual void initialize(const bpp::SubstitutionModel &model, const bpp::DiscreteDistribution& rateDist, bpp::TreeTemplate<bpp::Node>& tree, const std::shared_ptr<const LikelihoodState>&){
+                initialize(model, rateDist, tree);
+            }
+            
+            // The tree given to initialize was modified since: nodes were added, moved or their branch changed
+            // Implementations may recompute only the partials that depend on the changes
+            virtual void updateTree() = 0;
+            
+            // The branch above node, in the tree given to initialize, changed length: only the partials above it are recomputed
+            virtual void updateNode(const bpp::Node& node) = 0;
+            
+            // Start recording the changes notified by updateNode, so that rollback can undo them
+            // The partials are brought up to date first
+            virtual void checkpoint(){}
+            
+            // Return to the partials and log likelihood as of checkpoint, once the caller has restored the branch lengths
+            // This implementation initializes again with the tree
+            virtual void rollback(){
+                updateTree();
+            }
+            
+            // Partials of the tree as of the last evaluation, or null if the calculator does not keep them
+            virtual std::shared_ptr<const LikelihoodState> saveState(){
+                return nullptr;
+            }
+            
+            // Index of taxon taxonName in the alignment, which is also the id of its leaf
+            // Attachments are evaluated for a taxon index, the overloads taking a name look it up first
+            virtual size_t taxonIndex(const std::string& taxonName) const = 0;
+            
             virtual double calculateLogLikelihood() = 0;
             
-            virtual double calculateLogLikelihood(const bpp::Node& distal, std::string taxonName, double pendantLength, double distalLength, double proximalLength) = 0;
+            virtual double calculateLogLikelihood(const bpp::Node& distal, size_t taxonIndex, double pendantLength, double distalLength, double proximalLength) = 0;
+            
+            double calculateLogLikelihood(const bpp::Node& distal, const std::string& taxonName, double pendantLength, double distalLength, double proximalLength){
+                return calculateLogLikelihood(distal, taxonIndex(taxonName), pendantLength, distalLength, proximalLength);
+            }
+            
+            // Log likelihoods of attaching taxon taxonIndex at each location with each pendant length, indexed [location][pendant length]
+            // Implementations may share the work done for a location across pendant lengths, and for a pendant length across locations
+            virtual std::vector<std::vector<double> > calculateAttachmentLogLikelihoods(const std::vector<AttachmentLocation>& locations, size_t taxonIndex, const std::vector<double>& pendantLengths){
+                std::vector<std::vector<double> > logLikelihoods(locations.size(), std::vector<double>(pendantLengths.size()));
+                for(size_t i = 0; i < locations.size(); i++){
+                    const bpp::Node& node = *locations[i].node;
+                    for(size_t j = 0; j < pendantLengths.size(); j++){
+                        logLikelihoods[i][j] = calculateLogLikelihood(node, taxonIndex, pendantLengths[j], locations[i].distal, node.getDistanceToFather()-locations[i].distal);
+                    }
+                }
+                return logLikelihoods;
+            }
+            
+            std::vector<std::vector<double> > calculateAttachmentLogLikelihoods(const std::vector<AttachmentLocation>& locations, const std::string& taxonName, const std::vector<double>& pendantLengths){
+                return calculateAttachmentLogLikelihoods(locations, taxonIndex(taxonName), pendantLengths);
+            }
             
             // Compute derivatives at node node with current tree
 //            virtual void calculateDerivatives(const bpp::Node& node, double* d1, double* d2) = 0;
             
-            // Compute derivatives of pendant branch with taxon taxonName
-            virtual void calculatePendantDerivatives(const bpp::Node& distal, std::string taxonName, double pendantLength, double distalLength, double proximalLength, double* d1, double* d2) = 0;
+            // Compute derivatives of pendant branch with taxon taxonIndex
+            // Returns the log likelihood of the tree with the taxon attached, computed in the same pass
+            virtual double calculatePendantDerivatives(const bpp::Node& distal, size_t taxonIndex, double pendantLength, double distalLength, double proximalLength, double* d1, double* d2) = 0;
+            
+            virtual double calculateDistalDerivatives(const bpp::Node& distal, size_t taxonIndex, double pendantLength, double distalLength, double proximalLength, double* d1, double* d2) = 0;
             
-            virtual void calculateDistalDerivatives(const bpp::Node& distal, std::string taxonName, double pendantLength, double distalLength, double proximalLength, double* d1, double* d2) = 0;
+            double calculatePendantDerivatives(const bpp::Node& distal, const std::string& taxonName, double pendantLength, double distalLength, double proximalLength, double* d1, double* d2){
+                return calculatePendantDerivatives(distal, taxonIndex(taxonName), pendantLength, distalLength, proximalLength, d1, d2);
+            }
+            
+            double calculateDistalDerivatives(const bpp::Node& distal, const std::string& taxonName, double pendantLength, double distalLength, double proximalLength, double* d1, double* d2){
+                return calculateDistalDerivatives(distal, taxonIndex(taxonName), pendantLength, distalLength, proximalLength, d1, d2);
+            }
+            
+            // Context for repeated evaluations of the attachment of taxon taxonIndex on the edge above node distal
+            virtual std::unique_ptr<AttachmentContext> createAttachmentContext(const bpp::Node& distal, size_t taxonIndex);
+            
+            std::unique_ptr<AttachmentContext> createAttachmentContext(const bpp::Node& distal, const std::string& taxonName){
+                return createAttachmentContext(distal, taxonIndex(taxonName));
+            }
+        };
+        
+        // Attachment context evaluating every call from scratch
+        class ForwardingAttachmentContext : public AttachmentContext{
+            
+        public:
+            ForwardingAttachmentContext(FlexibleTreeLikelihood& calculator, const bpp::Node& distal, size_t taxonIndex):
+            _calculator(calculator), _distal(distal), _taxonIndex(taxonIndex){}
+            
+            virtual double logLikelihood(double pendantLength, double distalLength){
+                return _calculator.calculateLogLikelihood(_distal, _taxonIndex, pendantLength, distalLength, _distal.getDistanceToFather()-distalLength);
+            }
+            
+            virtual double pendantDerivatives(double pendantLength, double distalLength, double* d1, double* d2){
+                return _calculator.calculatePendantDerivatives(_distal, _taxonIndex, pendantLength, distalLength, _distal.getDistanceToFather()-distalLength, d1, d2);
+            }
+            
+            virtual double distalDerivatives(double pendantLength, double distalLength, double* d1, double* d2){
+                return _calculator.calculateDistalDerivatives(_distal, _taxonIndex, pendantLength, distalLength, _distal.getDistanceToFather()-distalLength, d1, d2);
+            }
+            
+        private:
+            FlexibleTreeLikelihood& _calculator;
+            const bpp::Node& _distal;
+            size_t _taxonIndex;
         };
+        
+        inline std::unique_ptr<AttachmentContext> FlexibleTreeLikelihood::createAttachmentContext(const bpp::Node& distal, size_t taxonIndex){
+            return std::unique_ptr<AttachmentContext>(new ForwardingAttachmentContext(*this, distal, taxonIndex));
+        }
     }
 }
     
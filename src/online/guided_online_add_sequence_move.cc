@@ -6,7 +6,6 @@
 #include "util.h"
 #include "online_util.h"
 #include "log_tricks.h"
-#include "weighted_selector.h"
 
 #include <algorithm>
 #include <cassert>
@@ -138,7 +137,7 @@ GuidedOnlineAddSequenceMove::GuidedOnlineAddSequenceMove(CompositeTreeLikelihood
 /// Passing by value purposefully here
 std::vector<std::pair<bpp::Node*, double> > GuidedOnlineAddSequenceMove::subdivideTopN(std::vector<AttachmentLocation> locs,
                                                                              const std::vector<double>& logWeights,
-                                                                             const std::string& leafName)
+                                                                             size_t taxonIndex)
 {
     assert(logWeights.size() == locs.size() && "Invalid size");
 
@@ -165,6 +164,9 @@ std::vector<std::pair<bpp::Node*, double> > GuidedOnlineAddSequenceMove::subdivi
 
     std::vector<AttachmentLocation> tmpLocs;
     std::vector<double> tmpLogLikes;
+    // Locations on divided edges, evaluated in a single batch
+    std::vector<AttachmentLocation> newLocs;
+    std::vector<size_t> newLocIndexes;
     for(size_t i = 0; i < locs.size(); i++) {
         AttachmentLocation& loc = locs.at(i);
         if(i >= subdivideTop || loc.node->getDistanceToFather() < 2 * maxLength) {
@@ -175,19 +177,23 @@ std::vector<std::pair<bpp::Node*, double> > GuidedOnlineAddSequenceMove::subdivi
             // Edge needs to be divided further
             assert(loc.node != nullptr);
             for(AttachmentLocation& l : divideEdge(loc.node, maxLength)) {
+                newLocIndexes.push_back(tmpLocs.size());
+                newLocs.push_back(l);
                 tmpLocs.push_back(l);
-                // Posterior
-                std::vector<double> ll;
-                for(double pendantLength : proposePendantBranchLengths){
-                    ll.push_back(calculator(*l.node, leafName, pendantLength, l.distal, l.node->getDistanceToFather()-l.distal));
-                }
-                
-                tmpLogLikes.push_back(*std::max_element(ll.begin(), ll.end()));
+                tmpLogLikes.push_back(0.0);
             }
         }
     }
     assert(tmpLocs.size() >= locs.size());
 
+    // Posterior
+    if(!newLocs.empty()) {
+        const std::vector<std::vector<double>> ll =
+            calculator.calculateAttachmentLogLikelihoods(newLocs, taxonIndex, proposePendantBranchLengths);
+        for(size_t i = 0; i < newLocs.size(); i++)
+            tmpLogLikes[newLocIndexes[i]] = *std::max_element(ll[i].begin(), ll[i].end());
+    }
+
     // Update
     return accumulatePerEdgeLikelihoods(tmpLocs, tmpLogLikes);
 }
@@ -203,8 +209,8 @@ std::vector<std::pair<bpp::Node*, double> > GuidedOnlineAddSequenceMove::subdivi
 /// This makes the proposal distribution a bit complicated - an edge may be present in the proposal set more than once.
 /// accumulatePerEdgeLikelihoods (above) takes care of averaging likelihoods.
 const pair<Node*, double> GuidedOnlineAddSequenceMove::chooseEdge(TreeTemplate<Node>& tree,
-                                                                  const std::string& leafName,
-                                                                  smc::rng* rng, size_t particleID)
+                                                                  size_t taxonIndex,
+                                                                  smc::rng* rng, EdgeDistribution& distribution)
 {
     // If subdivideTop is set, we do not subdivide edges here, rather
     // divide in half once and subdivide the top N edges later
@@ -214,16 +220,9 @@ const pair<Node*, double> GuidedOnlineAddSequenceMove::chooseEdge(TreeTemplate<N
                          std::numeric_limits<double>::max() :
                          maxLength));
     
-    std::vector<std::vector<double>> attachLogLikesByPendant;
-    for(AttachmentLocation& l : locs) {
-        // Posterior
-        std::vector<double> ll;
-        for(double pendantLength : proposePendantBranchLengths){
-            ll.push_back(calculator(*l.node, leafName, pendantLength, l.distal, l.node->getDistanceToFather()-l.distal));
-        }
-        
-        attachLogLikesByPendant.push_back(ll);
-    }
+    // Posterior
+    const std::vector<std::vector<double>> attachLogLikesByPendant =
+        calculator.calculateAttachmentLogLikelihoods(locs, taxonIndex, proposePendantBranchLengths);
 
     std::vector<double> attachLogLikes(locs.size());
 
@@ -241,37 +240,30 @@ const pair<Node*, double> GuidedOnlineAddSequenceMove::chooseEdge(TreeTemplate<N
 
     if(subdivideTop > 0) {
         // Hybrid scheme
-        nodeLogWeights = subdivideTopN(locs, attachLogLikes, leafName);
+        nodeLogWeights = subdivideTopN(locs, attachLogLikes, taxonIndex);
     } else {
         nodeLogWeights = accumulatePerEdgeLikelihoods(locs, attachLogLikes);
     }
-    std::vector<std::pair<size_t, double>> probabilities;
+    EdgeProbabilities& probabilities = distribution.probabilities;
+    probabilities.clear();
     probabilities.reserve(nodeLogWeights.size());
-    
-    WeightedSelector<bpp::Node*> nodeSelector{*rng};
-    for(auto& p : nodeLogWeights) {
-        double prob = exp(p.second);
-        nodeSelector.push_back(p.first, prob);
-        probabilities.push_back(make_pair(p.first->getId(), prob));
-    }
-    assert(nodeSelector.size() == nodeLogWeights.size());
-    
-    _probs[particleID] = probabilities;
+    for(auto& p : nodeLogWeights)
+        probabilities.push_back(make_pair(p.first->getId(), exp(p.second)));
 
-    bpp::Node* n = nodeSelector.choice();
-    auto it = std::find_if( nodeLogWeights.begin(), nodeLogWeights.end(),
-                           [n](const std::pair<bpp::Node*, double>& element){return element.first == n;});
-    return pair<Node*,double>(n, it->second);
+    // The same table serves the other particles of the group
+    distribution.table.assign(probabilities.size(), [&probabilities](size_t i) { return probabilities[i].second; });
+    const pair<Node*, double>& chosen = nodeLogWeights[distribution.table.draw(*rng)];
+    return pair<Node*,double>(chosen.first, chosen.second);
 }
 
 /// Propose branch-lengths around ML value
 void GuidedOnlineAddSequenceMove::optimizeBranchLengths(const Node* insertEdge,
-                                                                   const std::string& newLeafName,
+                                                                   size_t taxonIndex,
                                                                    double& distalBranchLength,
                                                                    double& pendantBranchLength)
 {
     const double d = insertEdge->getDistanceToFather();
-    TripodOptimizer optim(calculator, insertEdge, newLeafName, d);
+    TripodOptimizer optim(calculator, insertEdge, taxonIndex, d);
 
     double pendant = 1e-8;
     double distal = d / 2;
@@ -305,7 +297,7 @@ void GuidedOnlineAddSequenceMove::optimizeBranchLengths(const Node* insertEdge,
 
 /// Distal branch length proposal
 /// We propose from Gaussian(mlDistal, edgeLength / 4) with support truncated to [0, edgeLength]
-std::pair<double, double> GuidedOnlineAddSequenceMove::proposeDistal(bpp::Node& n, const std::string& leafName, const double mlDistal, const double mlPendant, smc::rng* rng) const
+std::pair<double, double> GuidedOnlineAddSequenceMove::proposeDistal(bpp::Node& n, size_t taxonIndex, const double mlDistal, const double mlPendant, smc::rng* rng) const
 {
     assert(mlDistal <= n.getDistanceToFather());
     const double edgeLength = n.getDistanceToFather();
@@ -338,17 +330,17 @@ std::pair<double, double> GuidedOnlineAddSequenceMove::proposeDistal(bpp::Node&
     return std::pair<double, double>(distal, distalLogDensity);
 }
 
-std::pair<double, double> GuidedOnlineAddSequenceMove::proposePendant(bpp::Node& n, const std::string& leafName, const double mlPendant, const double distalBranchLength, smc::rng* rng) const
+std::pair<double, double> GuidedOnlineAddSequenceMove::proposePendant(bpp::Node& n, size_t taxonIndex, const double mlPendant, const double distalBranchLength, smc::rng* rng) const
 {
     const double pendantBranchLength = rng->Exponential(mlPendant);
     const double pendantLogDensity = std::log(gsl_ran_exponential_pdf(pendantBranchLength, mlPendant));
     return std::pair<double, double>(pendantBranchLength, pendantLogDensity);
 }
 
-AttachmentProposal GuidedOnlineAddSequenceMove::propose(const std::string& leafName, smc::particle<TreeParticle>& particle, smc::rng* rng)
+AttachmentProposal GuidedOnlineAddSequenceMove::propose(size_t taxonIndex, TreeParticle& particle, smc::rng* rng)
 {
-    TreeParticle* value = particle.GetValuePointer();
-    unique_ptr<TreeTemplate<bpp::Node>>& tree = value->tree;
+    TreeParticle* value = &particle;
+    TreeTemplate<bpp::Node>* tree = &value->mutableTree();
 
     // Replace node `n` in the tree with a new node containing as children `n` and `new_node`
     // Attach a new leaf, in the following configuration
@@ -364,58 +356,49 @@ AttachmentProposal GuidedOnlineAddSequenceMove::propose(const std::string& leafN
     //              n
     
     // Step 1: Select attachment branch
+    // Particles of a tree group share the edge probabilities, computed by the first one to get here
+    const size_t group = treeGroup(*tree);
     Node* n = nullptr;
     double edgeLogDensity;
-    size_t toAddCount = std::distance(taxaToAdd.begin(),taxaToAdd.end());
-    if(_toAddCount == toAddCount && _probs.find(value->particleID) != _probs.end() ){
-        std::vector<bpp::Node*> nodes = onlineAvailableEdges(*tree);
-
-        const std::vector<std::pair<size_t, double>>& probabilities = _probs[value->particleID];
-        WeightedSelector<bpp::Node*> selector{*rng};
-        for(auto& pair: probabilities){
-            size_t idx = pair.first;
-            auto it = std::find_if( nodes.begin(), nodes.end(),
-                                   [idx](const bpp::Node* element){return element->getId() == idx;});
-            selector.push_back(*it, pair.second);
-        }
-        n = selector.choice();
-        int idx = n->getId();
-        auto it = std::find_if( probabilities.begin(), probabilities.end(),
-                               [idx](const std::pair<size_t, double>& element){return element.first == idx;});
-        edgeLogDensity = log(it->second);
+    bool computed;
+    const std::shared_ptr<const EdgeDistribution> distribution = _probs.getOrCompute(group, [&]() {
+        std::shared_ptr<EdgeDistribution> d = std::make_shared<EdgeDistribution>();
+        std::tie(n, edgeLogDensity) = chooseEdge(*tree, taxonIndex, rng, *d);
+        return std::shared_ptr<const EdgeDistribution>(d);
+    }, &computed);
+    // An edge chosen without drawing leaves no probabilities
+    if(!computed && distribution->probabilities.empty()) {
+        EdgeDistribution unshared;
+        std::tie(n, edgeLogDensity) = chooseEdge(*tree, taxonIndex, rng, unshared);
     }
-    else{
-        std::tie(n, edgeLogDensity) = chooseEdge(*tree, leafName, rng, value->particleID);
+    else if(!computed){
+        // Drawn from the table built by the first particle of the group, then looked up in this copy of the tree
+        const std::pair<size_t, double>& edge = distribution->probabilities[distribution->table.draw(*rng)];
+        n = tree->getNode(static_cast<int>(edge.first));
+        edgeLogDensity = log(edge.second);
     }
     
-//    calculator.calculateAttachmentLikelihood(leafName, n, 0);
+//    calculator.calculateAttachmentLikelihood(taxonIndex, n, 0);
     
     // Calculate MLEs of distal and pendant branch lengths
-    bool found = false;
-    std::unordered_map<size_t, std::unordered_map<size_t, std::pair<double,double>>>::const_iterator iter= _mles.find(value->particleID);
-    if(_toAddCount == toAddCount && iter != _mles.cend()){
-        std::unordered_map<size_t, std::pair<double,double>>::const_iterator iter2 = iter->second.find(n->getId());
-        if(iter2 != iter->second.cend()){
-            std::tie(_mleDistal, _mlePendant) = iter2->second;
-            found = true;
-        }
-    }
-    if(!found){
-        optimizeBranchLengths(n, leafName, _mleDistal, _mlePendant);
-        _mles[value->particleID][n->getId()] = std::make_pair(_mleDistal, _mlePendant);
-    }
+    double mleDistal, mlePendant;
+    std::tie(mleDistal, mlePendant) = _mles.getOrCompute(std::make_pair(group, static_cast<size_t>(n->getId())), [&]() {
+        double distal, pendant;
+        optimizeBranchLengths(n, taxonIndex, distal, pendant);
+        return std::make_pair(distal, pendant);
+    });
 
 
     // Step2:  proposal distal branch length
     double distalBranchLength, distalLogDensity;
-    std::tie(distalBranchLength, distalLogDensity) = proposeDistal(*n, leafName, _mleDistal, _mlePendant, rng);
+    std::tie(distalBranchLength, distalLogDensity) = proposeDistal(*n, taxonIndex, mleDistal, mlePendant, rng);
 
     // Step 3: propose pendant branch length
     double pendantBranchLength, pendantLogDensity;
-    std::tie(pendantBranchLength, pendantLogDensity) = proposePendant(*n, leafName, _mlePendant, distalBranchLength, rng);
+    std::tie(pendantBranchLength, pendantLogDensity) = proposePendant(*n, taxonIndex, mlePendant, distalBranchLength, rng);
     assert(!std::isnan(pendantLogDensity));
     
-    return AttachmentProposal { n, edgeLogDensity, distalBranchLength, distalLogDensity, pendantBranchLength, pendantLogDensity, _mleDistal, _mlePendant, _proposalMethodName };
+    return AttachmentProposal { n, edgeLogDensity, distalBranchLength, distalLogDensity, pendantBranchLength, pendantLogDensity, mleDistal, mlePendant, _proposalMethodName };
 }
 
 }} // namespaces
@@ -53,41 +53,39 @@ protected:
     /// \param node Chosen node
     /// \param mlDistal Maximum-likelihood estimate of distal branch length
     /// \return A pair of (distal branch length, log density)
-    virtual std::pair<double, double> proposeDistal(bpp::Node& n, const std::string& leafName, const double mlDistal, const double mlPendant, smc::rng* rn) const;
+    virtual std::pair<double, double> proposeDistal(bpp::Node& n, size_t taxonIndex, const double mlDistal, const double mlPendant, smc::rng* rn) const;
 
     /// \brief Propose a pendant branch length around the ML value
     ///
     /// \return A pair of (pendant branch length, log density)
-    virtual std::pair<double, double> proposePendant(bpp::Node& n, const std::string& leafName, const double mlPendant, const double distalBranchLength, smc::rng* rng) const;
-    virtual AttachmentProposal propose(const std::string& leafName, smc::particle<TreeParticle>& particle, smc::rng* rng);
+    virtual std::pair<double, double> proposePendant(bpp::Node& n, size_t taxonIndex, const double mlPendant, const double distalBranchLength, smc::rng* rng) const;
+    virtual AttachmentProposal propose(size_t taxonIndex, TreeParticle& particle, smc::rng* rng);
 
-    /// Choose edge on which to insert sequence \c leaf_name
+    /// Choose edge on which to insert sequence \c taxonIndex
     ///
     /// \param tree
-    /// \param leafName Name of the new taxon, already registered with the calculator.
+    /// \param taxonIndex Index of the new taxon in the alignment, already registered with the calculator.
     /// \param rng Random number generator
+    /// \param distribution Set to the probability of choosing each edge and the table the edge is drawn from, for the
+    /// other particles of the group, or left empty when there was no choice to draw
     /// \returns a pair consisting of the node to insert above, and an unnormalized log-likelihood of proposing the node
     /// (forward proposal density)
     virtual const std::pair<bpp::Node*, double> chooseEdge(bpp::TreeTemplate<bpp::Node>& tree,
-                                                           const std::string& leafName,
-                                                           smc::rng* rng, size_t particleID);
+                                                           size_t taxonIndex,
+                                                           smc::rng* rng, EdgeDistribution& distribution);
 
     std::vector<std::pair<bpp::Node*, double> > accumulatePerEdgeLikelihoods(std::vector<AttachmentLocation>& locs,
                                                                                                           const std::vector<double>& logWeights) const;
     
-    virtual void optimizeBranchLengths(const bpp::Node* insertEdge, const std::string& newLeafName,
+    virtual void optimizeBranchLengths(const bpp::Node* insertEdge, size_t taxonIndex,
                                                   double& distalBranchLength, double& pendantBranchLength);
 public:
     double _heating;
 
-protected:
-    double _mleDistal;
-    double _mlePendant;
-    
 private:
     std::vector<std::pair<bpp::Node*, double> > subdivideTopN(std::vector<AttachmentLocation> locs,
                                                          const std::vector<double>& logWeights,
-                                                         const std::string& leafName);
+                                                         size_t taxonIndex);
     /// Branch lengths to propose from
     std::vector<double> proposePendantBranchLengths;
     double maxLength;
@@ -0,0 +1,66 @@
+#include "insertion_order.h"
+#include "attachment_location.h"
+#include "composite_tree_likelihood.h"
+#include "online_util.h"
+#include "parallel.h"
+#include "tree_particle.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <stdexcept>
+
+using namespace bpp;
+
+namespace sts { namespace online {
+
+std::vector<PlacementScore> orderByPlacement(CompositeTreeLikelihood& calculator,
+                                             std::vector<TreeParticle>& trees,
+                                             const std::vector<size_t>& taxa,
+                                             const std::vector<double>& pendantLengths,
+                                             size_t threads)
+{
+    assert(threads <= calculator.workerCount() && "Not enough calculators for the workers!");
+    if(trees.empty() || pendantLengths.empty())
+        throw std::invalid_argument("Placements need at least one tree and one pendant branch length");
+
+    // Probability of the best edge of each taxon, by tree
+    std::vector<std::vector<double>> confidences(trees.size(), std::vector<double>(taxa.size()));
+    parallelFor(trees.size(), threads, [&](size_t t) {
+        TreeParticle& particle = trees[t];
+        TreeTemplate<Node>& tree = particle.mutableTree();
+        calculator.initialize(particle.model(), particle.rateDist(), tree);
+
+        std::vector<AttachmentLocation> locations;
+        for(Node* node : onlineAvailableEdges(tree))
+            locations.emplace_back(node, node->getDistanceToFather() / 2);
+
+        std::vector<double> logLikes(locations.size());
+        for(size_t i = 0; i < taxa.size(); i++) {
+            const std::vector<std::vector<double>> byPendant =
+                calculator.calculateAttachmentLogLikelihoods(locations, taxa[i], pendantLengths);
+            for(size_t j = 0; j < locations.size(); j++)
+                logLikes[j] = *std::max_element(byPendant[j].begin(), byPendant[j].end());
+
+            const double maxLogLike = *std::max_element(logLikes.begin(), logLikes.end());
+            double sum = 0;
+            for(double logLike : logLikes)
+                sum += std::exp(logLike - maxLogLike);
+            confidences[t][i] = 1 / sum;
+        }
+    });
+
+    std::vector<PlacementScore> scores(taxa.size());
+    for(size_t i = 0; i < taxa.size(); i++) {
+        double sum = 0;
+        for(const std::vector<double>& byTaxon : confidences)
+            sum += byTaxon[i];
+        scores[i] = PlacementScore { taxa[i], sum / trees.size() };
+    }
+    std::stable_sort(scores.begin(), scores.end(), [](const PlacementScore& x, const PlacementScore& y) {
+        return x.confidence > y.confidence;
+    });
+    return scores;
+}
+
+}} // namespaces
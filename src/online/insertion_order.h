@@ -0,0 +1,42 @@
+#ifndef STS_ONLINE_INSERTION_ORDER_H
+#define STS_ONLINE_INSERTION_ORDER_H
+
+#include <cstddef>
+#include <vector>
+
+namespace sts { namespace online {
+
+// Forwards
+class CompositeTreeLikelihood;
+class TreeParticle;
+
+/// How confidently a taxon attaches to the reference trees
+struct PlacementScore
+{
+    /// Index of the taxon in the alignment of the calculator
+    size_t taxonIndex;
+    /// Probability of its most likely edge, averaged over the trees
+    double confidence;
+};
+
+/// \brief Order taxa to add by how confidently they are placed on \c trees, most confident first
+///
+/// Each taxon is attached alone to the midpoint of every edge of each tree, with each of \c pendantLengths, and the
+/// edges weighted by their best likelihood. Taxa that clearly belong to one edge are added first, so that the
+/// populations are still diverse when the ambiguous ones come.
+///
+/// \param calculator Evaluates the trees, one per worker
+/// \param trees Sample of the reference trees
+/// \param taxa Indexes of the taxa to add
+/// \param pendantLengths Pendant branch lengths to try
+/// \param threads Number of workers, at most the number of calculators of \c calculator
+/// \returns A score for each taxon of \c taxa, sorted by decreasing confidence, ties in the order of \c taxa
+std::vector<PlacementScore> orderByPlacement(CompositeTreeLikelihood& calculator,
+                                             std::vector<TreeParticle>& trees,
+                                             const std::vector<size_t>& taxa,
+                                             const std::vector<double>& pendantLengths,
+                                             size_t threads);
+
+}} // namespaces
+
+#endif // STS_ONLINE_INSERTION_ORDER_H
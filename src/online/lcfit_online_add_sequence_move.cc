@@ -9,6 +9,7 @@
 #include <lcfit_rejection_sampler.h>
 #include <lcfit_select.h>
 
+#include "attachment_context.h"
 #include "composite_tree_likelihood.h"
 #include "guided_online_add_sequence_move.h"
 #include "lcfit_rejection_sampler.h"
@@ -35,28 +36,26 @@ LcfitOnlineAddSequenceMove::LcfitOnlineAddSequenceMove(CompositeTreeLikelihood&
 
 LcfitOnlineAddSequenceMove::~LcfitOnlineAddSequenceMove()
 {
-    const double lcfit_failure_rate = static_cast<double>(lcfit_failures_) / lcfit_attempts_;
+    const size_t failures = lcfit_failures_, attempts = lcfit_attempts_;
+    const double lcfit_failure_rate = static_cast<double>(failures) / attempts;
     std::clog << "[LcfitOnlineAddSequenceMove] lcfit failure rate = "
-              << lcfit_failures_ << "/" << lcfit_attempts_
+              << failures << "/" << attempts
               << " (" << lcfit_failure_rate * 100.0 << "%)\n";
 }
 
     struct WrapperFlexibleTreeLikelihood{
-        CompositeTreeLikelihood& ctl;
-        const bpp::Node& node;
-        const std::string& leafName;
+        AttachmentContext& context;
         const double distalLength;
-        const double proximalLength;
     };
     
 double attachment_lnl_callback(double t, void* data)
 {
     WrapperFlexibleTreeLikelihood* al = static_cast<WrapperFlexibleTreeLikelihood*>(data);
 
-    return al->ctl(al->node, al->leafName, t, al->distalLength, al->proximalLength);
+    return al->context.logLikelihood(t, al->distalLength);
 }
 
-std::pair<double, double> LcfitOnlineAddSequenceMove::proposeDistal(bpp::Node& n, const std::string& leafName, const double mlDistal, const double mlPendant, smc::rng* rng) const
+std::pair<double, double> LcfitOnlineAddSequenceMove::proposeDistal(bpp::Node& n, size_t taxonIndex, const double mlDistal, const double mlPendant, smc::rng* rng) const
 {
     assert(mlDistal <= n.getDistanceToFather());
     const double edgeLength = n.getDistanceToFather();
@@ -64,8 +63,8 @@ std::pair<double, double> LcfitOnlineAddSequenceMove::proposeDistal(bpp::Node& n
     double distal = -1;
 
     double dd1, dd2;
-	//calculator(n, leafName, mlPendant, mlDistal, edgeLength-mlDistal);
-    calculator.calculateDistalDerivatives(n, leafName, mlPendant, mlDistal, edgeLength-mlDistal, &dd1, &dd2);
+	//calculator(n, taxonIndex, mlPendant, mlDistal, edgeLength-mlDistal);
+    calculator.calculateDistalDerivatives(n, taxonIndex, mlPendant, mlDistal, edgeLength-mlDistal, &dd1, &dd2);
     const double sigma = sqrt(fabs(1/dd2));
     
     // Handle very small branch lengths - attach with distal BL of 0
@@ -94,15 +93,17 @@ std::pair<double, double> LcfitOnlineAddSequenceMove::proposeDistal(bpp::Node& n
     return std::pair<double, double>(distal, distalLogDensity);
 }
     
-std::pair<double, double> LcfitOnlineAddSequenceMove::proposePendant(bpp::Node& n, const std::string& leafName, const double mlPendant, const double distalBranchLength, smc::rng* rng) const{
+std::pair<double, double> LcfitOnlineAddSequenceMove::proposePendant(bpp::Node& n, size_t taxonIndex, const double mlPendant, const double distalBranchLength, smc::rng* rng) const{
 
     // FIXME: Are there actual branch length constraints available somewhere?
     const double min_t = 1e-6;
     const double max_t = 20.0;
     bsm_t model = DEFAULT_INIT;
     
-//    _al->initialize(&n, leafName, distalBranchLength);
-    WrapperFlexibleTreeLikelihood wftl{calculator, n, leafName, distalBranchLength, n.getDistanceToFather()-distalBranchLength};
+//    _al->initialize(&n, taxonIndex, distalBranchLength);
+    // The partials at the attachment point are shared by every pendant length lcfit evaluates
+    std::unique_ptr<AttachmentContext> context = calculator.createAttachmentContext(n, taxonIndex);
+    WrapperFlexibleTreeLikelihood wftl{*context, distalBranchLength};
     lcfit_fit_auto(&attachment_lnl_callback, &wftl, &model, min_t, max_t);
 
 //    _al->finalize();
@@ -120,7 +121,7 @@ std::pair<double, double> LcfitOnlineAddSequenceMove::proposePendant(bpp::Node&
         ++lcfit_failures_;
 
         // Fall back on original proposal
-        return GuidedOnlineAddSequenceMove::proposePendant(n, leafName, mlPendant, distalBranchLength, rng);
+        return GuidedOnlineAddSequenceMove::proposePendant(n, taxonIndex, mlPendant, distalBranchLength, rng);
     }
 
     assert(std::isfinite(pendantBranchLength));
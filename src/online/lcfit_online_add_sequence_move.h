@@ -3,6 +3,8 @@
 
 #include "guided_online_add_sequence_move.h"
 
+#include <atomic>
+
 
 namespace sts { namespace online {
 
@@ -46,14 +48,14 @@ public:
     virtual ~LcfitOnlineAddSequenceMove();
 
 protected:
-    std::pair<double, double> proposeDistal(bpp::Node& n, const std::string& leafName, const double mlDistal, const double mlPendant, smc::rng* rng) const;
+    std::pair<double, double> proposeDistal(bpp::Node& n, size_t taxonIndex, const double mlDistal, const double mlPendant, smc::rng* rng) const;
     
-    std::pair<double, double> proposePendant(bpp::Node& n, const std::string& leafName, const double mlPendant, const double distalBranchLength, smc::rng* rng) const;
+    std::pair<double, double> proposePendant(bpp::Node& n, size_t taxonIndex, const double mlPendant, const double distalBranchLength, smc::rng* rng) const;
 
 
 private:
     const std::tuple<bpp::Node*, double, double, double> chooseMoveLocation(bpp::TreeTemplate<bpp::Node>& tree,
-                                                                           const std::string& leafName,
+                                                                           size_t taxonIndex,
                                                                            smc::rng* rng,
                                                                            size_t particleID);
 
@@ -61,8 +63,9 @@ private:
     std::vector<double> proposePendantBranchLengths;
 
     double expPriorMean_;
-    mutable size_t lcfit_failures_;
-    mutable size_t lcfit_attempts_;
+    // Counted by every worker
+    mutable std::atomic<size_t> lcfit_failures_;
+    mutable std::atomic<size_t> lcfit_attempts_;
 };
 
 }} // namespaces
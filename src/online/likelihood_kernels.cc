@@ -0,0 +1,76 @@
+#include "likelihood_kernels.h"
+
+#include <initializer_list>
+#include <stdexcept>
+
+namespace sts { namespace online {
+
+template<typename T>
+BasicLikelihoodKernels<T> selectLikelihoodKernels(int stateCount, int rateCount, SimdBackend backend)
+{
+    BasicLikelihoodKernels<T> result;
+    if(stateCount == 4) {
+        switch(rateCount) {
+        case 1:
+            result = kernels::makeLikelihoodKernels<T, 4, 1>("4x1");
+            break;
+        case 4:
+            result = kernels::makeLikelihoodKernels<T, 4, 4>("4x4");
+            break;
+        default:
+            result = kernels::makeLikelihoodKernels<T, 4, 0>("4xN");
+        }
+    }
+    else {
+        result = kernels::makeLikelihoodKernels<T, 0, 0>("generic");
+    }
+
+    if(backend == SimdBackend::AUTO)
+        backend = bestSimdBackend();
+    else if(!simdBackendSupported(backend))
+        throw std::runtime_error(std::string("SIMD backend not supported by this CPU: ") + simdBackendName(backend));
+
+    result.backend = kernels::setSimdKernels(result, stateCount, backend);
+    return result;
+}
+
+template LikelihoodKernels selectLikelihoodKernels<double>(int, int, SimdBackend);
+template SingleLikelihoodKernels selectLikelihoodKernels<float>(int, int, SimdBackend);
+
+SimdBackend bestSimdBackend()
+{
+    for(SimdBackend backend : { SimdBackend::AVX512, SimdBackend::AVX2, SimdBackend::SSE2 }) {
+        if(simdBackendSupported(backend))
+            return backend;
+    }
+    return SimdBackend::NONE;
+}
+
+const char* simdBackendName(SimdBackend backend)
+{
+    switch(backend) {
+    case SimdBackend::AUTO:
+        return "auto";
+    case SimdBackend::NONE:
+        return "none";
+    case SimdBackend::SSE2:
+        return "sse2";
+    case SimdBackend::AVX2:
+        return "avx2";
+    case SimdBackend::AVX512:
+        return "avx512";
+    }
+    return "unknown";
+}
+
+SimdBackend simdBackendFromName(const std::string& name)
+{
+    for(SimdBackend backend : { SimdBackend::AUTO, SimdBackend::NONE, SimdBackend::SSE2,
+                                SimdBackend::AVX2, SimdBackend::AVX512 }) {
+        if(name == simdBackendName(backend))
+            return backend;
+    }
+    throw std::invalid_argument("Unknown SIMD backend: " + name);
+}
+
+}} // namespaces
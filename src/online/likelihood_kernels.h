@@ -0,0 +1,515 @@
+#ifndef STS_ONLINE_LIKELIHOOD_KERNELS_H
+#define STS_ONLINE_LIKELIHOOD_KERNELS_H
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+
+namespace sts { namespace online {
+
+/// Instruction sets available to the partials kernels
+enum class SimdBackend
+{
+    AUTO,   ///< Widest instruction set supported by the CPU
+    NONE,   ///< Portable scalar code
+    SSE2,
+    AVX2,   ///< AVX2 and FMA
+    AVX512  ///< AVX-512F
+};
+
+/// \brief Table of the partials kernels used by #sts::online::SimpleFlexibleTreeLikelihood
+///
+/// Every kernel takes the number of states, rate categories and patterns as trailing arguments. The table is filled
+/// by #selectLikelihoodKernels, once, when the likelihood calculator is constructed.
+///
+/// Layout conventions follow BEAGLE: partials are indexed <c>[rate][pattern][state]</c>, matrices
+/// <c>[rate][from][to]</c>, and root partials (rates integrated out) <c>[pattern][state]</c>.
+///
+/// Partials are stored as \c T, either \c double or \c float. Transition matrices, root partials and all sums are
+/// always in double precision.
+template<typename T>
+struct BasicLikelihoodKernels
+{
+    typedef void (*UpdatePartialsKnownKnown)(const int* states1, const double* matrices1,
+                                             const int* states2, const double* matrices2,
+                                             T* partials,
+                                             int stateCount, int rateCount, int patternCount);
+    typedef void (*UpdatePartialsKnownUndefined)(const int* states1, const double* matrices1,
+                                                 const T* partials2, const double* matrices2,
+                                                 T* partials3,
+                                                 int stateCount, int rateCount, int patternCount);
+    typedef void (*UpdatePartialsUndefinedUndefined)(const T* partials1, const double* matrices1,
+                                                     const T* partials2, const double* matrices2,
+                                                     T* partials3,
+                                                     int stateCount, int rateCount, int patternCount);
+    typedef void (*CalculateBranchLikelihood)(double* rootPartials, const T* attachmentPartials,
+                                              const T* pendantPartials, const double* pendantMatrices,
+                                              const double* weights,
+                                              int stateCount, int rateCount, int patternCount);
+    typedef void (*CalculateBranchLikelihoodStates)(double* rootPartials, const T* attachmentPartials,
+                                                    const int* pendantStates, const double* pendantMatrices,
+                                                    const double* weights,
+                                                    int stateCount, int rateCount, int patternCount);
+    typedef void (*CalculateBranchDerivatives)(double* outLikelihoods, double* outD1, double* outD2,
+                                               const T* attachmentPartials, const T* pendantPartials,
+                                               const double* matrices, const double* d1Matrices,
+                                               const double* d2Matrices,
+                                               const double* weights, const double* frequencies,
+                                               int stateCount, int rateCount, int patternCount);
+    typedef void (*CalculateBranchDerivativesStates)(double* outLikelihoods, double* outD1, double* outD2,
+                                                     const T* attachmentPartials, const int* pendantStates,
+                                                     const double* matrices, const double* d1Matrices,
+                                                     const double* d2Matrices,
+                                                     const double* weights, const double* frequencies,
+                                                     int stateCount, int rateCount, int patternCount);
+    typedef void (*TransformPartials)(const T* partials, const double* matrices, T* outPartials,
+                                      int stateCount, int rateCount, int patternCount);
+    typedef void (*CalculateProductLikelihood)(double* outLikelihoods, const T* partials1, const T* partials2,
+                                               const double* weights, const double* frequencies,
+                                               int stateCount, int rateCount, int patternCount);
+    typedef void (*IntegratePartials)(const T* inPartials, const double* proportions, double* outPartials,
+                                      int stateCount, int rateCount, int patternCount);
+    typedef void (*CalculatePatternLikelihood)(const double* partials, const double* frequencies,
+                                               double* outLikelihoods,
+                                               int stateCount, int patternCount);
+
+    UpdatePartialsKnownKnown updatePartialsKnownKnown;
+    UpdatePartialsKnownUndefined updatePartialsKnownUndefined;
+    UpdatePartialsUndefinedUndefined updatePartialsUndefinedUndefined;
+    CalculateBranchLikelihood calculateBranchLikelihood;
+    CalculateBranchLikelihoodStates calculateBranchLikelihoodStates;
+    /// Pattern likelihoods and their first and second derivatives with respect to the length of a branch, from the
+    /// transition matrices of the branch and their derivatives, in a single pass over the partials
+    CalculateBranchDerivatives calculateBranchDerivatives;
+    CalculateBranchDerivativesStates calculateBranchDerivativesStates;
+    /// Partials at the other end of a branch: each rate category of \c partials multiplied by its matrix
+    TransformPartials transformPartials;
+    /// Pattern likelihoods of two partials facing each other across a branch of length 0
+    CalculateProductLikelihood calculateProductLikelihood;
+    IntegratePartials integratePartials;
+    CalculatePatternLikelihood calculatePatternLikelihood;
+
+    /// Human readable description of the instantiation, e.g. "4x1"
+    const char* name;
+
+    /// Instruction set of the vectorized kernels, #SimdBackend::NONE if all kernels are scalar
+    SimdBackend backend;
+};
+
+typedef BasicLikelihoodKernels<double> LikelihoodKernels;
+typedef BasicLikelihoodKernels<float> SingleLikelihoodKernels;
+
+/// \brief Choose the kernels specialized for \c stateCount and \c rateCount
+///
+/// Four-state models with one or four rate categories get fully unrolled kernels; other four-state models get kernels
+/// unrolled over states only. Anything else uses the generic kernels.
+///
+/// For four-state models, the pruning, attachment and root reduction kernels are then replaced by vectorized versions
+/// for \c backend. #SimdBackend::AUTO picks the widest instruction set supported by the CPU. The branch derivative
+/// and batched attachment kernels are not vectorized.
+///
+/// \tparam T Storage type of the partials, \c double or \c float
+/// \throws std::runtime_error if \c backend is not supported by the CPU
+template<typename T = double>
+BasicLikelihoodKernels<T> selectLikelihoodKernels(int stateCount, int rateCount, SimdBackend backend=SimdBackend::AUTO);
+
+/// Whether the CPU (and operating system) support \c backend
+bool simdBackendSupported(SimdBackend backend);
+
+/// Widest instruction set supported by the CPU
+SimdBackend bestSimdBackend();
+
+/// Lower case name of \c backend, as accepted by #simdBackendFromName
+const char* simdBackendName(SimdBackend backend);
+
+/// \throws std::invalid_argument if \c name is not one of "auto", "none", "sse2", "avx2" or "avx512"
+SimdBackend simdBackendFromName(const std::string& name);
+
+namespace kernels {
+
+/// \brief Transition matrix of a single rate category
+///
+/// With a fixed number of states the matrix is copied to the stack, where it cannot alias the output buffer, so the
+/// compiler is free to keep it in registers for the whole pattern loop.
+template<int S>
+struct LocalMatrix
+{
+    LocalMatrix(const double* m, int) { std::memcpy(v, m, sizeof(v)); }
+    double v[S * S];
+};
+
+/// Generic fallback: use the matrix in place.
+template<>
+struct LocalMatrix<0>
+{
+    LocalMatrix(const double* m, int) : v(m) {}
+    const double* v;
+};
+
+/// \f$\sum_j a_j b_j\f$ over \c n states in double precision, unrolled when \c S is known.
+template<int S, typename T>
+inline double dot(const double* a, const T* b, int n)
+{
+    const int nStates = S > 0 ? S : n;
+    double sum = 0.0;
+    for(int j = 0; j < nStates; j++)
+        sum += a[j] * b[j];
+    return sum;
+}
+
+template<typename T, int S, int R>
+void updatePartialsKnownKnown(const int* states1, const double* matrices1,
+                              const int* states2, const double* matrices2,
+                              T* partials,
+                              int stateCount, int rateCount, int patternCount)
+{
+    const int nStates = S > 0 ? S : stateCount;
+    const int nRates = R > 0 ? R : rateCount;
+    const int matrixSize = nStates * nStates;
+    T* pPartials = partials;
+
+    for(int l = 0; l < nRates; l++) {
+        const LocalMatrix<S> m1(matrices1 + l * matrixSize, nStates);
+        const LocalMatrix<S> m2(matrices2 + l * matrixSize, nStates);
+
+        for(int k = 0; k < patternCount; k++) {
+            const int state1 = states1[k];
+            const int state2 = states2[k];
+
+            if(state1 < nStates && state2 < nStates) {
+                for(int i = 0, w = 0; i < nStates; i++, w += nStates)
+                    *pPartials++ = static_cast<T>(m1.v[w + state1] * m2.v[w + state2]);
+            }
+            else if(state1 < nStates) {
+                // child 2 has a gap or unknown state so treat it as unknown
+                for(int i = 0, w = 0; i < nStates; i++, w += nStates)
+                    *pPartials++ = static_cast<T>(m1.v[w + state1]);
+            }
+            else if(state2 < nStates) {
+                // child 1 has a gap or unknown state so treat it as unknown
+                for(int i = 0, w = 0; i < nStates; i++, w += nStates)
+                    *pPartials++ = static_cast<T>(m2.v[w + state2]);
+            }
+            else {
+                // both children have a gap or unknown state so set partials to 1
+                for(int i = 0; i < nStates; i++)
+                    *pPartials++ = 1.0;
+            }
+        }
+    }
+}
+
+template<typename T, int S, int R>
+void updatePartialsKnownUndefined(const int* states1, const double* matrices1,
+                                  const T* partials2, const double* matrices2,
+                                  T* partials3,
+                                  int stateCount, int rateCount, int patternCount)
+{
+    const int nStates = S > 0 ? S : stateCount;
+    const int nRates = R > 0 ? R : rateCount;
+    const int matrixSize = nStates * nStates;
+    const T* pPartials2 = partials2;
+    T* pPartials = partials3;
+
+    for(int l = 0; l < nRates; l++) {
+        const LocalMatrix<S> m1(matrices1 + l * matrixSize, nStates);
+        const LocalMatrix<S> m2(matrices2 + l * matrixSize, nStates);
+
+        for(int k = 0; k < patternCount; k++) {
+            const int state1 = states1[k];
+
+            if(state1 < nStates) {
+                for(int i = 0, w = 0; i < nStates; i++, w += nStates)
+                    *pPartials++ = static_cast<T>(m1.v[w + state1] * dot<S>(m2.v + w, pPartials2, nStates));
+            }
+            else {
+                // Child 1 has a gap or unknown state so don't use it
+                for(int i = 0, w = 0; i < nStates; i++, w += nStates)
+                    *pPartials++ = static_cast<T>(dot<S>(m2.v + w, pPartials2, nStates));
+            }
+            pPartials2 += nStates;
+        }
+    }
+}
+
+template<typename T, int S, int R>
+void updatePartialsUndefinedUndefined(const T* partials1, const double* matrices1,
+                                      const T* partials2, const double* matrices2,
+                                      T* partials3,
+                                      int stateCount, int rateCount, int patternCount)
+{
+    const int nStates = S > 0 ? S : stateCount;
+    const int nRates = R > 0 ? R : rateCount;
+    const int matrixSize = nStates * nStates;
+    const T* pPartials1 = partials1;
+    const T* pPartials2 = partials2;
+    T* pPartials = partials3;
+
+    for(int l = 0; l < nRates; l++) {
+        const LocalMatrix<S> m1(matrices1 + l * matrixSize, nStates);
+        const LocalMatrix<S> m2(matrices2 + l * matrixSize, nStates);
+
+        for(int k = 0; k < patternCount; k++) {
+            for(int i = 0, w = 0; i < nStates; i++, w += nStates) {
+                *pPartials++ = static_cast<T>(dot<S>(m1.v + w, pPartials1, nStates) * dot<S>(m2.v + w, pPartials2, nStates));
+            }
+            pPartials1 += nStates;
+            pPartials2 += nStates;
+        }
+    }
+}
+
+template<typename T, int S, int R>
+void calculateBranchLikelihood(double* rootPartials, const T* attachmentPartials,
+                               const T* pendantPartials, const double* pendantMatrices,
+                               const double* weights,
+                               int stateCount, int rateCount, int patternCount)
+{
+    const int nStates = S > 0 ? S : stateCount;
+    const int nRates = R > 0 ? R : rateCount;
+    const int matrixSize = nStates * nStates;
+    std::memset(rootPartials, 0, sizeof(double) * nStates * patternCount);
+
+    int v = 0;
+    for(int l = 0; l < nRates; l++) {
+        const LocalMatrix<S> m(pendantMatrices + l * matrixSize, nStates);
+        const double weight = weights[l];
+        int u = 0;
+        for(int k = 0; k < patternCount; k++) {
+            const T* partialsChildPtr = pendantPartials + v;
+            for(int i = 0, w = 0; i < nStates; i++, w += nStates) {
+                rootPartials[u] += dot<S>(m.v + w, partialsChildPtr, nStates) * attachmentPartials[v] * weight;
+                u++;
+                v++;
+            }
+        }
+    }
+}
+
+template<typename T, int S, int R>
+void calculateBranchLikelihoodStates(double* rootPartials, const T* attachmentPartials,
+                                     const int* pendantStates, const double* pendantMatrices,
+                                     const double* weights,
+                                     int stateCount, int rateCount, int patternCount)
+{
+    const int nStates = S > 0 ? S : stateCount;
+    const int nRates = R > 0 ? R : rateCount;
+    const int matrixSize = nStates * nStates;
+    std::memset(rootPartials, 0, sizeof(double) * nStates * patternCount);
+
+    int v = 0;
+    for(int l = 0; l < nRates; l++) {
+        const LocalMatrix<S> m(pendantMatrices + l * matrixSize, nStates);
+        const double weight = weights[l];
+        int u = 0; // Index in resulting product-partials (summed over categories)
+        for(int k = 0; k < patternCount; k++) {
+            const int state = pendantStates[k];
+            if(state < nStates) {
+                for(int i = 0, w = state; i < nStates; i++, w += nStates) {
+                    rootPartials[u] += m.v[w] * attachmentPartials[v] * weight;
+                    u++;
+                    v++;
+                }
+            }
+            else {
+                // Gap or unknown state: rows of the transition matrix sum to 1
+                for(int i = 0; i < nStates; i++) {
+                    rootPartials[u] += attachmentPartials[v] * weight;
+                    u++;
+                    v++;
+                }
+            }
+        }
+    }
+}
+
+template<typename T, int S, int R>
+void calculateBranchDerivatives(double* outLikelihoods, double* outD1, double* outD2,
+                                const T* attachmentPartials, const T* pendantPartials,
+                                const double* matrices, const double* d1Matrices, const double* d2Matrices,
+                                const double* weights, const double* frequencies,
+                                int stateCount, int rateCount, int patternCount)
+{
+    const int nStates = S > 0 ? S : stateCount;
+    const int nRates = R > 0 ? R : rateCount;
+    const int matrixSize = nStates * nStates;
+    const int partialsSize = nStates * patternCount;
+
+    for(int k = 0; k < patternCount; k++) {
+        double likelihood = 0.0, d1 = 0.0, d2 = 0.0;
+        for(int l = 0; l < nRates; l++) {
+            const T* pAttachment = attachmentPartials + l * partialsSize + k * nStates;
+            const T* pPendant = pendantPartials + l * partialsSize + k * nStates;
+            const double* m = matrices + l * matrixSize;
+            const double* m1 = d1Matrices + l * matrixSize;
+            const double* m2 = d2Matrices + l * matrixSize;
+            double rateLikelihood = 0.0, rateD1 = 0.0, rateD2 = 0.0;
+            for(int i = 0, w = 0; i < nStates; i++, w += nStates) {
+                const double attachment = frequencies[i] * pAttachment[i];
+                rateLikelihood += attachment * dot<S>(m + w, pPendant, nStates);
+                rateD1 += attachment * dot<S>(m1 + w, pPendant, nStates);
+                rateD2 += attachment * dot<S>(m2 + w, pPendant, nStates);
+            }
+            likelihood += rateLikelihood * weights[l];
+            d1 += rateD1 * weights[l];
+            d2 += rateD2 * weights[l];
+        }
+        outLikelihoods[k] = likelihood;
+        outD1[k] = d1;
+        outD2[k] = d2;
+    }
+}
+
+template<typename T, int S, int R>
+void calculateBranchDerivativesStates(double* outLikelihoods, double* outD1, double* outD2,
+                                      const T* attachmentPartials, const int* pendantStates,
+                                      const double* matrices, const double* d1Matrices, const double* d2Matrices,
+                                      const double* weights, const double* frequencies,
+                                      int stateCount, int rateCount, int patternCount)
+{
+    const int nStates = S > 0 ? S : stateCount;
+    const int nRates = R > 0 ? R : rateCount;
+    const int matrixSize = nStates * nStates;
+    const int partialsSize = nStates * patternCount;
+
+    for(int k = 0; k < patternCount; k++) {
+        const int state = pendantStates[k];
+        double likelihood = 0.0, d1 = 0.0, d2 = 0.0;
+        for(int l = 0; l < nRates; l++) {
+            const T* pAttachment = attachmentPartials + l * partialsSize + k * nStates;
+            double rateLikelihood = 0.0, rateD1 = 0.0, rateD2 = 0.0;
+            if(state < nStates) {
+                const double* m = matrices + l * matrixSize;
+                const double* m1 = d1Matrices + l * matrixSize;
+                const double* m2 = d2Matrices + l * matrixSize;
+                for(int i = 0, w = state; i < nStates; i++, w += nStates) {
+                    const double attachment = frequencies[i] * pAttachment[i];
+                    rateLikelihood += attachment * m[w];
+                    rateD1 += attachment * m1[w];
+                    rateD2 += attachment * m2[w];
+                }
+            }
+            else {
+                // Gap or unknown state: rows of the transition matrix sum to 1, rows of its derivatives to 0
+                for(int i = 0; i < nStates; i++)
+                    rateLikelihood += frequencies[i] * pAttachment[i];
+            }
+            likelihood += rateLikelihood * weights[l];
+            d1 += rateD1 * weights[l];
+            d2 += rateD2 * weights[l];
+        }
+        outLikelihoods[k] = likelihood;
+        outD1[k] = d1;
+        outD2[k] = d2;
+    }
+}
+
+template<typename T, int S, int R>
+void transformPartials(const T* partials, const double* matrices, T* outPartials,
+                       int stateCount, int rateCount, int patternCount)
+{
+    const int nStates = S > 0 ? S : stateCount;
+    const int nRates = R > 0 ? R : rateCount;
+    const int matrixSize = nStates * nStates;
+    const T* pPartials = partials;
+    T* pOutPartials = outPartials;
+
+    for(int l = 0; l < nRates; l++) {
+        const LocalMatrix<S> m(matrices + l * matrixSize, nStates);
+        for(int k = 0; k < patternCount; k++) {
+            for(int i = 0, w = 0; i < nStates; i++, w += nStates)
+                *pOutPartials++ = static_cast<T>(dot<S>(m.v + w, pPartials, nStates));
+            pPartials += nStates;
+        }
+    }
+}
+
+template<typename T, int S, int R>
+void calculateProductLikelihood(double* outLikelihoods, const T* partials1, const T* partials2,
+                                const double* weights, const double* frequencies,
+                                int stateCount, int rateCount, int patternCount)
+{
+    const int nStates = S > 0 ? S : stateCount;
+    const int nRates = R > 0 ? R : rateCount;
+    const int partialsSize = nStates * patternCount;
+
+    for(int k = 0; k < patternCount; k++) {
+        double likelihood = 0.0;
+        for(int l = 0; l < nRates; l++) {
+            const T* p1 = partials1 + l * partialsSize + k * nStates;
+            const T* p2 = partials2 + l * partialsSize + k * nStates;
+            double rateLikelihood = 0.0;
+            for(int i = 0; i < nStates; i++)
+                rateLikelihood += frequencies[i] * p1[i] * p2[i];
+            likelihood += rateLikelihood * weights[l];
+        }
+        outLikelihoods[k] = likelihood;
+    }
+}
+
+template<typename T, int S, int R>
+void integratePartials(const T* inPartials, const double* proportions, double* outPartials,
+                       int stateCount, int rateCount, int patternCount)
+{
+    const int nStates = S > 0 ? S : stateCount;
+    const int nRates = R > 0 ? R : rateCount;
+    const int n = nStates * patternCount;
+
+    if(nRates == 1) {
+        std::copy(inPartials, inPartials + n, outPartials);
+        return;
+    }
+
+    const T* pInPartials = inPartials;
+    for(int u = 0; u < n; u++)
+        outPartials[u] = *pInPartials++ * proportions[0];
+
+    for(int l = 1; l < nRates; l++) {
+        const double proportion = proportions[l];
+        for(int u = 0; u < n; u++)
+            outPartials[u] += *pInPartials++ * proportion;
+    }
+}
+
+template<int S>
+void calculatePatternLikelihood(const double* partials, const double* frequencies, double* outLikelihoods,
+                                int stateCount, int patternCount)
+{
+    const int nStates = S > 0 ? S : stateCount;
+    for(int k = 0; k < patternCount; k++)
+        outLikelihoods[k] = dot<S>(frequencies, partials + k * nStates, nStates);
+}
+
+template<typename T, int S, int R>
+BasicLikelihoodKernels<T> makeLikelihoodKernels(const char* name)
+{
+    BasicLikelihoodKernels<T> result;
+    result.updatePartialsKnownKnown = &updatePartialsKnownKnown<T, S, R>;
+    result.updatePartialsKnownUndefined = &updatePartialsKnownUndefined<T, S, R>;
+    result.updatePartialsUndefinedUndefined = &updatePartialsUndefinedUndefined<T, S, R>;
+    result.calculateBranchLikelihood = &calculateBranchLikelihood<T, S, R>;
+    result.calculateBranchLikelihoodStates = &calculateBranchLikelihoodStates<T, S, R>;
+    result.calculateBranchDerivatives = &calculateBranchDerivatives<T, S, R>;
+    result.calculateBranchDerivativesStates = &calculateBranchDerivativesStates<T, S, R>;
+    result.transformPartials = &transformPartials<T, S, R>;
+    result.calculateProductLikelihood = &calculateProductLikelihood<T, S, R>;
+    result.integratePartials = &integratePartials<T, S, R>;
+    result.calculatePatternLikelihood = &calculatePatternLikelihood<S>;
+    result.name = name;
+    result.backend = SimdBackend::NONE;
+    return result;
+}
+
+/// \brief Replace kernels of \c result with the versions vectorized for \c backend
+///
+/// Only four-state models are vectorized.
+/// \returns The instruction set of the kernels installed, or #SimdBackend::NONE, leaving \c result untouched, if
+/// there are no vectorized kernels for \c stateCount and \c backend
+SimdBackend setSimdKernels(LikelihoodKernels& result, int stateCount, SimdBackend backend);
+SimdBackend setSimdKernels(SingleLikelihoodKernels& result, int stateCount, SimdBackend backend);
+
+} // namespace kernels
+
+}} // namespaces
+
+#endif
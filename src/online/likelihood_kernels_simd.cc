@@ -0,0 +1,601 @@
+#include "likelihood_kernels.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define STS_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__) && !defined(__clang__)
+// The AVX-512 intrinsics of GCC 12 start from undefined vectors, which trips this warning
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+namespace sts { namespace online {
+
+#ifdef STS_X86_SIMD
+
+#define STS_TARGET_SSE2 __attribute__((target("sse2")))
+#define STS_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define STS_TARGET_AVX512 __attribute__((target("avx512f,avx2,fma")))
+
+namespace {
+
+/// Only nucleotide models are vectorized: one vector (or half a vector) per pattern.
+const int STATES = 4;
+
+/// States outside [0, 4) are gaps or unknown
+inline bool isKnown(int state) { return static_cast<unsigned>(state) < static_cast<unsigned>(STATES); }
+
+//
+// SSE2: each 4-state vector is split into two 128-bit halves
+//
+
+struct Sse2Vector
+{
+    __m128d lo, hi;
+};
+
+/// Columns of a transition matrix; column 4 is all ones, for gaps and unknown states.
+struct Sse2Columns
+{
+    STS_TARGET_SSE2 explicit Sse2Columns(const double* m)
+    {
+        for(int j = 0; j < STATES; j++) {
+            c[j].lo = _mm_set_pd(m[STATES + j], m[j]);
+            c[j].hi = _mm_set_pd(m[3 * STATES + j], m[2 * STATES + j]);
+        }
+        c[STATES].lo = c[STATES].hi = _mm_set1_pd(1.0);
+    }
+    Sse2Vector c[STATES + 1];
+};
+
+STS_TARGET_SSE2 inline Sse2Vector sse2Load(const double* p)
+{
+    return { _mm_loadu_pd(p), _mm_loadu_pd(p + 2) };
+}
+
+STS_TARGET_SSE2 inline Sse2Vector sse2Load(const float* p)
+{
+    const __m128 v = _mm_loadu_ps(p);
+    return { _mm_cvtps_pd(v), _mm_cvtps_pd(_mm_movehl_ps(v, v)) };
+}
+
+STS_TARGET_SSE2 inline void sse2Store(double* p, const Sse2Vector& v)
+{
+    _mm_storeu_pd(p, v.lo);
+    _mm_storeu_pd(p + 2, v.hi);
+}
+
+STS_TARGET_SSE2 inline void sse2Store(float* p, const Sse2Vector& v)
+{
+    _mm_storeu_ps(p, _mm_movelh_ps(_mm_cvtpd_ps(v.lo), _mm_cvtpd_ps(v.hi)));
+}
+
+STS_TARGET_SSE2 inline Sse2Vector sse2Mul(const Sse2Vector& a, const Sse2Vector& b)
+{
+    return { _mm_mul_pd(a.lo, b.lo), _mm_mul_pd(a.hi, b.hi) };
+}
+
+/// \f$M p\f$
+template<typename T>
+STS_TARGET_SSE2 inline Sse2Vector sse2MatVec(const Sse2Columns& m, const T* p)
+{
+    Sse2Vector r;
+    __m128d x = _mm_set1_pd(p[0]);
+    r.lo = _mm_mul_pd(m.c[0].lo, x);
+    r.hi = _mm_mul_pd(m.c[0].hi, x);
+    for(int j = 1; j < STATES; j++) {
+        x = _mm_set1_pd(p[j]);
+        r.lo = _mm_add_pd(r.lo, _mm_mul_pd(m.c[j].lo, x));
+        r.hi = _mm_add_pd(r.hi, _mm_mul_pd(m.c[j].hi, x));
+    }
+    return r;
+}
+
+template<typename T>
+STS_TARGET_SSE2 void sse2UpdatePartialsKnownKnown(const int* states1, const double* matrices1,
+                                                  const int* states2, const double* matrices2,
+                                                  T* partials,
+                                                  int, int rateCount, int patternCount)
+{
+    for(int l = 0; l < rateCount; l++) {
+        const Sse2Columns m1(matrices1 + l * STATES * STATES);
+        const Sse2Columns m2(matrices2 + l * STATES * STATES);
+        for(int k = 0; k < patternCount; k++, partials += STATES) {
+            const int state1 = isKnown(states1[k]) ? states1[k] : STATES;
+            const int state2 = isKnown(states2[k]) ? states2[k] : STATES;
+            sse2Store(partials, sse2Mul(m1.c[state1], m2.c[state2]));
+        }
+    }
+}
+
+template<typename T>
+STS_TARGET_SSE2 void sse2UpdatePartialsKnownUndefined(const int* states1, const double* matrices1,
+                                                      const T* partials2, const double* matrices2,
+                                                      T* partials3,
+                                                      int, int rateCount, int patternCount)
+{
+    for(int l = 0; l < rateCount; l++) {
+        const Sse2Columns m1(matrices1 + l * STATES * STATES);
+        const Sse2Columns m2(matrices2 + l * STATES * STATES);
+        for(int k = 0; k < patternCount; k++, partials2 += STATES, partials3 += STATES) {
+            const int state1 = isKnown(states1[k]) ? states1[k] : STATES;
+            sse2Store(partials3, sse2Mul(m1.c[state1], sse2MatVec(m2, partials2)));
+        }
+    }
+}
+
+template<typename T>
+STS_TARGET_SSE2 void sse2UpdatePartialsUndefinedUndefined(const T* partials1, const double* matrices1,
+                                                          const T* partials2, const double* matrices2,
+                                                          T* partials3,
+                                                          int, int rateCount, int patternCount)
+{
+    for(int l = 0; l < rateCount; l++) {
+        const Sse2Columns m1(matrices1 + l * STATES * STATES);
+        const Sse2Columns m2(matrices2 + l * STATES * STATES);
+        for(int k = 0; k < patternCount; k++, partials1 += STATES, partials2 += STATES, partials3 += STATES)
+            sse2Store(partials3, sse2Mul(sse2MatVec(m1, partials1), sse2MatVec(m2, partials2)));
+    }
+}
+
+template<typename T>
+STS_TARGET_SSE2 void sse2CalculateBranchLikelihood(double* rootPartials, const T* attachmentPartials,
+                                                   const T* pendantPartials, const double* pendantMatrices,
+                                                   const double* weights,
+                                                   int, int rateCount, int patternCount)
+{
+    std::memset(rootPartials, 0, sizeof(double) * STATES * patternCount);
+    for(int l = 0; l < rateCount; l++) {
+        const Sse2Columns m(pendantMatrices + l * STATES * STATES);
+        const __m128d weight = _mm_set1_pd(weights[l]);
+        double* root = rootPartials;
+        for(int k = 0; k < patternCount; k++, root += STATES, attachmentPartials += STATES, pendantPartials += STATES) {
+            const Sse2Vector v = sse2Mul(sse2MatVec(m, pendantPartials), sse2Load(attachmentPartials));
+            const Sse2Vector r = sse2Load(root);
+            sse2Store(root, { _mm_add_pd(r.lo, _mm_mul_pd(v.lo, weight)), _mm_add_pd(r.hi, _mm_mul_pd(v.hi, weight)) });
+        }
+    }
+}
+
+template<typename T>
+STS_TARGET_SSE2 void sse2CalculateBranchLikelihoodStates(double* rootPartials, const T* attachmentPartials,
+                                                         const int* pendantStates, const double* pendantMatrices,
+                                                         const double* weights,
+                                                         int, int rateCount, int patternCount)
+{
+    std::memset(rootPartials, 0, sizeof(double) * STATES * patternCount);
+    for(int l = 0; l < rateCount; l++) {
+        const Sse2Columns m(pendantMatrices + l * STATES * STATES);
+        const __m128d weight = _mm_set1_pd(weights[l]);
+        double* root = rootPartials;
+        for(int k = 0; k < patternCount; k++, root += STATES, attachmentPartials += STATES) {
+            const int state = isKnown(pendantStates[k]) ? pendantStates[k] : STATES;
+            const Sse2Vector v = sse2Mul(m.c[state], sse2Load(attachmentPartials));
+            const Sse2Vector r = sse2Load(root);
+            sse2Store(root, { _mm_add_pd(r.lo, _mm_mul_pd(v.lo, weight)), _mm_add_pd(r.hi, _mm_mul_pd(v.hi, weight)) });
+        }
+    }
+}
+
+STS_TARGET_SSE2 void sse2CalculatePatternLikelihood(const double* partials, const double* frequencies,
+                                                    double* outLikelihoods,
+                                                    int, int patternCount)
+{
+    const Sse2Vector f = sse2Load(frequencies);
+    for(int k = 0; k < patternCount; k++, partials += STATES) {
+        const Sse2Vector p = sse2Mul(sse2Load(partials), f);
+        const __m128d s = _mm_add_pd(p.lo, p.hi);
+        _mm_store_sd(outLikelihoods + k, _mm_add_sd(s, _mm_unpackhi_pd(s, s)));
+    }
+}
+
+//
+// AVX2: one 256-bit vector per pattern
+//
+
+/// Columns of a transition matrix; column 4 is all ones, for gaps and unknown states.
+struct Avx2Columns
+{
+    STS_TARGET_AVX2 explicit Avx2Columns(const double* m)
+    {
+        for(int j = 0; j < STATES; j++)
+            c[j] = _mm256_set_pd(m[3 * STATES + j], m[2 * STATES + j], m[STATES + j], m[j]);
+        c[STATES] = _mm256_set1_pd(1.0);
+    }
+    __m256d c[STATES + 1];
+};
+
+STS_TARGET_AVX2 inline __m256d avx2Load(const double* p) { return _mm256_loadu_pd(p); }
+STS_TARGET_AVX2 inline __m256d avx2Load(const float* p) { return _mm256_cvtps_pd(_mm_loadu_ps(p)); }
+STS_TARGET_AVX2 inline void avx2Store(double* p, __m256d v) { _mm256_storeu_pd(p, v); }
+STS_TARGET_AVX2 inline void avx2Store(float* p, __m256d v) { _mm_storeu_ps(p, _mm256_cvtpd_ps(v)); }
+
+/// \f$M p\f$
+template<typename T>
+STS_TARGET_AVX2 inline __m256d avx2MatVec(const Avx2Columns& m, const T* p)
+{
+    __m256d r = _mm256_mul_pd(m.c[0], _mm256_set1_pd(p[0]));
+    r = _mm256_fmadd_pd(m.c[1], _mm256_set1_pd(p[1]), r);
+    r = _mm256_fmadd_pd(m.c[2], _mm256_set1_pd(p[2]), r);
+    return _mm256_fmadd_pd(m.c[3], _mm256_set1_pd(p[3]), r);
+}
+
+template<typename T>
+STS_TARGET_AVX2 void avx2UpdatePartialsKnownKnown(const int* states1, const double* matrices1,
+                                                  const int* states2, const double* matrices2,
+                                                  T* partials,
+                                                  int, int rateCount, int patternCount)
+{
+    for(int l = 0; l < rateCount; l++) {
+        const Avx2Columns m1(matrices1 + l * STATES * STATES);
+        const Avx2Columns m2(matrices2 + l * STATES * STATES);
+        for(int k = 0; k < patternCount; k++, partials += STATES) {
+            const int state1 = isKnown(states1[k]) ? states1[k] : STATES;
+            const int state2 = isKnown(states2[k]) ? states2[k] : STATES;
+            avx2Store(partials, _mm256_mul_pd(m1.c[state1], m2.c[state2]));
+        }
+    }
+}
+
+template<typename T>
+STS_TARGET_AVX2 void avx2UpdatePartialsKnownUndefined(const int* states1, const double* matrices1,
+                                                      const T* partials2, const double* matrices2,
+                                                      T* partials3,
+                                                      int, int rateCount, int patternCount)
+{
+    for(int l = 0; l < rateCount; l++) {
+        const Avx2Columns m1(matrices1 + l * STATES * STATES);
+        const Avx2Columns m2(matrices2 + l * STATES * STATES);
+        for(int k = 0; k < patternCount; k++, partials2 += STATES, partials3 += STATES) {
+            const int state1 = isKnown(states1[k]) ? states1[k] : STATES;
+            avx2Store(partials3, _mm256_mul_pd(m1.c[state1], avx2MatVec(m2, partials2)));
+        }
+    }
+}
+
+template<typename T>
+STS_TARGET_AVX2 void avx2UpdatePartialsUndefinedUndefined(const T* partials1, const double* matrices1,
+                                                          const T* partials2, const double* matrices2,
+                                                          T* partials3,
+                                                          int, int rateCount, int patternCount)
+{
+    for(int l = 0; l < rateCount; l++) {
+        const Avx2Columns m1(matrices1 + l * STATES * STATES);
+        const Avx2Columns m2(matrices2 + l * STATES * STATES);
+        for(int k = 0; k < patternCount; k++, partials1 += STATES, partials2 += STATES, partials3 += STATES)
+            avx2Store(partials3, _mm256_mul_pd(avx2MatVec(m1, partials1), avx2MatVec(m2, partials2)));
+    }
+}
+
+template<typename T>
+STS_TARGET_AVX2 void avx2CalculateBranchLikelihood(double* rootPartials, const T* attachmentPartials,
+                                                   const T* pendantPartials, const double* pendantMatrices,
+                                                   const double* weights,
+                                                   int, int rateCount, int patternCount)
+{
+    std::memset(rootPartials, 0, sizeof(double) * STATES * patternCount);
+    for(int l = 0; l < rateCount; l++) {
+        const Avx2Columns m(pendantMatrices + l * STATES * STATES);
+        const __m256d weight = _mm256_set1_pd(weights[l]);
+        double* root = rootPartials;
+        for(int k = 0; k < patternCount; k++, root += STATES, attachmentPartials += STATES, pendantPartials += STATES) {
+            const __m256d v = _mm256_mul_pd(avx2MatVec(m, pendantPartials), avx2Load(attachmentPartials));
+            _mm256_storeu_pd(root, _mm256_fmadd_pd(v, weight, _mm256_loadu_pd(root)));
+        }
+    }
+}
+
+template<typename T>
+STS_TARGET_AVX2 void avx2CalculateBranchLikelihoodStates(double* rootPartials, const T* attachmentPartials,
+                                                         const int* pendantStates, const double* pendantMatrices,
+                                                         const double* weights,
+                                                         int, int rateCount, int patternCount)
+{
+    std::memset(rootPartials, 0, sizeof(double) * STATES * patternCount);
+    for(int l = 0; l < rateCount; l++) {
+        const Avx2Columns m(pendantMatrices + l * STATES * STATES);
+        const __m256d weight = _mm256_set1_pd(weights[l]);
+        double* root = rootPartials;
+        for(int k = 0; k < patternCount; k++, root += STATES, attachmentPartials += STATES) {
+            const int state = isKnown(pendantStates[k]) ? pendantStates[k] : STATES;
+            const __m256d v = _mm256_mul_pd(m.c[state], avx2Load(attachmentPartials));
+            _mm256_storeu_pd(root, _mm256_fmadd_pd(v, weight, _mm256_loadu_pd(root)));
+        }
+    }
+}
+
+STS_TARGET_AVX2 void avx2CalculatePatternLikelihood(const double* partials, const double* frequencies,
+                                                    double* outLikelihoods,
+                                                    int, int patternCount)
+{
+    const __m256d f = _mm256_loadu_pd(frequencies);
+    int k = 0;
+    // Four patterns at a time, reduced with a transpose
+    for(; k + 4 <= patternCount; k += 4, partials += 4 * STATES) {
+        const __m256d a = _mm256_mul_pd(_mm256_loadu_pd(partials), f);
+        const __m256d b = _mm256_mul_pd(_mm256_loadu_pd(partials + STATES), f);
+        const __m256d c = _mm256_mul_pd(_mm256_loadu_pd(partials + 2 * STATES), f);
+        const __m256d d = _mm256_mul_pd(_mm256_loadu_pd(partials + 3 * STATES), f);
+        const __m256d ab = _mm256_hadd_pd(a, b);
+        const __m256d cd = _mm256_hadd_pd(c, d);
+        const __m256d lo = _mm256_permute2f128_pd(ab, cd, 0x20);
+        const __m256d hi = _mm256_permute2f128_pd(ab, cd, 0x31);
+        _mm256_storeu_pd(outLikelihoods + k, _mm256_add_pd(lo, hi));
+    }
+    for(; k < patternCount; k++, partials += STATES)
+        outLikelihoods[k] = kernels::dot<STATES>(frequencies, partials, STATES);
+}
+
+//
+// AVX-512: two patterns per 512-bit vector, the odd pattern out is handled with masks
+//
+
+/// Columns of a transition matrix repeated for two patterns; column 4 is all ones.
+struct Avx512Columns
+{
+    STS_TARGET_AVX512 explicit Avx512Columns(const double* m)
+    {
+        for(int j = 0; j < STATES; j++) {
+            half[j] = _mm256_set_pd(m[3 * STATES + j], m[2 * STATES + j], m[STATES + j], m[j]);
+            c[j] = _mm512_broadcast_f64x4(half[j]);
+        }
+        half[STATES] = _mm256_set1_pd(1.0);
+    }
+
+    /// Columns \c state1 and \c state2 for a pair of patterns
+    STS_TARGET_AVX512 __m512d pair(int state1, int state2) const
+    {
+        return _mm512_insertf64x4(_mm512_castpd256_pd512(half[state1]), half[state2], 1);
+    }
+
+    __m512d c[STATES];
+    __m256d half[STATES + 1];
+};
+
+/// Whether two patterns are left, otherwise only the low half of the vectors is used
+inline bool avx512Pair(int remaining) { return remaining >= 2; }
+
+/// Load one or two patterns, zeroing the unused half
+STS_TARGET_AVX512 inline __m512d avx512Load(const double* p, bool pair)
+{
+    return _mm512_maskz_loadu_pd(pair ? 0xFF : 0x0F, p);
+}
+
+STS_TARGET_AVX512 inline __m512d avx512Load(const float* p, bool pair)
+{
+    if(pair)
+        return _mm512_cvtps_pd(_mm256_loadu_ps(p));
+    return _mm512_cvtps_pd(_mm256_insertf128_ps(_mm256_setzero_ps(), _mm_loadu_ps(p), 0));
+}
+
+STS_TARGET_AVX512 inline void avx512Store(double* p, __m512d v, bool pair)
+{
+    _mm512_mask_storeu_pd(p, pair ? 0xFF : 0x0F, v);
+}
+
+STS_TARGET_AVX512 inline void avx512Store(float* p, __m512d v, bool pair)
+{
+    const __m256 f = _mm512_cvtpd_ps(v);
+    if(pair)
+        _mm256_storeu_ps(p, f);
+    else
+        _mm_storeu_ps(p, _mm256_castps256_ps128(f));
+}
+
+/// \f$M p\f$ for two patterns
+STS_TARGET_AVX512 inline __m512d avx512MatVec(const Avx512Columns& m, __m512d p)
+{
+    __m512d r = _mm512_mul_pd(m.c[0], _mm512_permutexvar_pd(_mm512_set_epi64(4, 4, 4, 4, 0, 0, 0, 0), p));
+    r = _mm512_fmadd_pd(m.c[1], _mm512_permutexvar_pd(_mm512_set_epi64(5, 5, 5, 5, 1, 1, 1, 1), p), r);
+    r = _mm512_fmadd_pd(m.c[2], _mm512_permutexvar_pd(_mm512_set_epi64(6, 6, 6, 6, 2, 2, 2, 2), p), r);
+    return _mm512_fmadd_pd(m.c[3], _mm512_permutexvar_pd(_mm512_set_epi64(7, 7, 7, 7, 3, 3, 3, 3), p), r);
+}
+
+template<typename T>
+STS_TARGET_AVX512 void avx512UpdatePartialsKnownKnown(const int* states1, const double* matrices1,
+                                                      const int* states2, const double* matrices2,
+                                                      T* partials,
+                                                      int, int rateCount, int patternCount)
+{
+    for(int l = 0; l < rateCount; l++) {
+        const Avx512Columns m1(matrices1 + l * STATES * STATES);
+        const Avx512Columns m2(matrices2 + l * STATES * STATES);
+        for(int k = 0; k < patternCount; k += 2) {
+            const bool pair = avx512Pair(patternCount - k);
+            const int s1a = isKnown(states1[k]) ? states1[k] : STATES;
+            const int s2a = isKnown(states2[k]) ? states2[k] : STATES;
+            const int s1b = pair && isKnown(states1[k + 1]) ? states1[k + 1] : STATES;
+            const int s2b = pair && isKnown(states2[k + 1]) ? states2[k + 1] : STATES;
+            avx512Store(partials, _mm512_mul_pd(m1.pair(s1a, s1b), m2.pair(s2a, s2b)), pair);
+            partials += pair ? 2 * STATES : STATES;
+        }
+    }
+}
+
+template<typename T>
+STS_TARGET_AVX512 void avx512UpdatePartialsKnownUndefined(const int* states1, const double* matrices1,
+                                                          const T* partials2, const double* matrices2,
+                                                          T* partials3,
+                                                          int, int rateCount, int patternCount)
+{
+    for(int l = 0; l < rateCount; l++) {
+        const Avx512Columns m1(matrices1 + l * STATES * STATES);
+        const Avx512Columns m2(matrices2 + l * STATES * STATES);
+        for(int k = 0; k < patternCount; k += 2) {
+            const bool pair = avx512Pair(patternCount - k);
+            const int s1a = isKnown(states1[k]) ? states1[k] : STATES;
+            const int s1b = pair && isKnown(states1[k + 1]) ? states1[k + 1] : STATES;
+            const __m512d p2 = avx512Load(partials2, pair);
+            avx512Store(partials3, _mm512_mul_pd(m1.pair(s1a, s1b), avx512MatVec(m2, p2)), pair);
+            const int step = pair ? 2 * STATES : STATES;
+            partials2 += step;
+            partials3 += step;
+        }
+    }
+}
+
+template<typename T>
+STS_TARGET_AVX512 void avx512UpdatePartialsUndefinedUndefined(const T* partials1, const double* matrices1,
+                                                              const T* partials2, const double* matrices2,
+                                                              T* partials3,
+                                                              int, int rateCount, int patternCount)
+{
+    for(int l = 0; l < rateCount; l++) {
+        const Avx512Columns m1(matrices1 + l * STATES * STATES);
+        const Avx512Columns m2(matrices2 + l * STATES * STATES);
+        for(int k = 0; k < patternCount; k += 2) {
+            const bool pair = avx512Pair(patternCount - k);
+            const __m512d p1 = avx512Load(partials1, pair);
+            const __m512d p2 = avx512Load(partials2, pair);
+            avx512Store(partials3, _mm512_mul_pd(avx512MatVec(m1, p1), avx512MatVec(m2, p2)), pair);
+            const int step = pair ? 2 * STATES : STATES;
+            partials1 += step;
+            partials2 += step;
+            partials3 += step;
+        }
+    }
+}
+
+template<typename T>
+STS_TARGET_AVX512 void avx512CalculateBranchLikelihood(double* rootPartials, const T* attachmentPartials,
+                                                       const T* pendantPartials, const double* pendantMatrices,
+                                                       const double* weights,
+                                                       int, int rateCount, int patternCount)
+{
+    std::memset(rootPartials, 0, sizeof(double) * STATES * patternCount);
+    for(int l = 0; l < rateCount; l++) {
+        const Avx512Columns m(pendantMatrices + l * STATES * STATES);
+        const __m512d weight = _mm512_set1_pd(weights[l]);
+        double* root = rootPartials;
+        for(int k = 0; k < patternCount; k += 2) {
+            const bool pair = avx512Pair(patternCount - k);
+            const __m512d v = _mm512_mul_pd(avx512MatVec(m, avx512Load(pendantPartials, pair)),
+                                            avx512Load(attachmentPartials, pair));
+            avx512Store(root, _mm512_fmadd_pd(v, weight, avx512Load(root, pair)), pair);
+            const int step = pair ? 2 * STATES : STATES;
+            root += step;
+            attachmentPartials += step;
+            pendantPartials += step;
+        }
+    }
+}
+
+template<typename T>
+STS_TARGET_AVX512 void avx512CalculateBranchLikelihoodStates(double* rootPartials, const T* attachmentPartials,
+                                                             const int* pendantStates, const double* pendantMatrices,
+                                                             const double* weights,
+                                                             int, int rateCount, int patternCount)
+{
+    std::memset(rootPartials, 0, sizeof(double) * STATES * patternCount);
+    for(int l = 0; l < rateCount; l++) {
+        const Avx512Columns m(pendantMatrices + l * STATES * STATES);
+        const __m512d weight = _mm512_set1_pd(weights[l]);
+        double* root = rootPartials;
+        for(int k = 0; k < patternCount; k += 2) {
+            const bool pair = avx512Pair(patternCount - k);
+            const int sa = isKnown(pendantStates[k]) ? pendantStates[k] : STATES;
+            const int sb = pair && isKnown(pendantStates[k + 1]) ? pendantStates[k + 1] : STATES;
+            const __m512d v = _mm512_mul_pd(m.pair(sa, sb), avx512Load(attachmentPartials, pair));
+            avx512Store(root, _mm512_fmadd_pd(v, weight, avx512Load(root, pair)), pair);
+            const int step = pair ? 2 * STATES : STATES;
+            root += step;
+            attachmentPartials += step;
+        }
+    }
+}
+
+template<typename T>
+SimdBackend setKernels(BasicLikelihoodKernels<T>& result, int stateCount, SimdBackend backend)
+{
+    if(stateCount != STATES)
+        return SimdBackend::NONE;
+
+    switch(backend) {
+    case SimdBackend::SSE2:
+        result.updatePartialsKnownKnown = &sse2UpdatePartialsKnownKnown<T>;
+        result.updatePartialsKnownUndefined = &sse2UpdatePartialsKnownUndefined<T>;
+        result.updatePartialsUndefinedUndefined = &sse2UpdatePartialsUndefinedUndefined<T>;
+        result.calculateBranchLikelihood = &sse2CalculateBranchLikelihood<T>;
+        result.calculateBranchLikelihoodStates = &sse2CalculateBranchLikelihoodStates<T>;
+        result.calculatePatternLikelihood = &sse2CalculatePatternLikelihood;
+        return backend;
+    case SimdBackend::AVX2:
+        result.updatePartialsKnownKnown = &avx2UpdatePartialsKnownKnown<T>;
+        result.updatePartialsKnownUndefined = &avx2UpdatePartialsKnownUndefined<T>;
+        result.updatePartialsUndefinedUndefined = &avx2UpdatePartialsUndefinedUndefined<T>;
+        result.calculateBranchLikelihood = &avx2CalculateBranchLikelihood<T>;
+        result.calculateBranchLikelihoodStates = &avx2CalculateBranchLikelihoodStates<T>;
+        result.calculatePatternLikelihood = &avx2CalculatePatternLikelihood;
+        return backend;
+    case SimdBackend::AVX512:
+        result.updatePartialsKnownKnown = &avx512UpdatePartialsKnownKnown<T>;
+        result.updatePartialsKnownUndefined = &avx512UpdatePartialsKnownUndefined<T>;
+        result.updatePartialsUndefinedUndefined = &avx512UpdatePartialsUndefinedUndefined<T>;
+        result.calculateBranchLikelihood = &avx512CalculateBranchLikelihood<T>;
+        result.calculateBranchLikelihoodStates = &avx512CalculateBranchLikelihoodStates<T>;
+        // The reduction is bound by memory bandwidth, 256-bit vectors are as fast
+        result.calculatePatternLikelihood = &avx2CalculatePatternLikelihood;
+        return backend;
+    default:
+        return SimdBackend::NONE;
+    }
+}
+
+} // namespace
+
+bool simdBackendSupported(SimdBackend backend)
+{
+    __builtin_cpu_init();
+    switch(backend) {
+    case SimdBackend::AUTO:
+    case SimdBackend::NONE:
+        return true;
+    case SimdBackend::SSE2:
+        return __builtin_cpu_supports("sse2");
+    case SimdBackend::AVX2:
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    case SimdBackend::AVX512:
+        return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    }
+    return false;
+}
+
+namespace kernels {
+
+SimdBackend setSimdKernels(LikelihoodKernels& result, int stateCount, SimdBackend backend)
+{
+    return setKernels(result, stateCount, backend);
+}
+
+SimdBackend setSimdKernels(SingleLikelihoodKernels& result, int stateCount, SimdBackend backend)
+{
+    return setKernels(result, stateCount, backend);
+}
+
+} // namespace kernels
+
+#else // STS_X86_SIMD
+
+bool simdBackendSupported(SimdBackend backend)
+{
+    return backend == SimdBackend::AUTO || backend == SimdBackend::NONE;
+}
+
+namespace kernels {
+
+SimdBackend setSimdKernels(LikelihoodKernels&, int, SimdBackend)
+{
+    return SimdBackend::NONE;
+}
+
+SimdBackend setSimdKernels(SingleLikelihoodKernels&, int, SimdBackend)
+{
+    return SimdBackend::NONE;
+}
+
+} // namespace kernels
+
+#endif // STS_X86_SIMD
+
+}} // namespaces
@@ -0,0 +1,22 @@
+#ifndef STS_ONLINE_LIKELIHOOD_STATE_H
+#define STS_ONLINE_LIKELIHOOD_STATE_H
+
+namespace sts { namespace online {
+
+/// \brief Partials computed for a tree, kept between evaluations of that tree
+///
+/// Obtained from #sts::online::FlexibleTreeLikelihood::saveState after evaluating a tree, and passed back to
+/// #sts::online::FlexibleTreeLikelihood::initialize when the same tree, possibly modified since, is evaluated again:
+/// only the partials that no longer hold for the tree are recomputed.
+///
+/// A state is never modified once saved, so that it can be shared by the copies of a particle, and it can be restored
+/// by any calculator built like the one it was obtained from.
+class LikelihoodState
+{
+public:
+    virtual ~LikelihoodState() {}
+};
+
+}} // namespaces
+
+#endif // STS_ONLINE_LIKELIHOOD_STATE_H
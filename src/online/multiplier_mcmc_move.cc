@@ -29,26 +29,32 @@ int MultiplierMCMCMove::proposeMove(long, smc::particle<TreeParticle>& particle,
 {
     // Choose an edge at random
     TreeParticle* value = particle.GetValuePointer();
-    std::vector<bpp::Node*> nodes = onlineAvailableEdges(*value->tree);
+    TreeTemplate<bpp::Node>& tree = value->mutableTree();
+    std::vector<bpp::Node*> nodes = onlineAvailableEdges(tree);
     size_t idx = rng->UniformDiscrete(0, nodes.size() - 1);
 
     bpp::Node* n = nodes[idx];
     const double orig_dist = n->getDistanceToFather();
 
-    calculator.initialize(*value->model, *value->rateDist, *value->tree);
+    calculator.initialize(value->model(), value->rateDist(), tree, value->likelihoodState());
 
     double orig_ll = calculator();
+    value->setLikelihoodState(calculator.saveState());
+    calculator.checkpoint();
 
     const Proposal p = positive_real_multiplier(orig_dist, 1e-6, 100.0, _lambda, rng);
     n->setDistanceToFather(p.value);
+    calculator.updateNode(*n);
     double new_ll = calculator();
 
     double mh_ratio = std::exp(new_ll + std::log(p.hastingsRatio) - orig_ll);
     if(mh_ratio >= 1.0 || rng->UniformS() < mh_ratio) {
+        value->setLikelihoodState(calculator.saveState());
         return 1;
     } else {
         // Rejected
         n->setDistanceToFather(orig_dist);
+        calculator.rollback();
         return 0;
     }
 }
@@ -23,19 +23,22 @@ void MultiplierSMCMove::operator()(long, smc::particle<TreeParticle>& particle,
 {
     // Choose an edge at random
     TreeParticle* value = particle.GetValuePointer();
-    std::vector<bpp::Node*> nodes = onlineAvailableEdges(*value->tree);
+    TreeTemplate<bpp::Node>& tree = value->mutableTree();
+    std::vector<bpp::Node*> nodes = onlineAvailableEdges(tree);
     size_t idx = rng->UniformDiscrete(0, nodes.size() - 1);
 
     bpp::Node* n = nodes[idx];
     const double orig_dist = n->getDistanceToFather();
 
-    calculator.initialize(*value->model, *value->rateDist, *value->tree);
+    calculator.initialize(value->model(), value->rateDist(), tree, value->likelihoodState());
 
     double orig_ll = calculator();
 
     const Proposal p = positive_real_multiplier(orig_dist, 1e-6, 100.0, lambda, rng);
     n->setDistanceToFather(p.value);
+    calculator.updateNode(*n);
     double new_ll = calculator();
+    value->setLikelihoodState(calculator.saveState());
 
     particle.AddToLogWeight(new_ll - orig_ll - std::log(p.forwardDensity));
 }
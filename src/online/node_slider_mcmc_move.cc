@@ -29,7 +29,8 @@ NodeSliderMCMCMove::~NodeSliderMCMCMove()
 int NodeSliderMCMCMove::proposeMove(long, smc::particle<TreeParticle>& particle, smc::rng* rng)
 {
     // Choose an edge at random
-    TreeTemplate<bpp::Node>* tree = particle.GetValuePointer()->tree.get();
+    TreeParticle* value = particle.GetValuePointer();
+    TreeTemplate<bpp::Node>* tree = &value->mutableTree();
     std::vector<bpp::Node*> nodes = onlineAvailableEdges(*tree);
 
     // restrict to nodes with a parent in the available set
@@ -49,26 +50,30 @@ int NodeSliderMCMCMove::proposeMove(long, smc::particle<TreeParticle>& particle,
     const double orig_n_dist = n->getDistanceToFather();
     const double orig_father_dist = father->getDistanceToFather();
 
-    calculator.initialize(*particle.GetValuePointer()->model,
-                          *particle.GetValuePointer()->rateDist,
-                          *tree);
+    calculator.initialize(value->model(), value->rateDist(), *tree, value->likelihoodState());
     double orig_ll = calculator();
+    value->setLikelihoodState(calculator.saveState());
+    calculator.checkpoint();
 
     const Proposal p = positive_real_multiplier(orig_dist, 1e-6, 100.0, _lambda, rng);
     const double d = rng->UniformS() * p.value;
 
     n->setDistanceToFather(d);
     father->setDistanceToFather(p.value - d);
+    calculator.updateNode(*n);
+    calculator.updateNode(*father);
 
     double new_ll = calculator();
 
     double mh_ratio = std::exp(new_ll + std::log(p.hastingsRatio) - orig_ll);
     if(mh_ratio >= 1.0 || rng->UniformS() < mh_ratio) {
+        value->setLikelihoodState(calculator.saveState());
         return 1;
     } else {
         // Rejected
         n->setDistanceToFather(orig_n_dist);
         father->setDistanceToFather(orig_father_dist);
+        calculator.rollback();
         return 0;
     }
 }
@@ -22,7 +22,8 @@ NodeSliderSMCMove::NodeSliderSMCMove(CompositeTreeLikelihood& calculator,
 void NodeSliderSMCMove::operator()(long, smc::particle<TreeParticle>& particle, smc::rng* rng)
 {
     // Choose an edge at random
-    TreeTemplate<bpp::Node>* tree = particle.GetValuePointer()->tree.get();
+    TreeParticle* value = particle.GetValuePointer();
+    TreeTemplate<bpp::Node>* tree = &value->mutableTree();
     std::vector<bpp::Node*> nodes = onlineAvailableEdges(*tree);
 
     // restrict to nodes with a parent in the available set
@@ -39,9 +40,7 @@ void NodeSliderSMCMove::operator()(long, smc::particle<TreeParticle>& particle,
 
     const double orig_dist = n->getDistanceToFather() + father->getDistanceToFather();
 
-    calculator.initialize(*particle.GetValuePointer()->model,
-                          *particle.GetValuePointer()->rateDist,
-                          *tree);
+    calculator.initialize(value->model(), value->rateDist(), *tree, value->likelihoodState());
     double orig_ll = calculator();
 
     const Proposal p = positive_real_multiplier(orig_dist, 1e-6, 1000.0, lambda, rng);
@@ -49,8 +48,11 @@ void NodeSliderSMCMove::operator()(long, smc::particle<TreeParticle>& particle,
 
     n->setDistanceToFather(d);
     father->setDistanceToFather(p.value - d);
+    calculator.updateNode(*n);
+    calculator.updateNode(*father);
 
     double new_ll = calculator();
+    value->setLikelihoodState(calculator.saveState());
 
     particle.AddToLogWeight(new_ll - orig_ll - std::log(p.forwardDensity));
 }
@@ -29,15 +29,18 @@ namespace sts { namespace online {
         // Choose an edge at random
         TreeParticle* value = particle.GetValuePointer();
         //std::cout << value->particleID <<std::endl;
-        std::vector<bpp::Node*> nodes = onlineAvailableEdges(*value->tree);
+        TreeTemplate<bpp::Node>& tree = value->mutableTree();
+        std::vector<bpp::Node*> nodes = onlineAvailableEdges(tree);
         size_t idx = rng->UniformDiscrete(0, nodes.size() - 1);
         
         bpp::Node* n = nodes[idx];
         const double orig_dist = n->getDistanceToFather();
         
-        calculator.initialize(*value->model, *value->rateDist, *value->tree);
+        calculator.initialize(value->model(), value->rateDist(), tree, value->likelihoodState());
         
         double orig_ll = calculator();
+        value->setLikelihoodState(calculator.saveState());
+        calculator.checkpoint();
         const double max_bl = 100.0;
         const double min_bl = 1e-6;
         double new_dist = orig_dist + (rng->UniformS() - 0.5)*_lambda;
@@ -50,14 +53,17 @@ namespace sts { namespace online {
         
         //const Proposal p = positive_real_multiplier(orig_dist, 1e-6, 100.0, lambda, rng);
         n->setDistanceToFather(new_dist);
+        calculator.updateNode(*n);
         double new_ll = calculator();
         
         double mh_ratio = std::exp(new_ll - orig_ll);
         if(mh_ratio >= 1.0 || rng->UniformS() < mh_ratio) {
+            value->setLikelihoodState(calculator.saveState());
             return 1;
         } else {
             // Rejected
             n->setDistanceToFather(orig_dist);
+            calculator.rollback();
             return 0;
         }
     }
@@ -1,6 +1,7 @@
 #include "online_add_sequence_move.h"
 #include "tree_particle.h"
 #include "composite_tree_likelihood.h"
+#include "parallel.h"
 #include "util.h"
 
 #include <algorithm>
@@ -8,6 +9,8 @@
 #include <cassert>
 #include <cmath>
 #include <memory>
+#include <stdexcept>
+#include <unordered_map>
 
 using namespace std;
 using namespace bpp;
@@ -19,11 +22,24 @@ OnlineAddSequenceMove::OnlineAddSequenceMove(CompositeTreeLikelihood& calculator
                                              const vector<string>& taxaToAdd) :
     calculator(calculator),
     _sequenceNames(sequenceNames),
-    taxaToAdd(std::begin(taxaToAdd), std::end(taxaToAdd)),
+    _treeGroupCount(0),
     _toAddCount(-1),
     _counter(0),
+    _batchSize(1),
     lastTime(-1)
-{ }
+{
+    // Taxa are referred to by index from here on
+    unordered_map<string, size_t> indexes;
+    for(size_t i = 0; i < sequenceNames.size(); i++)
+        indexes[sequenceNames[i]] = i;
+    auto last = this->taxaToAdd.before_begin();
+    for(const string& name : taxaToAdd) {
+        auto it = indexes.find(name);
+        if(it == indexes.end())
+            throw std::invalid_argument("Unknown taxon to add: " + name);
+        last = this->taxaToAdd.insert_after(last, it->second);
+    }
+}
 
 void OnlineAddSequenceMove::addProposalRecord(const ProposalRecord& proposalRecord)
 {
@@ -35,18 +51,149 @@ const std::vector<ProposalRecord> OnlineAddSequenceMove::getProposalRecords() co
     return proposalRecords_;
 }
 
-void OnlineAddSequenceMove::operator()(long time, smc::particle<TreeParticle>& particle, smc::rng* rng)
+void OnlineAddSequenceMove::setBatchSize(size_t batchSize)
 {
-    if(time != lastTime && lastTime >= 0)
-        taxaToAdd.pop_front();
+    if(batchSize == 0)
+        throw std::invalid_argument("At least one taxon must be added per generation");
+    _batchSize = batchSize;
+}
+
+void OnlineAddSequenceMove::startGeneration(long time)
+{
+    if(time != lastTime && lastTime >= 0) {
+        for(size_t i = 0; i < _batch.size(); i++)
+            taxaToAdd.pop_front();
+    }
     lastTime = time;
 
     if(taxaToAdd.empty()) {
         assert(0 && "No more sequences to add");
     }
 
+    size_t toAddCount = std::distance(taxaToAdd.begin(),taxaToAdd.end());
+    
+    // we start a new iteration
+    if(_toAddCount != toAddCount){
+        _probs.newEpoch();
+        _mles.newEpoch();
+        _treeGroups.newEpoch();
+        _treeGroupCount = 0;
+        _counter = 0;
+        _pending.clear();
+
+        _batch.clear();
+        for(auto it = taxaToAdd.cbegin(); it != taxaToAdd.cend() && _batch.size() < _batchSize; ++it)
+            _batch.push_back(*it);
+    }
+    _toAddCount = toAddCount;
+}
+
+void OnlineAddSequenceMove::operator()(long time, smc::particle<TreeParticle>& particle, smc::rng* rng)
+{
+    startGeneration(time);
+
     TreeParticle* value = particle.GetValuePointer();
-    unique_ptr<TreeTemplate<bpp::Node>>& tree = value->tree;
+    std::vector<Insertion> insertions;
+
+    // Particles propagated ahead of the sampler only need their weight updated, unless they were replaced since
+    auto pending = _pending.find(value);
+    if(pending != _pending.end() && pending->second.tree == &value->tree()) {
+        insertions = std::move(pending->second.insertions);
+        _pending.erase(pending);
+    }
+    else {
+        addSequences(*value, _counter++, rng, insertions);
+    }
+
+    // The incremental weights of a batch multiply, each attachment conditioned on the previous ones
+    for(const Insertion& insertion : insertions) {
+        const double orig_weight = particle.GetLogWeight();
+        particle.AddToLogWeight(insertion.newLogLike);
+        particle.AddToLogWeight(-insertion.proposal.logProposalDensity());
+        particle.AddToLogWeight(-insertion.originalLogLike);
+        const double new_weight = particle.GetLogWeight();
+
+        assert(!std::isnan(particle.GetLogWeight()));
+
+        addProposalRecord({time, insertion.originalLogLike, insertion.newLogLike, orig_weight, new_weight,
+                           insertion.proposal});
+    }
+}
+
+void OnlineAddSequenceMove::propagate(long time, const std::vector<TreeParticle*>& particles, const std::vector<smc::rng*>& rngs)
+{
+    assert(rngs.size() <= calculator.workerCount() && "Not enough calculators for the workers!");
+    startGeneration(time);
+
+    // Particle IDs are assigned in the order of the particles, as the sampler would
+    const size_t firstID = _counter.fetch_add(particles.size());
+
+    // Tree groups are formed here, in the order of the particles, rather than by the workers as they get there. The
+    // particles of a group then take the tree and partials of its first particle, which can differ from theirs in the
+    // order of the children: whichever worker computes the proposals of a group, it computes them from the same tree.
+    // The trees of the next taxa of the batch are built from these by the same steps.
+    std::vector<FlatTree> trees(particles.size());
+    parallelFor(particles.size(), rngs.size(), [&](size_t i) {
+        trees[i].assign(particles[i]->tree());
+    });
+    std::unordered_map<size_t, size_t> firstOfGroup;
+    for(size_t i = 0; i < particles.size(); i++) {
+        const size_t group = _treeGroups.getOrCompute(trees[i], [this]() { return _treeGroupCount++; });
+        const TreeParticle& first = *particles[firstOfGroup.emplace(group, i).first->second];
+        if(&first.tree() != &particles[i]->tree()) {
+            const size_t particleID = particles[i]->particleID;
+            *particles[i] = first;
+            particles[i]->particleID = particleID;
+        }
+    }
+
+    std::vector<PendingUpdate> updates(particles.size());
+    parallelFor(particles.size(), rngs.size(), [&](size_t i) {
+        PendingUpdate& update = updates[i];
+        addSequences(*particles[i], firstID + i, rngs[currentWorker()], update.insertions);
+        update.tree = &particles[i]->tree();
+    });
+
+    for(size_t i = 0; i < particles.size(); i++)
+        _pending[particles[i]] = updates[i];
+}
+
+size_t OnlineAddSequenceMove::treeGroup(const TreeTemplate<Node>& tree)
+{
+    return _treeGroups.getOrCompute(FlatTree(tree), [this]() { return _treeGroupCount++; });
+}
+
+void OnlineAddSequenceMove::addSequences(TreeParticle& particle, size_t particleID, smc::rng* rng,
+                                         std::vector<Insertion>& insertions)
+{
+    // Particles resampled from the same one share their tree until now
+    TreeTemplate<bpp::Node>* tree = &particle.mutableTree();
+
+    calculator.initialize(particle.model(), particle.rateDist(), *tree, particle.likelihoodState());
+
+    // Calculate root log-likelihood of original tree
+    // \gamma*(s_{r-1,k}) from PhyloSMC eqn 2
+    double logLike = calculator();
+    particle.setLikelihoodState(calculator.saveState());
+
+    // New internal nodes are numbered in the order the taxa are added
+    const int firstNodeID = 2*_sequenceNames.size()-1 - _toAddCount;
+    insertions.resize(_batch.size());
+    for(size_t i = 0; i < _batch.size(); i++) {
+        insertions[i].originalLogLike = logLike;
+        addSequence(particle, _batch[i], firstNodeID + i, rng, insertions[i]);
+        logLike = insertions[i].newLogLike;
+    }
+    // Copies made by the next resampling keep this ID
+    particle.particleID = particleID;
+}
+
+void OnlineAddSequenceMove::addSequence(TreeParticle& particle, size_t taxonIndex, int nodeID, smc::rng* rng,
+                                        Insertion& insertion)
+{
+    TreeParticle* value = &particle;
+    TreeTemplate<bpp::Node>* tree = &value->mutableTree();
+    AttachmentProposal& proposal = insertion.proposal;
 
     const size_t orig_n_leaves = tree->getNumberOfLeaves(),
                  orig_n_nodes = tree->getNumberOfNodes();
@@ -64,36 +211,17 @@ void OnlineAddSequenceMove::operator()(long time, smc::particle<TreeParticle>& p
     //   \          o
     //              n
 
-    calculator.initialize(*value->model, *value->rateDist, *tree);
-
-    // Calculate root log-likelihood of original tree
-    // \gamma*(s_{r-1,k}) from PhyloSMC eqn 2
-    const double orig_ll = calculator();
-    
-    size_t toAddCount = std::distance(taxaToAdd.begin(),taxaToAdd.end());
-    
-    // we start a new iteration
-    if(_toAddCount != toAddCount){
-        _probs.clear();
-        _mles.clear();
-        _counter = 0;
-    }
-
-    AttachmentProposal proposal = propose(taxaToAdd.front(), particle, rng);
+    proposal = propose(taxonIndex, *value, rng);
     
 //    const double log_like = calculator(*proposal.edge, taxaToAdd.front(), proposal.pendantBranchLength, proposal.distalBranchLength, proposal.edge->getDistanceToFather()-proposal.distalBranchLength);
 //    log_like += calculator.sumAdditionalLogLikes();
-    _toAddCount = toAddCount;
-    value->particleID = _counter++;
-
-    const int new_node_id = 2*_sequenceNames.size()-1 - std::distance(taxaToAdd.cbegin(), taxaToAdd.cend());
 
     // New internal node, new leaf
-    Node* new_node = new Node(new_node_id, "node"+std::to_string(tree->getNumberOfNodes()));
+    Node* new_node = new Node(nodeID, "node"+std::to_string(tree->getNumberOfNodes()));
     
-    size_t idx = find(_sequenceNames.begin(), _sequenceNames.end(), taxaToAdd.front()) - _sequenceNames.begin();
+    const size_t idx = taxonIndex;
     assert(idx<_sequenceNames.size());
-    Node* new_leaf = new Node(idx, taxaToAdd.front());
+    Node* new_leaf = new Node(idx, _sequenceNames[idx]);
     new_node->addSon(new_leaf);
     new_leaf->setDistanceToFather(proposal.pendantBranchLength);
 
@@ -124,22 +252,11 @@ void OnlineAddSequenceMove::operator()(long time, smc::particle<TreeParticle>& p
     assert(tree->getNumberOfLeaves() == orig_n_leaves + 1);
     assert(tree->getNumberOfNodes() == orig_n_nodes + 2);
 
-    // Calculate new LL - need to re-initialize since nodes have been added
-    // TODO: Should nodes be allocated dynamically?
-    calculator.initialize(*value->model, *value->rateDist, *value->tree);
-
-    const double log_like = calculator();
-    
-
-    const double orig_weight = particle.GetLogWeight();
-    particle.AddToLogWeight(log_like);
-    particle.AddToLogWeight(-proposal.logProposalDensity());
-    particle.AddToLogWeight(-orig_ll);
-    const double new_weight = particle.GetLogWeight();
-
-    assert(!std::isnan(particle.GetLogWeight()));
+    // Calculate new LL: only the partials of the new node and of its ancestors are recomputed
+    calculator.updateTree();
 
-    addProposalRecord({time, orig_ll, log_like, orig_weight, new_weight, proposal});
+    insertion.newLogLike = calculator();
+    value->setLikelihoodState(calculator.saveState());
 }
 
 }} // namespaces
@@ -4,7 +4,9 @@
 #include <lcfit_cpp.h>
 #include <smctc.hh>
 
+#include <atomic>
 #include <forward_list>
+#include <memory>
 #include <string>
 #include <utility>
 #include <vector>
@@ -13,6 +15,10 @@
 #include <Bpp/Phyl/TreeTemplate.h>
 #include <lcfit_cpp.h>
 
+#include "alias_table.h"
+#include "concurrent_cache.h"
+#include "flat_tree.h"
+
 namespace sts { namespace online {
 
 // Forwards
@@ -62,24 +68,105 @@ public:
 
     void operator()(long, smc::particle<TreeParticle>&, smc::rng*);
 
+    /// \brief Add the next taxon to every particle ahead of the sampler, on \c rngs.size() workers.
+    ///
+    /// Worker \c w draws from \c rngs[w] and evaluates with the calculator of worker \c w of the
+    /// #CompositeTreeLikelihood. The weights are updated when the sampler then calls #operator() with the same
+    /// \c time on these particles. The outcome depends on the random number generators and on their number, not on
+    /// the scheduling of the workers.
+    void propagate(long time, const std::vector<TreeParticle*>& particles, const std::vector<smc::rng*>& rngs);
+
+    /// \brief Add up to \c batchSize taxa per generation rather than one.
+    ///
+    /// The taxa of a batch are added one after the other to each particle, whose weight is updated by the product of
+    /// the incremental weights, so that resampling, MCMC moves and the proposal caches are paid once per batch.
+    void setBatchSize(size_t batchSize);
+    size_t batchSize() const { return _batchSize; }
+
     void addProposalRecord(const ProposalRecord& proposalRecord);
     const std::vector<ProposalRecord> getProposalRecords() const;
 
 protected:
-    virtual AttachmentProposal propose(const std::string& leafName, smc::particle<TreeParticle>& particle, smc::rng* rng) = 0;
+    virtual AttachmentProposal propose(size_t taxonIndex, TreeParticle& particle, smc::rng* rng) = 0;
 
     CompositeTreeLikelihood& calculator;
     
     std::vector<std::string> _sequenceNames;
-    std::forward_list<std::string> taxaToAdd;
+    /// Indexes in #_sequenceNames of the taxa left to add, which are also the ids of their leaves
+    std::forward_list<size_t> taxaToAdd;
     
-    std::map<size_t, std::vector<std::pair<size_t, double>>> _probs;
-    std::unordered_map<size_t, std::unordered_map<size_t, std::pair<double, double>>> _mles;
+    /// Probability of proposing each edge, by id of the node below it
+    typedef std::vector<std::pair<size_t, double>> EdgeProbabilities;
+
+    /// Edge probabilities with a table to draw from them, shared by the particles of a tree group
+    struct EdgeDistribution
+    {
+        EdgeProbabilities probabilities;
+        /// Indexes #probabilities, empty when there was no choice to make
+        AliasTable table;
+    };
+
+    struct NodeKeyHash
+    {
+        size_t operator()(const std::pair<size_t, size_t>& key) const
+        {
+            return std::hash<size_t>()(key.first) * 31 + std::hash<size_t>()(key.second);
+        }
+    };
+
+    /// \brief Group of the particles that share the proposals for the next taxon in this generation
+    ///
+    /// Particles are grouped by tree, whatever the order of the children, so that copies of a particle share their
+    /// proposals while MCMC moves leave them identical, and so do distinct lineages that reached the same tree:
+    /// populations seeded from a posterior sample contain many copies of a few trees.
+    size_t treeGroup(const bpp::TreeTemplate<bpp::Node>& tree);
+
+    // Proposals of the current generation, shared by the workers and computed once per tree group
+    /// Edge probabilities by tree group
+    ConcurrentCache<size_t, std::shared_ptr<const EdgeDistribution>> _probs;
+    /// Maximum likelihood distal and pendant branch lengths by tree group and node ID
+    ConcurrentCache<std::pair<size_t, size_t>, std::pair<double, double>, NodeKeyHash> _mles;
+    /// Tree groups by tree
+    ConcurrentCache<FlatTree, size_t, FlatTree::Hash> _treeGroups;
+    std::atomic<size_t> _treeGroupCount;
+    // Only changed by #startGeneration, on the thread of the sampler
     size_t _toAddCount;
-    size_t _counter;
+    /// Taxa added in the current generation, the first ones of #taxaToAdd
+    std::vector<size_t> _batch;
+    std::atomic<size_t> _counter;
     std::string _proposalMethodName;
     
 private:
+    /// Moves on to the taxa of \c time, clearing the caches of the previous ones
+    void startGeneration(long time);
+
+    /// Attachment of one taxon
+    struct Insertion
+    {
+        AttachmentProposal proposal;
+        double originalLogLike;
+        double newLogLike;
+    };
+
+    /// Attach the taxa of the current generation to \c particle, one insertion each
+    void addSequences(TreeParticle& particle, size_t particleID, smc::rng* rng, std::vector<Insertion>& insertions);
+
+    /// Attach \c taxonIndex to \c particle, whose tree the calculator holds, below a new node \c nodeID
+    void addSequence(TreeParticle& particle, size_t taxonIndex, int nodeID, smc::rng* rng, Insertion& insertion);
+
+    /// Outcome of #addSequences for a particle propagated ahead of the sampler
+    struct PendingUpdate
+    {
+        // Tree of the particle once the taxa were added, to detect particles replaced since
+        const bpp::TreeTemplate<bpp::Node>* tree;
+        std::vector<Insertion> insertions;
+    };
+
+    std::unordered_map<const TreeParticle*, PendingUpdate> _pending;
+
+    size_t _batchSize;
+
+    // Only changed by #startGeneration, on the thread of the sampler
     long lastTime;
     std::vector<ProposalRecord> proposalRecords_;
 };
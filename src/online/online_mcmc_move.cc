@@ -24,6 +24,13 @@ int OnlineMCMCMove::operator()(long time, smc::particle<TreeParticle>& particle,
     return result;
 }
 
+void OnlineMCMCMove::setTuning(const Tuning& tuning)
+{
+    _lambda = tuning.lambda;
+    n_attempted = tuning.attempted;
+    n_accepted = tuning.accepted;
+}
+
 double OnlineMCMCMove::acceptanceProbability() const
 {
     if(!n_attempted)
@@ -17,6 +17,17 @@ public:
     double acceptanceProbability() const;
 
     int operator()(long, smc::particle<TreeParticle>&, smc::rng*);
+
+    /// Scale of the proposals and the counts it was tuned from, to carry them over to a resumed run
+    struct Tuning
+    {
+        double lambda;
+        unsigned int attempted;
+        unsigned int accepted;
+    };
+
+    Tuning tuning() const { return Tuning { _lambda, n_attempted, n_accepted }; }
+    void setTuning(const Tuning& tuning);
 protected:
     virtual int proposeMove(long time, smc::particle<TreeParticle>& particle, smc::rng* rng) = 0;
 
@@ -11,9 +11,11 @@ namespace sts { namespace online {
 smc::particle<TreeParticle> OnlineSMCInit::operator()(smc::rng*)
 {
 
-    TreeParticle value = particles[i++ % particles.size()];
-    value.particleID = (i-1) % particles.size();
-    return smc::particle<TreeParticle>(value, 0.);
+    const size_t index = i++ % particles.size();
+    TreeParticle value = particles[index];
+    if(!keepParticleIDs)
+        value.particleID = index;
+    return smc::particle<TreeParticle>(value, logWeights.empty() ? 0. : logWeights[index]);
 }
 
 }} // namespaces
@@ -19,13 +19,22 @@ class TreeParticle;
 class OnlineSMCInit
 {
 public:
-    OnlineSMCInit(const std::vector<TreeParticle>& p) :
+    /// \param p Particles to start from, repeated as needed
+    /// \param keepParticleIDs Keep the IDs of \c p rather than numbering the particles by their index, for a population
+    /// carried over from another sampler
+    /// \param logWeights Log weight of each particle of \c p, all 0 when empty
+    OnlineSMCInit(const std::vector<TreeParticle>& p, bool keepParticleIDs = false,
+                  const std::vector<double>& logWeights = std::vector<double>()) :
         particles(p),
+        keepParticleIDs(keepParticleIDs),
+        logWeights(logWeights),
         i(0) { };
 
     smc::particle<TreeParticle> operator()(smc::rng*);
 private:
     const std::vector<TreeParticle> particles;
+    bool keepParticleIDs;
+    const std::vector<double> logWeights;
     size_t i;
 };
 
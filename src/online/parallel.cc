@@ -0,0 +1,58 @@
+#include "parallel.h"
+
+#include <algorithm>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace sts { namespace online {
+
+namespace {
+thread_local size_t workerIndex = 0;
+}
+
+size_t currentWorker()
+{
+    return workerIndex;
+}
+
+void parallelFor(size_t count, size_t threads, const std::function<void(size_t)>& fn)
+{
+    // Workers beyond the number of items would have nothing to do; item i still runs on worker i % threads
+    threads = std::min(threads, count);
+    if(threads <= 1) {
+        for(size_t i = 0; i < count; i++)
+            fn(i);
+        return;
+    }
+
+    std::exception_ptr error;
+    std::mutex errorMutex;
+    auto work = [&](size_t worker) {
+        workerIndex = worker;
+        try {
+            for(size_t i = worker; i < count; i += threads)
+                fn(i);
+        } catch(...) {
+            std::lock_guard<std::mutex> lock(errorMutex);
+            if(!error)
+                error = std::current_exception();
+        }
+        workerIndex = 0;
+    };
+
+    // The calling thread is worker 0
+    std::vector<std::thread> workers;
+    workers.reserve(threads - 1);
+    for(size_t worker = 1; worker < threads; worker++)
+        workers.emplace_back(work, worker);
+    work(0);
+    for(std::thread& t : workers)
+        t.join();
+
+    if(error)
+        std::rethrow_exception(error);
+}
+
+}} // namespaces
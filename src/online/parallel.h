@@ -0,0 +1,27 @@
+/// \file parallel.h
+/// \brief Running independent work items on several threads
+#ifndef STS_ONLINE_PARALLEL_H
+#define STS_ONLINE_PARALLEL_H
+
+#include <cstddef>
+#include <functional>
+
+namespace sts { namespace online {
+
+/// \brief Index of the worker running the calling thread
+///
+/// Workers are numbered from 0 to the number of threads given to #parallelFor minus one. Code running outside of
+/// #parallelFor is worker 0. Objects that cannot be shared between threads, such as likelihood calculators, keep one
+/// instance per worker and pick theirs with this index.
+size_t currentWorker();
+
+/// \brief Call \c fn(i) for each \c i in <c>[0, count)</c> on \c threads workers
+///
+/// Item \c i runs on worker <c>i % threads</c>, in increasing order of \c i within a worker, so that the work done by
+/// each worker, and the random numbers it draws, do not depend on scheduling. The first exception thrown by \c fn is
+/// rethrown once all workers are done.
+void parallelFor(size_t count, size_t threads, const std::function<void(size_t)>& fn);
+
+}} // namespaces
+
+#endif // STS_ONLINE_PARALLEL_H
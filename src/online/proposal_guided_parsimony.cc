@@ -4,12 +4,12 @@
 
 
 #include "online_util.h"
-#include "weighted_selector.h"
+#include "parallel.h"
 
 namespace sts {
     namespace online {
         
-        const std::pair<bpp::Node*, double> ProposalGuidedParsimony::chooseEdge(bpp::TreeTemplate<bpp::Node>& tree, const std::string& leafName, smc::rng* rng, size_t particleID) {
+        const std::pair<bpp::Node*, double> ProposalGuidedParsimony::chooseEdge(bpp::TreeTemplate<bpp::Node>& tree, size_t taxonIndex, smc::rng* rng, EdgeDistribution& distribution) {
             
             std::vector<bpp::Node*> nodes = onlineAvailableEdges(tree);
             
@@ -20,10 +20,11 @@ namespace sts {
             std::vector<std::pair<bpp::Node*, double> > nodeWeights;
             double minWeight = std::numeric_limits<double>::max();
             
-            double score = _parsimony->getScore(tree);
+            FlexibleParsimony& parsimony = *_parsimony.at(currentWorker());
+            double score = parsimony.getScore(tree);
             
             for(bpp::Node *node : nodes){
-                double score = _parsimony->getScore(tree, *node, leafName);
+                double score = parsimony.getScore(tree, *node, taxonIndex);
                 nodeWeights.push_back(std::make_pair(node, score));
                 if(score < minWeight){
                     minWeight = score;
@@ -38,24 +39,20 @@ namespace sts {
                 vec.push_back(std::make_pair(v.first, p));
             }
             
-            std::vector<std::pair<size_t, double>> probabilities;
+            EdgeProbabilities& probabilities = distribution.probabilities;
+            probabilities.clear();
             probabilities.reserve(vec.size());
-            
-            WeightedSelector<bpp::Node*> selector{*rng};
             for(int i = 0; i < vec.size(); i++){
                 double p = vec[i].second/sum;
-                selector.push_back(vec[i].first, p);
                 probabilities.push_back(std::make_pair(vec[i].first->getId(), p));
             }
             
-            _probs[particleID] = probabilities;
-            
-            bpp::Node* n = selector.choice();
-            auto it = std::find_if( nodeWeights.begin(), nodeWeights.end(),
-                                   [n](const std::pair<bpp::Node*, double>& element){return element.first == n;});
-            double l = _heating*(minWeight-it->second) - log(sum);
+            // The same table serves the other particles of the group
+            distribution.table.assign(probabilities.size(), [&probabilities](size_t i) { return probabilities[i].second; });
+            const std::pair<bpp::Node*, double>& chosen = nodeWeights[distribution.table.draw(*rng)];
+            double l = _heating*(minWeight-chosen.second) - log(sum);
             
-            return std::pair<bpp::Node*,double>(n, l);
+            return std::pair<bpp::Node*,double>(chosen.first, l);
         }
     }
 }
@@ -2,6 +2,8 @@
 #define PROPOSAL_GUIDED_PARSIMONY_H
 
 #include <stdio.h>
+#include <memory>
+#include <vector>
 
 #include "lcfit_online_add_sequence_move.h"
 #include "flexible_parsimony.h"
@@ -11,7 +13,8 @@ namespace sts {
         class ProposalGuidedParsimony : public LcfitOnlineAddSequenceMove{
         
         public:
-            ProposalGuidedParsimony(std::shared_ptr<FlexibleParsimony> parsimony,
+            /// \param parsimony One parsimony calculator per worker, see #CompositeTreeLikelihood::workerCount
+            ProposalGuidedParsimony(std::vector<std::shared_ptr<FlexibleParsimony>> parsimony,
                                     CompositeTreeLikelihood& calculator,
                                     const std::vector<std::string>& sequenceNames,
                                     const std::vector<std::string>& taxaToAdd,
@@ -22,12 +25,12 @@ namespace sts {
             virtual ~ProposalGuidedParsimony(){};
             
             virtual const std::pair<bpp::Node*, double> chooseEdge(bpp::TreeTemplate<bpp::Node>& tree,
-                                                                   const std::string& leafName,
-                                                                   smc::rng* rng, size_t particleID);
+                                                                   size_t taxonIndex,
+                                                                   smc::rng* rng, EdgeDistribution& distribution);
             
         private:
             
-            std::shared_ptr<FlexibleParsimony> _parsimony;
+            std::vector<std::shared_ptr<FlexibleParsimony>> _parsimony;
         };
     }
 }
@@ -1,15 +1,44 @@
 #include "simple_flexible_tree_likelihood.h"
+#include <atomic>
+#include <cmath>
 #include <cstring>
+#include <limits>
 
 using namespace std;
 
 namespace sts {
     namespace online {
         
-        SimpleFlexibleTreeLikelihood::SimpleFlexibleTreeLikelihood(const bpp::SitePatterns& patterns, const bpp::SubstitutionModel &model, const bpp::DiscreteDistribution& rateDist, bool useAmbiguities):
-        AbstractFlexibleTreeLikelihood(patterns, model, rateDist, useAmbiguities){
+        namespace {
+            // Partials of a pattern are rescaled by a power of two, which is exact, when their maximum drops below
+            // 2^-256, or 2^-32 when they are stored as float
+            template<typename T>
+            double scalingThreshold();
+            
+            template<>
+            double scalingThreshold<double>() { return std::ldexp(1.0, -256); }
+            
+            template<>
+            double scalingThreshold<float>() { return std::ldexp(1.0, -32); }
+        }
+        
+        SimpleFlexibleTreeLikelihood::SimpleFlexibleTreeLikelihood(const bpp::SitePatterns& patterns, const bpp::SubstitutionModel &model, const bpp::DiscreteDistribution& rateDist, bool useAmbiguities, SimdBackend simd, bool singlePrecision, bool hugePages, bool keepStates):
+        AbstractFlexibleTreeLikelihood(patterns, model, rateDist, useAmbiguities),
+        _singlePrecision(singlePrecision),
+        _treeRevision(0),
+        _keepStates(keepStates),
+        _checkpoint(false){
 
             _matrixSize = _stateCount*_stateCount;
+            _matrixProvider.setModel(model);
+            
+            // Kernels specialized for the dimensions of this instance, vectorized when possible
+            if(_singlePrecision){
+                _singleKernels = selectLikelihoodKernels<float>(_stateCount, _rateCount, simd);
+            }
+            else{
+                _kernels = selectLikelihoodKernels<double>(_stateCount, _rateCount, simd);
+            }
             
             _patternWeights.resize(_patternCount);
             const std::vector<unsigned int>& w = patterns.getWeights();
@@ -21,32 +50,106 @@ namespace sts {
             }
             std::unique_ptr<bpp::SiteContainer> sites(patterns.getSites());
             
-            // Lower partials 
-            _partials.resize(_totalNodeCount*2+1);
-            for(auto it = _partials.begin(); it != _partials.end(); ++it){
-                it->resize(_rateCount*_stateCount*_patternCount);
+            // All buffers live in a single arena, unless they are kept in states. Lower partials, upper partials and a
+            // temporary buffer share the indexing of the partials, and each node's lower partials sit next to the
+            // matrix of its branch and its upper partials
+            const size_t partialsCount = _totalNodeCount*2+1;
+            const size_t partialsSize = _rateCount*_stateCount*_patternCount;
+            std::vector<size_t> partialsOffsets(partialsCount);
+            std::vector<size_t> scaleFactorsOffsets(partialsCount);
+            std::vector<size_t> matricesOffsets(_totalNodeCount+5);
+            
+            auto reservePartials = [&](size_t index){
+                partialsOffsets[index] = _singlePrecision ? _arena.reserve<float>(partialsSize) : _arena.reserve<double>(partialsSize);
+                scaleFactorsOffsets[index] = _arena.reserve<double>(_patternCount);
+            };
+            for(int i = 0; i < _totalNodeCount; i++){
+                if(!_keepStates || i < _sequenceCount){
+                    reservePartials(i);
+                }
+                if(!_keepStates){
+                    matricesOffsets[i] = _arena.reserve<double>(_rateCount*_matrixSize);
+                }
+                reservePartials(i+_totalNodeCount);
             }
+            reservePartials(partialsCount-1);
             
-            // Probability matrices
-            _matrices.resize(_totalNodeCount+3);
-            for(auto it = _matrices.begin(); it != _matrices.end(); ++it){
-                it->resize(_rateCount*_matrixSize);
+            // Temporary matrices of the pendant, distal and proximal branches, then the first and second derivatives of
+            // the matrices of one of them
+            for(size_t i = _totalNodeCount; i < matricesOffsets.size(); i++){
+                matricesOffsets[i] = _arena.reserve<double>(_rateCount*_matrixSize);
             }
             
-            // Rates are integrated out
-            _rootPartials.resize(4);
-            for(auto it = _rootPartials.begin(); it != _rootPartials.end(); ++it){
-                it->assign(_stateCount*_patternCount, 0.);
+            // Rates are integrated out: 0 current tree, 1 current tree + taxon
+            std::vector<size_t> rootPartialsOffsets(2);
+            for(auto it = rootPartialsOffsets.begin(); it != rootPartialsOffsets.end(); ++it){
+                *it = _arena.reserve<double>(_stateCount*_patternCount);
             }
             
             // 0 current tree
             // 1 current tree + taxon
             // 2 1st derivative current tree + taxon
             // 3 2nd derivative current tree + taxon
-            _patternLikelihoods.resize(4);
-            for(auto it = _patternLikelihoods.begin(); it != _patternLikelihoods.end(); ++it){
-                it->assign(_patternCount, 0.);
+            std::vector<size_t> patternLikelihoodsOffsets(4);
+            for(auto it = patternLikelihoodsOffsets.begin(); it != patternLikelihoodsOffsets.end(); ++it){
+                *it = _arena.reserve<double>(_patternCount);
+            }
+            // Derivatives share the scale factors of the likelihood of the current tree + taxon
+            std::vector<size_t> patternScaleFactorsOffsets(2);
+            for(auto it = patternScaleFactorsOffsets.begin(); it != patternScaleFactorsOffsets.end(); ++it){
+                *it = _arena.reserve<double>(_patternCount);
+            }
+            
+            // Zero-initialized: scale factors of tips stay at 0
+            _arena.allocate(hugePages);
+            
+            auto doubleBuffer = [this](size_t offset){ return _arena.at<double>(offset); };
+            if(_singlePrecision){
+                _singlePartials.resize(partialsCount);
+                std::transform(partialsOffsets.begin(), partialsOffsets.end(), _singlePartials.begin(), [this](size_t offset){ return _arena.at<float>(offset); });
+            }
+            else{
+                _partials.resize(partialsCount);
+                std::transform(partialsOffsets.begin(), partialsOffsets.end(), _partials.begin(), doubleBuffer);
             }
+            _logScaleFactors.resize(partialsCount);
+            std::transform(scaleFactorsOffsets.begin(), scaleFactorsOffsets.end(), _logScaleFactors.begin(), doubleBuffer);
+            _matrices.resize(matricesOffsets.size());
+            std::transform(matricesOffsets.begin(), matricesOffsets.end(), _matrices.begin(), doubleBuffer);
+            _rootPartials.resize(rootPartialsOffsets.size());
+            std::transform(rootPartialsOffsets.begin(), rootPartialsOffsets.end(), _rootPartials.begin(), doubleBuffer);
+            _patternLikelihoods.resize(patternLikelihoodsOffsets.size());
+            std::transform(patternLikelihoodsOffsets.begin(), patternLikelihoodsOffsets.end(), _patternLikelihoods.begin(), doubleBuffer);
+            _patternLogScaleFactors.resize(patternScaleFactorsOffsets.size());
+            std::transform(patternScaleFactorsOffsets.begin(), patternScaleFactorsOffsets.end(), _patternLogScaleFactors.begin(), doubleBuffer);
+            
+            // Layout of the buffers of a single node, kept in states or used as shadows
+            AlignedArena layout;
+            _bufferPartialsOffset = _singlePrecision ? layout.reserve<float>(partialsSize) : layout.reserve<double>(partialsSize);
+            _bufferScaleFactorsOffset = layout.reserve<double>(_patternCount);
+            
+            if(_keepStates){
+                _partialsBuffers.resize(_totalNodeCount);
+                _matrixBuffers.resize(_totalNodeCount);
+                for(int i = 0; i < _totalNodeCount; i++){
+                    if(i >= _sequenceCount){
+                        setPartialsBuffer(i, createPartialsBuffer());
+                    }
+                    setMatrixBuffer(i, createMatrixBuffer());
+                }
+            }
+            
+            _shadowPartials.resize(_totalNodeCount);
+            _shadowSinglePartials.resize(_totalNodeCount);
+            _shadowLogScaleFactors.resize(_totalNodeCount);
+            _shadowMatrices.resize(_totalNodeCount);
+            _shadowPartialsBuffers.resize(_totalNodeCount);
+            _shadowMatrixBuffers.resize(_totalNodeCount);
+            _isShadowedPartials.assign(_totalNodeCount, false);
+            _isShadowedMatrices.assign(_totalNodeCount, false);
+            
+            // Rescaling only kicks in for patterns that are about to underflow, so it is always on
+            _useScaleFactors = true;
             
             if(!_useAmbiguities){
 	            setStates(*sites);
@@ -73,445 +176,287 @@ namespace sts {
         }
         
         void SimpleFlexibleTreeLikelihood::setPartials(const bpp::SiteContainer& sites){
+            if(_singlePrecision){
+                setPartials(_singlePartials, sites);
+            }
+            else{
+                setPartials(_partials, sites);
+            }
+        }
+        
+        template<typename T>
+        void SimpleFlexibleTreeLikelihood::setPartials(const std::vector<T*>& partials, const bpp::SiteContainer& sites){
             for(int i = 0; i < _sequenceCount; i++){
                 const bpp::Sequence& sequence = sites.getSequence(i);
                 for(size_t site = 0; site < _patternCount; site++) {
                     for(size_t j = 0; j < _stateCount; j++) {
                         size_t idx = _stateCount * site + j;
-                        _partials[i][idx] = _model->getInitValue(j, sequence.getValue(site));
+                        partials[i][idx] = _model->getInitValue(j, sequence.getValue(site));
                     }
                     for(size_t c = 1; c < _rateCount; c++)
-                        std::copy(_partials[i].begin(),
-                                  _partials[i].begin() + _stateCount*_patternCount,
-                                  _partials[i].begin() + (_stateCount*_patternCount * c));
+                        std::copy(partials[i],
+                                  partials[i] + _stateCount*_patternCount,
+                                  partials[i] + (_stateCount*_patternCount * c));
                 }
             }
         }
         
-        void SimpleFlexibleTreeLikelihood::traverseUpper(const bpp::Node* node){
-        
-        	if(node->hasFather()){
-                const bpp::Node* parent = node->getFather();
-                const bpp::Node* sibling = parent->getSon(0);
-                if (sibling == node) {
-                    sibling = parent->getSon(1);
+        void SimpleFlexibleTreeLikelihood::traverseUpper(){
+            const std::vector<int>& order = _flatTree.postOrder();
+            
+            // Parents before their children
+            for(auto it = order.rbegin(); it != order.rend(); ++it){
+                const int nodeId = *it;
+                const int parentId = _flatTree.parent(nodeId);
+                if(parentId == FlatTree::NONE){
+                    continue;
                 }
                 
-        		if(parent->hasFather()){
-                    const bpp::Node* grandParent = parent->getFather();
-                    const int idSibling = sibling->getId();
+                const int grandParentId = _flatTree.parent(parentId);
+                if(grandParentId != FlatTree::NONE){
+                    const int idSibling = _flatTree.sibling(nodeId);
                     
-                    int idMatrix = parent->getId();
+                    int idMatrix = parentId;
                     
                     // The sons of the right node of the root are going to use the lower partials of the left node of the root
-                    if(!grandParent->hasFather() && grandParent->getSon(1) == parent){
-                        idMatrix = grandParent->getSon(0)->getId();
+                    if(_flatTree.parent(grandParentId) == FlatTree::NONE && _flatTree.child(grandParentId, 1) == parentId){
+                        idMatrix = _flatTree.child(grandParentId, 0);
                     }
                     
-                    _upperPartialsIndexes[node->getId()] = node->getId()+_totalNodeCount;
-                    updatePartials(_upperPartialsIndexes[node->getId()], _upperPartialsIndexes[parent->getId()], idMatrix, idSibling, idSibling);
-				}
-                // We dont need to calculate upper partials for the children of the root as it is using the lower partials of its sibling
-                // Left node of the root
-                else if(parent->getSon(0) == node){
-                    _upperPartialsIndexes[node->getId()] = parent->getSon(1)->getId();
+                    _upperPartialsIndexes[nodeId] = nodeId+_totalNodeCount;
+                    updatePartials(_upperPartialsIndexes[nodeId], _upperPartialsIndexes[parentId], idMatrix, idSibling, idSibling);
                 }
+                // We dont need to calculate upper partials for the children of the root as it is using the lower partials of its sibling
                 else{
-                    _upperPartialsIndexes[node->getId()] = parent->getSon(0)->getId();
+                    _upperPartialsIndexes[nodeId] = _flatTree.sibling(nodeId);
                 }
-        	}
-
-        	if(node->getNumberOfSons() > 0){
-				traverseUpper(node->getSon(0));
-                traverseUpper(node->getSon(1));
-        	}
+            }
         }
         
-        bool SimpleFlexibleTreeLikelihood::traverse(const bpp::Node* node){
-            bool update = _needNodeUpdate[node->getId()];
-            
-            if(node->hasFather() && update){
-                int id = node->getId();
-                
-                int offset = 0;
-                for(int c = 0; c < _rateCount; c++){
-                    const bpp::Matrix<double>& m = _model->getPij_t(node->getDistanceToFather() * _rateDist->getCategory(c));
-                    
-                    for(int i = 0; i < _stateCount; i++){
-                        const vector<double>& mi = m.row(i);
-                        std::copy(mi.begin(), mi.end(), _matrices[id].data()+offset);
-                        offset += _stateCount;
-                    }
+        void SimpleFlexibleTreeLikelihood::traverse(){
+            for(int nodeId : _flatTree.postOrder()){
+                if(_needNodeUpdate[nodeId] && _flatTree.parent(nodeId) != FlatTree::NONE){
+                    ownMatrices(nodeId);
+                    updateMatrices(nodeId, _flatTree.branchLength(nodeId));
                 }
-            }
-            
-            if(node->getNumberOfSons() > 0){
                 
-                bool update1 = traverse(node->getSon(0));
-                bool update2 = traverse(node->getSon(1));
-                
-                if( update1 || update2 ){
-                    
-                    updatePartials(node->getId(), node->getSon(0)->getId(), node->getSon(0)->getId(), node->getSon(1)->getId(), node->getSon(1)->getId());
-
-//                    if (_useScaleFactors) {
-//                        // get the index of this scaling buffer
-//                        int indexInternal = node->getId() - _leafCount;
-//                        
-//                        if (_recomputeScaleFactors) {
-//                            
-//                            // store the index
-//                            _scaleBufferIndices[indexInternal] = indexInternal;
-//                            _operations.back().destinationScaleWrite = _scaleBufferIndices[indexInternal];
-//                            _operations.back().destinationScaleRead  = BEAGLE_OP_NONE;
-//                            
-//                        }
-//                        else {
-//                            _operations.back().destinationScaleWrite  = BEAGLE_OP_NONE;
-//                            _operations.back().destinationScaleRead = _scaleBufferIndices[indexInternal];// Read existing scaleFactor
-//                        }
-//                        
-//                    }
-//                    else if (_useAutoScaling) {
-//                        _scaleBufferIndices[node->getId() - _leafCount] = node->getId();
-//                    }
+                if(!_flatTree.isLeaf(nodeId)){
+                    const int id1 = _flatTree.child(nodeId, 0);
+                    const int id2 = _flatTree.child(nodeId, 1);
                     
-                    update |= (update1 | update2);
+                    // Children come first in the post-order, their flags already include their own subtree
+                    if( _needNodeUpdate[id1] || _needNodeUpdate[id2] ){
+                        ownPartials(nodeId);
+                        updatePartials(nodeId, id1, id1, id2, id2);
+                        _needNodeUpdate[nodeId] = true;
+                    }
                 }
             }
-            return update;
         }
         
         void SimpleFlexibleTreeLikelihood::calculatePatternLikelihood( const double *partials, const double *frequencies, double *outLogLikelihoods)const{
-            int v = 0;
-            int i = 0;
-            
-            for ( int k = 0; k < _patternCount; k++ ) {
-                
-                outLogLikelihoods[k] = 0;
-                for ( i = 0; i < _stateCount; i++ ) {
-                    outLogLikelihoods[k] += frequencies[i] * partials[v];
-                    v++;
-                }
-                //outLogLikelihoods[k] = log(outLogLikelihoods[k]);
-                
-                if ( _useScaleFactors ) {
-                    //outLogLikelihoods[k] += getLogScalingFactor( tlk, k);
-                }
+            // Root partials are in double precision whatever the storage of the partials
+            if(_singlePrecision){
+                _singleKernels.calculatePatternLikelihood(partials, frequencies, outLogLikelihoods, _stateCount, _patternCount);
+            }
+            else{
+                _kernels.calculatePatternLikelihood(partials, frequencies, outLogLikelihoods, _stateCount, _patternCount);
             }
-            
         }
         
-
-        void SimpleFlexibleTreeLikelihood::integratePartials( const double *inPartials, const double *proportions, double *outPartials )const{
-            int i,k;
-            double *pPartials = outPartials;
-            const double *pInPartials = inPartials;
-            
-            if( _rateCount == 1 ){
-                memcpy(outPartials, inPartials, sizeof(double)*_patternCount*_stateCount);
-                return;
+        void SimpleFlexibleTreeLikelihood::integratePartials( int partialsIndex, const double *proportions, double *outPartials )const{
+            if(_singlePrecision){
+                _singleKernels.integratePartials(_singlePartials[partialsIndex], proportions, outPartials, _stateCount, _rateCount, _patternCount);
             }
-            
-            for ( k = 0; k < _patternCount; k++ ) {
-                
-                for ( i = 0; i < _stateCount; i++ ) {
-                    
-                    *pPartials++ = *pInPartials++ * proportions[0];
-                }
+            else{
+                _kernels.integratePartials(_partials[partialsIndex], proportions, outPartials, _stateCount, _rateCount, _patternCount);
             }
-            
-            
-            for ( int l = 1; l < _rateCount; l++ ) {
-                pPartials = outPartials;
+        }
+        
+        void SimpleFlexibleTreeLikelihood::updatePartials(int partialsIndex, int partialsIndex1, int matrixIndex1, int partialsIndex2, int matrixIndex2 ) {
+            if(_singlePrecision){
+                updatePartials(_singlePartials, _singleKernels, partialsIndex, partialsIndex1, matrixIndex1, partialsIndex2, matrixIndex2);
+            }
+            else{
+                updatePartials(_partials, _kernels, partialsIndex, partialsIndex1, matrixIndex1, partialsIndex2, matrixIndex2);
+            }
+            operationCallCount++;
+        }
+        
+        template<typename T>
+        void SimpleFlexibleTreeLikelihood::updatePartials(const std::vector<T*>& partials, const BasicLikelihoodKernels<T>& kernels, int partialsIndex, int partialsIndex1, int matrixIndex1, int partialsIndex2, int matrixIndex2 ) {
+            if( partials[partialsIndex1] != nullptr ){
+                if(  partials[partialsIndex2] != nullptr ){
+                    kernels.updatePartialsUndefinedUndefined(partials[partialsIndex1],
+                                                             _matrices[matrixIndex1],
+                                                             partials[partialsIndex2],
+                                                             _matrices[matrixIndex2],
+                                                             partials[partialsIndex],
+                                                             _stateCount, _rateCount, _patternCount);
+                }
+                else {
+                    kernels.updatePartialsKnownUndefined(_states[partialsIndex2].data(),
+                                                         _matrices[matrixIndex2],
+                                                         partials[partialsIndex1],
+                                                         _matrices[matrixIndex1],
+                                                         partials[partialsIndex],
+                                                         _stateCount, _rateCount, _patternCount);
+                }
                 
-                for ( k = 0; k < _patternCount; k++ ) {
+            }
+            else{
+                if(  partials[partialsIndex2] != nullptr ){
+                    kernels.updatePartialsKnownUndefined(_states[partialsIndex1].data(),
+                                                         _matrices[matrixIndex1],
+                                                         partials[partialsIndex2],
+                                                         _matrices[matrixIndex2],
+                                                         partials[partialsIndex],
+                                                         _stateCount, _rateCount, _patternCount);
                     
-                    for ( i = 0; i < _stateCount; i++ ) {
-                        
-                        *pPartials += *pInPartials++ * proportions[l];
-                        pPartials++;
-                    }
+                }
+                else{
+                    kernels.updatePartialsKnownKnown(_states[partialsIndex1].data(),
+                                                     _matrices[matrixIndex1],
+                                                     _states[partialsIndex2].data(),
+                                                     _matrices[matrixIndex2],
+                                                     partials[partialsIndex],
+                                                     _stateCount, _rateCount, _patternCount);
                 }
             }
             
+            if ( _useScaleFactors ) {
+                scalePartials(partials, partialsIndex, partialsIndex1, partialsIndex2);
+            }
         }
         
-        void SimpleFlexibleTreeLikelihood::updatePartialsKnownKnown( const int *states1, const double *matrices1, const int *states2, const double *matrices2, double *partials )const{
-            int k,i,w;
-            int u = 0;
-            int state1, state2;
-            double *pPartials = partials;
-    
-            u = 0;
-            pPartials = partials;
-            for ( int l = 0; l < _rateCount; l++ ) {
-                
-                for ( k = 0; k < _patternCount; k++ ) {
-                    
-                    state1 = states1[k];
-                    state2 = states2[k];
-                    
-                    w = u;
-                    
-                    if (state1 < _stateCount && state2 < _stateCount) {
-                        
-                        for ( i = 0; i < _stateCount; i++ ) {
-                            
-                            *pPartials++ = matrices1[w + state1] * matrices2[w + state2];
-                            w += _stateCount;
-                        }
-                        
-                    }
-                    else if (state1 < _stateCount) {
-                        // child 1 has a gap or unknown state so treat it as unknown
-                        
-                        for ( i = 0; i < _stateCount ; i++ ) {
-                            
-                            *pPartials++ = matrices1[w + state1];
-                            
-                            w += _stateCount;
-                        }
-                    } else if (state2 < _stateCount ) {
-                        // child 2 has a gap or unknown state so treat it as unknown
-                        
-                        for ( i = 0; i < _stateCount ; i++ ) {
-                            
-                            *pPartials++ = matrices2[w + state2];
-                            
-                            w += _stateCount;
-                        }
-                    } else {
-                        // both children have a gap or unknown state so set partials to 1
-                        
-                        for ( i = 0; i < _stateCount; i++ ) {
-                            *pPartials++ = 1.0;
-                        }
-                    }
-                }
-                u += _matrixSize;
+        void SimpleFlexibleTreeLikelihood::scalePartials(int partialsIndex, int partialsIndex1, int partialsIndex2){
+            if(_singlePrecision){
+                scalePartials(_singlePartials, partialsIndex, partialsIndex1, partialsIndex2);
+            }
+            else{
+                scalePartials(_partials, partialsIndex, partialsIndex1, partialsIndex2);
             }
         }
         
+        template<typename T>
+        void SimpleFlexibleTreeLikelihood::scalePartials(const std::vector<T*>& partialsBuffers, int partialsIndex, int partialsIndex1, int partialsIndex2){
+            scalePartials(partialsBuffers[partialsIndex], _logScaleFactors[partialsIndex], _logScaleFactors[partialsIndex1], _logScaleFactors[partialsIndex2]);
+        }
         
-        void SimpleFlexibleTreeLikelihood::updatePartialsKnownUndefined( const int *states1, const double *matrices1, const double *partials2, const double *matrices2, double *partials3 )const{
-            double sum;
-            int v = 0;
-            int i,j,k;
-            int w;
-            int state1;
+        template<typename T>
+        void SimpleFlexibleTreeLikelihood::scalePartials(T* partials, double* logScaleFactors, const double* logScaleFactors1, const double* logScaleFactors2) const{
+            const double threshold = scalingThreshold<T>();
+            const int rateOffset = _stateCount*_patternCount;
             
-            double *pPartials = partials3;
-            
-            for ( int l = 0; l < _rateCount; l++ ) {
+            for(int k = 0; k < _patternCount; k++){
+                logScaleFactors[k] = logScaleFactors1[k] + logScaleFactors2[k];
                 
-                for ( k = 0; k < _patternCount; k++ ) {
-                    
-                    state1 = states1[k];
-                    
-                    w = l * _matrixSize;
-                    
-                    if ( state1 < _stateCount) {
-                        
-                        
-                        for ( i = 0; i < _stateCount; i++) {
-                            
-                            *pPartials = matrices1[w + state1];
-                            
-                            sum = 0.0;
-                            for ( j = 0; j < _stateCount; j++) {
-                                sum += matrices2[w] * partials2[v + j];
-                                w++;
-                            }
-                            
-                            *pPartials *= sum;
-                            pPartials++;
-                        }
-                        
-                    }
-                    else {
-                        // Child 1 has a gap or unknown state so don't use it
-                        
-                        for ( i = 0; i < _stateCount; i++) {
-                            
-                            *pPartials = 0.0;
-                            for ( j = 0; j < _stateCount; j++) {
-                                *pPartials += matrices2[w] * partials2[v + j];
-                                w++;
-                            }
-                            
-                            pPartials++;
-                        }
-                        
+                // All rate categories share the scale factor of a pattern
+                double maxPartial = 0.;
+                for(int c = 0; c < _rateCount; c++){
+                    const T* p = partials + c*rateOffset + k*_stateCount;
+                    for(int i = 0; i < _stateCount; i++){
+                        maxPartial = std::max(maxPartial, static_cast<double>(p[i]));
                     }
-                    
-                    v += _stateCount;
                 }
-            }
-        }        
-        
-        void SimpleFlexibleTreeLikelihood::updatePartialsUndefinedUndefined( const double *partials1, const double *matrices1, const double *partials2, const double *matrices2, double *partials3 )const{
-            double sum1, sum2;
-            int v = 0;
-            int i,j,k;
-            int w;
-            double *pPartials = partials3;
-            
-            for ( int l = 0; l < _rateCount; l++ ) {
                 
-                for ( k = 0; k < _patternCount; k++ ) {
-                    
-                    w = l * _matrixSize;
-                    
-                    for ( i = 0; i < _stateCount; i++ ) {
-                        
-                        sum1 = sum2 = 0.;
-                        
-                        for ( j = 0; j < _stateCount; j++) {
-                            sum1 += matrices1[w] * partials1[v + j];
-                            sum2 += matrices2[w] * partials2[v + j];
-                            
-                            w++;
+                if(maxPartial < threshold && maxPartial > 0.){
+                    int exponent;
+                    std::frexp(maxPartial, &exponent);
+                    const T factor = std::ldexp(1.0, -exponent);
+                    for(int c = 0; c < _rateCount; c++){
+                        T* p = partials + c*rateOffset + k*_stateCount;
+                        for(int i = 0; i < _stateCount; i++){
+                            p[i] *= factor;
                         }
-                        
-                        *pPartials++ = sum1 * sum2;
                     }
-                    v += _stateCount;
+                    logScaleFactors[k] += exponent * M_LN2;
                 }
             }
-
         }
         
-        void SimpleFlexibleTreeLikelihood::updatePartials(int partialsIndex, int partialsIndex1, int matrixIndex1, int partialsIndex2, int matrixIndex2 ) {
-            if( _partials[partialsIndex1].size() > 0 ){
-                if(  _partials[partialsIndex2].size() > 0 ){
-                    updatePartialsUndefinedUndefined(_partials[partialsIndex1].data(),
-                                                     _matrices[matrixIndex1].data(),
-                                                     _partials[partialsIndex2].data(),
-                                                     _matrices[matrixIndex2].data(),
-                                                     _partials[partialsIndex].data());
-                }
-                else {
-                    updatePartialsKnownUndefined(_states[partialsIndex2].data(),
-                                                 _matrices[matrixIndex2].data(),
-                                                 _partials[partialsIndex1].data(),
-                                                 _matrices[matrixIndex1].data(),
-                                                 _partials[partialsIndex].data());
-                }
-                
+        void SimpleFlexibleTreeLikelihood::accumulateScaleFactors(int index, int partialsIndex1, int partialsIndex2){
+            const double* logScaleFactors1 = _logScaleFactors[partialsIndex1];
+            const double* logScaleFactors2 = _logScaleFactors[partialsIndex2];
+            double* logScaleFactors = _patternLogScaleFactors[index];
+            for(int k = 0; k < _patternCount; k++){
+                logScaleFactors[k] = logScaleFactors1[k] + logScaleFactors2[k];
             }
-            else{
-                if(  _partials[partialsIndex2].size() > 0 ){
-                    updatePartialsKnownUndefined(_states[partialsIndex1].data(),
-                                                 _matrices[matrixIndex1].data(),
-                                                 _partials[partialsIndex2].data(),
-                                                 _matrices[matrixIndex2].data(),
-                                                 _partials[partialsIndex].data());
-                    
-                }
-                else{
-                    updatePartialsKnownKnown(_states[partialsIndex1].data(),
-                                             _matrices[matrixIndex1].data(),
-                                             _states[partialsIndex2].data(),
-                                             _matrices[matrixIndex2].data(),
-                                             _partials[partialsIndex].data());
-                }
+        }
+        
+        double SimpleFlexibleTreeLikelihood::sumLogLikelihood(int index) const{
+            const double* patternLikelihood = _patternLikelihoods[index];
+            const double* logScaleFactors = _patternLogScaleFactors[index];
+            double logLnl = 0.;
+            for ( int i = 0; i < _patternCount; i++) {
+                logLnl += (log(patternLikelihood[i]) + logScaleFactors[i]) * _patternWeights[i];
             }
+            return logLnl;
+        }
+        
+        void SimpleFlexibleTreeLikelihood::sumDerivatives(double* d1, double* d2) const{
+            const double* patternLikelihood = _patternLikelihoods[1];
+            const double* d1PatternLikelihood = _patternLikelihoods[2];
+            const double* d2PatternLikelihood = _patternLikelihoods[3];
             
-            if ( _useScaleFactors ) {
-                //SingleTreeLikelihood_scalePartials( tlk, nodeIndex3);
+            // The derivatives share the scale factors of the likelihood, which cancel out in the ratios
+            double dd1 = 0.;
+            double dd2 = 0.;
+            for ( int i = 0; i < _patternCount; i++) {
+                const double ratio = d1PatternLikelihood[i]/patternLikelihood[i];
+                dd1 += ratio * _patternWeights[i];
+                dd2 += (d2PatternLikelihood[i]/patternLikelihood[i] - ratio*ratio) * _patternWeights[i];
+            }
+            if(d1 != NULL){
+                *d1 = dd1;
+            }
+            if(d2 != NULL){
+                *d2 = dd2;
             }
-            operationCallCount++;
         }
         
-        void SimpleFlexibleTreeLikelihood::calculateBranchLikelihood(double* rootPartials, const double* attachmentPartials, const double* pendantPartials, const double* pendantMatrices, const double* weights){
-            memset(rootPartials, 0, sizeof(double)*_stateCount*_patternCount);
-            int v = 0;
-            for(int l = 0; l < _rateCount; l++) {
-                int u = 0;
-                const double weight = weights[l];
-                for(int k = 0; k < _patternCount; k++) {
-                    int w = l * _matrixSize;
-                    const double* partialsChildPtr = pendantPartials+v;
-                    for(int i = 0; i < _stateCount; i++) {
-                        const double* transMatrixPtr = &pendantMatrices[w];
-                        double sum = 0.0;
-                        for (int j = 0; j < _stateCount; j++) {
-                            sum += transMatrixPtr[j] * partialsChildPtr[j];
-                        }
-                        rootPartials[u] += sum * attachmentPartials[v] * weight;
-                        u++;
-                        v++;
-                        w += _stateCount;
-                    }
-                }
+        void SimpleFlexibleTreeLikelihood::calculateBranchLikelihood(double* rootPartials, int attachmentPartialsIndex, int pendantIndex, int pendantMatrixIndex, const double* weights){
+            if(_singlePrecision){
+                calculateBranchLikelihood(_singlePartials, _singleKernels, rootPartials, attachmentPartialsIndex, pendantIndex, pendantMatrixIndex, weights);
+            }
+            else{
+                calculateBranchLikelihood(_partials, _kernels, rootPartials, attachmentPartialsIndex, pendantIndex, pendantMatrixIndex, weights);
             }
-                
-            
         }
         
-        void SimpleFlexibleTreeLikelihood::calculateBranchLikelihood(double* rootPartials, const double* attachmentPartials, const int* pendantStates, const double* pendantMatrices, const double* weights){
-            memset(rootPartials, 0, sizeof(double)*_stateCount*_patternCount);
-            int v = 0;
-            for(int l = 0; l < _rateCount; l++) {
-                int u = 0; // Index in resulting product-partials (summed over categories)
-                const double weight = weights[l];
-                for(int k = 0; k < _patternCount; k++) {
-                    int w =  l * _matrixSize + pendantStates[k];
-                    for(int i = 0; i < _stateCount; i++) {
-                        rootPartials[u] += pendantMatrices[w] * attachmentPartials[v] * weight;
-                        u++;
-                        v++;
-                        w += _stateCount;
-                    }
-                }
+        template<typename T>
+        void SimpleFlexibleTreeLikelihood::calculateBranchLikelihood(const std::vector<T*>& partials, const BasicLikelihoodKernels<T>& kernels, double* rootPartials, int attachmentPartialsIndex, int pendantIndex, int pendantMatrixIndex, const double* weights){
+            if(partials[pendantIndex] != nullptr){
+                kernels.calculateBranchLikelihood(rootPartials, partials[attachmentPartialsIndex], partials[pendantIndex], _matrices[pendantMatrixIndex], weights, _stateCount, _rateCount, _patternCount);
+            }
+            else{
+                kernels.calculateBranchLikelihoodStates(rootPartials, partials[attachmentPartialsIndex], _states[pendantIndex].data(), _matrices[pendantMatrixIndex], weights, _stateCount, _rateCount, _patternCount);
             }
-            
         }
         
-        double SimpleFlexibleTreeLikelihood::calculateLogLikelihood(const bpp::Node& distal, std::string taxonName, double pendantLength, double distalLength, double proximalLength){
-            
+        void SimpleFlexibleTreeLikelihood::prepareAttachment(){
+            // The log likelihood of the tree is computed along, so that it is never stale once the partials are up to date
             if(_updatePartials){
-                traverse(_tree->getRootNode());
-                traverseUpper(_tree->getRootNode());
-                _updatePartials = _updateUpperPartials = false;
-                _needNodeUpdate.assign(_totalNodeCount, false);
+                calculateLogLikelihood();
             }
-            else if(_updateUpperPartials){
-                traverseUpper(_tree->getRootNode());
+            if(_updateUpperPartials){
+                traverseUpper();
                 _updateUpperPartials = false;
             }
+        }
+        
+        double SimpleFlexibleTreeLikelihood::calculateLogLikelihood(const bpp::Node& distal, size_t taxonIndex, double pendantLength, double distalLength, double proximalLength){
+            
+            prepareAttachment();
             
             const int distalIndex = distal.getId();
-            const int indexTaxon = std::find(_taxa.begin(), _taxa.end(), taxonName) - _taxa.begin();
+            const int indexTaxon = taxonIndex;
             const int tmpPartialsIndex = _totalNodeCount*2;
             
             // update matrices of pendant, proximal and distal
-            int offset = 0;
-            for(int c = 0; c < _rateCount; c++){
-                offset = c * _matrixSize;
-                const bpp::Matrix<double>& matrixPendant  = _model->getPij_t(pendantLength*_rateDist->getCategory(c));
-                for(int i = 0; i < _stateCount; i++){
-                    const vector<double>& row = matrixPendant.row(i);
-                    std::copy(row.begin(), row.end(), _matrices[_totalNodeCount].data()+offset);
-                    offset += _stateCount;
-                }
-                offset = c * _matrixSize;
-                const bpp::Matrix<double>& matrixDistal  = _model->getPij_t(distalLength*_rateDist->getCategory(c));
-                for(int i = 0; i < _stateCount; i++){
-                    const vector<double>& row = matrixDistal.row(i);
-                    std::copy(row.begin(), row.end(), _matrices[_totalNodeCount+1].data()+offset);
-                    offset += _stateCount;
-                }
-                offset = c * _matrixSize;
-                const bpp::Matrix<double>& matrixProximal  = _model->getPij_t(proximalLength*_rateDist->getCategory(c));
-                for(int i = 0; i < _stateCount; i++){
-                    const vector<double>& row = matrixProximal.row(i);
-                    std::copy(row.begin(), row.end(), _matrices[_totalNodeCount+2].data()+offset);
-                    offset += _stateCount;
-                }
-                
-            }
+            updateMatrices(_totalNodeCount, pendantLength);
+            updateMatrices(_totalNodeCount+1, distalLength);
+            updateMatrices(_totalNodeCount+2, proximalLength);
             
             // Distal and Proximal  are attached
             updatePartials(tmpPartialsIndex, distalIndex, _totalNodeCount+1, _upperPartialsIndexes[distalIndex], _totalNodeCount+2);
@@ -519,324 +464,584 @@ namespace sts {
             const vector<double>& weights = _rateDist->getProbabilities();
 
 
-            if(_partials[_totalNodeCount].size()>0){
-                calculateBranchLikelihood(_rootPartials[1].data(), _partials[tmpPartialsIndex].data(), _partials[indexTaxon].data(), _matrices[_totalNodeCount].data(), weights.data());
-            }
-            else{
-                calculateBranchLikelihood(_rootPartials[1].data(), _partials[tmpPartialsIndex].data(), _states[indexTaxon].data(), _matrices[_totalNodeCount].data(), weights.data());
-            }
+            calculateBranchLikelihood(_rootPartials[1], tmpPartialsIndex, indexTaxon, _totalNodeCount, weights.data());
             
-            double* patternLikelihood = _patternLikelihoods[1].data();
-			calculatePatternLikelihood(_rootPartials[1].data(), _model->getFrequencies().data(), patternLikelihood);
-                
-            double logLnl = 0.;
-            for ( int i = 0; i < _patternCount; i++) {
-                logLnl += log(patternLikelihood[i]) * _patternWeights[i];
-            }
+            calculatePatternLikelihood(_rootPartials[1], _model->getFrequencies().data(), _patternLikelihoods[1]);
+            accumulateScaleFactors(1, tmpPartialsIndex, indexTaxon);
             
-            return logLnl;
+            return sumLogLikelihood(1);
         }
         
-        void SimpleFlexibleTreeLikelihood::calculatePendantDerivatives(const bpp::Node& distal, std::string taxonName, double pendantLength, double distalLength, double proximalLength, double* d1, double* d2){
-            if(_updatePartials){
-                traverse(_tree->getRootNode());
-                traverseUpper(_tree->getRootNode());
-                _updatePartials = _updateUpperPartials = false;
-                _needNodeUpdate.assign(_totalNodeCount, false);
-            }
-            else if(_updateUpperPartials){
-                traverseUpper(_tree->getRootNode());
-                _updateUpperPartials = false;
-            }
+        double SimpleFlexibleTreeLikelihood::calculatePendantDerivatives(const bpp::Node& distal, size_t taxonIndex, double pendantLength, double distalLength, double proximalLength, double* d1, double* d2){
+            prepareAttachment();
             
-            const vector<double>& weights = _rateDist->getProbabilities();
+            const int distalIndex = distal.getId();
+            const int indexTaxon = taxonIndex;
+            const int tmpPartialsIndex = _totalNodeCount*2;
+            
+            // Temporary transition matrices
+            const int tempMatrixPendant = _totalNodeCount;
+            const int tempMatrixDistal = _totalNodeCount + 1;
+            const int tempMatrixProximal =  _totalNodeCount + 2;
+            const int tempMatrixPendantd1 =  _totalNodeCount + 3;
+            const int tempMatrixPendantd2 =  _totalNodeCount + 4;
+            
+            updateMatrices(tempMatrixDistal, distalLength);
+            updateMatrices(tempMatrixProximal, proximalLength);
+            updateMatrices(tempMatrixPendant, pendantLength, tempMatrixPendantd1, tempMatrixPendantd2);
+            
+            // Proximal and distal  are attached
+            updatePartials(tmpPartialsIndex, distalIndex, tempMatrixDistal, _upperPartialsIndexes[distalIndex], tempMatrixProximal);
+            
+            return calculateBranchDerivatives(tmpPartialsIndex, indexTaxon, tempMatrixPendant, tempMatrixPendantd1, tempMatrixPendantd2, d1, d2);
+        }
+        
+        double SimpleFlexibleTreeLikelihood::calculateDistalDerivatives(const bpp::Node& distal, size_t taxonIndex, double pendantLength, double distalLength, double proximalLength, double* d1, double* d2){
+            
+            prepareAttachment();
             
             const int distalIndex = distal.getId();
-            const int indexTaxon = std::find(_taxa.begin(), _taxa.end(), taxonName) - _taxa.begin();
+            const int indexTaxon = taxonIndex;
             const int tmpPartialsIndex = _totalNodeCount*2;
             
-            // update matrices of pendant, proximal and distal
-            int offset = 0;
-            for(int c = 0; c < _rateCount; c++){
-                offset = c * _matrixSize;
-                const bpp::Matrix<double>& matrixDistal  = _model->getPij_t(distalLength*_rateDist->getCategory(c));
-                for(int i = 0; i < _stateCount; i++){
-                    const vector<double>& row = matrixDistal.row(i);
-                    std::copy(row.begin(), row.end(), _matrices[_totalNodeCount+1].data()+offset);
-                    offset += _stateCount;
-                }
-                
-                offset = c * _matrixSize;
-                const bpp::Matrix<double>& matrixProximal  = _model->getPij_t(proximalLength*_rateDist->getCategory(c));
-                for(int i = 0; i < _stateCount; i++){
-                    const vector<double>& row = matrixProximal.row(i);
-                    std::copy(row.begin(), row.end(), _matrices[_totalNodeCount+2].data()+offset);
-                    offset += _stateCount;
-                }
-                
+            // Temporary transition matrices
+            const int tempMatrixPendant = _totalNodeCount;
+            const int tempMatrixDistal = _totalNodeCount + 1;
+            const int tempMatrixProximal =  _totalNodeCount + 2;
+            const int tempMatrixDistald1 =  _totalNodeCount + 3;
+            const int tempMatrixDistald2 =  _totalNodeCount + 4;
+            
+            updateMatrices(tempMatrixPendant, pendantLength);
+            updateMatrices(tempMatrixProximal, proximalLength);
+            updateMatrices(tempMatrixDistal, distalLength, tempMatrixDistald1, tempMatrixDistald2);
+            
+            // Pendant and proximal  are attached
+            updatePartials(tmpPartialsIndex, indexTaxon, tempMatrixPendant, _upperPartialsIndexes[distalIndex], tempMatrixProximal);
+            
+            return calculateBranchDerivatives(tmpPartialsIndex, distalIndex, tempMatrixDistal, tempMatrixDistald1, tempMatrixDistald2, d1, d2);
+        }
+        
+        std::vector<std::vector<double> > SimpleFlexibleTreeLikelihood::calculateAttachmentLogLikelihoods(const std::vector<AttachmentLocation>& locations, size_t taxonIndex, const std::vector<double>& pendantLengths){
+            prepareAttachment();
+            
+            const int indexTaxon = taxonIndex;
+            // Taxa without partials go through the unbatched calculation
+            if((_singlePrecision && _singlePartials[indexTaxon] == nullptr) || (!_singlePrecision && _partials[indexTaxon] == nullptr)){
+                return FlexibleTreeLikelihood::calculateAttachmentLogLikelihoods(locations, taxonIndex, pendantLengths);
             }
             
-            offset = 0;
-            for(int c = 0; c < _rateCount; c++){
-                offset = c * _matrixSize;
-                const bpp::Matrix<double>& dMatrix  = _model->getdPij_dt(pendantLength*_rateDist->getCategory(c));
-                for(int i = 0; i < _stateCount; i++){
-                    const vector<double>& row = dMatrix.row(i);
-                    std::copy(row.begin(), row.end(), _matrices[_totalNodeCount].data()+offset);
-                    offset += _stateCount;
-                }
-                for (int k = 0; k < _matrixSize; k++) {
-                    _matrices[_totalNodeCount][c*_matrixSize+k] *= _rateDist->getCategory(c);
+            // One partials buffer per pendant length
+            if(_pendantPartialsOffsets.size() < pendantLengths.size()){
+                const size_t partialsSize = _rateCount*_stateCount*_patternCount;
+                _pendantArena.clear();
+                _pendantPartialsOffsets.resize(pendantLengths.size());
+                for(auto it = _pendantPartialsOffsets.begin(); it != _pendantPartialsOffsets.end(); ++it){
+                    *it = _singlePrecision ? _pendantArena.reserve<float>(partialsSize) : _pendantArena.reserve<double>(partialsSize);
                 }
+                _pendantArena.allocate();
             }
             
-            // Proximal and distal  are attached
-            updatePartials(tmpPartialsIndex, distalIndex, _totalNodeCount+1, _upperPartialsIndexes[distalIndex], _totalNodeCount+2);
-            
-            if(_partials[_totalNodeCount].size()>0){
-                calculateBranchLikelihood(_rootPartials[2].data(), _partials[tmpPartialsIndex].data(), _partials[indexTaxon].data(), _matrices[_totalNodeCount].data(), weights.data());
+            std::vector<std::vector<double> > logLikelihoods(locations.size(), std::vector<double>(pendantLengths.size()));
+            if(_singlePrecision){
+                calculateAttachmentLogLikelihoods(_singlePartials, _singleKernels, locations, indexTaxon, pendantLengths, logLikelihoods);
             }
             else{
-                calculateBranchLikelihood(_rootPartials[2].data(), _partials[tmpPartialsIndex].data(), _states[indexTaxon].data(), _matrices[_totalNodeCount].data(), weights.data());
+                calculateAttachmentLogLikelihoods(_partials, _kernels, locations, indexTaxon, pendantLengths, logLikelihoods);
             }
+            return logLikelihoods;
+        }
+        
+        template<typename T>
+        void SimpleFlexibleTreeLikelihood::calculateAttachmentLogLikelihoods(const std::vector<T*>& partials, const BasicLikelihoodKernels<T>& kernels, const std::vector<AttachmentLocation>& locations, int indexTaxon, const std::vector<double>& pendantLengths, std::vector<std::vector<double> >& logLikelihoods){
+            const vector<double>& weights = _rateDist->getProbabilities();
+            const double* frequencies = _model->getFrequencies().data();
+            const int tmpPartialsIndex = _totalNodeCount*2;
             
+            // Temporary transition matrices
+            const int tempMatrixPendant = _totalNodeCount;
+            const int tempMatrixDistal = _totalNodeCount + 1;
+            const int tempMatrixProximal =  _totalNodeCount + 2;
             
-            double* patternLikelihood = _patternLikelihoods[1].data();
-            double* d1PatternLikelihood = _patternLikelihoods[2].data();
-            
-            calculatePatternLikelihood(_rootPartials[2].data(), _model->getFrequencies().data(), d1PatternLikelihood);
-            
-            if(d1 != NULL){
-                double dd1 = 0.;
-                for ( int i = 0; i < _patternCount; i++) {
-                    dd1 += (d1PatternLikelihood[i]/patternLikelihood[i]) * _patternWeights[i];
-                }
-                *d1 = dd1;
+            // Partials of the taxon at the attachment point, shared by all the locations
+            for(size_t j = 0; j < pendantLengths.size(); j++){
+                updateMatrices(tempMatrixPendant, pendantLengths[j]);
+                kernels.transformPartials(partials[indexTaxon], _matrices[tempMatrixPendant], _pendantArena.at<T>(_pendantPartialsOffsets[j]), _stateCount, _rateCount, _patternCount);
             }
             
-            if(d2 != NULL){
-                offset = 0;
-                for(int c = 0; c < _rateCount; c++){
-                    const double rate = _rateDist->getCategory(c);
-                    offset = c * _matrixSize;
-                    const bpp::Matrix<double>& d2Matrix = _model->getd2Pij_dt2(pendantLength*rate);
-                    for(int i = 0; i < _stateCount; i++){
-                        const vector<double>& row = d2Matrix.row(i);
-                        std::copy(row.begin(), row.end(), _matrices[_totalNodeCount].data()+offset);
-                        offset += _stateCount;
-                    }
-                    for (int k = 0; k < _matrixSize; k++) {
-                        _matrices[_totalNodeCount][c*_matrixSize+k] *= rate*rate;
-                    }
-                }
+            for(size_t i = 0; i < locations.size(); i++){
+                const bpp::Node& distal = *locations[i].node;
+                const int distalIndex = distal.getId();
                 
-                // Proximal and distal  are attached
-                updatePartials(tmpPartialsIndex, distalIndex, _totalNodeCount+1, _upperPartialsIndexes[distalIndex], _totalNodeCount+2);
+                updateMatrices(tempMatrixDistal, locations[i].distal);
+                updateMatrices(tempMatrixProximal, distal.getDistanceToFather()-locations[i].distal);
                 
+                // Distal and Proximal  are attached, once for all the pendant lengths
+                updatePartials(tmpPartialsIndex, distalIndex, tempMatrixDistal, _upperPartialsIndexes[distalIndex], tempMatrixProximal);
+                accumulateScaleFactors(1, tmpPartialsIndex, indexTaxon);
                 
-                if(_partials[_totalNodeCount].size()>0){
-                    calculateBranchLikelihood(_rootPartials[3].data(), _partials[tmpPartialsIndex].data(), _partials[indexTaxon].data(), _matrices[_totalNodeCount].data(), weights.data());
+                for(size_t j = 0; j < pendantLengths.size(); j++){
+                    kernels.calculateProductLikelihood(_patternLikelihoods[1], partials[tmpPartialsIndex], _pendantArena.at<T>(_pendantPartialsOffsets[j]), weights.data(), frequencies, _stateCount, _rateCount, _patternCount);
+                    logLikelihoods[i][j] = sumLogLikelihood(1);
+                }
+            }
+        }
+        
+        // Partials of the attachment point for the last distal length and of the taxon at the top of the pendant branch
+        // for the last pendant length, each recomputed only when its branch length changes
+        class SimpleFlexibleTreeLikelihood::CachedAttachmentContext : public AttachmentContext{
+            
+        public:
+            CachedAttachmentContext(SimpleFlexibleTreeLikelihood& calculator, const bpp::Node& distal, int indexTaxon):
+            calculator(calculator), distal(distal), indexTaxon(indexTaxon),
+            revision(calculator._treeRevision), joinDistal(std::numeric_limits<double>::quiet_NaN()), pendant(std::numeric_limits<double>::quiet_NaN()){
+                const size_t partialsSize = calculator._rateCount*calculator._stateCount*calculator._patternCount;
+                if(calculator._singlePrecision){
+                    joinOffset = arena.reserve<float>(partialsSize);
+                    pendantOffset = arena.reserve<float>(partialsSize);
                 }
                 else{
-                    calculateBranchLikelihood(_rootPartials[3].data(), _partials[tmpPartialsIndex].data(), _states[indexTaxon].data(), _matrices[_totalNodeCount].data(), weights.data());
+                    joinOffset = arena.reserve<double>(partialsSize);
+                    pendantOffset = arena.reserve<double>(partialsSize);
                 }
-                
-                
-                double* d2PatternLikelihood = _patternLikelihoods[3].data();
-                calculatePatternLikelihood(_rootPartials[3].data(), _model->getFrequencies().data(), d2PatternLikelihood);
-                
-                double dd2 = 0.;
-                for ( int i = 0; i < _patternCount; i++) {
-                    dd2 += ((d2PatternLikelihood[i]*patternLikelihood[i]  - d1PatternLikelihood[i]*d1PatternLikelihood[i])/(patternLikelihood[i]*patternLikelihood[i])) * _patternWeights[i];
+                joinScaleFactorsOffset = arena.reserve<double>(calculator._patternCount);
+                arena.allocate();
+            }
+            
+            virtual double logLikelihood(double pendantLength, double distalLength){
+                calculator.prepareAttachment();
+                // The tree or the model changed since the partials were cached
+                if(revision != calculator._treeRevision){
+                    revision = calculator._treeRevision;
+                    joinDistal = pendant = std::numeric_limits<double>::quiet_NaN();
                 }
-                *d2 = dd2;
+                if(calculator._singlePrecision){
+                    return calculator.calculateLogLikelihood(calculator._singlePartials, calculator._singleKernels, *this, pendantLength, distalLength);
+                }
+                return calculator.calculateLogLikelihood(calculator._partials, calculator._kernels, *this, pendantLength, distalLength);
             }
-        }
-        
-        void SimpleFlexibleTreeLikelihood::calculateDistalDerivatives(const bpp::Node& distal, std::string taxonName, double pendantLength, double distalLength, double proximalLength, double* d1, double* d2){
             
-            if(_updatePartials){
-                traverse(_tree->getRootNode());
-                traverseUpper(_tree->getRootNode());
-                _updatePartials = _updateUpperPartials = false;
-                _needNodeUpdate.assign(_totalNodeCount, false);
+            virtual double pendantDerivatives(double pendantLength, double distalLength, double* d1, double* d2){
+                return calculator.calculatePendantDerivatives(distal, indexTaxon, pendantLength, distalLength, distal.getDistanceToFather()-distalLength, d1, d2);
             }
-            else if(_updateUpperPartials){
-                traverseUpper(_tree->getRootNode());
-                _updateUpperPartials = false;
+            
+            virtual double distalDerivatives(double pendantLength, double distalLength, double* d1, double* d2){
+                return calculator.calculateDistalDerivatives(distal, indexTaxon, pendantLength, distalLength, distal.getDistanceToFather()-distalLength, d1, d2);
             }
             
-            const vector<double>& weights = _rateDist->getProbabilities();
+            SimpleFlexibleTreeLikelihood& calculator;
+            const bpp::Node& distal;
+            int indexTaxon;
             
-            const int distalIndex = distal.getId();
-            const int indexTaxon = std::find(_taxa.begin(), _taxa.end(), taxonName) - _taxa.begin();
-            const int tmpPartialsIndex = _totalNodeCount*2;
+            size_t revision;
+            // Branch lengths of the cached partials, NaN when there are none
+            double joinDistal;
+            double pendant;
+            
+            AlignedArena arena;
+            size_t joinOffset;
+            size_t pendantOffset;
+            size_t joinScaleFactorsOffset;
+        };
+        
+        std::unique_ptr<AttachmentContext> SimpleFlexibleTreeLikelihood::createAttachmentContext(const bpp::Node& distal, size_t taxonIndex){
+            const int indexTaxon = taxonIndex;
+            // Taxa without partials are evaluated from scratch every time
+            if((_singlePrecision && _singlePartials[indexTaxon] == nullptr) || (!_singlePrecision && _partials[indexTaxon] == nullptr)){
+                return FlexibleTreeLikelihood::createAttachmentContext(distal, taxonIndex);
+            }
+            return std::unique_ptr<AttachmentContext>(new CachedAttachmentContext(*this, distal, indexTaxon));
+        }
+        
+        template<typename T>
+        double SimpleFlexibleTreeLikelihood::calculateLogLikelihood(const std::vector<T*>& partials, const BasicLikelihoodKernels<T>& kernels, CachedAttachmentContext& context, double pendantLength, double distalLength){
+            const vector<double>& weights = _rateDist->getProbabilities();
+            const double* frequencies = _model->getFrequencies().data();
+            T* joinPartials = context.arena.at<T>(context.joinOffset);
+            T* pendantPartials = context.arena.at<T>(context.pendantOffset);
+            double* joinLogScaleFactors = context.arena.at<double>(context.joinScaleFactorsOffset);
             
             // Temporary transition matrices
             const int tempMatrixPendant = _totalNodeCount;
             const int tempMatrixDistal = _totalNodeCount + 1;
             const int tempMatrixProximal =  _totalNodeCount + 2;
             
-            // update matrices of pendant, proximal and distal
-            int offset = 0;
-            for(int c = 0; c < _rateCount; c++){
-                const double rate = _rateDist->getCategory(c);
-                offset = c * _matrixSize;
-                const bpp::Matrix<double>& matrixPendant  = _model->getPij_t(pendantLength*rate);
-                for(int i = 0; i < _stateCount; i++){
-                    const vector<double>& row = matrixPendant.row(i);
-                    std::copy(row.begin(), row.end(), _matrices[tempMatrixPendant].data()+offset);
-                    offset += _stateCount;
-                }
-
-                offset = c * _matrixSize;
-                const bpp::Matrix<double>& matrixProximal  = _model->getPij_t(proximalLength*rate);
-                for(int i = 0; i < _stateCount; i++){
-                    const vector<double>& row = matrixProximal.row(i);
-                    std::copy(row.begin(), row.end(), _matrices[tempMatrixProximal].data()+offset);
-                    offset += _stateCount;
-                }
+            if(pendantLength != context.pendant){
+                updateMatrices(tempMatrixPendant, pendantLength);
+                kernels.transformPartials(partials[context.indexTaxon], _matrices[tempMatrixPendant], pendantPartials, _stateCount, _rateCount, _patternCount);
+                context.pendant = pendantLength;
             }
-
-            offset = 0;
+            
+            if(distalLength != context.joinDistal){
+                const int distalIndex = context.distal.getId();
+                const int upperIndex = _upperPartialsIndexes[distalIndex];
+                updateMatrices(tempMatrixDistal, distalLength);
+                updateMatrices(tempMatrixProximal, context.distal.getDistanceToFather()-distalLength);
+                
+                // Distal and Proximal  are attached
+                kernels.updatePartialsUndefinedUndefined(partials[distalIndex], _matrices[tempMatrixDistal], partials[upperIndex], _matrices[tempMatrixProximal], joinPartials, _stateCount, _rateCount, _patternCount);
+                scalePartials(joinPartials, joinLogScaleFactors, _logScaleFactors[distalIndex], _logScaleFactors[upperIndex]);
+                operationCallCount++;
+                context.joinDistal = distalLength;
+            }
+            
+            kernels.calculateProductLikelihood(_patternLikelihoods[1], joinPartials, pendantPartials, weights.data(), frequencies, _stateCount, _rateCount, _patternCount);
+            
+            const double* taxonLogScaleFactors = _logScaleFactors[context.indexTaxon];
+            double* logScaleFactors = _patternLogScaleFactors[1];
+            for(int k = 0; k < _patternCount; k++){
+                logScaleFactors[k] = joinLogScaleFactors[k] + taxonLogScaleFactors[k];
+            }
+            return sumLogLikelihood(1);
+        }
+        
+        void SimpleFlexibleTreeLikelihood::updateMatrices(int matrixIndex, double branchLength, int d1MatrixIndex, int d2MatrixIndex){
+            if(d1MatrixIndex >= 0){
+                updateMatrices(_matrices[matrixIndex], branchLength, _matrices[d1MatrixIndex], _matrices[d2MatrixIndex]);
+            }
+            else{
+                updateMatrices(_matrices[matrixIndex], branchLength);
+            }
+        }
+        
+        void SimpleFlexibleTreeLikelihood::updateMatrices(double* matrices, double branchLength, double* d1Matrices, double* d2Matrices){
             for(int c = 0; c < _rateCount; c++){
                 const double rate = _rateDist->getCategory(c);
-                offset = c * _matrixSize;
-                const bpp::Matrix<double>& dMatrix  = _model->getdPij_dt(distalLength*rate);
-                for(int i = 0; i < _stateCount; i++){
-                    const vector<double>& row = dMatrix.row(i);
-                    std::copy(row.begin(), row.end(), _matrices[tempMatrixDistal].data()+offset);
-                    offset += _stateCount;
-                }
-                for (int k = 0; k < _matrixSize; k++) {
-                    _matrices[tempMatrixDistal][c*_matrixSize+k] *= rate;
+                const int offset = c * _matrixSize;
+                _matrixProvider.transitionMatrix(branchLength*rate, matrices+offset);
+                
+                // Derivatives with respect to the branch length, not to the scaled branch length
+                if(d1Matrices != nullptr){
+                    double* d1Matrix = d1Matrices+offset;
+                    double* d2Matrix = d2Matrices+offset;
+                    _matrixProvider.transitionMatrixDerivatives(branchLength*rate, d1Matrix, d2Matrix);
+                    for(int k = 0; k < _matrixSize; k++){
+                        d1Matrix[k] *= rate;
+                        d2Matrix[k] *= rate*rate;
+                    }
                 }
             }
+        }
+        
+        double SimpleFlexibleTreeLikelihood::calculateBranchDerivatives(int attachmentPartialsIndex, int pendantIndex, int matrixIndex, int d1MatrixIndex, int d2MatrixIndex, double* d1, double* d2){
+            if(_singlePrecision){
+                calculateBranchDerivatives(_singlePartials, _singleKernels, attachmentPartialsIndex, pendantIndex, matrixIndex, d1MatrixIndex, d2MatrixIndex);
+            }
+            else{
+                calculateBranchDerivatives(_partials, _kernels, attachmentPartialsIndex, pendantIndex, matrixIndex, d1MatrixIndex, d2MatrixIndex);
+            }
+            accumulateScaleFactors(1, attachmentPartialsIndex, pendantIndex);
             
-            // Pendant and proximal  are attached
-            updatePartials(tmpPartialsIndex, indexTaxon, tempMatrixPendant, _upperPartialsIndexes[distalIndex], tempMatrixProximal);
-            
-            if(_partials[distalIndex].size()>0){
-                calculateBranchLikelihood(_rootPartials[2].data(), _partials[tmpPartialsIndex].data(), _partials[distalIndex].data(), _matrices[tempMatrixDistal].data(), weights.data());
+            sumDerivatives(d1, d2);
+            return sumLogLikelihood(1);
+        }
+        
+        template<typename T>
+        void SimpleFlexibleTreeLikelihood::calculateBranchDerivatives(const std::vector<T*>& partials, const BasicLikelihoodKernels<T>& kernels, int attachmentPartialsIndex, int pendantIndex, int matrixIndex, int d1MatrixIndex, int d2MatrixIndex){
+            const vector<double>& weights = _rateDist->getProbabilities();
+            const double* frequencies = _model->getFrequencies().data();
+            if(partials[pendantIndex] != nullptr){
+                kernels.calculateBranchDerivatives(_patternLikelihoods[1], _patternLikelihoods[2], _patternLikelihoods[3], partials[attachmentPartialsIndex], partials[pendantIndex], _matrices[matrixIndex], _matrices[d1MatrixIndex], _matrices[d2MatrixIndex], weights.data(), frequencies, _stateCount, _rateCount, _patternCount);
             }
             else{
-                calculateBranchLikelihood(_rootPartials[2].data(), _partials[tmpPartialsIndex].data(), _states[distalIndex].data(), _matrices[tempMatrixDistal].data(), weights.data());
+                kernels.calculateBranchDerivativesStates(_patternLikelihoods[1], _patternLikelihoods[2], _patternLikelihoods[3], partials[attachmentPartialsIndex], _states[pendantIndex].data(), _matrices[matrixIndex], _matrices[d1MatrixIndex], _matrices[d2MatrixIndex], weights.data(), frequencies, _stateCount, _rateCount, _patternCount);
             }
+        }
+        
+        double SimpleFlexibleTreeLikelihood::calculateLogLikelihood(){
             
+            if(!_updatePartials)return _logLnl;
             
-            double* patternLikelihood = _patternLikelihoods[1].data();
-            double* d1PatternLikelihood = _patternLikelihoods[2].data();
+            traverse();
             
-            calculatePatternLikelihood(_rootPartials[2].data(), _model->getFrequencies().data(), d1PatternLikelihood);
+            const int rootIndex = _flatTree.root();
+            integratePartials(rootIndex, _rateDist->getProbabilities().data(), _rootPartials[0]);
             
-            if(d1 != NULL){
-                double dd1 = 0.;
-                for ( int i = 0; i < _patternCount; i++) {
-                    dd1 += (d1PatternLikelihood[i]/patternLikelihood[i]) * _patternWeights[i];
-                }
-                *d1 = dd1;
+            calculatePatternLikelihood(_rootPartials[0], _model->getFrequencies().data(), _patternLikelihoods[0]);
+            std::copy(_logScaleFactors[rootIndex], _logScaleFactors[rootIndex]+_patternCount, _patternLogScaleFactors[0]);
+            
+            _logLnl = sumLogLikelihood(0);
+            
+            _needNodeUpdate.assign(_totalNodeCount, false);
+            _updatePartials = false;
+            _updateUpperPartials = true;
+            
+            return _logLnl;
+        }
+        
+        void SimpleFlexibleTreeLikelihood::initialize(const bpp::SubstitutionModel &model, const bpp::DiscreteDistribution& rateDist, bpp::TreeTemplate<bpp::Node>& tree){
+            AbstractFlexibleTreeLikelihood::initialize(model, rateDist, tree);
+            _matrixProvider.setModel(model);
+            clearCheckpoint();
+            _treeRevision++;
+        }
+        
+        class SimpleFlexibleTreeLikelihood::SavedState : public LikelihoodState{
+            
+        public:
+            const bpp::SubstitutionModel* model;
+            const bpp::DiscreteDistribution* rateDist;
+            bool singlePrecision;
+            int patternCount;
+            
+            // Tree the buffers were computed for
+            FlatTree tree;
+            // Indexed by node id, null for the nodes that are not in the tree
+            std::vector<NodeBuffer> partials;
+            std::vector<NodeBuffer> matrices;
+            
+            double logLikelihood;
+        };
+        
+        void SimpleFlexibleTreeLikelihood::initialize(const bpp::SubstitutionModel &model, const bpp::DiscreteDistribution& rateDist, bpp::TreeTemplate<bpp::Node>& tree, const std::shared_ptr<const LikelihoodState>& state){
+            initialize(model, rateDist, tree);
+            
+            const SavedState* saved = dynamic_cast<const SavedState*>(state.get());
+            if(!_keepStates || saved == nullptr || saved->model != &model || saved->rateDist != &rateDist || saved->singlePrecision != _singlePrecision || saved->patternCount != _patternCount || saved->partials.size() != _partialsBuffers.size()){
+                return;
             }
             
-            if(d2 != NULL){
-                offset = 0;
-                for(int c = 0; c < _rateCount; c++){
-                    const double rate = _rateDist->getCategory(c);
-                    offset = c * _matrixSize;
-                    const bpp::Matrix<double>& d2MatrixPendant  = _model->getd2Pij_dt2(distalLength*rate);
-                    for(int i = 0; i < _stateCount; i++){
-                        const vector<double>& row = d2MatrixPendant.row(i);
-                        std::copy(row.begin(), row.end(), _matrices[tempMatrixDistal].data()+offset);
-                        offset += _stateCount;
-                    }
-                    for (int k = 0; k < _matrixSize; k++) {
-                        _matrices[tempMatrixDistal][c*_matrixSize+k] *= rate*rate;
-                    }
+            _needNodeUpdate.assign(_totalNodeCount, false);
+            for(int nodeId : _flatTree.postOrder()){
+                if(!saved->tree.contains(nodeId)){
+                    continue;
                 }
-                
-                // Pendant and proximal  are attached
-                updatePartials(tmpPartialsIndex, indexTaxon, tempMatrixPendant, _upperPartialsIndexes[distalIndex], tempMatrixProximal);
-                
-                
-                if(_partials[distalIndex].size()>0){
-	                calculateBranchLikelihood(_rootPartials[3].data(), _partials[tmpPartialsIndex].data(), _partials[distalIndex].data(), _matrices[tempMatrixDistal].data(), weights.data());
-				}
-				else{
-					calculateBranchLikelihood(_rootPartials[3].data(), _partials[tmpPartialsIndex].data(), _states[distalIndex].data(), _matrices[tempMatrixDistal].data(), weights.data());
-				}
-                
-
-                double* d2PatternLikelihood = _patternLikelihoods[3].data();
-                calculatePatternLikelihood(_rootPartials[3].data(), _model->getFrequencies().data(), d2PatternLikelihood);
-            
-                double dd2 = 0.;
-                for ( int i = 0; i < _patternCount; i++) {
-                    dd2 += ((d2PatternLikelihood[i]*patternLikelihood[i]  - d1PatternLikelihood[i]*d1PatternLikelihood[i])/(patternLikelihood[i]*patternLikelihood[i])) * _patternWeights[i];
+                if(nodeId >= _sequenceCount){
+                    setPartialsBuffer(nodeId, saved->partials[nodeId]);
+                }
+                if(saved->matrices[nodeId] != nullptr){
+                    setMatrixBuffer(nodeId, saved->matrices[nodeId]);
                 }
-                *d2 = dd2;
             }
             
+            if(!flagChangedNodes(saved->tree)){
+                _logLnl = saved->logLikelihood;
+                _updatePartials = false;
+            }
         }
         
-        double SimpleFlexibleTreeLikelihood::calculateLogLikelihood(){
+        void SimpleFlexibleTreeLikelihood::updateTree(){
+            clearCheckpoint();
+            std::swap(_flatTree, _previousTree);
+            _flatTree.assign(*_tree);
             
-            if(!_updatePartials)return _logLnl;
+            _nodeCount = _tree->getNumberOfNodes();
+            _leafCount = _tree->getNumberOfLeaves();
+            _internalNodeCount = _nodeCount - _leafCount;
             
-            traverse(_tree->getRootNode());
+            _treeRevision++;
+            _updateUpperPartials = true;
+            if(flagChangedNodes(_previousTree)){
+                _updatePartials = true;
+            }
+        }
+        
+        bool SimpleFlexibleTreeLikelihood::flagChangedNodes(const FlatTree& previous){
+            bool flagged = false;
+            for(int nodeId : _flatTree.postOrder()){
+                const int parentId = _flatTree.parent(nodeId);
+                if(!previous.contains(nodeId) || previous.parent(nodeId) != parentId ||
+                   (parentId != FlatTree::NONE && previous.branchLength(nodeId) != _flatTree.branchLength(nodeId))){
+                    _needNodeUpdate[nodeId] = true;
+                }
+                flagged |= _needNodeUpdate[nodeId];
+            }
+            return flagged;
+        }
+        
+        std::shared_ptr<const LikelihoodState> SimpleFlexibleTreeLikelihood::saveState(){
+            if(!_keepStates || _tree == nullptr){
+                return nullptr;
+            }
             
-            _logLnl = 0;
+            if(_updatePartials){
+                calculateLogLikelihood();
+            }
             
-            for(int pass = 0; pass < 2; pass++){
-                
-                if (_useScaleFactors) {
-//                    if (_recomputeScaleFactors) {
-//                        cumulateScaleBufferIndex = _internalNodeCount;
-//                        beagle_check(beagleResetScaleFactors(_beagleInstance, cumulateScaleBufferIndex));
-//                        
-//                        beagle_check(beagleAccumulateScaleFactors(_beagleInstance,
-//                                                                  _scaleBufferIndices.data(),
-//                                                                  _internalNodeCount,
-//                                                                  cumulateScaleBufferIndex));
-//                    }
-//                    else {
-//                        cumulateScaleBufferIndex = _internalNodeCount;
-//                    }
+            std::shared_ptr<SavedState> state = std::make_shared<SavedState>();
+            state->model = _model;
+            state->rateDist = _rateDist;
+            state->singlePrecision = _singlePrecision;
+            state->patternCount = _patternCount;
+            state->tree = _flatTree;
+            state->partials.resize(_partialsBuffers.size());
+            state->matrices.resize(_matrixBuffers.size());
+            for(int nodeId : _flatTree.postOrder()){
+                state->partials[nodeId] = _partialsBuffers[nodeId];
+                if(_flatTree.parent(nodeId) != FlatTree::NONE){
+                    state->matrices[nodeId] = _matrixBuffers[nodeId];
                 }
-                integratePartials(_partials[_tree->getRootNode()->getId()].data(), _rateDist->getProbabilities().data(), _rootPartials[0].data());
-                
-                calculatePatternLikelihood(_rootPartials[0].data(), _model->getFrequencies().data(), _patternLikelihoods[0].data());
-                
-                const double* patternLikelihood = _patternLikelihoods[0].data();
-                _logLnl = 0;
-                for ( int i = 0; i < _patternCount; i++) {
-                    _logLnl += log(patternLikelihood[i]) * _patternWeights[i];
-                }
-
-                if (std::isnan(_logLnl) || std::isinf(_logLnl)) {
-                    _useScaleFactors = true;
-                    _recomputeScaleFactors = true;
-                    
-                    traverse(_tree->getRootNode());
+            }
+            state->logLikelihood = _logLnl;
+            return state;
+        }
+        
+        void SimpleFlexibleTreeLikelihood::ownPartials(int nodeIndex){
+            // The buffer as of the checkpoint is left as is for rollback
+            if(_checkpoint && !_isShadowedPartials[nodeIndex]){
+                swapShadowPartials(nodeIndex);
+                _isShadowedPartials[nodeIndex] = true;
+                _shadowedPartials.push_back(nodeIndex);
+            }
+            if(!_keepStates){
+                return;
+            }
+            if(_partialsBuffers[nodeIndex].use_count() > 1){
+                setPartialsBuffer(nodeIndex, createPartialsBuffer());
+            }
+            else{
+                // Pairs with the release of the last other owner, possibly on another thread
+                std::atomic_thread_fence(std::memory_order_acquire);
+            }
+        }
+        
+        void SimpleFlexibleTreeLikelihood::ownMatrices(int nodeIndex){
+            if(_checkpoint && !_isShadowedMatrices[nodeIndex]){
+                swapShadowMatrices(nodeIndex);
+                _isShadowedMatrices[nodeIndex] = true;
+                _shadowedMatrices.push_back(nodeIndex);
+            }
+            if(!_keepStates){
+                return;
+            }
+            if(_matrixBuffers[nodeIndex].use_count() > 1){
+                setMatrixBuffer(nodeIndex, createMatrixBuffer());
+            }
+            else{
+                std::atomic_thread_fence(std::memory_order_acquire);
+            }
+        }
+        
+        SimpleFlexibleTreeLikelihood::NodeBuffer SimpleFlexibleTreeLikelihood::createPartialsBuffer() const{
+            NodeBuffer buffer = std::make_shared<AlignedArena>();
+            const size_t partialsSize = _rateCount*_stateCount*_patternCount;
+            if(_singlePrecision){
+                buffer->reserve<float>(partialsSize);
+            }
+            else{
+                buffer->reserve<double>(partialsSize);
+            }
+            buffer->reserve<double>(_patternCount);
+            buffer->allocate();
+            return buffer;
+        }
+        
+        SimpleFlexibleTreeLikelihood::NodeBuffer SimpleFlexibleTreeLikelihood::createMatrixBuffer() const{
+            NodeBuffer buffer = std::make_shared<AlignedArena>();
+            buffer->reserve<double>(_rateCount*_matrixSize);
+            buffer->allocate();
+            return buffer;
+        }
+        
+        void SimpleFlexibleTreeLikelihood::setPartialsBuffer(int nodeIndex, const NodeBuffer& buffer){
+            _partialsBuffers[nodeIndex] = buffer;
+            if(_singlePrecision){
+                _singlePartials[nodeIndex] = buffer->at<float>(_bufferPartialsOffset);
+            }
+            else{
+                _partials[nodeIndex] = buffer->at<double>(_bufferPartialsOffset);
+            }
+            _logScaleFactors[nodeIndex] = buffer->at<double>(_bufferScaleFactorsOffset);
+        }
+        
+        void SimpleFlexibleTreeLikelihood::setMatrixBuffer(int nodeIndex, const NodeBuffer& buffer){
+            _matrixBuffers[nodeIndex] = buffer;
+            _matrices[nodeIndex] = buffer->at<double>(0);
+        }
+        
+        void SimpleFlexibleTreeLikelihood::swapShadowPartials(int nodeIndex){
+            if(_shadowPartialsBuffers[nodeIndex] == nullptr){
+                const NodeBuffer& buffer = _shadowPartialsBuffers[nodeIndex] = createPartialsBuffer();
+                if(_singlePrecision){
+                    _shadowSinglePartials[nodeIndex] = buffer->at<float>(_bufferPartialsOffset);
                 }
                 else{
-                    break;
+                    _shadowPartials[nodeIndex] = buffer->at<double>(_bufferPartialsOffset);
                 }
-                
+                _shadowLogScaleFactors[nodeIndex] = buffer->at<double>(_bufferScaleFactorsOffset);
             }
+            if(_singlePrecision){
+                std::swap(_singlePartials[nodeIndex], _shadowSinglePartials[nodeIndex]);
+            }
+            else{
+                std::swap(_partials[nodeIndex], _shadowPartials[nodeIndex]);
+            }
+            std::swap(_logScaleFactors[nodeIndex], _shadowLogScaleFactors[nodeIndex]);
+            // Without keepStates the shadow buffer only owns the memory, which may be either of the two
+            if(_keepStates){
+                std::swap(_partialsBuffers[nodeIndex], _shadowPartialsBuffers[nodeIndex]);
+            }
+        }
+        
+        void SimpleFlexibleTreeLikelihood::swapShadowMatrices(int nodeIndex){
+            if(_shadowMatrixBuffers[nodeIndex] == nullptr){
+                _shadowMatrixBuffers[nodeIndex] = createMatrixBuffer();
+                _shadowMatrices[nodeIndex] = _shadowMatrixBuffers[nodeIndex]->at<double>(0);
+            }
+            std::swap(_matrices[nodeIndex], _shadowMatrices[nodeIndex]);
+            if(_keepStates){
+                std::swap(_matrixBuffers[nodeIndex], _shadowMatrixBuffers[nodeIndex]);
+            }
+        }
+        
+        void SimpleFlexibleTreeLikelihood::updateNode(const bpp::Node& node){
+            if(_checkpoint && node.hasFather()){
+                _checkpointBranchLengths.emplace_back(node.getId(), _flatTree.branchLength(node.getId()));
+            }
+            _treeRevision++;
+            AbstractFlexibleTreeLikelihood::updateNode(node);
+        }
+        
+        void SimpleFlexibleTreeLikelihood::checkpoint(){
+            if(_updatePartials){
+                calculateLogLikelihood();
+            }
+            clearCheckpoint();
+            _checkpoint = true;
+            _checkpointLogLnl = _logLnl;
+        }
+        
+        void SimpleFlexibleTreeLikelihood::rollback(){
+            if(!_checkpoint){
+                AbstractFlexibleTreeLikelihood::rollback();
+                return;
+            }
+            
+            for(int nodeId : _shadowedPartials){
+                swapShadowPartials(nodeId);
+            }
+            for(int nodeId : _shadowedMatrices){
+                swapShadowMatrices(nodeId);
+            }
+            // The first recorded length of a branch is the one as of the checkpoint
+            for(auto it = _checkpointBranchLengths.rbegin(); it != _checkpointBranchLengths.rend(); ++it){
+                _flatTree.setBranchLength(it->first, it->second);
+            }
+            _logLnl = _checkpointLogLnl;
+            clearCheckpoint();
             
+            _treeRevision++;
             _needNodeUpdate.assign(_totalNodeCount, false);
             _updatePartials = false;
             _updateUpperPartials = true;
-            
-            return _logLnl;
         }
         
-        void SimpleFlexibleTreeLikelihood::updateNode(const bpp::Node& node){
-            _needNodeUpdate[node.getId()] = true;
-            _updatePartials = true;
-            _updateUpperPartials = true;
+        void SimpleFlexibleTreeLikelihood::clearCheckpoint(){
+            for(int nodeId : _shadowedPartials){
+                _isShadowedPartials[nodeId] = false;
+            }
+            for(int nodeId : _shadowedMatrices){
+                _isShadowedMatrices[nodeId] = false;
+            }
+            _shadowedPartials.clear();
+            _shadowedMatrices.clear();
+            _checkpointBranchLengths.clear();
+            _checkpoint = false;
         }
         
         void SimpleFlexibleTreeLikelihood::updateAllNodes(){
+            clearCheckpoint();
+            _treeRevision++;
+            _flatTree.assign(*_tree);
             _needNodeUpdate.assign(_needNodeUpdate.size(), true);
             _updatePartials = true;
             _updateUpperPartials = true;
@@ -2,9 +2,14 @@
 #define SimpleFlexibleTreeLikelihood_hpp
 
 #include <stdio.h>
+#include <memory>
+#include <utility>
 #include <vector>
 
 #include "abstract_flexible_treelikelihood.h"
+#include "aligned_arena.h"
+#include "likelihood_kernels.h"
+#include "transition_matrix_provider.h"
 
 #include <Bpp/Phyl/TreeTemplate.h>
 #include <Bpp/Phyl/SitePatterns.h>
@@ -17,21 +22,78 @@ namespace sts {
         class SimpleFlexibleTreeLikelihood : public AbstractFlexibleTreeLikelihood{
             
         public:
-            SimpleFlexibleTreeLikelihood(const bpp::SitePatterns& patterns, const bpp::SubstitutionModel &model, const bpp::DiscreteDistribution& rateDist, bool useAmbiguities=true);
+            /// \param keepStates Give the lower partials and the matrices of each node their own buffers, so that
+            /// #saveState can share them with the caller instead of returning null
+            SimpleFlexibleTreeLikelihood(const bpp::SitePatterns& patterns, const bpp::SubstitutionModel &model, const bpp::DiscreteDistribution& rateDist, bool useAmbiguities=true, SimdBackend simd=SimdBackend::AUTO, bool singlePrecision=false, bool hugePages=false, bool keepStates=false);
             
             virtual ~SimpleFlexibleTreeLikelihood(){}
             
+            virtual void initialize(const bpp::SubstitutionModel &model, const bpp::DiscreteDistribution& rateDist, bpp::TreeTemplate<bpp::Node>& tree);
+            
+            /// The buffers of the nodes whose parent and branch length are those of the saved tree are restored without
+            /// copy, the partials of the nodes above them being recomputed by the next evaluation
+            virtual void initialize(const bpp::SubstitutionModel &model, const bpp::DiscreteDistribution& rateDist, bpp::TreeTemplate<bpp::Node>& tree, const std::shared_ptr<const LikelihoodState>& state);
+            
+            /// Brings the partials up to date first. Buffers shared with a state are copied on write: the calculator
+            /// allocates a new buffer for a node instead of updating one that a state holds.
+            virtual std::shared_ptr<const LikelihoodState> saveState();
+            
+            /// Compares the tree with the copy the partials were computed for
+            virtual void updateTree();
+            
             virtual double calculateLogLikelihood();
             
-            virtual double calculateLogLikelihood(const bpp::Node& distal, std::string taxonName, double pendantLength, double distalLength, double proximalLength);
+            virtual double calculateLogLikelihood(const bpp::Node& distal, size_t taxonIndex, double pendantLength, double distalLength, double proximalLength);
             
-            virtual void calculatePendantDerivatives(const bpp::Node& distal, std::string taxonName, double pendantLength, double distalLength, double proximalLength, double* d1, double* d2);
+            virtual std::vector<std::vector<double> > calculateAttachmentLogLikelihoods(const std::vector<AttachmentLocation>& locations, size_t taxonIndex, const std::vector<double>& pendantLengths);
+            
+            virtual double calculatePendantDerivatives(const bpp::Node& distal, size_t taxonIndex, double pendantLength, double distalLength, double proximalLength, double* d1, double* d2);
 
-            virtual void calculateDistalDerivatives(const bpp::Node& distal, std::string taxonName, double pendantLength, double distalLength, double proximalLength, double* d1, double* d2);
+            virtual double calculateDistalDerivatives(const bpp::Node& distal, size_t taxonIndex, double pendantLength, double distalLength, double proximalLength, double* d1, double* d2);
+            
+            /// The context keeps the partials at the attachment point and those of the taxon at the end of the pendant
+            /// branch, so that only the side whose branch length changed is recomputed
+            virtual std::unique_ptr<AttachmentContext> createAttachmentContext(const bpp::Node& distal, size_t taxonIndex);
+            
+            using FlexibleTreeLikelihood::calculateLogLikelihood;
+            using FlexibleTreeLikelihood::calculateAttachmentLogLikelihoods;
+            using FlexibleTreeLikelihood::calculatePendantDerivatives;
+            using FlexibleTreeLikelihood::calculateDistalDerivatives;
+            using FlexibleTreeLikelihood::createAttachmentContext;
             
-            void updateNode(const bpp::Node& node);
+            /// Also records the previous length while a checkpoint is active
+            virtual void updateNode(const bpp::Node& node);
+            
+            /// \brief Subsequent updates of the partials and matrices of a node go to a shadow buffer
+            ///
+            /// The buffers as of the checkpoint are left untouched until the next checkpoint or initialization, so that
+            /// #rollback only swaps them back. Evaluating a move of a few branch lengths then costs an update of the
+            /// partials on their path to the root, and rejecting it none.
+            virtual void checkpoint();
+            
+            /// Swaps back the buffers of the nodes updated since #checkpoint and restores the branch lengths notified by
+            /// #updateNode. Topology changes notified by #updateTree end the checkpoint and cannot be undone this way.
+            virtual void rollback();
             
             void updateAllNodes();
+            
+            /// Name of the kernels selected for this instance
+            const char* kernelsName() const { return _singlePrecision ? _singleKernels.name : _kernels.name; }
+            
+            /// Instruction set of the kernels selected for this instance
+            SimdBackend simdBackend() const { return _singlePrecision ? _singleKernels.backend : _kernels.backend; }
+            
+            /// Whether partials are stored as float
+            bool singlePrecision() const { return _singlePrecision; }
+            
+            /// Whether the storage of partials and matrices is backed by huge pages
+            bool hugePages() const { return _arena.hugePages(); }
+            
+            /// Whether #saveState returns the partials of the tree
+            bool keepStates() const { return _keepStates; }
+            
+            /// Source of the transition matrices
+            const TransitionMatrixProvider& matrixProvider() const { return _matrixProvider; }
     
         protected:
             
@@ -39,28 +101,62 @@ namespace sts {
             
             virtual void setPartials(const bpp::SiteContainer& sites);
             
-            bool traverse(const bpp::Node* node);
-            
-            void traverseUpper(const bpp::Node* node);
+            /// Update the matrices of the flagged nodes and the partials above them, in post-order
+            void traverse();
             
-            void calculateBranchLikelihood(double* rootPartials, const double* attachmentPartials, const double* pendantPartials, const double* pendantMatrices, const double* weights);
+            /// Bring the lower and upper partials up to date before attaching a taxon
+            void prepareAttachment();
             
-            void calculateBranchLikelihood(double* rootPartials, const double* attachmentPartials, const int* pendantStates, const double* pendantMatrices, const double* weights);
-                
+            void traverseUpper();
             
+            void calculateBranchLikelihood(double* rootPartials, int attachmentPartialsIndex, int pendantIndex, int pendantMatrixIndex, const double* weights);
             
             void calculatePatternLikelihood( const double *partials, const double *frequencies, double *outLogLikelihoods)const;
             
-            void integratePartials( const double *inPartials, const double *proportions, double *outPartials )const;
+            void integratePartials( int partialsIndex, const double *proportions, double *outPartials )const;
             
-            void updatePartialsKnownKnown( const int *states1, const double *matrices1, const int *states2, const double *matrices2, double *partials )const;
+            void updatePartials(int partialsIndex, int partialsIndex1, int matrixIndex1, int partialsIndex2, int matrixIndex2 );
             
-            void updatePartialsKnownUndefined( const int *states1, const double *matrices1, const double *partials2, const double *matrices2, double *partials3 )const;
+            /// Rescale the patterns of \c partialsIndex whose partials are about to underflow. The scale factors of the
+            /// children are accumulated so that each buffer carries the scale factors of its whole subtree.
+            void scalePartials(int partialsIndex, int partialsIndex1, int partialsIndex2);
             
-            void updatePartialsUndefinedUndefined( const double *partials1, const double *matrices1, const double *partials2, const double *matrices2, double *partials3 )const;            
+            /// Store the log scale factors of the product of two partials buffers in \c _patternLogScaleFactors[index]
+            void accumulateScaleFactors(int index, int partialsIndex1, int partialsIndex2);
             
-            void updatePartials(int partialsIndex, int partialsIndex1, int matrixIndex1, int partialsIndex2, int matrixIndex2 );
+            /// Sum of the log pattern likelihoods in \c _patternLikelihoods[index], scale factors included
+            double sumLogLikelihood(int index) const;
+            
+            /// Sum of the first and second derivatives of the log pattern likelihoods stored in \c _patternLikelihoods
+            void sumDerivatives(double* d1, double* d2) const;
+            
+            /// Fill the transition matrices of a branch of length \c branchLength for every rate category, and their
+            /// first and second derivatives with respect to \c branchLength unless \c d1MatrixIndex is negative
+            void updateMatrices(int matrixIndex, double branchLength, int d1MatrixIndex=-1, int d2MatrixIndex=-1);
+            
+            /// Same as above with buffers that are not indexed by the calculator
+            void updateMatrices(double* matrices, double branchLength, double* d1Matrices=nullptr, double* d2Matrices=nullptr);
+            
+            /// \brief Flag the nodes of the tree that are not in \c previous, that moved or whose branch changed
+            ///
+            /// The partials above them are recomputed by the next traversal, those of a node whose subtree did not
+            /// change still hold.
+            /// \return Whether any node of the tree is flagged
+            bool flagChangedNodes(const FlatTree& previous);
+            
+            /// Make the lower partials of node \c nodeIndex writable, replacing their buffer if a state shares it, or with
+            /// its shadow on the first update since #checkpoint
+            void ownPartials(int nodeIndex);
+            
+            /// Make the matrices of the branch above node \c nodeIndex writable, like #ownPartials
+            void ownMatrices(int nodeIndex);
+            
+            /// Forget the changes recorded since #checkpoint, keeping the current buffers
+            void clearCheckpoint();
             
+            /// Log likelihood and its derivatives with respect to the length of the branch between the attachment
+            /// partials and \c pendantIndex, in a single pass over the patterns
+            double calculateBranchDerivatives(int attachmentPartialsIndex, int pendantIndex, int matrixIndex, int d1MatrixIndex, int d2MatrixIndex, double* d1, double* d2);
             
 //            void updateUpperPartialsKnown( const double *matrix_upper, const double *partials_upper, const double *matrix_lower, const int *states, double *partials ) const;
 //            
@@ -77,22 +173,117 @@ namespace sts {
 //            void calculatePatternLikelihoodLeaf( const double *partials_upper, const int* states, const double *matrix_lower, const double *proportions, double *pattern_lk ) const;
             
         private:
-//            void calculateDerivatives(const bpp::Node& distal, std::string taxonName, int index, double pendantLength, double distalLength, double proximalLength, double* d1, double* d2);
+            class CachedAttachmentContext;
+            class SavedState;
+            
+            typedef std::shared_ptr<AlignedArena> NodeBuffer;
+            
+            NodeBuffer createPartialsBuffer() const;
+            NodeBuffer createMatrixBuffer() const;
+            void setPartialsBuffer(int nodeIndex, const NodeBuffer& buffer);
+            void setMatrixBuffer(int nodeIndex, const NodeBuffer& buffer);
+            
+            /// Exchange the current buffers of node \c nodeIndex with its shadow buffers, allocated on first use
+            void swapShadowPartials(int nodeIndex);
+            void swapShadowMatrices(int nodeIndex);
+            
+            // Implementations for either storage type of the partials
+            
+            template<typename T>
+            void setPartials(const std::vector<T*>& partials, const bpp::SiteContainer& sites);
+            
+            template<typename T>
+            void updatePartials(const std::vector<T*>& partials, const BasicLikelihoodKernels<T>& kernels, int partialsIndex, int partialsIndex1, int matrixIndex1, int partialsIndex2, int matrixIndex2);
+            
+            template<typename T>
+            void calculateBranchLikelihood(const std::vector<T*>& partials, const BasicLikelihoodKernels<T>& kernels, double* rootPartials, int attachmentPartialsIndex, int pendantIndex, int pendantMatrixIndex, const double* weights);
+            
+            template<typename T>
+            void calculateBranchDerivatives(const std::vector<T*>& partials, const BasicLikelihoodKernels<T>& kernels, int attachmentPartialsIndex, int pendantIndex, int matrixIndex, int d1MatrixIndex, int d2MatrixIndex);
+            
+            template<typename T>
+            void calculateAttachmentLogLikelihoods(const std::vector<T*>& partials, const BasicLikelihoodKernels<T>& kernels, const std::vector<AttachmentLocation>& locations, int indexTaxon, const std::vector<double>& pendantLengths, std::vector<std::vector<double> >& logLikelihoods);
+            
+            template<typename T>
+            void scalePartials(const std::vector<T*>& partials, int partialsIndex, int partialsIndex1, int partialsIndex2);
+            
+            template<typename T>
+            void scalePartials(T* partials, double* logScaleFactors, const double* logScaleFactors1, const double* logScaleFactors2) const;
+            
+            template<typename T>
+            double calculateLogLikelihood(const std::vector<T*>& partials, const BasicLikelihoodKernels<T>& kernels, CachedAttachmentContext& context, double pendantLength, double distalLength);
+            
+//            void calculateDerivatives(const bpp::Node& distal, size_t taxonIndex, int index, double pendantLength, double distalLength, double proximalLength, double* d1, double* d2);
             
             std::vector<std::vector<int> > _states;
+            
+            TransitionMatrixProvider _matrixProvider;
+            
+            LikelihoodKernels _kernels;
+            SingleLikelihoodKernels _singleKernels;
+            
+            // Partials are stored in _singlePartials instead of _partials
+            bool _singlePrecision;
 
             double _logLnl;
             
+            // Incremented whenever the partials of the tree may change, attachment contexts of older revisions are stale
+            size_t _treeRevision;
+            
             int _matrixSize;
             
             std::vector<double> _patternWeights;
             
-            std::vector<std::vector<double> > _matrices;
-            std::vector<std::vector<double> > _partials;
-            std::vector<std::vector<double> > _rootPartials;
-            std::vector<std::vector<double> > _patternLikelihoods;
+            // Every buffer below points into _arena
+            AlignedArena _arena;
+            
+            std::vector<double*> _matrices;
+            std::vector<double*> _partials;
+            std::vector<float*> _singlePartials;
+            std::vector<double*> _rootPartials;
+            std::vector<double*> _patternLikelihoods;
+            
+            // Log scale factors of each partials buffer, accumulated over the subtree below it (or above it for upper partials)
+            std::vector<double*> _logScaleFactors;
+            // Log scale factors of the first two entries of _patternLikelihoods, the derivatives use those of the second
+            std::vector<double*> _patternLogScaleFactors;
             
             std::vector<int> _upperPartialsIndexes;
+            
+            // Tree the partials were computed for, while updateTree compares it with the new one
+            FlatTree _previousTree;
+            
+            // With keepStates, the lower partials of the internal nodes and the matrices of the branches are not in
+            // _arena but in buffers of their own, indexed by node id, which saved states share
+            bool _keepStates;
+            std::vector<NodeBuffer> _partialsBuffers;
+            std::vector<NodeBuffer> _matrixBuffers;
+            // Offsets of the partials and of the log scale factors in a buffer of _partialsBuffers
+            size_t _bufferPartialsOffset;
+            size_t _bufferScaleFactorsOffset;
+            
+            // Nodes whose partials or matrices were swapped with their shadows since checkpoint, and the branch lengths
+            // before each updateNode, undone by rollback
+            bool _checkpoint;
+            double _checkpointLogLnl;
+            std::vector<int> _shadowedPartials;
+            std::vector<int> _shadowedMatrices;
+            std::vector<char> _isShadowedPartials;
+            std::vector<char> _isShadowedMatrices;
+            std::vector<std::pair<int, double> > _checkpointBranchLengths;
+            
+            // Second set of buffers of each node, indexed by node id and exchanged with the current ones, together with
+            // their owner under keepStates
+            std::vector<double*> _shadowPartials;
+            std::vector<float*> _shadowSinglePartials;
+            std::vector<double*> _shadowLogScaleFactors;
+            std::vector<double*> _shadowMatrices;
+            std::vector<NodeBuffer> _shadowPartialsBuffers;
+            std::vector<NodeBuffer> _shadowMatrixBuffers;
+            
+            // Partials of the taxon at the end of each pendant branch of a batched attachment
+            AlignedArena _pendantArena;
+            std::vector<size_t> _pendantPartialsOffsets;
         };
     }
 }
@@ -12,18 +12,26 @@
 #include "smctc.hh"
 #include "json/json.h"
 
+#include <sys/stat.h>
+
 #include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
 #include <iterator>
 #include <limits>
 #include <memory>
 #include <string>
+#include <unordered_map>
 #include <unordered_set>
 #include <vector>
 #include <set>
 
 #include "sts_config.h"
+#include "adaptive_population.h"
 #include "branch_length_prior.h"
+#include "checkpoint.h"
 #include "simple_flexible_tree_likelihood.h"
 #ifndef NO_BEAGLE
 #include "beagle_flexible_tree_likelihood.h"
@@ -34,6 +42,7 @@
 #include "uniform_length_online_add_sequence_move.h"
 #include "gsl.h"
 #include "guided_online_add_sequence_move.h"
+#include "insertion_order.h"
 #include "lcfit_online_add_sequence_move.h"
 #include "online_smc_init.h"
 #include "multiplier_mcmc_move.h"
@@ -139,11 +148,38 @@ int main(int argc, char **argv)
                                             false, 0.99, &resample_range, cmd);
     cl::ValueArg<int> particleFactor("p", "particle-factor", "Multiple of number of trees to determine particle count",
                                       false, 1, "#", cmd);
+    cl::SwitchArg adaptiveParticles("", "adaptive-particles", "Grow or shrink the particle count before each sequence "
+                                    "is added, from the ESS and the number of distinct particles", cmd, false);
+    cl::ValueArg<size_t> minParticles("", "min-particles", "Fewest particles with --adaptive-particles "
+                                      "[default: a quarter of the initial count]", false, 0, "N", cmd);
+    cl::ValueArg<size_t> maxParticles("", "max-particles", "Most particles with --adaptive-particles "
+                                      "[default: four times the initial count]", false, 0, "N", cmd);
     cl::ValueArg<int> mcmcCount("m", "mcmc-moves", "Number of MCMC moves per-particle",
                                  false, 0, "#", cmd);
     cl::ValueArg<int> treeSmcCount("", "tree-moves",
                                    "Number of additional tree-altering SMC moves per added sequence",
                                    false, 0, "#", cmd);
+    std::vector<std::string> orderNames { "alignment", "placement" };
+    cl::ValuesConstraint<std::string> allowedOrders(orderNames);
+    cl::ValueArg<std::string> insertionOrder("", "insertion-order", "Order in which sequences are added: that of the "
+                                             "alignment, or the most confidently placed on the reference trees first",
+                                             false, "alignment", &allowedOrders, cmd);
+    cl::ValueArg<size_t> orderTrees("", "order-trees", "Number of reference trees on which sequences are placed "
+                                    "to order them", false, 10, "N", cmd);
+    cl::ValueArg<string> daemonPath("", "daemon", "Keep running after the query sequences are added, waiting for more "
+                                    "in FASTA format on the FIFO <path>, created if needed. Each batch written to it is "
+                                    "added to the particles in memory and the JSON output replaced. An empty batch stops.",
+                                    false, "", "path", cmd);
+    cl::ValueArg<size_t> batchSize("k", "batch-size", "Number of sequences added per generation, one after the other "
+                                   "in each particle, before resampling and the other moves", false, 1, "k", cmd);
+    cl::ValueArg<string> checkpointPath("", "checkpoint", "Save the state of the run to <path> every few sequence "
+                                        "additions, replacing the previous state. The run continues from each "
+                                        "checkpoint with newly seeded generators, so its results differ from those "
+                                        "of the same seed without checkpoints", false, "", "path", cmd);
+    cl::ValueArg<size_t> checkpointEvery("", "checkpoint-every", "Number of sequence additions (of --batch-size "
+                                         "sequences) between checkpoints", false, 10, "N", cmd);
+    cl::SwitchArg resume("", "resume", "Continue the run saved to the --checkpoint file, with the same options",
+                         cmd, false);
 #ifdef SMCTC_HAVE_BGL
     cl::ValueArg<string> particleGraphPath("g", "particle-graph",
                                            "Path to write particle graph in graphviz format",
@@ -162,6 +198,19 @@ int main(int argc, char **argv)
                                    false, 0, "N", cmd);
     cl::SwitchArg fribbleResampling("", "fribble", "Use fribblebits resampling method", cmd, false);
     cl::MultiArg<double> pendantBranchLengths("", "pendant-bl", "Guided move: attempt attachment with pendant bl X", false, "X", cmd);
+    std::vector<std::string> simdNames { "auto", "none", "sse2", "avx2", "avx512" };
+    cl::ValuesConstraint<std::string> allowedSimdNames(simdNames);
+    cl::ValueArg<std::string> simdBackend("", "simd", "Instruction set of the built-in likelihood kernels (without BEAGLE)",
+                                          false, "auto", &allowedSimdNames, cmd);
+    cl::SwitchArg singlePrecision("", "single-precision", "Store partials of the built-in likelihood kernels as float "
+                                  "(without BEAGLE)", cmd, false);
+    cl::SwitchArg hugePages("", "huge-pages", "Back the storage of the built-in likelihood calculator with huge pages "
+                            "when available (without BEAGLE)", cmd, false);
+    cl::SwitchArg keepPartials("", "keep-partials", "Keep the partials of each particle between moves, shared by its "
+                               "copies, so that only the partials above a change are recomputed (without BEAGLE)",
+                               cmd, false);
+    cl::ValueArg<size_t> threads("", "threads", "Number of threads adding sequences to the particles, "
+                                 "each with its own likelihood and parsimony calculators", false, 1, "N", cmd);
 
     cl::UnlabeledValueArg<string> alignmentPath(
         "alignment", "Input fasta alignment.", true, "", "fasta", cmd);
@@ -268,10 +317,10 @@ int main(int argc, char **argv)
 
     // TODO: Other distributions
     const double expPriorMean = blPriorExpMean.getValue();
-    std::function<double(double)> exponentialPrior = [expPriorMean](const double d) {
-        return std::log(gsl_ran_exponential_pdf(d, expPriorMean));
-    };
 
+    // Parameters are not sampled, all the particles share the same model and rate distribution
+    std::shared_ptr<const bpp::SubstitutionModel> particleModel(model.clone());
+    std::shared_ptr<const bpp::DiscreteDistribution> particleRateDist(rate_dist.clone());
     vector<TreeParticle> particles;
     particles.reserve(trees.size());
     for(unique_ptr<Tree>& tree : trees) {
@@ -279,213 +328,565 @@ int main(int argc, char **argv)
                                                            tree->getRootNode()->getSon(1)->getDistanceToFather());
         tree->getRootNode()->getSon(1)->setDistanceToFather(0.0);
         
-        particles.emplace_back(std::unique_ptr<bpp::SubstitutionModel>(model.clone()),
+        particles.emplace_back(particleModel,
                                std::unique_ptr<bpp::TreeTemplate<bpp::Node>>(tree.release()),
-                               std::unique_ptr<bpp::DiscreteDistribution>(rate_dist.clone()),
+                               particleRateDist,
                                &ref);
     }
 
-    std::unique_ptr<bpp::SitePatterns> _patterns(new bpp::SitePatterns(sites.get()));
-    
+    if(threads.getValue() == 0) {
+        cerr << "error: at least one thread is required" << endl;
+        return 1;
+    }
+    const size_t threadCount = fribbleResampling.getValue() ? 1 : threads.getValue();
+    if(threadCount != threads.getValue())
+        clog << "fribble resampling adds sequences on a single thread" << endl;
+
+    if(resume.getValue() && !checkpointPath.isSet()) {
+        cerr << "error: --resume requires --checkpoint" << endl;
+        return 1;
+    }
+    if(checkpointPath.isSet()) {
+        if(checkpointEvery.getValue() == 0) {
+            cerr << "error: --checkpoint-every must be positive" << endl;
+            return 1;
+        }
+        if(daemonPath.isSet() || fribbleResampling.getValue()) {
+            cerr << "error: --checkpoint cannot be combined with --daemon or --fribble" << endl;
+            return 1;
+        }
+#ifdef SMCTC_HAVE_BGL
+        // The graph of a sampler starts at the last checkpoint
+        if(particleGraphPath.isSet()) {
+            cerr << "error: --checkpoint cannot be combined with --particle-graph" << endl;
+            return 1;
+        }
+#endif
+    }
+
+    if(daemonPath.isSet() && mkfifo(daemonPath.getValue().c_str(), 0600) != 0 && errno != EEXIST) {
+        cerr << "error: cannot create " << daemonPath.getValue() << ": " << strerror(errno) << endl;
+        return 1;
+    }
+
+    // A single run, unless new sequences keep coming as a daemon
+    const size_t initialParticleCount = particleFactor.getValue() * trees.size();
+    vector<string> queryNames = query.getSequencesNames();
+    for(size_t run = 0; ; run++) {
+        std::unique_ptr<bpp::SitePatterns> _patterns(new bpp::SitePatterns(sites.get()));
+
+        // One calculator per worker, the first one also serves the moves that run serially
+        std::vector<shared_ptr<FlexibleTreeLikelihood>> calculators;
+        for(size_t w = 0; w < threadCount; w++) {
 #ifndef NO_BEAGLE
-    shared_ptr<FlexibleTreeLikelihood> beagleLike(new BeagleFlexibleTreeLikelihood(*_patterns.get(), model, rate_dist));
+            calculators.emplace_back(new BeagleFlexibleTreeLikelihood(*_patterns.get(), model, rate_dist));
 #else
-    shared_ptr<FlexibleTreeLikelihood> beagleLike(new SimpleFlexibleTreeLikelihood(*_patterns.get(), model, rate_dist));
+            SimpleFlexibleTreeLikelihood* simpleLike = nullptr;
+            try {
+                simpleLike = new SimpleFlexibleTreeLikelihood(*_patterns.get(), model, rate_dist, true,
+                                                              simdBackendFromName(simdBackend.getValue()),
+                                                              singlePrecision.getValue(), hugePages.getValue(),
+                                                              keepPartials.getValue());
+            } catch(std::runtime_error& e) {
+                cerr << "error: " << e.what() << endl;
+                return 1;
+            }
+            if(w == 0)
+                clog << "likelihood kernels: " << simpleLike->kernelsName()
+                     << " (simd: " << simdBackendName(simpleLike->simdBackend())
+                     << ", partials: " << (simpleLike->singlePrecision() ? "float" : "double")
+                     << (simpleLike->hugePages() ? ", huge pages" : "")
+                     << (simpleLike->keepStates() ? ", kept per particle" : "") << ")" << endl;
+            calculators.emplace_back(simpleLike);
 #endif
+        }
+        clog << "threads: " << threadCount << endl;
     
-    CompositeTreeLikelihood treeLike(beagleLike);
-    treeLike.add(BranchLengthPrior(exponentialPrior));
-
-    const int treeMoveCount = treeSmcCount.getValue();
-    // move selection
-    std::vector<smc::moveset<TreeParticle>::move_fn> smcMoves;
+        CompositeTreeLikelihood treeLike(calculators);
+        treeLike.add(BranchLengthPrior::exponential(expPriorMean));
+
+        const int treeMoveCount = treeSmcCount.getValue();
+        // move selection
+        std::vector<smc::moveset<TreeParticle>::move_fn> smcMoves;
+
+        std::vector<double> pbl = pendantBranchLengths.getValue();
+        if(pbl.empty())
+            pbl = {0.0, median};
+
+        // State of an interrupted run
+        std::unique_ptr<Checkpoint> checkpoint;
+        if(resume.getValue()) {
+            try {
+                checkpoint.reset(new Checkpoint(readCheckpoint(checkpointPath.getValue(), names, particleModel,
+                                                               particleRateDist, &ref)));
+            } catch(std::runtime_error& e) {
+                cerr << "error: " << e.what() << endl;
+                return 1;
+            }
+            if(std::set<string>(checkpoint->sequenceNames.begin(), checkpoint->sequenceNames.end()) !=
+               std::set<string>(queryNames.begin(), queryNames.end())) {
+                cerr << "error: " << checkpointPath.getValue() << " adds other query sequences" << endl;
+                return 1;
+            }
+            clog << "resuming at generation " << checkpoint->generation << endl;
+        }
+        const size_t firstGeneration = checkpoint ? checkpoint->generation : 0;
+        const size_t sequencesAdded = firstGeneration / (1 + treeMoveCount) * batchSize.getValue();
+        if(firstGeneration % (1 + treeMoveCount) != 0 || sequencesAdded >= queryNames.size()) {
+            cerr << "error: " << checkpointPath.getValue() << " was saved with other options" << endl;
+            return 1;
+        }
 
-    std::vector<double> pbl = pendantBranchLengths.getValue();
-    if(pbl.empty())
-        pbl = {0.0, median};
-    
-    std::unique_ptr<OnlineAddSequenceMove> onlineAddSequenceMove;
-    const string& name = proposalMethod.getValue();
-    if(name == "uniform-length" || name == "uniform-edge") {
-        auto branchLengthProposer = [expPriorMean](smc::rng* rng) -> std::pair<double, double> {
-            const double v = rng->Exponential(expPriorMean);
-            const double logDensity = std::log(gsl_ran_exponential_pdf(v, expPriorMean));
-            return {v, logDensity};
-        };
-        if(name == "uniform-length") {
-            onlineAddSequenceMove.reset(new UniformLengthOnlineAddSequenceMove(treeLike, sites->getSequencesNames(), query.getSequencesNames(), branchLengthProposer));
-        } else {
-            onlineAddSequenceMove.reset(new UniformOnlineAddSequenceMove(treeLike, sites->getSequencesNames(), query.getSequencesNames(), branchLengthProposer));
+        // Order of the sequences to add, kept by a resumed run
+        vector<string> sequenceNames = checkpoint ? checkpoint->sequenceNames : queryNames;
+        vector<PlacementScore> placementScores;
+        if(!checkpoint && insertionOrder.getValue() == "placement") {
+            if(orderTrees.getValue() == 0) {
+                cerr << "error: at least one tree is required to order the sequences" << endl;
+                return 1;
+            }
+            // Evenly spaced through the posterior sample
+            const size_t treeCount = std::min(orderTrees.getValue(), particles.size());
+            vector<TreeParticle> orderingTrees;
+            for(size_t i = 0; i < treeCount; i++)
+                orderingTrees.push_back(particles[i * particles.size() / treeCount]);
+
+            vector<size_t> taxa;
+            for(const string& name : sequenceNames)
+                taxa.push_back(find(names.begin(), names.end(), name) - names.begin());
+            placementScores = orderByPlacement(treeLike, orderingTrees, taxa, pbl, threadCount);
+            for(size_t i = 0; i < placementScores.size(); i++)
+                sequenceNames[i] = names[placementScores[i].taxonIndex];
+            clog << "sequences ordered by placement on " << treeCount << " trees" << endl;
         }
-    } else{
-        GuidedOnlineAddSequenceMove* p = nullptr;
+        const vector<string> namesToAdd(sequenceNames.begin() + sequencesAdded, sequenceNames.end());
+    
+        std::unique_ptr<OnlineAddSequenceMove> onlineAddSequenceMove;
+        const string& name = proposalMethod.getValue();
+        if(name == "uniform-length" || name == "uniform-edge") {
+            auto branchLengthProposer = [expPriorMean](smc::rng* rng) -> std::pair<double, double> {
+                const double v = rng->Exponential(expPriorMean);
+                const double logDensity = std::log(gsl_ran_exponential_pdf(v, expPriorMean));
+                return {v, logDensity};
+            };
+            if(name == "uniform-length") {
+                onlineAddSequenceMove.reset(new UniformLengthOnlineAddSequenceMove(treeLike, sites->getSequencesNames(), namesToAdd, branchLengthProposer));
+            } else {
+                onlineAddSequenceMove.reset(new UniformOnlineAddSequenceMove(treeLike, sites->getSequencesNames(), namesToAdd, branchLengthProposer));
+            }
+        } else{
+            GuidedOnlineAddSequenceMove* p = nullptr;
         
-        if(name == "guided") {
-            p = new GuidedOnlineAddSequenceMove(treeLike, sites->getSequencesNames(), query.getSequencesNames(), pbl, maxLength.getValue(), subdivideTop.getValue());
-        } else if(name == "lcfit") {
-            p = new LcfitOnlineAddSequenceMove(treeLike, sites->getSequencesNames(), query.getSequencesNames(), pbl, maxLength.getValue(), subdivideTop.getValue(), expPriorMean);
-        } else if(name == "guided-parsimony") {
-            std::shared_ptr<FlexibleParsimony> pars = make_shared<FlexibleParsimony>(*_patterns.get(), DNA);
-            p = new ProposalGuidedParsimony(pars, treeLike, sites->getSequencesNames(), query.getSequencesNames(), expPriorMean);
+            if(name == "guided") {
+                p = new GuidedOnlineAddSequenceMove(treeLike, sites->getSequencesNames(), namesToAdd, pbl, maxLength.getValue(), subdivideTop.getValue());
+            } else if(name == "lcfit") {
+                p = new LcfitOnlineAddSequenceMove(treeLike, sites->getSequencesNames(), namesToAdd, pbl, maxLength.getValue(), subdivideTop.getValue(), expPriorMean);
+            } else if(name == "guided-parsimony") {
+                std::vector<std::shared_ptr<FlexibleParsimony>> pars;
+                for(size_t w = 0; w < threadCount; w++)
+                    pars.push_back(make_shared<FlexibleParsimony>(*_patterns.get(), DNA));
+                p = new ProposalGuidedParsimony(pars, treeLike, sites->getSequencesNames(), namesToAdd, expPriorMean);
+            }
+            else{
+                throw std::runtime_error("Unknown sequence addition method: " + name);
+            }
+            p->_heating = exponent.getValue();
+            onlineAddSequenceMove.reset(p);
         }
-        else{
-            throw std::runtime_error("Unknown sequence addition method: " + name);
+        try {
+            onlineAddSequenceMove->setBatchSize(batchSize.getValue());
+        } catch(std::invalid_argument& e) {
+            cerr << "error: " << e.what() << endl;
+            return 1;
         }
-        p->_heating = exponent.getValue();
-        onlineAddSequenceMove.reset(p);
-    }
 
+        // Generations run by the samplers replaced when the population is resized
+        long timeOffset = 0;
+        {
+            OnlineAddSequenceMove& move = *onlineAddSequenceMove;
+            auto wrapper = [&move, &timeOffset](long time, smc::particle<TreeParticle>& particle, smc::rng* rng) {
+                move(time + timeOffset, particle, rng);
+            };
+            smcMoves.push_back(wrapper);
+        }
 
-    {
-        using namespace std::placeholders;
-        auto wrapper = std::bind(&OnlineAddSequenceMove::operator(), std::ref(*onlineAddSequenceMove), _1, _2, _3);
-        smcMoves.push_back(wrapper);
-    }
+        if(treeMoveCount) {
+            smcMoves.push_back(MultiplierSMCMove(treeLike));
+            smcMoves.push_back(NodeSliderSMCMove(treeLike));
+        }
 
-    if(treeMoveCount) {
-        smcMoves.push_back(MultiplierSMCMove(treeLike));
-        smcMoves.push_back(NodeSliderSMCMove(treeLike));
-    }
+        std::function<long(long, const smc::particle<TreeParticle>&, smc::rng*)> moveSelector =
+            [treeMoveCount,&smcMoves](long time, const smc::particle<TreeParticle>&, smc::rng* rng) -> long {
+           const size_t blockSize = 1 + treeMoveCount;
+
+           // Add a sequence, followed by treeMoveCount randomly selected moves
+           const bool addSequenceStep = (time - 1) % blockSize == 0;
+           if(addSequenceStep)
+               return 0;
+                WeightedSelector<size_t> additionalSMCMoves{*rng};
+           // Twice as many multipliers
+           additionalSMCMoves.push_back(1, 20);
+           additionalSMCMoves.push_back(2, 5);
+           return additionalSMCMoves.choice();
+        };
 
-    std::function<long(long, const smc::particle<TreeParticle>&, smc::rng*)> moveSelector =
-        [treeMoveCount,&query,&smcMoves](long time, const smc::particle<TreeParticle>&, smc::rng* rng) -> long {
-       const size_t blockSize = 1 + treeMoveCount;
-
-       // Add a sequence, followed by treeMoveCount randomly selected moves
-       const bool addSequenceStep = (time - 1) % blockSize == 0;
-       if(addSequenceStep)
-           return 0;
-            WeightedSelector<size_t> additionalSMCMoves{*rng};
-       // Twice as many multipliers
-       additionalSMCMoves.push_back(1, 20);
-       additionalSMCMoves.push_back(2, 5);
-       return additionalSMCMoves.choice();
-    };
+        // SMC
+        // Later batches continue from the particles of the previous one
+        const size_t particleCount = run == 0 ? initialParticleCount : particles.size();
+        const long runSeed = run == 0 ? seed : static_cast<long>(gsl_rng_get(rng));
+        std::unique_ptr<AdaptivePopulation> adaptivePopulation;
+        if(adaptiveParticles.getValue()) {
+            if(fribbleResampling.getValue()) {
+                cerr << "error: --adaptive-particles cannot be combined with --fribble" << endl;
+                return 1;
+            }
+            const size_t minimum = minParticles.isSet() ? minParticles.getValue() :
+                                   std::max<size_t>(1, initialParticleCount / 4);
+            const size_t maximum = maxParticles.isSet() ? maxParticles.getValue() : 4 * initialParticleCount;
+            if(minimum == 0 || minimum > initialParticleCount || maximum < initialParticleCount) {
+                cerr << "error: the particle count (" << initialParticleCount << ") must be within --min-particles ("
+                     << minimum << ") and --max-particles (" << maximum << ")" << endl;
+                return 1;
+            }
+            adaptivePopulation.reset(new AdaptivePopulation(minimum, maximum));
+            clog << "particles: " << minimum << " to " << maximum << endl;
+        }
 
-    // SMC
-    OnlineSMCInit particleInitializer(particles);
+        // Referred to by the samplers, so that their tuning carries over when one replaces another
+        MultiplierMCMCMove multiplierMove(treeLike);
+        NodeSliderMCMCMove nodeSliderMove(treeLike);
+        SlidingWindowMCMCMove slidingWindowMove(treeLike);
+        const std::vector<OnlineMCMCMove*> tunedMoves { &multiplierMove, &nodeSliderMove, &slidingWindowMove };
+        smc::mcmc_moves<TreeParticle> mcmcMoves;
+        mcmcMoves.AddMove(std::ref(multiplierMove), 4.0);
+        mcmcMoves.AddMove(std::ref(nodeSliderMove), 1.0);
+        mcmcMoves.AddMove(std::ref(slidingWindowMove), 1.0);
+
+        // smctc fixes the number of particles of a sampler, resizing the population starts a new one from the particles
+        auto makeSampler = [&](const std::vector<TreeParticle>& population, size_t count, bool keepParticleIDs,
+                               long samplerSeed, const std::vector<double>& logWeights)
+                               -> std::unique_ptr<smc::sampler<TreeParticle>> {
+            OnlineSMCInit particleInitializer(population, keepParticleIDs, logWeights);
+            smc::moveset<TreeParticle> moveSet(particleInitializer, moveSelector, smcMoves, mcmcMoves);
+            moveSet.SetNumberOfMCMCMoves(mcmcCount.getValue());
+
+            std::unique_ptr<smc::sampler<TreeParticle>> result(
+                new smc::sampler<TreeParticle>(count, SMC_HISTORY_NONE, gsl_rng_default, samplerSeed));
+            result->SetResampleParams(SMC_RESAMPLE_STRATIFIED, resample_threshold.getValue());
+            result->SetMoveSet(moveSet);
+            result->Initialise();
+            return result;
+        };
 
-    smc::sampler<TreeParticle> sampler(particleFactor.getValue() * trees.size(), SMC_HISTORY_NONE, gsl_rng_default, seed);
-    smc::mcmc_moves<TreeParticle> mcmcMoves;
-    mcmcMoves.AddMove(MultiplierMCMCMove(treeLike), 4.0);
-    mcmcMoves.AddMove(NodeSliderMCMCMove(treeLike), 1.0);
-    mcmcMoves.AddMove(SlidingWindowMCMCMove(treeLike), 1.0);
-    
-    smc::moveset<TreeParticle> moveSet(particleInitializer, moveSelector, smcMoves, mcmcMoves);
-    moveSet.SetNumberOfMCMCMoves(mcmcCount.getValue());
-
-    // Output
-    Json::Value jsonRoot;
-    Json::Value& jsonTrees = jsonRoot["trees"];
-    Json::Value& jsonIters = jsonRoot["generations"];
-    if(jsonOutputPath.isSet()) {
-        Json::Value& v = jsonRoot["run"];
-        v["nQuerySeqs"] = static_cast<unsigned int>(query.getNumberOfSequences());
-        v["nParticles"] = static_cast<unsigned int>(sampler.GetNumber());
-        for(size_t i = 0; i < argc; i++)
-            v["args"][i] = argv[i];
-        v["version"] = sts::STS_VERSION;
-        if(v["seed"].isNull()) v["seed"] = static_cast<unsigned int>(seed);
-    }
+        // Output, continued by a resumed run
+        Json::Value jsonRoot;
+        if(checkpoint && !Json::Reader().parse(checkpoint->output, jsonRoot)) {
+            cerr << "error: " << checkpointPath.getValue() << " has a damaged JSON output" << endl;
+            return 1;
+        }
+        Json::Value& jsonTrees = jsonRoot["trees"];
+        Json::Value& jsonIters = jsonRoot["generations"];
+        if(jsonOutputPath.isSet()) {
+            Json::Value& v = jsonRoot["run"];
+            v["nQuerySeqs"] = static_cast<unsigned int>(queryNames.size());
+            v["nParticles"] = static_cast<unsigned int>(particleCount);
+            if(adaptivePopulation) {
+                v["minParticles"] = static_cast<unsigned int>(adaptivePopulation->minimum());
+                v["maxParticles"] = static_cast<unsigned int>(adaptivePopulation->maximum());
+            }
+            for(size_t i = 0; i < argc; i++)
+                v["args"][i] = argv[i];
+            v["version"] = sts::STS_VERSION;
+            if(v["seed"].isNull()) v["seed"] = static_cast<unsigned int>(seed);
+            if(daemonPath.isSet())
+                v["batch"] = static_cast<unsigned int>(run);
+
+            v["insertionOrder"] = insertionOrder.getValue();
+            Json::Value& jsonOrder = jsonRoot["insertionOrder"];
+            for(size_t i = 0; i < sequenceNames.size(); i++) {
+                jsonOrder[i]["sequence"] = sequenceNames[i];
+                if(!placementScores.empty())
+                    jsonOrder[i]["placementConfidence"] = placementScores[i].confidence;
+            }
+        }
 
-    sampler.SetResampleParams(SMC_RESAMPLE_STRATIFIED, resample_threshold.getValue());
-    sampler.SetMoveSet(moveSet);
-    sampler.Initialise();
-    const size_t nIters = (1 + treeMoveCount) * query.getNumberOfSequences();
-    vector<string> sequenceNames = query.getSequencesNames();
+        std::unique_ptr<smc::sampler<TreeParticle>> sampler;
+        if(!checkpoint)
+            sampler = makeSampler(particles, particleCount, false, runSeed, {});
+        const size_t nBatches = (queryNames.size() + batchSize.getValue() - 1) / batchSize.getValue();
+        const size_t nIters = (1 + treeMoveCount) * nBatches;
+
+        smc::DatabaseHistory database_history;
+
+        // Random number generators of the workers adding sequences, seeded after the one of the sampler
+        std::vector<std::unique_ptr<smc::rng>> workerRngs;
+        std::vector<smc::rng*> workerRngPointers;
+        if(threadCount > 1) {
+            for(size_t w = 0; w < threadCount; w++) {
+                workerRngs.emplace_back(new smc::rng(gsl_rng_default, runSeed + 1 + w));
+                workerRngPointers.push_back(workerRngs.back().get());
+            }
+        }
 
-    smc::DatabaseHistory database_history;
+        // Continue from a population with a new sampler and new worker generators, all seeded from rng: a checkpoint
+        // saves rng beforehand, so that the run resumed from it draws the same numbers
+        auto restartAt = [&](size_t n, const std::vector<TreeParticle>& population, const std::vector<double>& logWeights) {
+            sampler = makeSampler(population, population.size(), true, static_cast<long>(gsl_rng_get(rng)), logWeights);
+            timeOffset = n;
+            for(size_t w = 0; w < workerRngs.size(); w++) {
+                workerRngs[w].reset(new smc::rng(gsl_rng_default, gsl_rng_get(rng)));
+                workerRngPointers[w] = workerRngs[w].get();
+            }
+        };
 
-    for(size_t n = 0; n < nIters; n++) {
         double ess = 0.0;
-
-        if (fribbleResampling.getValue()) {
-            ess = sampler.IterateEssVariable(&database_history);
-        } else {
-            ess = sampler.IterateEss();
+        size_t uniqueParticles = particleCount;
+        if(checkpoint) {
+            if(checkpoint->rngState.size() != gsl_rng_size(rng) || checkpoint->mcmcTunings.size() != tunedMoves.size()) {
+                cerr << "error: " << checkpointPath.getValue() << " was saved by another version" << endl;
+                return 1;
+            }
+            std::copy(checkpoint->rngState.begin(), checkpoint->rngState.end(), static_cast<char*>(gsl_rng_state(rng)));
+            for(size_t i = 0; i < tunedMoves.size(); i++)
+                tunedMoves[i]->setTuning(checkpoint->mcmcTunings[i]);
+            for(const ProposalRecord& record : checkpoint->proposalRecords)
+                onlineAddSequenceMove->addProposalRecord(record);
+            ess = checkpoint->ess;
+            uniqueParticles = checkpoint->uniqueParticles;
+            restartAt(firstGeneration, checkpoint->particles, checkpoint->logWeights);
+            checkpoint.reset();
         }
 
-        cerr << "Iter " << n << ": ESS=" << ess << " sequence=" << sequenceNames[n / (1 + treeMoveCount)] << endl;
-        if(jsonOutputPath.isSet()) {
-            Json::Value& v = jsonIters[n];
-            v["T"] = static_cast<unsigned int>(n + 1);
-            v["ess"] = ess;
-            v["sequence"] = sequenceNames[n / (1 + treeMoveCount)];
-            //v["totalUpdatePartialsCalls"] = static_cast<unsigned int>(BeagleTreeLikelihood::totalBeagleUpdateTransitionsCalls());
-            v["totalUpdatePartialsCalls"] = static_cast<unsigned int>(AbstractFlexibleTreeLikelihood::operationCallCount);
+        for(size_t n = firstGeneration; n < nIters; n++) {
+            // Save the state before adding the next sequences, then continue from it as a resumed run would
+            if(checkpointPath.isSet() && n > firstGeneration &&
+               n % (checkpointEvery.getValue() * (1 + treeMoveCount)) == 0) {
+                Checkpoint state;
+                state.generation = n;
+                state.sequenceNames = sequenceNames;
+                for(long i = 0; i < sampler->GetNumber(); i++) {
+                    state.particles.push_back(sampler->GetParticleValue(i));
+                    state.logWeights.push_back(sampler->GetParticleLogWeight(i));
+                }
+                state.ess = ess;
+                state.uniqueParticles = uniqueParticles;
+                const char* rngState = static_cast<const char*>(gsl_rng_state(rng));
+                state.rngState.assign(rngState, rngState + gsl_rng_size(rng));
+                for(const OnlineMCMCMove* move : tunedMoves)
+                    state.mcmcTunings.push_back(move->tuning());
+                state.proposalRecords = onlineAddSequenceMove->getProposalRecords();
+                state.output = Json::FastWriter().write(jsonRoot);
+                try {
+                    writeCheckpoint(checkpointPath.getValue(), state);
+                } catch(std::runtime_error& e) {
+                    cerr << "error: " << e.what() << endl;
+                    return 1;
+                }
+                restartAt(n, state.particles, state.logWeights);
+                clog << "Iter " << n << ": saved to " << checkpointPath.getValue() << endl;
+            }
+
+            // Resize the population before adding the next sequence, from the last generation
+            if(adaptivePopulation && n > 0 && n % (1 + treeMoveCount) == 0) {
+                const size_t count = adaptivePopulation->next(sampler->GetNumber(), ess, uniqueParticles);
+                if(count != static_cast<size_t>(sampler->GetNumber())) {
+                    std::vector<double> logWeights(sampler->GetNumber());
+                    for(long i = 0; i < sampler->GetNumber(); i++)
+                        logWeights[i] = sampler->GetParticleLogWeight(i);
+                    std::vector<TreeParticle> population;
+                    population.reserve(count);
+                    for(size_t i : systematicResample(logWeights, count, gsl_rng_uniform(rng)))
+                        population.push_back(sampler->GetParticleValue(i));
+
+                    // Seeded after the worker generators
+                    sampler = makeSampler(population, count, true, runSeed + threadCount + n, {});
+                    timeOffset = n;
+                    clog << "Iter " << n << ": " << count << " particles" << endl;
+                }
+            }
+
+            // The sampler moves its particles one at a time: sequences are added on the workers beforehand and the
+            // weights updated as the sampler reaches each particle
+            if(threadCount > 1 && n % (1 + treeMoveCount) == 0) {
+                std::vector<TreeParticle*> values;
+                values.reserve(sampler->GetNumber());
+                for(long i = 0; i < sampler->GetNumber(); i++)
+                    values.push_back(const_cast<TreeParticle*>(&sampler->GetParticleValue(i)));
+                onlineAddSequenceMove->propagate(n + 1, values, workerRngPointers);
+            }
+
             if (fribbleResampling.getValue()) {
-                Json::Value ess_array;
-                for (size_t i = 0; i < database_history.ess.size(); ++i)
-                    ess_array.append(database_history.ess[i]);
-                v["essHistory"] = ess_array;
+                ess = sampler->IterateEssVariable(&database_history);
+            } else {
+                ess = sampler->IterateEss();
             }
-            
+
             std::set<size_t> set;
-            for(size_t i = 0; i < sampler.GetNumber(); i++) {
-                const TreeParticle& p = sampler.GetParticleValue(i);
-                set.insert(p.particleID);
+            for(long i = 0; i < sampler->GetNumber(); i++)
+                set.insert(sampler->GetParticleValue(i).particleID);
+            uniqueParticles = set.size();
+
+            // Sequences added by this generation
+            const size_t firstSequence = n / (1 + treeMoveCount) * batchSize.getValue();
+            const size_t lastSequence = std::min(firstSequence + batchSize.getValue(), sequenceNames.size());
+
+            cerr << "Iter " << n << ": ESS=" << ess << " sequence=" << sequenceNames[firstSequence];
+            for(size_t i = firstSequence + 1; i < lastSequence; i++)
+                cerr << ',' << sequenceNames[i];
+            cerr << endl;
+            if(jsonOutputPath.isSet()) {
+                Json::Value& v = jsonIters[n];
+                v["T"] = static_cast<unsigned int>(n + 1);
+                v["ess"] = ess;
+                v["sequence"] = sequenceNames[firstSequence];
+                if(batchSize.getValue() > 1) {
+                    for(size_t i = firstSequence; i < lastSequence; i++)
+                        v["sequences"].append(sequenceNames[i]);
+                }
+                //v["totalUpdatePartialsCalls"] = static_cast<unsigned int>(BeagleTreeLikelihood::totalBeagleUpdateTransitionsCalls());
+                v["totalUpdatePartialsCalls"] = static_cast<unsigned int>(AbstractFlexibleTreeLikelihood::operationCallCount);
+                if (fribbleResampling.getValue()) {
+                    Json::Value ess_array;
+                    for (size_t i = 0; i < database_history.ess.size(); ++i)
+                        ess_array.append(database_history.ess[i]);
+                    v["essHistory"] = ess_array;
+                }
+                v["nParticles"] = static_cast<unsigned int>(sampler->GetNumber());
+                v["uniqueParticles"] = static_cast<unsigned int>(uniqueParticles);
             }
-            v["uniqueParticles"] = static_cast<unsigned int>(set.size());
         }
-    }
 
-    double maxLogLike = -std::numeric_limits<double>::max();
-    for(size_t i = 0; i < sampler.GetNumber(); i++) {
-        const TreeParticle& p = sampler.GetParticleValue(i);
-//        treeLike.initialize(*p.model, *p.rateDist, *p.tree);
-//        const double logLike = beagleLike->calculateLogLikelihood();
-//        maxLogLike = std::max(logLike, maxLogLike);
-        string s = bpp::TreeTemplateTools::treeToParenthesis(*p.tree);
-        if(jsonOutputPath.isSet()) {
-            Json::Value& v = jsonTrees[jsonTrees.size()];
-//            v["treeLogLikelihood"] = logLike;
-//            v["totalLikelihood"] = treeLike();
-            v["particleID"] = static_cast<unsigned int>(p.particleID);
-            v["newickString"] = s;
-            v["logWeight"] = sampler.GetParticleLogWeight(i);
-            v["treeLength"] = p.tree->getTotalLength();
+        double maxLogLike = -std::numeric_limits<double>::max();
+        for(size_t i = 0; i < sampler->GetNumber(); i++) {
+            const TreeParticle& p = sampler->GetParticleValue(i);
+    //        treeLike.initialize(p.model(), p.rateDist(), p.mutableTree());
+    //        const double logLike = beagleLike->calculateLogLikelihood();
+    //        maxLogLike = std::max(logLike, maxLogLike);
+            string s = bpp::TreeTemplateTools::treeToParenthesis(p.tree());
+            if(jsonOutputPath.isSet()) {
+                Json::Value& v = jsonTrees[jsonTrees.size()];
+    //            v["treeLogLikelihood"] = logLike;
+    //            v["totalLikelihood"] = treeLike();
+                v["particleID"] = static_cast<unsigned int>(p.particleID);
+                v["newickString"] = s;
+                v["logWeight"] = sampler->GetParticleLogWeight(i);
+                v["treeLength"] = bpp::TreeTemplateTools::getTotalLength(*p.tree().getRootNode(), false);
+            }
         }
-    }
 
-    std::vector<ProposalRecord> proposalRecords = onlineAddSequenceMove->getProposalRecords();
-    Json::Value& jsonProposals = jsonRoot["proposals"];
-    for (size_t i = 0; i < proposalRecords.size(); ++i) {
-        const auto& pr = proposalRecords[i];
-        Json::Value& v = jsonProposals[i];
-        v["T"] = static_cast<unsigned int>(pr.T);
-        v["originalLogLike"] = pr.originalLogLike;
-        v["newLogLike"] = pr.newLogLike;
-        v["originalLogWeight"] = pr.originalLogWeight;
-        v["newLogWeight"] = pr.newLogWeight;
-        v["distalBranchLength"] = pr.proposal.distalBranchLength;
-        v["distalLogProposalDensity"] = pr.proposal.distalLogProposalDensity;
-        v["pendantBranchLength"] = pr.proposal.pendantBranchLength;
-        v["pendantLogProposalDensity"] = pr.proposal.pendantLogProposalDensity;
-        v["edgeLogProposalDensity"] = pr.proposal.edgeLogProposalDensity;
-        v["logProposalDensity"] = pr.proposal.logProposalDensity();
-        v["mlDistalBranchLength"] = pr.proposal.mlDistalBranchLength;
-        v["mlPendantBranchLength"] = pr.proposal.mlPendantBranchLength;
-
-        v["proposalMethodName"] = pr.proposal.proposalMethodName;
+        std::vector<ProposalRecord> proposalRecords = onlineAddSequenceMove->getProposalRecords();
+        Json::Value& jsonProposals = jsonRoot["proposals"];
+        for (size_t i = 0; i < proposalRecords.size(); ++i) {
+            const auto& pr = proposalRecords[i];
+            Json::Value& v = jsonProposals[i];
+            v["T"] = static_cast<unsigned int>(pr.T);
+            v["originalLogLike"] = pr.originalLogLike;
+            v["newLogLike"] = pr.newLogLike;
+            v["originalLogWeight"] = pr.originalLogWeight;
+            v["newLogWeight"] = pr.newLogWeight;
+            v["distalBranchLength"] = pr.proposal.distalBranchLength;
+            v["distalLogProposalDensity"] = pr.proposal.distalLogProposalDensity;
+            v["pendantBranchLength"] = pr.proposal.pendantBranchLength;
+            v["pendantLogProposalDensity"] = pr.proposal.pendantLogProposalDensity;
+            v["edgeLogProposalDensity"] = pr.proposal.edgeLogProposalDensity;
+            v["logProposalDensity"] = pr.proposal.logProposalDensity();
+            v["mlDistalBranchLength"] = pr.proposal.mlDistalBranchLength;
+            v["mlPendantBranchLength"] = pr.proposal.mlPendantBranchLength;
+
+            v["proposalMethodName"] = pr.proposal.proposalMethodName;
         
-        if(pr.T == nIters){
-            maxLogLike = std::max(pr.newLogLike, maxLogLike);
+            if(pr.T == nIters){
+                maxLogLike = std::max(pr.newLogLike, maxLogLike);
+            }
         }
-    }
 
-    if(jsonOutputPath.isSet()) {
-        ofstream jsonOutput(jsonOutputPath.getValue());
-        Json::StyledWriter writer;
-        jsonOutput << writer.write(jsonRoot);
-    }
+        if(jsonOutputPath.isSet()) {
+            // Replaced at once, for readers of a daemon's output
+            const string tmpPath = jsonOutputPath.getValue() + ".tmp";
+            {
+                ofstream jsonOutput(tmpPath);
+                Json::StyledWriter writer;
+                jsonOutput << writer.write(jsonRoot);
+            }
+            std::rename(tmpPath.c_str(), jsonOutputPath.getValue().c_str());
+        }
 #ifdef SMCTC_HAVE_BGL
-    if(particleGraphPath.isSet()) {
-        ofstream gOut(particleGraphPath.getValue());
-        sampler.StreamParticleGraph(gOut);
-    }
+        if(particleGraphPath.isSet()) {
+            ofstream gOut(particleGraphPath.getValue());
+            sampler->StreamParticleGraph(gOut);
+        }
 #endif
 
-    clog << "Maximum LL: " << maxLogLike << '\n';
+        clog << "Maximum LL: " << maxLogLike << '\n';
+
+        if(!daemonPath.isSet())
+            break;
+
+        // The particles carry over to the next batch, equally weighted
+        std::vector<double> logWeights(sampler->GetNumber());
+        for(long i = 0; i < sampler->GetNumber(); i++)
+            logWeights[i] = sampler->GetParticleLogWeight(i);
+        particles.clear();
+        for(size_t i : systematicResample(logWeights, logWeights.size(), gsl_rng_uniform(rng)))
+            particles.push_back(sampler->GetParticleValue(i));
+        sampler.reset();
+
+        // Wait for the next batch: the FIFO reaches its end once the writer closes it
+        std::unique_ptr<bpp::SiteContainer> batch;
+        while(!batch) {
+            clog << "waiting for sequences on " << daemonPath.getValue() << endl;
+            ifstream fifo(daemonPath.getValue());
+            try {
+                batch.reset(sts::util::read_alignment(fifo, &DNA));
+                if(batch->getNumberOfSequences() > 0 && batch->getNumberOfSites() != sites->getNumberOfSites())
+                    throw std::runtime_error("sequences are not aligned with the others");
+                unordered_set<string> known(names.begin(), names.end());
+                for(const string& name : batch->getSequencesNames()) {
+                    if(!known.insert(name).second)
+                        throw std::runtime_error("sequence " + name + " was already added");
+                }
+            } catch(std::exception& e) {
+                cerr << "error: batch ignored, " << e.what() << endl;
+                batch.reset();
+            }
+        }
+        if(batch->getNumberOfSequences() == 0)
+            break;
+
+        // New sequences come after the others, so that the leaves keep their IDs and internal nodes shift
+        const int added = static_cast<int>(batch->getNumberOfSequences());
+        for(const string& name : queryNames)
+            ref.addSequence(sites->getSequence(name), false);
+        std::unique_ptr<bpp::VectorSiteContainer> allSequences(new bpp::VectorSiteContainer(*sites));
+        queryNames.clear();
+        for(size_t i = 0; i < batch->getNumberOfSequences(); i++) {
+            allSequences->addSequence(batch->getSequence(i), false);
+            queryNames.push_back(batch->getSequence(i).getName());
+        }
+        sites.reset(allSequences.release());
+        names = sites->getSequencesNames();
+
+        // Copies of a particle share their tree: the first copy renumbers its own, which the others then share
+        std::unordered_map<const Tree*, size_t> renumbered;
+        for(size_t i = 0; i < particles.size(); i++) {
+            TreeParticle& particle = particles[i];
+            auto first = renumbered.emplace(&particle.tree(), i);
+            if(first.second) {
+                for(bpp::Node* node : particle.mutableTree().getNodes()) {
+                    if(!node->isLeaf())
+                        node->setId(node->getId() + added);
+                }
+                // Partials are for the previous sequences
+                particle.setLikelihoodState(nullptr);
+            }
+            else {
+                const size_t particleID = particle.particleID;
+                particle = particles[first.first->second];
+                particle.particleID = particleID;
+            }
+        }
+        clog << "batch " << run + 1 << ": " << added << " query sequences" << endl;
+    }
 
     gsl_rng_free(rng);
 }
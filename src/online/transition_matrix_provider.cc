@@ -0,0 +1,153 @@
+#include "transition_matrix_provider.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <Bpp/Phyl/Model/SubstitutionModel.h>
+
+namespace sts { namespace online {
+
+const size_t TransitionMatrixProvider::DEFAULT_CAPACITY = 1 << 14;
+
+TransitionMatrixProvider::TransitionMatrixProvider(size_t capacity, bool closedForms) :
+    _model(),
+    _stateCount(0),
+    _revision(0),
+    _useClosedForms(closedForms),
+    _closedForm(false),
+    _beta(0),
+    _capacity(capacity),
+    _hits(0),
+    _misses(0)
+{}
+
+TransitionMatrixProvider::~TransitionMatrixProvider()
+{}
+
+void TransitionMatrixProvider::setModel(const bpp::SubstitutionModel& model)
+{
+    const bpp::ParameterList& parameters = model.getParameters();
+    std::vector<double> values;
+    values.reserve(parameters.size() + model.getNumberOfStates() + 1);
+    for(size_t i = 0; i < parameters.size(); i++)
+        values.push_back(parameters[i].getValue());
+    const std::vector<double>& frequencies = model.getFrequencies();
+    values.insert(values.end(), frequencies.begin(), frequencies.end());
+    values.push_back(model.getRate());
+
+    if(_revision > 0 && model.getName() == _modelName && values == _parameterValues)
+        return;
+
+    _model.reset(model.clone());
+    _revision++;
+    _modelName = model.getName();
+    _parameterValues.swap(values);
+    _stateCount = model.getNumberOfStates();
+
+    _closedForm = false;
+    if(_useClosedForms && (_modelName == "JC69" || _modelName == "F81")) {
+        _frequencies = frequencies;
+        double sum = 0.0;
+        for(double f : _frequencies)
+            sum += f * f;
+        // Normalized to one expected substitution per unit of time, scaled by the rate of the model
+        _beta = model.getRate() / (1.0 - sum);
+        _closedForm = hasClosedForm(*_model);
+    }
+}
+
+bool TransitionMatrixProvider::hasClosedForm(const bpp::SubstitutionModel& model) const
+{
+    std::vector<double> matrix(_stateCount * _stateCount);
+    for(double t : { 0.01, 0.5 }) {
+        closedFormMatrices(t, matrix.data(), nullptr, nullptr);
+        const bpp::Matrix<double>& expected = model.getPij_t(t);
+        for(size_t i = 0; i < _stateCount; i++) {
+            for(size_t j = 0; j < _stateCount; j++) {
+                if(std::abs(expected(i, j) - matrix[i * _stateCount + j]) > 1e-10)
+                    return false;
+            }
+        }
+    }
+    return true;
+}
+
+void TransitionMatrixProvider::closedFormMatrices(double t, double* matrix, double* d1Matrix, double* d2Matrix) const
+{
+    const double e = std::exp(-_beta * t);
+    for(size_t i = 0; i < _stateCount; i++) {
+        for(size_t j = 0; j < _stateCount; j++) {
+            const double a = (i == j ? 1.0 : 0.0) - _frequencies[j];
+            const size_t index = i * _stateCount + j;
+            if(matrix != nullptr)
+                matrix[index] = _frequencies[j] + a * e;
+            if(d1Matrix != nullptr)
+                d1Matrix[index] = -_beta * a * e;
+            if(d2Matrix != nullptr)
+                d2Matrix[index] = _beta * _beta * a * e;
+        }
+    }
+}
+
+void TransitionMatrixProvider::transitionMatrix(double t, double* matrix)
+{
+    if(_closedForm) {
+        closedFormMatrices(t, matrix, nullptr, nullptr);
+        return;
+    }
+
+    const size_t matrixSize = _stateCount * _stateCount;
+    const Key key = { _revision, t };
+    auto found = _index.find(key);
+    if(found != _index.end()) {
+        _hits++;
+        _entries.splice(_entries.begin(), _entries, found->second);
+        const std::vector<double>& cached = found->second->matrix;
+        std::copy(cached.begin(), cached.end(), matrix);
+        return;
+    }
+
+    _misses++;
+    const bpp::Matrix<double>& m = _model->getPij_t(t);
+    for(size_t i = 0; i < _stateCount; i++) {
+        const std::vector<double>& row = m.row(i);
+        std::copy(row.begin(), row.end(), matrix + i * _stateCount);
+    }
+
+    if(_capacity == 0)
+        return;
+    // Recycle the least recently used entry once the cache is full
+    if(_entries.size() == _capacity) {
+        _index.erase(_entries.back().key);
+        _entries.splice(_entries.begin(), _entries, std::prev(_entries.end()));
+    }
+    else {
+        _entries.emplace_front();
+    }
+    Entry& entry = _entries.front();
+    entry.key = key;
+    entry.matrix.assign(matrix, matrix + matrixSize);
+    _index[key] = _entries.begin();
+}
+
+void TransitionMatrixProvider::transitionMatrixDerivatives(double t, double* d1Matrix, double* d2Matrix)
+{
+    if(_closedForm) {
+        closedFormMatrices(t, nullptr, d1Matrix, d2Matrix);
+        return;
+    }
+
+    // Each matrix is copied before the next one is requested as the model may reuse its storage
+    const bpp::Matrix<double>& d1 = _model->getdPij_dt(t);
+    for(size_t i = 0; i < _stateCount; i++) {
+        const std::vector<double>& row = d1.row(i);
+        std::copy(row.begin(), row.end(), d1Matrix + i * _stateCount);
+    }
+    const bpp::Matrix<double>& d2 = _model->getd2Pij_dt2(t);
+    for(size_t i = 0; i < _stateCount; i++) {
+        const std::vector<double>& row = d2.row(i);
+        std::copy(row.begin(), row.end(), d2Matrix + i * _stateCount);
+    }
+}
+
+}} // namespaces
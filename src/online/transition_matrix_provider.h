@@ -0,0 +1,112 @@
+#ifndef STS_ONLINE_TRANSITION_MATRIX_PROVIDER_H
+#define STS_ONLINE_TRANSITION_MATRIX_PROVIDER_H
+
+#include <cstddef>
+#include <functional>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace bpp {
+class SubstitutionModel;
+}
+
+namespace sts { namespace online {
+
+/// \brief Transition probability matrices of a substitution model, with a cache
+///
+/// Matrices are written row-major, <c>[from][to]</c>, as expected by the likelihood kernels.
+///
+/// Equal-input models (JC69 and F81) are computed in closed form. Matrices of other models come from Bio++ and are
+/// kept in a least recently used cache keyed on the revision of the model and the (rate scaled) branch length. The
+/// revision changes when #setModel is given a model with a different name or different parameter values, so
+/// identical clones of a model, as held by each particle, share the cache.
+///
+/// The provider works on its own copy of the model, which may be shared by particles evaluated on other threads.
+class TransitionMatrixProvider
+{
+public:
+    /// Default number of matrices kept in the cache
+    static const size_t DEFAULT_CAPACITY;
+
+    /// \param capacity Number of matrices kept in the cache, 0 disables the cache
+    /// \param closedForms Use closed forms for the models that have one
+    explicit TransitionMatrixProvider(size_t capacity=DEFAULT_CAPACITY, bool closedForms=true);
+    ~TransitionMatrixProvider();
+
+    /// Use \c model for the following matrices
+    void setModel(const bpp::SubstitutionModel& model);
+
+    /// Revision of the model, incremented every time its parameters change
+    size_t revision() const { return _revision; }
+
+    /// Whether matrices of the current model are computed in closed form
+    bool closedForm() const { return _closedForm; }
+
+    /// Fill \c matrix with \f$P(t)\f$
+    void transitionMatrix(double t, double* matrix);
+
+    /// Fill \c d1Matrix and \c d2Matrix with the first and second derivatives of \f$P(t)\f$ with respect to \c t.
+    /// They are not cached.
+    void transitionMatrixDerivatives(double t, double* d1Matrix, double* d2Matrix);
+
+    /// Number of matrices found in the cache
+    size_t hits() const { return _hits; }
+
+    /// Number of matrices computed by Bio++
+    size_t misses() const { return _misses; }
+
+private:
+    struct Key
+    {
+        size_t revision;
+        double t;
+        bool operator==(const Key& other) const { return revision == other.revision && t == other.t; }
+    };
+
+    struct KeyHash
+    {
+        size_t operator()(const Key& key) const
+        {
+            return std::hash<double>()(key.t) ^ (std::hash<size_t>()(key.revision) * 0x9e3779b97f4a7c15ULL);
+        }
+    };
+
+    struct Entry
+    {
+        Key key;
+        std::vector<double> matrix;
+    };
+
+    /// Whether \c model is an equal-input model whose matrices match the closed form
+    bool hasClosedForm(const bpp::SubstitutionModel& model) const;
+
+    /// \f$P(t)\f$ and its derivatives for an equal-input model, any of the outputs can be NULL
+    void closedFormMatrices(double t, double* matrix, double* d1Matrix, double* d2Matrix) const;
+
+    std::unique_ptr<bpp::SubstitutionModel> _model;
+    size_t _stateCount;
+    size_t _revision;
+    std::string _modelName;
+    std::vector<double> _parameterValues;
+
+    // Equal-input models: P(t)_ij = pi_j + (delta_ij - pi_j) exp(-beta t)
+    bool _useClosedForms;
+    bool _closedForm;
+    std::vector<double> _frequencies;
+    double _beta;
+
+    // Most recently used matrices at the front
+    size_t _capacity;
+    std::list<Entry> _entries;
+    std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> _index;
+
+    size_t _hits;
+    size_t _misses;
+};
+
+}} // namespaces
+
+#endif // STS_ONLINE_TRANSITION_MATRIX_PROVIDER_H
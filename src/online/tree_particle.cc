@@ -1,60 +1,66 @@
 #include "tree_particle.h"
 
+#include <atomic>
+
 namespace sts { namespace online {
 
 TreeParticle::TreeParticle() :
-    model(nullptr),
-    tree(nullptr),
-    rateDist(nullptr),
-    sites(nullptr)
+    sites(nullptr),
+    _model(nullptr),
+    _tree(nullptr),
+    _rateDist(nullptr)
 {}
 
 TreeParticle::TreeParticle(std::unique_ptr<bpp::SubstitutionModel> model,
                            std::unique_ptr<bpp::TreeTemplate<bpp::Node>> tree,
                            std::unique_ptr<bpp::DiscreteDistribution> rateDist,
                            bpp::SiteContainer const* sites) :
-    model(std::move(model)),
-    tree(std::move(tree)),
-    rateDist(std::move(rateDist)),
-    sites(sites)
+    sites(sites),
+    _model(std::move(model)),
+    _tree(std::move(tree)),
+    _rateDist(std::move(rateDist))
 {}
 
-TreeParticle::TreeParticle(const TreeParticle& other) :
-    model(other.model->clone()),
-    tree(other.tree->clone()),
-    rateDist(other.rateDist->clone()),
-    sites(other.sites),
-    particleID(other.particleID)
-{
-}
-
-TreeParticle& TreeParticle::operator=(const TreeParticle& other)
-{
-    sites = other.sites;
-    model.reset(other.model->clone());
-    tree.reset(other.tree->clone());
-    rateDist.reset(other.rateDist->clone());
-    particleID = other.particleID;
-    return *this;
-}
+TreeParticle::TreeParticle(std::shared_ptr<const bpp::SubstitutionModel> model,
+                           std::unique_ptr<bpp::TreeTemplate<bpp::Node>> tree,
+                           std::shared_ptr<const bpp::DiscreteDistribution> rateDist,
+                           bpp::SiteContainer const* sites) :
+    sites(sites),
+    _model(std::move(model)),
+    _tree(std::move(tree)),
+    _rateDist(std::move(rateDist))
+{}
 
 TreeParticle& TreeParticle::operator=(TreeParticle&& other)
 {
     sites = other.sites;
-    model = std::move(other.model);
-    tree = std::move(other.tree);
-    rateDist = std::move(other.rateDist);
+    _model = std::move(other._model);
+    _tree = std::move(other._tree);
+    _rateDist = std::move(other._rateDist);
+    _likelihoodState = std::move(other._likelihoodState);
     particleID = other.particleID;
     return *this;
 }
 
 TreeParticle::TreeParticle(TreeParticle&& other) :
-    model(std::move(other.model)),
-    tree(std::move(other.tree)),
-    rateDist(std::move(other.rateDist)),
     sites(other.sites),
-    particleID(other.particleID)
+    particleID(other.particleID),
+    _model(std::move(other._model)),
+    _tree(std::move(other._tree)),
+    _rateDist(std::move(other._rateDist)),
+    _likelihoodState(std::move(other._likelihoodState))
 {}
 
+bpp::TreeTemplate<bpp::Node>& TreeParticle::mutableTree()
+{
+    if(_tree.use_count() > 1) {
+        _tree.reset(_tree->clone());
+    }
+    else {
+        // The other owners released the tree, possibly from other threads: their reads happened before
+        std::atomic_thread_fence(std::memory_order_acquire);
+    }
+    return *_tree;
+}
 
 }} // Namespaces
@@ -10,7 +10,13 @@
 
 namespace sts { namespace online {
 
+class LikelihoodState;
+
 /// \brief A particle representing a fully-specified tree.
+///
+/// Copies share the tree, substitution model and rate distribution of the original, so that resampling does not clone
+/// them. The tree is cloned by #mutableTree when shared with another particle; the model and rate distribution are
+/// never modified. The partials saved by the last evaluation of the tree are shared in the same way.
 class TreeParticle
 {
 public:
@@ -24,19 +30,43 @@ public:
                  std::unique_ptr<bpp::TreeTemplate<bpp::Node>> tree,
                  std::unique_ptr<bpp::DiscreteDistribution> rateDist,
                  bpp::SiteContainer const* sites);
+    /// \brief Constructor with a model and a rate distribution shared with other particles
+    TreeParticle(std::shared_ptr<const bpp::SubstitutionModel> model,
+                 std::unique_ptr<bpp::TreeTemplate<bpp::Node>> tree,
+                 std::shared_ptr<const bpp::DiscreteDistribution> rateDist,
+                 bpp::SiteContainer const* sites);
     TreeParticle();
-    TreeParticle(const TreeParticle& other);
-    TreeParticle& operator=(const TreeParticle& other);
+    TreeParticle(const TreeParticle& other) = default;
+    TreeParticle& operator=(const TreeParticle& other) = default;
     TreeParticle& operator=(TreeParticle&&);
     TreeParticle(TreeParticle&&);
     virtual ~TreeParticle() {};
 
-    std::unique_ptr<bpp::SubstitutionModel> model;
-    std::unique_ptr<bpp::TreeTemplate<bpp::Node>> tree;
-    std::unique_ptr<bpp::DiscreteDistribution> rateDist;
+    const bpp::SubstitutionModel& model() const { return *_model; }
+    const bpp::DiscreteDistribution& rateDist() const { return *_rateDist; }
+    const bpp::TreeTemplate<bpp::Node>& tree() const { return *_tree; }
+
+    /// \brief The tree, to be modified
+    ///
+    /// Clones the tree first if other particles share it: nodes obtained before this call may belong to the tree of
+    /// another particle. Particles sharing a tree may call this concurrently.
+    bpp::TreeTemplate<bpp::Node>& mutableTree();
+
+    /// Whether other particles share the tree
+    bool sharesTree() const { return _tree.use_count() > 1; }
+
+    /// Partials saved by the last evaluation of the tree, possibly modified since; null if none were saved
+    const std::shared_ptr<const LikelihoodState>& likelihoodState() const { return _likelihoodState; }
+
+    void setLikelihoodState(std::shared_ptr<const LikelihoodState> state) { _likelihoodState = std::move(state); }
+
     bpp::SiteContainer const* sites;
     size_t particleID;
 private:
+    std::shared_ptr<const bpp::SubstitutionModel> _model;
+    std::shared_ptr<bpp::TreeTemplate<bpp::Node>> _tree;
+    std::shared_ptr<const bpp::DiscreteDistribution> _rateDist;
+    std::shared_ptr<const LikelihoodState> _likelihoodState;
 };
 
 }} // Namespaces
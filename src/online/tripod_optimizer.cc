@@ -10,11 +10,16 @@ namespace sts { namespace online {
 
 const double TripodOptimizer::TOLERANCE = 1e-3;
 
-TripodOptimizer::TripodOptimizer(CompositeTreeLikelihood& ctl, const bpp::Node* insertEdge, const std::string& newLeafName, double d) :
-        _ctl(ctl), _insertEdge(insertEdge), _newLeafName(newLeafName)
+TripodOptimizer::TripodOptimizer(CompositeTreeLikelihood& ctl, const bpp::Node* insertEdge, size_t taxonIndex, double d) :
+        _ctl(ctl), _insertEdge(insertEdge), _taxonIndex(taxonIndex),
+        _context(ctl.createAttachmentContext(*insertEdge, taxonIndex))
 {
     this->d = d;
 }
+
+TripodOptimizer::TripodOptimizer(CompositeTreeLikelihood& ctl, const bpp::Node* insertEdge, const std::string& newLeafName, double d) :
+        TripodOptimizer(ctl, insertEdge, ctl.taxonIndex(newLeafName), d)
+{}
     
 double minimize(std::function<double(double)> fn,
                 double rawStart,
@@ -49,7 +54,7 @@ double minimize(std::function<double(double)> fn,
 double TripodOptimizer::optimizeDistal(const double distal_start, const double pendant, size_t max_iters)
 {
     auto fn = [&](double distal) {
-        return - _ctl(*_insertEdge, _newLeafName, pendant, distal, d-distal);
+        return - _context->logLikelihood(pendant, distal);
     };
     return minimize(fn, distal_start, 0, d, max_iters);
 }
@@ -58,7 +63,7 @@ double TripodOptimizer::optimizeDistal(const double distal_start, const double p
 double TripodOptimizer::optimizePendant(const double distal, const double pendant_start, size_t max_iters)
 {
     auto fn = [&](double pendant) {
-        return - _ctl(*_insertEdge, _newLeafName, pendant, distal, d-distal);
+        return - _context->logLikelihood(pendant, distal);
     };
 
     return minimize(fn, pendant_start, 0, 2.0, max_iters);
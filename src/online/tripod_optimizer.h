@@ -5,6 +5,7 @@
 #include <string>
 
 //#include "attachment_likelihood.h"
+#include "attachment_context.h"
 #include "composite_tree_likelihood.h"
 
 namespace sts { namespace online {
@@ -14,6 +15,7 @@ class TripodOptimizer
 public:
     const static double TOLERANCE;
 
+    TripodOptimizer(CompositeTreeLikelihood& ctl, const bpp::Node* insertEdge, size_t taxonIndex, double d);
     TripodOptimizer(CompositeTreeLikelihood& ctl, const bpp::Node* insertEdge, const std::string& newLeafName, double d);
 
     virtual ~TripodOptimizer(){}
@@ -27,8 +29,10 @@ public:
 private:
     CompositeTreeLikelihood& _ctl;
     const bpp::Node* _insertEdge;
-    const std::string& _newLeafName;
+    size_t _taxonIndex;
     double d;
+    // Keeps the partials of the side of the attachment that does not change during a sweep
+    std::unique_ptr<AttachmentContext> _context;
 };
 
 }} // namespace sts::online
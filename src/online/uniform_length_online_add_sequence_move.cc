@@ -34,10 +34,10 @@ UniformLengthOnlineAddSequenceMove::UniformLengthOnlineAddSequenceMove(Composite
 // distal position is selected from a uniform distrbution across the edge length.
 // pendant length is extracted from branchLengthProposer passed in at instace creation.
 // 
-AttachmentProposal UniformLengthOnlineAddSequenceMove::propose(const std::string&, smc::particle<TreeParticle>& particle, smc::rng* rng)
+AttachmentProposal UniformLengthOnlineAddSequenceMove::propose(size_t, TreeParticle& particle, smc::rng* rng)
 {
-    TreeParticle* value = particle.GetValuePointer();
-    unique_ptr<TreeTemplate<bpp::Node>>& tree = value->tree;
+    TreeParticle* value = &particle;
+    TreeTemplate<bpp::Node>* tree = &value->mutableTree();
 
     std::vector<bpp::Node*> nodes = onlineAvailableEdges(*tree);
     std::vector<double> lengths;
@@ -23,10 +23,10 @@ UniformOnlineAddSequenceMove::UniformOnlineAddSequenceMove(CompositeTreeLikeliho
     branchLengthProposer(branchLengthProposer)
 { }
 
-AttachmentProposal UniformOnlineAddSequenceMove::propose(const std::string& leafName, smc::particle<TreeParticle>& particle, smc::rng* rng)
+AttachmentProposal UniformOnlineAddSequenceMove::propose(size_t taxonIndex, TreeParticle& particle, smc::rng* rng)
 {
-    TreeParticle* value = particle.GetValuePointer();
-    unique_ptr<TreeTemplate<bpp::Node>>& tree = value->tree;
+    TreeParticle* value = &particle;
+    TreeTemplate<bpp::Node>* tree = &value->mutableTree();
 
     size_t idx = rng->UniformDiscrete(0, tree->getNumberOfNodes() - 3);
     std::vector<bpp::Node*> nodes = tree->getNodes();
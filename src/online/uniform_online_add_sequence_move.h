@@ -26,7 +26,7 @@ public:
                                  const std::vector<std::string>& taxaToAdd,
                                  std::function<std::pair<double,double>(smc::rng*)> branchLengthProposer);
 protected:
-    virtual AttachmentProposal propose(const std::string& leafName, smc::particle<TreeParticle>& particle, smc::rng* rng);
+    virtual AttachmentProposal propose(size_t taxonIndex, TreeParticle& particle, smc::rng* rng);
     std::function<std::pair<double,double>(smc::rng*)> branchLengthProposer;
 };
 
@@ -6,13 +6,18 @@
 #include <vector>
 #include <numeric>
 
+#include "alias_table.h"
+
 namespace sts { namespace online {
 
+/// \brief Draws values with probabilities proportional to their weights
+///
+/// An #sts::online::AliasTable is built on the first draw after the weights change, so that repeated draws cost O(1).
 template<typename T>
 class WeightedSelector
 {
 public:
-    WeightedSelector(smc::rng& rng): _rng(rng){};
+    WeightedSelector(smc::rng& rng): _rng(rng), _stale(true){};
     WeightedSelector(smc::rng& rng, const std::vector<T>& v, const std::vector<double>& weights);
 
     void push_back(T t, const double weight);
@@ -25,6 +30,8 @@ private:
     std::vector<T> values;
     std::vector<double> weights;
     smc::rng& _rng;
+    mutable AliasTable _table;
+    mutable bool _stale;
 
     size_t choose_index() const;
 };
@@ -34,7 +41,8 @@ WeightedSelector<T>::WeightedSelector(smc::rng& rng, const std::vector<T>& v,
                                   const std::vector<double>& weights) :
     values(v),
     weights(weights),
-    _rng(rng)
+    _rng(rng),
+    _stale(true)
 {
     if(values.size() != weights.size())
         throw std::runtime_error("Number of values does not match number of weights.");
@@ -46,22 +54,17 @@ void WeightedSelector<T>::push_back(T t, const double weight)
 {
     values.push_back(t);
     weights.push_back(weight);
+    _stale = true;
 }
 
 template<typename T>
 size_t WeightedSelector<T>::choose_index() const
 {
-    std::vector<unsigned int> indices(size());
-
-    _rng.Multinomial(1, size(), weights.data(), indices.data());
-    size_t i = 0;
-    for(; i < size(); i++) {
-        if(indices[i] > 0) {
-            assert(indices[i] == 1);
-            break;
-        }
+    if(_stale) {
+        _table.assign(weights);
+        _stale = false;
     }
-    return i;
+    return _table.draw(_rng);
 }
 
 
@@ -0,0 +1,50 @@
+#include "gtest/gtest.h"
+
+#include <cmath>
+#include <stdexcept>
+#include <vector>
+
+#include "adaptive_population.h"
+
+namespace sts { namespace test { namespace adaptive_population {
+
+using namespace sts::online;
+
+TEST(AdaptivePopulation, FollowsTheLastGeneration)
+{
+    const AdaptivePopulation population(10, 100);
+
+    // Collapsed ESS, or few distinct particles left after resampling
+    EXPECT_EQ(80u, population.next(40, 10.0, 40));
+    EXPECT_EQ(80u, population.next(40, 39.0, 12));
+    // Healthy
+    EXPECT_EQ(40u, population.next(40, 30.0, 30));
+    // Easy
+    EXPECT_EQ(20u, population.next(40, 39.5, 38));
+
+    // Within the bounds
+    EXPECT_EQ(100u, population.next(60, 1.0, 1));
+    EXPECT_EQ(10u, population.next(12, 12.0, 12));
+
+    EXPECT_THROW(AdaptivePopulation(0, 10), std::invalid_argument);
+    EXPECT_THROW(AdaptivePopulation(10, 5), std::invalid_argument);
+}
+
+TEST(AdaptivePopulation, SystematicResample)
+{
+    const std::vector<double> logWeights = {std::log(0.5), -INFINITY, std::log(0.25), std::log(0.25)};
+
+    EXPECT_EQ(std::vector<size_t>({0, 0, 2, 3}), systematicResample(logWeights, 4, 0.5));
+    EXPECT_EQ(std::vector<size_t>({0, 0, 0, 0, 2, 2, 3, 3}), systematicResample(logWeights, 8, 0.0));
+    EXPECT_EQ(std::vector<size_t>({0, 3}), systematicResample(logWeights, 2, 0.999));
+
+    // Only the relative weights matter
+    std::vector<double> shifted(logWeights);
+    for(double& logWeight : shifted)
+        logWeight -= 1000;
+    EXPECT_EQ(systematicResample(logWeights, 6, 0.3), systematicResample(shifted, 6, 0.3));
+
+    EXPECT_THROW(systematicResample({-INFINITY, -INFINITY}, 2, 0.5), std::invalid_argument);
+}
+
+}}} // namespaces
@@ -0,0 +1,67 @@
+#include "gtest/gtest.h"
+
+#include <stdexcept>
+#include <vector>
+
+#include <gsl/gsl_rng.h>
+#include <smctc.hh>
+
+#include "alias_table.h"
+#include "weighted_selector.h"
+
+namespace sts { namespace test { namespace alias_table {
+
+using namespace sts::online;
+
+TEST(AliasTable, Frequencies)
+{
+    const std::vector<double> weights = {1.0, 0.0, 3.0, 0.5, 2.5, 3.0};
+    AliasTable table(weights);
+    ASSERT_EQ(weights.size(), table.size());
+
+    smc::rng rng(gsl_rng_mt19937, 1);
+    const size_t draws = 200000;
+    std::vector<size_t> counts(weights.size(), 0);
+    for(size_t i = 0; i < draws; i++)
+        counts[table.draw(rng)]++;
+
+    ASSERT_EQ(0u, counts[1]);
+    for(size_t i = 0; i < weights.size(); i++)
+        EXPECT_NEAR(weights[i] / 10.0, counts[i] / static_cast<double>(draws), 0.005);
+}
+
+TEST(AliasTable, Reassigned)
+{
+    AliasTable table(std::vector<double>{1.0, 1.0});
+    table.assign(3, [](size_t i) { return i == 2 ? 1.0 : 0.0; });
+    smc::rng rng(gsl_rng_mt19937, 1);
+    for(size_t i = 0; i < 100; i++)
+        ASSERT_EQ(2u, table.draw(rng));
+}
+
+TEST(AliasTable, RejectsInvalidWeights)
+{
+    AliasTable table;
+    ASSERT_THROW(table.assign(std::vector<double>{}), std::invalid_argument);
+    ASSERT_THROW(table.assign(std::vector<double>{0.0, 0.0}), std::invalid_argument);
+    ASSERT_THROW(table.assign(std::vector<double>{1.0, -0.5}), std::invalid_argument);
+}
+
+TEST(WeightedSelector, ChoiceFollowsPushedWeights)
+{
+    smc::rng rng(gsl_rng_mt19937, 1);
+    WeightedSelector<char> selector{rng};
+    selector.push_back('a', 1.0);
+    ASSERT_EQ('a', selector.choice());
+    selector.push_back('b', 0.0);
+    selector.push_back('c', 1.0);
+    size_t a = 0;
+    for(size_t i = 0; i < 10000; i++) {
+        const char c = selector.choice();
+        ASSERT_NE('b', c);
+        a += c == 'a';
+    }
+    EXPECT_NEAR(0.5, a / 10000.0, 0.03);
+}
+
+}}} // namespaces
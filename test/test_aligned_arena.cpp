@@ -0,0 +1,59 @@
+#include "gtest/gtest.h"
+
+#include "aligned_arena.h"
+
+#include <cstdint>
+
+namespace sts { namespace test { namespace aligned_arena {
+
+using namespace sts::online;
+
+bool isAligned(const void* p)
+{
+    return reinterpret_cast<std::uintptr_t>(p) % AlignedArena::ALIGNMENT == 0;
+}
+
+TEST(AlignedArena, BuffersAreAligned)
+{
+    AlignedArena arena;
+    const size_t a = arena.reserve<double>(3);
+    const size_t b = arena.reserve<float>(17);
+    const size_t c = arena.reserve<double>(1);
+    ASSERT_EQ(0u, a);
+    ASSERT_EQ(AlignedArena::ALIGNMENT, b);
+    ASSERT_EQ(AlignedArena::ALIGNMENT * 3, c);
+    ASSERT_EQ(AlignedArena::ALIGNMENT * 4, arena.size());
+
+    arena.allocate();
+    ASSERT_TRUE(isAligned(arena.at<double>(a)));
+    ASSERT_TRUE(isAligned(arena.at<float>(b)));
+    ASSERT_TRUE(isAligned(arena.at<double>(c)));
+}
+
+TEST(AlignedArena, ZeroInitialized)
+{
+    AlignedArena arena;
+    const size_t offset = arena.reserve<double>(1000);
+    arena.allocate();
+    double* buffer = arena.at<double>(offset);
+    for(size_t i = 0; i < 1000; i++)
+        ASSERT_EQ(0.0, buffer[i]);
+    buffer[999] = 1.0;
+}
+
+TEST(AlignedArena, HugePages)
+{
+    // Small arenas never use huge pages
+    AlignedArena small;
+    small.reserve<double>(10);
+    small.allocate(true);
+    ASSERT_FALSE(small.hugePages());
+
+    AlignedArena large;
+    const size_t offset = large.reserve<double>(1 << 20);
+    large.allocate(true);
+    ASSERT_TRUE(isAligned(large.at<double>(offset)));
+    large.at<double>(offset)[(1 << 20) - 1] = 1.0;
+}
+
+}}} // namespaces
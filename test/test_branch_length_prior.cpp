@@ -0,0 +1,93 @@
+#include "gtest/gtest.h"
+
+#include <cmath>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <Bpp/Phyl/Model/Nucleotide/JCnuc.h>
+#include <Bpp/Phyl/Model/RateDistribution/ConstantRateDistribution.h>
+#include <Bpp/Phyl/SitePatterns.h>
+#include <Bpp/Phyl/TreeTemplate.h>
+#include <Bpp/Seq/Alphabet/DNA.h>
+#include <Bpp/Seq/Container/VectorSiteContainer.h>
+
+#include "branch_length_prior.h"
+#include "composite_tree_likelihood.h"
+#include "simple_flexible_tree_likelihood.h"
+#include "test_trees.h"
+
+namespace sts { namespace test { namespace branch_length_prior {
+
+using namespace bpp;
+using namespace sts::online;
+
+const DNA dna;
+
+// ((t0,t1),(t2,t3))
+TreeTemplate<Node>* makeTree()
+{
+    return makeQuartet(6, {0.05, 0.1, 0.15, 0.2}, 0.1);
+}
+
+TEST(BranchLengthPrior, ExponentialSum)
+{
+    std::unique_ptr<TreeTemplate<Node>> tree(makeTree());
+    const double mean = 0.1;
+    const BranchLengthPrior exponential = BranchLengthPrior::exponential(mean);
+    const BranchLengthPrior generic([mean](double d) { return std::log(std::exp(-d / mean) / mean); });
+
+    double expected = 0;
+    for(const Node* node : tree->getNodes()) {
+        if(node->hasDistanceToFather())
+            expected += generic(node->getDistanceToFather());
+    }
+    EXPECT_NEAR(expected, generic(*tree), 1e-12);
+    EXPECT_NEAR(expected, exponential(*tree), 1e-12);
+
+    const std::vector<double> lengths = {0.1, 0.2, 0.3, 0.4, 0.5, 0.6, 0.7};
+    EXPECT_NEAR(generic(lengths.data(), lengths.size()), exponential(lengths.data(), lengths.size()), 1e-12);
+    EXPECT_EQ(-INFINITY, exponential(-0.1));
+}
+
+TEST(BranchLengthPrior, UpdatedByNode)
+{
+    VectorSiteContainer sites(&dna);
+    const std::vector<std::string> sequences = { "ACGTACGTAA", "ACGTACGAAA", "ACCTACGTAA", "TCGTACGTAT" };
+    for(size_t i = 0; i < sequences.size(); i++)
+        sites.addSequence(BasicSequence("t" + std::to_string(i), sequences[i], &dna));
+    SitePatterns patterns(&sites);
+    JCnuc model(&dna);
+    ConstantRateDistribution rateDist;
+
+    std::shared_ptr<FlexibleTreeLikelihood> calculator(new SimpleFlexibleTreeLikelihood(patterns, model, rateDist));
+    CompositeTreeLikelihood treeLike(calculator);
+    treeLike.add(BranchLengthPrior::exponential(0.1));
+
+    std::unique_ptr<TreeTemplate<Node>> tree(makeTree());
+    treeLike.initialize(model, rateDist, *tree);
+    const double logLikelihood = treeLike();
+
+    treeLike.checkpoint();
+    tree->getNode(2)->setDistanceToFather(0.3);
+    treeLike.updateNode(*tree->getNode(2));
+    const double changed = treeLike();
+
+    treeLike.initialize(model, rateDist, *tree);
+    EXPECT_NEAR(treeLike(), changed, 1e-12);
+
+    // Rejected
+    treeLike.checkpoint();
+    tree->getNode(5)->setDistanceToFather(0.5);
+    treeLike.updateNode(*tree->getNode(5));
+    treeLike();
+    tree->getNode(5)->setDistanceToFather(0.1);
+    treeLike.rollback();
+    EXPECT_EQ(changed, treeLike());
+
+    tree->getNode(2)->setDistanceToFather(0.15);
+    treeLike.updateNode(*tree->getNode(2));
+    EXPECT_NEAR(logLikelihood, treeLike(), 1e-12);
+}
+
+}}} // namespaces
@@ -0,0 +1,151 @@
+#include "gtest/gtest.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <Bpp/Phyl/Model/Nucleotide/JCnuc.h>
+#include <Bpp/Phyl/Model/RateDistribution/ConstantRateDistribution.h>
+#include <Bpp/Phyl/TreeTemplate.h>
+#include <Bpp/Seq/Alphabet/DNA.h>
+
+#include "checkpoint.h"
+#include "flat_tree.h"
+#include "tree_particle.h"
+#include "test_trees.h"
+
+namespace sts { namespace test { namespace checkpoint {
+
+using namespace bpp;
+using namespace sts::online;
+
+const DNA dna;
+const std::vector<std::string> names { "t0", "t1", "t2", "t3" };
+const std::string path = "test_checkpoint.bin";
+
+// ((t0,t1),(t2,t3)), with internal ids after the leaves
+TreeTemplate<Node>* makeTree()
+{
+    return makeQuartet(6, {0.1, 0.2, 0.3, 0.4}, 0.25);
+}
+
+TEST(Checkpoint, RoundTrip)
+{
+    std::shared_ptr<const SubstitutionModel> model(new JCnuc(&dna));
+    std::shared_ptr<const DiscreteDistribution> rateDist(new ConstantRateDistribution());
+
+    Checkpoint written;
+    written.generation = 12;
+    written.sequenceNames = { "t3", "t2" };
+    written.particles.emplace_back(model, std::unique_ptr<TreeTemplate<Node>>(makeTree()), rateDist, nullptr);
+    written.particles.push_back(written.particles[0]);
+    written.particles.push_back(written.particles[0]);
+    written.particles[2].mutableTree().getNode(2)->setDistanceToFather(0.75);
+    for(size_t i = 0; i < written.particles.size(); i++)
+        written.particles[i].particleID = 10 + i;
+    written.logWeights = { -1.5, -0.5, -2.0 };
+    written.ess = 2.5;
+    written.uniqueParticles = 2;
+    written.rngState = { 1, 2, 3, 4, 5 };
+    written.mcmcTunings = { OnlineMCMCMove::Tuning { 0.5, 10, 4 }, OnlineMCMCMove::Tuning { 3.0, 7, 7 } };
+    ProposalRecord record;
+    record.T = 11;
+    record.originalLogLike = -100;
+    record.newLogLike = -110;
+    record.originalLogWeight = -1;
+    record.newLogWeight = -1.25;
+    record.proposal = AttachmentProposal { nullptr, -2.0, 0.01, 1.0, 0.02, 2.0, 0.015, 0.025, "lcfit" };
+    written.proposalRecords = { record };
+    written.output = "{\"generations\":[]}";
+    writeCheckpoint(path, written);
+
+    const Checkpoint read = readCheckpoint(path, names, model, rateDist, nullptr);
+    EXPECT_EQ(12u, read.generation);
+    EXPECT_EQ(written.sequenceNames, read.sequenceNames);
+    ASSERT_EQ(3u, read.particles.size());
+    for(size_t i = 0; i < read.particles.size(); i++) {
+        EXPECT_EQ(FlatTree(written.particles[i].tree()), FlatTree(read.particles[i].tree()));
+        EXPECT_EQ(10 + i, read.particles[i].particleID);
+        EXPECT_EQ(model.get(), &read.particles[i].model());
+    }
+    // Copies still share their tree
+    EXPECT_EQ(&read.particles[0].tree(), &read.particles[1].tree());
+    EXPECT_NE(&read.particles[0].tree(), &read.particles[2].tree());
+    EXPECT_EQ(names, read.particles[0].tree().getLeavesNames());
+
+    EXPECT_EQ(written.logWeights, read.logWeights);
+    EXPECT_EQ(2.5, read.ess);
+    EXPECT_EQ(2u, read.uniqueParticles);
+    EXPECT_EQ(written.rngState, read.rngState);
+    ASSERT_EQ(2u, read.mcmcTunings.size());
+    EXPECT_EQ(0.5, read.mcmcTunings[0].lambda);
+    EXPECT_EQ(10u, read.mcmcTunings[0].attempted);
+    EXPECT_EQ(7u, read.mcmcTunings[1].accepted);
+    ASSERT_EQ(1u, read.proposalRecords.size());
+    EXPECT_EQ(11, read.proposalRecords[0].T);
+    EXPECT_EQ(-1.25, read.proposalRecords[0].newLogWeight);
+    EXPECT_EQ(0.025, read.proposalRecords[0].proposal.mlPendantBranchLength);
+    EXPECT_EQ("lcfit", read.proposalRecords[0].proposal.proposalMethodName);
+    EXPECT_EQ(written.output, read.output);
+
+    std::remove(path.c_str());
+}
+
+TEST(Checkpoint, RejectsOtherFiles)
+{
+    std::shared_ptr<const SubstitutionModel> model(new JCnuc(&dna));
+    std::shared_ptr<const DiscreteDistribution> rateDist(new ConstantRateDistribution());
+
+    Checkpoint written;
+    written.generation = 2;
+    written.particles.emplace_back(model, std::unique_ptr<TreeTemplate<Node>>(makeTree()), rateDist, nullptr);
+    written.logWeights = { 0.0 };
+    written.ess = 1;
+    written.uniqueParticles = 1;
+    writeCheckpoint(path, written);
+
+    // Cut short
+    std::string content;
+    {
+        std::ifstream in(path, std::ios::binary);
+        content.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    std::ofstream(path, std::ios::binary) << content.substr(0, content.size() / 2);
+    EXPECT_THROW(readCheckpoint(path, names, model, rateDist, nullptr), std::runtime_error);
+
+    // Counts beyond the end of the file, or an index past the trees
+    const auto corrupt = [&](size_t offset, uint64_t value, size_t size) {
+        std::string corrupted(content);
+        corrupted.replace(offset, size, reinterpret_cast<const char*>(&value), size);
+        std::ofstream(path, std::ios::binary) << corrupted;
+    };
+    const size_t namesOffset = 8 + sizeof(uint32_t) + sizeof(uint64_t);
+    const size_t treesOffset = namesOffset + sizeof(uint64_t);
+    const size_t nodesOffset = treesOffset + sizeof(uint64_t);
+    // 7 nodes of 3 ids, and their branch lengths
+    const size_t particlesOffset = nodesOffset + sizeof(uint64_t) + 21 * sizeof(int32_t) +
+                                   sizeof(uint64_t) + 7 * sizeof(double);
+    corrupt(particlesOffset + sizeof(uint64_t), 0, sizeof(uint32_t));
+    ASSERT_NO_THROW(readCheckpoint(path, names, model, rateDist, nullptr));
+    for(size_t offset : { namesOffset, treesOffset, nodesOffset }) {
+        for(uint64_t count : { uint64_t(1) << 40, ~uint64_t(0), ~uint64_t(0) / sizeof(int32_t) + 1 }) {
+            corrupt(offset, count, sizeof(uint64_t));
+            EXPECT_THROW(readCheckpoint(path, names, model, rateDist, nullptr), std::runtime_error);
+        }
+    }
+    corrupt(particlesOffset + sizeof(uint64_t), 1, sizeof(uint32_t));
+    EXPECT_THROW(readCheckpoint(path, names, model, rateDist, nullptr), std::runtime_error);
+
+    std::ofstream(path, std::ios::binary) << "not a checkpoint";
+    EXPECT_THROW(readCheckpoint(path, names, model, rateDist, nullptr), std::runtime_error);
+
+    std::remove(path.c_str());
+    EXPECT_THROW(readCheckpoint(path, names, model, rateDist, nullptr), std::runtime_error);
+}
+
+}}} // namespaces
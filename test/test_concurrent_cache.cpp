@@ -0,0 +1,60 @@
+#include "gtest/gtest.h"
+
+#include "concurrent_cache.h"
+#include "parallel.h"
+
+#include <atomic>
+#include <stdexcept>
+#include <vector>
+
+namespace sts { namespace test { namespace concurrent_cache {
+
+using namespace sts::online;
+
+TEST(ConcurrentCache, ComputedOncePerEpoch)
+{
+    ConcurrentCache<size_t, double> cache(4);
+    size_t calls = 0;
+    auto compute = [&calls]() { calls++; return 0.5; };
+    bool computed;
+
+    ASSERT_EQ(0.5, cache.getOrCompute(1, compute, &computed));
+    ASSERT_TRUE(computed);
+    ASSERT_EQ(0.5, cache.getOrCompute(1, compute, &computed));
+    ASSERT_FALSE(computed);
+    ASSERT_EQ(1u, calls);
+
+    cache.newEpoch();
+    cache.getOrCompute(1, compute, &computed);
+    ASSERT_TRUE(computed);
+    ASSERT_EQ(2u, calls);
+}
+
+TEST(ConcurrentCache, WorkersShareValues)
+{
+    ConcurrentCache<size_t, size_t> cache(3);
+    const size_t keys = 10;
+    std::vector<std::atomic<int>> calls(keys);
+    for(std::atomic<int>& c : calls)
+        c = 0;
+    std::vector<size_t> values(200);
+    parallelFor(values.size(), 4, [&](size_t i) {
+        const size_t key = i % keys;
+        values[i] = cache.getOrCompute(key, [&]() { calls[key]++; return key * key; });
+    });
+    for(size_t i = 0; i < values.size(); i++)
+        ASSERT_EQ((i % keys) * (i % keys), values[i]);
+    for(size_t key = 0; key < keys; key++)
+        ASSERT_EQ(1, calls[key]) << "key " << key;
+}
+
+TEST(ConcurrentCache, FailuresAreNotCached)
+{
+    ConcurrentCache<size_t, double> cache;
+    ASSERT_THROW(cache.getOrCompute(3, []() -> double { throw std::runtime_error("failed"); }), std::runtime_error);
+    bool computed;
+    ASSERT_EQ(1.0, cache.getOrCompute(3, []() { return 1.0; }, &computed));
+    ASSERT_TRUE(computed);
+}
+
+}}} // namespaces
@@ -0,0 +1,120 @@
+#include "gtest/gtest.h"
+
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <Bpp/Phyl/TreeTemplate.h>
+
+#include "flat_tree.h"
+
+namespace sts { namespace test { namespace flat_tree {
+
+using namespace bpp;
+using namespace sts::online;
+
+// ((a:0.1,b:0.2):0.3,c:0.4); with ids following the alignment order
+TreeTemplate<Node>* makeTree()
+{
+    Node* root = new Node(4);
+    Node* inner = new Node(3);
+    Node* a = new Node(0, "a");
+    Node* b = new Node(1, "b");
+    Node* c = new Node(2, "c");
+    inner->addSon(a);
+    inner->addSon(b);
+    root->addSon(inner);
+    root->addSon(c);
+    a->setDistanceToFather(0.1);
+    b->setDistanceToFather(0.2);
+    inner->setDistanceToFather(0.3);
+    c->setDistanceToFather(0.4);
+    return new TreeTemplate<Node>(root);
+}
+
+TEST(FlatTree, MirrorsTopology)
+{
+    std::unique_ptr<TreeTemplate<Node>> tree(makeTree());
+    FlatTree flat(*tree);
+
+    ASSERT_EQ(5u, flat.size());
+    ASSERT_EQ(4, flat.root());
+    ASSERT_EQ(FlatTree::NONE, flat.parent(4));
+    ASSERT_EQ(3, flat.parent(0));
+    ASSERT_EQ(4, flat.parent(2));
+    ASSERT_EQ(1, flat.sibling(0));
+    ASSERT_EQ(3, flat.sibling(2));
+    ASSERT_TRUE(flat.isLeaf(2));
+    ASSERT_FALSE(flat.isLeaf(3));
+    ASSERT_EQ(0.3, flat.branchLength(3));
+
+    // Every node comes after its children
+    std::vector<int> position(flat.capacity(), -1);
+    for(size_t i = 0; i < flat.postOrder().size(); i++)
+        position[flat.postOrder()[i]] = i;
+    for(int id : flat.postOrder()) {
+        if(!flat.isLeaf(id)) {
+            ASSERT_LT(position[flat.child(id, 0)], position[id]);
+            ASSERT_LT(position[flat.child(id, 1)], position[id]);
+        }
+    }
+}
+
+TEST(FlatTree, RoundTrip)
+{
+    std::unique_ptr<TreeTemplate<Node>> tree(makeTree());
+    FlatTree flat(*tree);
+    flat.setBranchLength(2, 0.5);
+
+    const std::vector<std::string> names = {"a", "b", "c"};
+    std::unique_ptr<TreeTemplate<Node>> copy(flat.toTree(names));
+    FlatTree other(*copy);
+    ASSERT_EQ(flat.postOrder(), other.postOrder());
+    for(int id : flat.postOrder()) {
+        ASSERT_EQ(flat.parent(id), other.parent(id));
+        ASSERT_EQ(flat.branchLength(id), other.branchLength(id));
+    }
+    ASSERT_EQ("c", copy->getRootNode()->getSon(1)->getName());
+}
+
+TEST(FlatTree, EqualWhateverTheOrderOfChildren)
+{
+    std::unique_ptr<TreeTemplate<Node>> tree(makeTree());
+    std::unique_ptr<TreeTemplate<Node>> swapped(makeTree());
+    swapped->getRootNode()->swap(0, 1);
+    ASSERT_EQ(FlatTree(*tree), FlatTree(*swapped));
+    ASSERT_EQ(FlatTree(*tree).hash(), FlatTree(*swapped).hash());
+
+    swapped->getNode(1)->setDistanceToFather(0.25);
+    ASSERT_NE(FlatTree(*tree), FlatTree(*swapped));
+
+    // ((a:0.1,c:0.2):0.3,b:0.4); has the same branch lengths by position
+    Node* root = new Node(4);
+    Node* inner = new Node(3);
+    Node* a = new Node(0, "a");
+    Node* b = new Node(1, "b");
+    Node* c = new Node(2, "c");
+    inner->addSon(a);
+    inner->addSon(c);
+    root->addSon(inner);
+    root->addSon(b);
+    a->setDistanceToFather(0.1);
+    c->setDistanceToFather(0.2);
+    inner->setDistanceToFather(0.3);
+    b->setDistanceToFather(0.4);
+    TreeTemplate<Node> other(root);
+    ASSERT_NE(FlatTree(*tree), FlatTree(other));
+}
+
+TEST(FlatTree, RejectsMultifurcations)
+{
+    Node* root = new Node(3);
+    for(int i = 0; i < 3; i++)
+        root->addSon(new Node(i));
+    TreeTemplate<Node> tree(root);
+    FlatTree flat;
+    ASSERT_THROW(flat.assign(tree), std::invalid_argument);
+}
+
+}}} // namespaces
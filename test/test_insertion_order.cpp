@@ -0,0 +1,65 @@
+#include "gtest/gtest.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <Bpp/Phyl/Model/Nucleotide/JCnuc.h>
+#include <Bpp/Phyl/Model/RateDistribution/ConstantRateDistribution.h>
+#include <Bpp/Phyl/SitePatterns.h>
+#include <Bpp/Phyl/TreeTemplate.h>
+#include <Bpp/Seq/Alphabet/DNA.h>
+#include <Bpp/Seq/Container/VectorSiteContainer.h>
+
+#include "composite_tree_likelihood.h"
+#include "insertion_order.h"
+#include "simple_flexible_tree_likelihood.h"
+#include "tree_particle.h"
+#include "test_trees.h"
+
+namespace sts { namespace test { namespace insertion_order {
+
+using namespace bpp;
+using namespace sts::online;
+
+const DNA dna;
+
+TEST(InsertionOrder, ConfidentFirst)
+{
+    VectorSiteContainer sites(&dna);
+    const std::vector<std::string> sequences = {
+        "ACGTACGTAAACGTACGTAAACGTACGTAA",
+        "ACGTACGAAAACGTACGAAAACGTTCGAAA",
+        "TCCTAGGTAATCCAACGTATTCCTACGTAT",
+        "TCCTAGGTATTCCAACCTATTCGTACCTAT",
+        // Copy of t2
+        "TCCTAGGTAATCCAACGTATTCCTACGTAT",
+        // Unrelated to all
+        "GAAGCTAGCGGAAGGTTGCGGAAGCTTGCG" };
+    for(size_t i = 0; i < sequences.size(); i++)
+        sites.addSequence(BasicSequence("t" + std::to_string(i), sequences[i], &dna));
+    SitePatterns patterns(&sites);
+    JCnuc model(&dna);
+    ConstantRateDistribution rateDist;
+
+    std::shared_ptr<FlexibleTreeLikelihood> calculator(new SimpleFlexibleTreeLikelihood(patterns, model, rateDist));
+    CompositeTreeLikelihood treeLike(calculator);
+
+    std::vector<TreeParticle> trees;
+    trees.emplace_back(std::shared_ptr<const SubstitutionModel>(model.clone()),
+                       std::unique_ptr<TreeTemplate<Node>>(makeQuartet(10, {0.1, 0.1, 0.1, 0.1}, 0.2)),
+                       std::shared_ptr<const DiscreteDistribution>(rateDist.clone()),
+                       &sites);
+
+    const std::vector<PlacementScore> scores = orderByPlacement(treeLike, trees, {5, 4}, {0.0, 0.1}, 1);
+    ASSERT_EQ(2u, scores.size());
+    EXPECT_EQ(4u, scores[0].taxonIndex);
+    EXPECT_EQ(5u, scores[1].taxonIndex);
+    for(const PlacementScore& score : scores) {
+        EXPECT_GT(score.confidence, 0.0);
+        EXPECT_LE(score.confidence, 1.0);
+    }
+    EXPECT_GT(scores[0].confidence, scores[1].confidence);
+}
+
+}}} // namespaces
@@ -0,0 +1,246 @@
+#include "gtest/gtest.h"
+
+#include "likelihood_kernels.h"
+
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+namespace sts { namespace test { namespace likelihood_kernels {
+
+using namespace sts::online;
+
+const double TOLERANCE = 1e-12;
+// Partials stored as float
+const double SINGLE_TOLERANCE = 1e-5;
+
+/// Random inputs for a kernel call
+struct KernelInput
+{
+    KernelInput(int stateCount, int rateCount, int patternCount) :
+        stateCount(stateCount),
+        rateCount(rateCount),
+        patternCount(patternCount)
+    {
+        std::mt19937 gen(stateCount * 100 + rateCount);
+        std::uniform_real_distribution<double> unif(0.0, 1.0);
+        auto fill = [&](std::vector<double>& v, size_t n) {
+            v.resize(n);
+            for(double& x : v) x = unif(gen);
+        };
+        const size_t partialsSize = stateCount * rateCount * patternCount;
+        fill(partials1, partialsSize);
+        fill(partials2, partialsSize);
+        fill(matrices1, stateCount * stateCount * rateCount);
+        fill(matrices2, stateCount * stateCount * rateCount);
+        fill(weights, rateCount);
+        fill(frequencies, stateCount);
+        states1.resize(patternCount);
+        states2.resize(patternCount);
+        for(int k = 0; k < patternCount; k++) {
+            // Include some gaps
+            states1[k] = gen() % (stateCount + 1);
+            states2[k] = gen() % (stateCount + 1);
+        }
+    }
+
+    int stateCount, rateCount, patternCount;
+    std::vector<double> partials1, partials2, matrices1, matrices2, weights, frequencies;
+    std::vector<int> states1, states2;
+};
+
+template<typename T>
+void expectNear(const std::vector<double>& expected, const std::vector<T>& actual, double tolerance)
+{
+    ASSERT_EQ(expected.size(), actual.size());
+    for(size_t i = 0; i < expected.size(); i++)
+        ASSERT_NEAR(expected[i], actual[i], tolerance) << "at index " << i;
+}
+
+/// Compare \c kernels against the generic double precision instantiation
+template<typename T>
+void compareWithGeneric(const BasicLikelihoodKernels<T>& kernels, const KernelInput& in, double tolerance=TOLERANCE)
+{
+    const LikelihoodKernels generic = kernels::makeLikelihoodKernels<double, 0, 0>("generic");
+    const int s = in.stateCount, r = in.rateCount, p = in.patternCount;
+    // Inputs as stored by the kernels under test
+    const std::vector<T> partials1(in.partials1.begin(), in.partials1.end());
+    const std::vector<T> partials2(in.partials2.begin(), in.partials2.end());
+    const std::vector<double> expectedPartials1(partials1.begin(), partials1.end());
+    const std::vector<double> expectedPartials2(partials2.begin(), partials2.end());
+    std::vector<double> expected(s * r * p);
+    std::vector<T> actual(s * r * p);
+
+    generic.updatePartialsUndefinedUndefined(expectedPartials1.data(), in.matrices1.data(), expectedPartials2.data(), in.matrices2.data(), expected.data(), s, r, p);
+    kernels.updatePartialsUndefinedUndefined(partials1.data(), in.matrices1.data(), partials2.data(), in.matrices2.data(), actual.data(), s, r, p);
+    expectNear(expected, actual, tolerance);
+
+    generic.updatePartialsKnownUndefined(in.states1.data(), in.matrices1.data(), expectedPartials2.data(), in.matrices2.data(), expected.data(), s, r, p);
+    kernels.updatePartialsKnownUndefined(in.states1.data(), in.matrices1.data(), partials2.data(), in.matrices2.data(), actual.data(), s, r, p);
+    expectNear(expected, actual, tolerance);
+
+    generic.updatePartialsKnownKnown(in.states1.data(), in.matrices1.data(), in.states2.data(), in.matrices2.data(), expected.data(), s, r, p);
+    kernels.updatePartialsKnownKnown(in.states1.data(), in.matrices1.data(), in.states2.data(), in.matrices2.data(), actual.data(), s, r, p);
+    expectNear(expected, actual, tolerance);
+
+    // Root partials are double precision whatever the storage
+    std::vector<double> expectedRoot(s * p), actualRoot(s * p);
+    generic.calculateBranchLikelihood(expectedRoot.data(), expectedPartials1.data(), expectedPartials2.data(), in.matrices1.data(), in.weights.data(), s, r, p);
+    kernels.calculateBranchLikelihood(actualRoot.data(), partials1.data(), partials2.data(), in.matrices1.data(), in.weights.data(), s, r, p);
+    expectNear(expectedRoot, actualRoot, TOLERANCE);
+
+    generic.calculateBranchLikelihoodStates(expectedRoot.data(), expectedPartials1.data(), in.states2.data(), in.matrices1.data(), in.weights.data(), s, r, p);
+    kernels.calculateBranchLikelihoodStates(actualRoot.data(), partials1.data(), in.states2.data(), in.matrices1.data(), in.weights.data(), s, r, p);
+    expectNear(expectedRoot, actualRoot, TOLERANCE);
+
+    generic.integratePartials(expectedPartials1.data(), in.weights.data(), expectedRoot.data(), s, r, p);
+    kernels.integratePartials(partials1.data(), in.weights.data(), actualRoot.data(), s, r, p);
+    expectNear(expectedRoot, actualRoot, TOLERANCE);
+
+    std::vector<double> expectedPattern(p), actualPattern(p);
+    generic.calculatePatternLikelihood(expectedRoot.data(), in.frequencies.data(), expectedPattern.data(), s, p);
+    kernels.calculatePatternLikelihood(expectedRoot.data(), in.frequencies.data(), actualPattern.data(), s, p);
+    expectNear(expectedPattern, actualPattern, TOLERANCE);
+}
+
+/// The fused derivative kernels must agree with the branch likelihood computed with each matrix in turn
+template<typename T>
+void compareDerivativesWithBranchLikelihood(const BasicLikelihoodKernels<T>& kernels, const KernelInput& in, double tolerance=TOLERANCE)
+{
+    const int s = in.stateCount, r = in.rateCount, p = in.patternCount;
+    const std::vector<T> partials1(in.partials1.begin(), in.partials1.end());
+    const std::vector<T> partials2(in.partials2.begin(), in.partials2.end());
+    // Any matrix will do for the second derivative
+    std::vector<double> d2Matrices(in.matrices1.rbegin(), in.matrices1.rend());
+    const double* matrices[3] = { in.matrices1.data(), in.matrices2.data(), d2Matrices.data() };
+
+    std::vector<double> rootPartials(s * p);
+    std::vector<std::vector<double> > expected(3, std::vector<double>(p)), actual(3, std::vector<double>(p));
+
+    for(int i = 0; i < 3; i++) {
+        kernels.calculateBranchLikelihood(rootPartials.data(), partials1.data(), partials2.data(), matrices[i], in.weights.data(), s, r, p);
+        kernels.calculatePatternLikelihood(rootPartials.data(), in.frequencies.data(), expected[i].data(), s, p);
+    }
+    kernels.calculateBranchDerivatives(actual[0].data(), actual[1].data(), actual[2].data(), partials1.data(), partials2.data(),
+                                       matrices[0], matrices[1], matrices[2], in.weights.data(), in.frequencies.data(), s, r, p);
+    for(int i = 0; i < 3; i++)
+        expectNear(expected[i], actual[i], tolerance);
+
+    for(int i = 0; i < 3; i++) {
+        kernels.calculateBranchLikelihoodStates(rootPartials.data(), partials1.data(), in.states2.data(), matrices[i], in.weights.data(), s, r, p);
+        kernels.calculatePatternLikelihood(rootPartials.data(), in.frequencies.data(), expected[i].data(), s, p);
+    }
+    kernels.calculateBranchDerivativesStates(actual[0].data(), actual[1].data(), actual[2].data(), partials1.data(), in.states2.data(),
+                                             matrices[0], matrices[1], matrices[2], in.weights.data(), in.frequencies.data(), s, r, p);
+    // Gaps contribute nothing to the derivatives, rows of derivative matrices summing to 0
+    for(int k = 0; k < p; k++) {
+        if(in.states2[k] >= s) {
+            expected[1][k] = 0.0;
+            expected[2][k] = 0.0;
+        }
+    }
+    for(int i = 0; i < 3; i++)
+        expectNear(expected[i], actual[i], tolerance);
+}
+
+/// Attaching transformed pendant partials must match the attachment kernel
+template<typename T>
+void compareProductWithBranchLikelihood(const BasicLikelihoodKernels<T>& kernels, const KernelInput& in, double tolerance)
+{
+    const int s = in.stateCount, r = in.rateCount, p = in.patternCount;
+    const std::vector<T> partials1(in.partials1.begin(), in.partials1.end());
+    const std::vector<T> partials2(in.partials2.begin(), in.partials2.end());
+    std::vector<double> rootPartials(s * p), expected(p), actual(p);
+    std::vector<T> transformed(s * r * p);
+
+    kernels.calculateBranchLikelihood(rootPartials.data(), partials1.data(), partials2.data(), in.matrices1.data(), in.weights.data(), s, r, p);
+    kernels.calculatePatternLikelihood(rootPartials.data(), in.frequencies.data(), expected.data(), s, p);
+    kernels.transformPartials(partials2.data(), in.matrices1.data(), transformed.data(), s, r, p);
+    kernels.calculateProductLikelihood(actual.data(), partials1.data(), transformed.data(), in.weights.data(), in.frequencies.data(), s, r, p);
+    expectNear(expected, actual, tolerance);
+}
+
+TEST(LikelihoodKernels, SelectsSpecializations)
+{
+    ASSERT_STREQ("4x1", selectLikelihoodKernels(4, 1, SimdBackend::NONE).name);
+    ASSERT_STREQ("4x4", selectLikelihoodKernels(4, 4, SimdBackend::NONE).name);
+    ASSERT_STREQ("4xN", selectLikelihoodKernels(4, 6, SimdBackend::NONE).name);
+    ASSERT_STREQ("generic", selectLikelihoodKernels(20, 4, SimdBackend::NONE).name);
+    ASSERT_EQ(SimdBackend::NONE, selectLikelihoodKernels(20, 4, SimdBackend::AUTO).backend);
+}
+
+TEST(LikelihoodKernels, NucleotideOneRate)
+{
+    compareWithGeneric(selectLikelihoodKernels(4, 1, SimdBackend::NONE), KernelInput(4, 1, 57));
+}
+
+TEST(LikelihoodKernels, NucleotideFourRates)
+{
+    compareWithGeneric(selectLikelihoodKernels(4, 4, SimdBackend::NONE), KernelInput(4, 4, 57));
+}
+
+TEST(LikelihoodKernels, NucleotideManyRates)
+{
+    compareWithGeneric(selectLikelihoodKernels(4, 3, SimdBackend::NONE), KernelInput(4, 3, 57));
+}
+
+TEST(LikelihoodKernels, BranchDerivatives)
+{
+    for(int rateCount : { 1, 3, 4 }) {
+        compareDerivativesWithBranchLikelihood(selectLikelihoodKernels(4, rateCount), KernelInput(4, rateCount, 57));
+        compareDerivativesWithBranchLikelihood(selectLikelihoodKernels<float>(4, rateCount), KernelInput(4, rateCount, 57));
+    }
+    compareDerivativesWithBranchLikelihood(selectLikelihoodKernels(20, 4), KernelInput(20, 4, 11));
+}
+
+TEST(LikelihoodKernels, BatchedAttachment)
+{
+    for(int rateCount : { 1, 3, 4 }) {
+        compareProductWithBranchLikelihood(selectLikelihoodKernels(4, rateCount), KernelInput(4, rateCount, 57), TOLERANCE);
+        compareProductWithBranchLikelihood(selectLikelihoodKernels<float>(4, rateCount), KernelInput(4, rateCount, 57), SINGLE_TOLERANCE);
+    }
+    compareProductWithBranchLikelihood(selectLikelihoodKernels(20, 4), KernelInput(20, 4, 11), TOLERANCE);
+}
+
+TEST(LikelihoodKernels, BackendNames)
+{
+    for(SimdBackend backend : { SimdBackend::AUTO, SimdBackend::NONE, SimdBackend::SSE2,
+                                SimdBackend::AVX2, SimdBackend::AVX512 })
+        ASSERT_EQ(backend, simdBackendFromName(simdBackendName(backend)));
+    ASSERT_THROW(simdBackendFromName("mmx"), std::invalid_argument);
+}
+
+TEST(LikelihoodKernels, VectorizedMatchScalar)
+{
+    for(SimdBackend backend : { SimdBackend::SSE2, SimdBackend::AVX2, SimdBackend::AVX512 }) {
+        if(!simdBackendSupported(backend))
+            continue;
+        SCOPED_TRACE(simdBackendName(backend));
+        for(int rateCount : { 1, 3, 4 }) {
+            // Odd and even pattern counts exercise the remainder loops
+            for(int patternCount : { 1, 6, 57 }) {
+                const LikelihoodKernels kernels = selectLikelihoodKernels(4, rateCount, backend);
+                ASSERT_EQ(backend, kernels.backend);
+                compareWithGeneric(kernels, KernelInput(4, rateCount, patternCount));
+            }
+        }
+    }
+}
+
+TEST(LikelihoodKernels, SinglePrecisionMatchDouble)
+{
+    for(SimdBackend backend : { SimdBackend::NONE, SimdBackend::SSE2, SimdBackend::AVX2, SimdBackend::AVX512 }) {
+        if(!simdBackendSupported(backend))
+            continue;
+        SCOPED_TRACE(simdBackendName(backend));
+        for(int rateCount : { 1, 4 }) {
+            for(int patternCount : { 1, 57 }) {
+                const SingleLikelihoodKernels kernels = selectLikelihoodKernels<float>(4, rateCount, backend);
+                compareWithGeneric(kernels, KernelInput(4, rateCount, patternCount), SINGLE_TOLERANCE);
+            }
+        }
+    }
+    compareWithGeneric(selectLikelihoodKernels<float>(20, 4), KernelInput(20, 4, 11), SINGLE_TOLERANCE);
+}
+
+}}} // namespaces
@@ -0,0 +1,227 @@
+#include "gtest/gtest.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <Bpp/Phyl/Model/Nucleotide/JCnuc.h>
+#include <Bpp/Phyl/Model/RateDistribution/ConstantRateDistribution.h>
+#include <Bpp/Phyl/SitePatterns.h>
+#include <Bpp/Phyl/TreeTemplate.h>
+#include <Bpp/Seq/Alphabet/DNA.h>
+#include <Bpp/Seq/Container/VectorSiteContainer.h>
+
+#include "simple_flexible_tree_likelihood.h"
+#include "test_trees.h"
+
+namespace sts { namespace test { namespace likelihood_state {
+
+using namespace bpp;
+using namespace sts::online;
+
+const DNA dna;
+
+struct LikelihoodStateTest : public ::testing::Test
+{
+    LikelihoodStateTest() : sites(&dna), model(&dna)
+    {
+        const std::vector<std::string> sequences = {
+            "ACGTACGTAAGTTCAGACCA", "ACGTACGAAAGTTCAGATCA", "ACCTACGTAAGATCGGACCA",
+            "TCGTACGTATGTTCAGACGA", "ACGAACGTAAGTTGAGACCT" };
+        for(size_t i = 0; i < sequences.size(); i++)
+            sites.addSequence(BasicSequence("t" + std::to_string(i), sequences[i], &dna));
+        patterns.reset(new SitePatterns(&sites));
+    }
+
+    // ((t0,t1),(t2,t3)), internal nodes numbered from the sequence count
+    TreeTemplate<Node>* makeTree() const { return makeQuartet(8, {0.05, 0.1, 0.15, 0.2}, 0.1); }
+
+    // t4 attached in the middle of the branch above t1
+    static void insertTaxon(TreeTemplate<Node>& tree)
+    {
+        Node* distal = tree.getNode(1);
+        Node* father = distal->getFather();
+        Node* node = new Node(5);
+        Node* leaf = new Node(4, "t4");
+        father->setSon(father->getSonPosition(distal), node);
+        node->addSon(distal);
+        node->addSon(leaf);
+        node->setDistanceToFather(0.05);
+        distal->setDistanceToFather(0.05);
+        leaf->setDistanceToFather(0.2);
+    }
+
+    double freshLogLikelihood(TreeTemplate<Node>& tree)
+    {
+        SimpleFlexibleTreeLikelihood calculator(*patterns, model, rateDist);
+        calculator.initialize(model, rateDist, tree);
+        return calculator.calculateLogLikelihood();
+    }
+
+    VectorSiteContainer sites;
+    std::unique_ptr<SitePatterns> patterns;
+    JCnuc model;
+    ConstantRateDistribution rateDist;
+};
+
+TEST_F(LikelihoodStateTest, NotKeptByDefault)
+{
+    std::unique_ptr<TreeTemplate<Node>> tree(makeTree());
+    SimpleFlexibleTreeLikelihood calculator(*patterns, model, rateDist);
+    calculator.initialize(model, rateDist, *tree);
+    calculator.calculateLogLikelihood();
+    ASSERT_EQ(nullptr, calculator.saveState());
+}
+
+TEST_F(LikelihoodStateTest, RestoredWithoutRecomputation)
+{
+    std::unique_ptr<TreeTemplate<Node>> tree(makeTree());
+    SimpleFlexibleTreeLikelihood calculator(*patterns, model, rateDist, true, SimdBackend::AUTO, false, false, true);
+    calculator.initialize(model, rateDist, *tree);
+    const double logLikelihood = calculator.calculateLogLikelihood();
+    std::shared_ptr<const LikelihoodState> state = calculator.saveState();
+    ASSERT_NE(nullptr, state);
+
+    // Evaluate another tree in between
+    std::unique_ptr<TreeTemplate<Node>> other(makeTree());
+    other->getNode(0)->setDistanceToFather(0.4);
+    calculator.initialize(model, rateDist, *other);
+    calculator.calculateLogLikelihood();
+
+    const size_t operations = AbstractFlexibleTreeLikelihood::operationCallCount;
+    calculator.initialize(model, rateDist, *tree, state);
+    ASSERT_EQ(logLikelihood, calculator.calculateLogLikelihood());
+    ASSERT_EQ(operations, AbstractFlexibleTreeLikelihood::operationCallCount);
+}
+
+TEST_F(LikelihoodStateTest, ChangesAreCopiedOnWrite)
+{
+    std::unique_ptr<TreeTemplate<Node>> tree(makeTree());
+    SimpleFlexibleTreeLikelihood calculator(*patterns, model, rateDist, true, SimdBackend::AUTO, false, false, true);
+    calculator.initialize(model, rateDist, *tree);
+    const double logLikelihood = calculator.calculateLogLikelihood();
+    std::shared_ptr<const LikelihoodState> state = calculator.saveState();
+
+    // A copy of the particle changes a branch: only the partials of its ancestors are recomputed
+    std::unique_ptr<TreeTemplate<Node>> copy(tree->clone());
+    copy->getNode(2)->setDistanceToFather(0.3);
+    const double expected = freshLogLikelihood(*copy);
+    size_t operations = AbstractFlexibleTreeLikelihood::operationCallCount;
+    calculator.initialize(model, rateDist, *copy, state);
+    ASSERT_EQ(expected, calculator.calculateLogLikelihood());
+    ASSERT_EQ(operations + 2, AbstractFlexibleTreeLikelihood::operationCallCount);
+
+    // The state of the original was left as is
+    operations = AbstractFlexibleTreeLikelihood::operationCallCount;
+    calculator.initialize(model, rateDist, *tree, state);
+    ASSERT_EQ(logLikelihood, calculator.calculateLogLikelihood());
+    ASSERT_EQ(operations, AbstractFlexibleTreeLikelihood::operationCallCount);
+}
+
+TEST_F(LikelihoodStateTest, InsertedTaxon)
+{
+    std::unique_ptr<TreeTemplate<Node>> tree(makeTree());
+    SimpleFlexibleTreeLikelihood calculator(*patterns, model, rateDist, true, SimdBackend::AUTO, false, false, true);
+    calculator.initialize(model, rateDist, *tree);
+    calculator.calculateLogLikelihood();
+    std::shared_ptr<const LikelihoodState> state = calculator.saveState();
+
+    insertTaxon(*tree);
+    const double expected = freshLogLikelihood(*tree);
+    const size_t operations = AbstractFlexibleTreeLikelihood::operationCallCount;
+    calculator.initialize(model, rateDist, *tree, state);
+    ASSERT_EQ(expected, calculator.calculateLogLikelihood());
+    // New node, its father and the root
+    ASSERT_EQ(operations + 3, AbstractFlexibleTreeLikelihood::operationCallCount);
+}
+
+TEST_F(LikelihoodStateTest, UpdatedTree)
+{
+    std::unique_ptr<TreeTemplate<Node>> tree(makeTree());
+    SimpleFlexibleTreeLikelihood calculator(*patterns, model, rateDist);
+    calculator.initialize(model, rateDist, *tree);
+    calculator.calculateLogLikelihood();
+
+    insertTaxon(*tree);
+    const double expected = freshLogLikelihood(*tree);
+    const size_t operations = AbstractFlexibleTreeLikelihood::operationCallCount;
+    calculator.updateTree();
+    ASSERT_EQ(expected, calculator.calculateLogLikelihood());
+    ASSERT_EQ(operations + 3, AbstractFlexibleTreeLikelihood::operationCallCount);
+}
+
+TEST_F(LikelihoodStateTest, RolledBack)
+{
+    std::unique_ptr<TreeTemplate<Node>> tree(makeTree());
+    SimpleFlexibleTreeLikelihood calculator(*patterns, model, rateDist);
+    calculator.initialize(model, rateDist, *tree);
+    const double logLikelihood = calculator.calculateLogLikelihood();
+
+    // Only the path from the changed branch to the root is updated
+    calculator.checkpoint();
+    tree->getNode(2)->setDistanceToFather(0.3);
+    const double expected = freshLogLikelihood(*tree);
+    size_t operations = AbstractFlexibleTreeLikelihood::operationCallCount;
+    calculator.updateNode(*tree->getNode(2));
+    ASSERT_EQ(expected, calculator.calculateLogLikelihood());
+    ASSERT_EQ(operations + 2, AbstractFlexibleTreeLikelihood::operationCallCount);
+
+    // Rejected: nothing is recomputed
+    tree->getNode(2)->setDistanceToFather(0.15);
+    operations = AbstractFlexibleTreeLikelihood::operationCallCount;
+    calculator.rollback();
+    ASSERT_EQ(logLikelihood, calculator.calculateLogLikelihood());
+    ASSERT_EQ(operations, AbstractFlexibleTreeLikelihood::operationCallCount);
+
+    // The buffers swapped back hold for the next change
+    tree->getNode(0)->setDistanceToFather(0.4);
+    const double other = freshLogLikelihood(*tree);
+    operations = AbstractFlexibleTreeLikelihood::operationCallCount;
+    calculator.updateNode(*tree->getNode(0));
+    ASSERT_EQ(other, calculator.calculateLogLikelihood());
+    ASSERT_EQ(operations + 2, AbstractFlexibleTreeLikelihood::operationCallCount);
+}
+
+TEST_F(LikelihoodStateTest, RolledBackToLastCheckpoint)
+{
+    std::unique_ptr<TreeTemplate<Node>> tree(makeTree());
+    SimpleFlexibleTreeLikelihood calculator(*patterns, model, rateDist, true, SimdBackend::AUTO, false, false, true);
+    calculator.initialize(model, rateDist, *tree);
+    calculator.calculateLogLikelihood();
+    std::shared_ptr<const LikelihoodState> state = calculator.saveState();
+
+    // Accepted
+    calculator.checkpoint();
+    tree->getNode(7)->setDistanceToFather(0.2);
+    calculator.updateNode(*tree->getNode(7));
+    const double accepted = calculator.calculateLogLikelihood();
+    ASSERT_EQ(freshLogLikelihood(*tree), accepted);
+
+    // Rejected, changing the same branch twice and another one
+    calculator.checkpoint();
+    tree->getNode(7)->setDistanceToFather(0.5);
+    calculator.updateNode(*tree->getNode(7));
+    tree->getNode(7)->setDistanceToFather(0.6);
+    calculator.updateNode(*tree->getNode(7));
+    tree->getNode(3)->setDistanceToFather(0.1);
+    calculator.updateNode(*tree->getNode(3));
+    calculator.calculateLogLikelihood();
+    tree->getNode(7)->setDistanceToFather(0.2);
+    tree->getNode(3)->setDistanceToFather(0.2);
+    calculator.rollback();
+    ASSERT_EQ(accepted, calculator.calculateLogLikelihood());
+    tree->getNode(1)->setDistanceToFather(0.3);
+    calculator.updateNode(*tree->getNode(1));
+    ASSERT_EQ(freshLogLikelihood(*tree), calculator.calculateLogLikelihood());
+    tree->getNode(1)->setDistanceToFather(0.1);
+
+    // The state saved before the first checkpoint was left as is
+    std::unique_ptr<TreeTemplate<Node>> original(makeTree());
+    const double expected = freshLogLikelihood(*original);
+    const size_t operations = AbstractFlexibleTreeLikelihood::operationCallCount;
+    calculator.initialize(model, rateDist, *original, state);
+    ASSERT_EQ(expected, calculator.calculateLogLikelihood());
+    ASSERT_EQ(operations, AbstractFlexibleTreeLikelihood::operationCallCount);
+}
+
+}}} // namespaces
@@ -0,0 +1,190 @@
+#include "gtest/gtest.h"
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <Bpp/Phyl/Model/Nucleotide/JCnuc.h>
+#include <Bpp/Phyl/Model/RateDistribution/ConstantRateDistribution.h>
+#include <Bpp/Phyl/SitePatterns.h>
+#include <Bpp/Phyl/TreeTemplate.h>
+#include <Bpp/Seq/Alphabet/DNA.h>
+#include <Bpp/Seq/Container/VectorSiteContainer.h>
+
+#include "composite_tree_likelihood.h"
+#include "simple_flexible_tree_likelihood.h"
+#include "tree_particle.h"
+#include "uniform_online_add_sequence_move.h"
+
+namespace sts { namespace test { namespace online_add_sequence_move {
+
+using namespace bpp;
+using namespace sts::online;
+
+const DNA dna;
+
+/// Records the group of each proposal
+class GroupRecordingMove : public UniformOnlineAddSequenceMove
+{
+public:
+    using UniformOnlineAddSequenceMove::UniformOnlineAddSequenceMove;
+
+    /// Taxon and group of each proposal, in order
+    std::vector<std::pair<size_t, size_t>> groups;
+protected:
+    virtual AttachmentProposal propose(size_t taxonIndex, TreeParticle& particle, smc::rng* rng)
+    {
+        groups.emplace_back(taxonIndex, treeGroup(particle.tree()));
+        return UniformOnlineAddSequenceMove::propose(taxonIndex, particle, rng);
+    }
+};
+
+class OnlineAddSequenceMoveTest : public ::testing::Test
+{
+protected:
+    OnlineAddSequenceMoveTest() :
+        sites(&dna),
+        names { "t0", "t1", "t2", "t3", "t4", "t5", "t6" }
+    {
+        const std::vector<std::string> sequences = {
+            "ACGTACGTAAACGTACGTAA",
+            "ACGTACGAAAACGTACGAAA",
+            "ACCTACGTAAACCTACGTAT",
+            "TCGTACGTATTCGTACGTAT",
+            "ACGTTCGTAAACGTTCGTAA",
+            "ACGAACGTCAACGAACGTCA",
+            "TCGTACCTAATCGTACCTAA" };
+        for(size_t i = 0; i < sequences.size(); i++)
+            sites.addSequence(BasicSequence(names[i], sequences[i], &dna));
+        patterns.reset(new SitePatterns(&sites));
+        calculator.reset(new CompositeTreeLikelihood(std::shared_ptr<FlexibleTreeLikelihood>(
+            new SimpleFlexibleTreeLikelihood(*patterns, model, rateDist))));
+    }
+
+    // ((t0,t1),t2), or ((t1,t0),t2), internal ids after those of all the leaves, rooted as the particles are
+    TreeParticle makeParticle(bool swapped = false)
+    {
+        Node* root = new Node(8);
+        Node* inner = new Node(7);
+        root->addSon(inner);
+        for(int j = 0; j < 3; j++) {
+            const int i = swapped && j < 2 ? 1 - j : j;
+            Node* leaf = new Node(i, names[i]);
+            (i < 2 ? inner : root)->addSon(leaf);
+            leaf->setDistanceToFather(i < 2 ? 0.1 * (i + 1) : 0.0);
+        }
+        inner->setDistanceToFather(0.3);
+        return TreeParticle(std::shared_ptr<const SubstitutionModel>(model.clone()),
+                            std::unique_ptr<TreeTemplate<Node>>(new TreeTemplate<Node>(root)),
+                            std::shared_ptr<const DiscreteDistribution>(rateDist.clone()),
+                            &sites);
+    }
+
+    double logLikelihood(TreeParticle& particle)
+    {
+        calculator->initialize(particle.model(), particle.rateDist(), particle.mutableTree());
+        return (*calculator)();
+    }
+
+    static std::pair<double, double> proposeLength(smc::rng* rng)
+    {
+        const double length = rng->Exponential(0.1);
+        return { length, std::log(10.0) - length / 0.1 };
+    }
+
+    VectorSiteContainer sites;
+    const std::vector<std::string> names;
+    JCnuc model { &dna };
+    ConstantRateDistribution rateDist;
+    std::unique_ptr<SitePatterns> patterns;
+    std::unique_ptr<CompositeTreeLikelihood> calculator;
+};
+
+TEST_F(OnlineAddSequenceMoveTest, AddsBatches)
+{
+    UniformOnlineAddSequenceMove move(*calculator, names, { "t3", "t4", "t5", "t6" }, proposeLength);
+    move.setBatchSize(3);
+    smc::particle<TreeParticle> particle(makeParticle(), 0.0);
+    smc::rng rng(gsl_rng_mt19937, 1);
+    const double initialLogLike = logLikelihood(*particle.GetValuePointer());
+
+    // Three taxa, then the one left
+    move(1, particle, &rng);
+    std::vector<ProposalRecord> records = move.getProposalRecords();
+    ASSERT_EQ(3u, records.size());
+    EXPECT_EQ(6u, particle.GetValue().tree().getNumberOfLeaves());
+    move(2, particle, &rng);
+    records = move.getProposalRecords();
+    ASSERT_EQ(4u, records.size());
+    EXPECT_EQ(1, records[0].T);
+    EXPECT_EQ(1, records[2].T);
+    EXPECT_EQ(2, records[3].T);
+
+    // The weight of a batch adds the terms of its insertions, each from the tree left by the previous one
+    double logWeight = 0;
+    double logLike = initialLogLike;
+    for(const ProposalRecord& record : records) {
+        EXPECT_NEAR(logLike, record.originalLogLike, 1e-8);
+        EXPECT_DOUBLE_EQ(logWeight, record.originalLogWeight);
+        logWeight += record.newLogLike - record.proposal.logProposalDensity() - record.originalLogLike;
+        EXPECT_NEAR(logWeight, record.newLogWeight, 1e-8);
+        logLike = record.newLogLike;
+    }
+    EXPECT_NEAR(logWeight, particle.GetLogWeight(), 1e-8);
+    EXPECT_NEAR(logLike, logLikelihood(*particle.GetValuePointer()), 1e-8);
+
+    // New internal nodes follow the others, in the order their taxa were added
+    const TreeTemplate<Node>& tree = particle.GetValue().tree();
+    std::set<int> ids;
+    for(const Node* node : tree.getNodes())
+        ids.insert(node->getId());
+    EXPECT_EQ(std::set<int>({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12}), ids);
+    EXPECT_EQ(7u, tree.getNumberOfLeaves());
+    EXPECT_FALSE(tree.isMultifurcating());
+}
+
+TEST_F(OnlineAddSequenceMoveTest, GroupsByTree)
+{
+    GroupRecordingMove move(*calculator, names, { "t3", "t4" }, proposeLength);
+    move.setBatchSize(2);
+    // Copies of a particle, resampled from it, one of them since changed by an MCMC move
+    smc::particle<TreeParticle> particle(makeParticle(), 0.0);
+    smc::particle<TreeParticle> copy(particle);
+    smc::particle<TreeParticle> moved(particle);
+    moved.GetValuePointer()->mutableTree().getNode(0)->setDistanceToFather(0.15);
+    smc::rng rng(gsl_rng_mt19937, 1);
+    move(1, particle, &rng);
+    move(1, copy, &rng);
+    move(1, moved, &rng);
+
+    ASSERT_EQ(6u, move.groups.size());
+    EXPECT_EQ(3u, move.groups[0].first);
+    EXPECT_EQ(4u, move.groups[1].first);
+    // Same tree for the first taxon, and distinct trees once it is attached
+    EXPECT_EQ(move.groups[0].second, move.groups[2].second);
+    EXPECT_NE(move.groups[1].second, move.groups[3].second);
+    EXPECT_NE(move.groups[0].second, move.groups[1].second);
+    // A copy no longer identical to the others draws from proposals of its own
+    EXPECT_NE(move.groups[0].second, move.groups[4].second);
+}
+
+TEST_F(OnlineAddSequenceMoveTest, PropagatesGroupsFromTheirFirstParticle)
+{
+    UniformOnlineAddSequenceMove move(*calculator, names, { "t3" }, proposeLength);
+    // The same tree, but for the order of the children
+    std::vector<TreeParticle> particles { makeParticle(), makeParticle(true) };
+    ASSERT_EQ(std::vector<std::string>({ "t1", "t0", "t2" }), particles[1].tree().getLeavesNames());
+    smc::rng rng(gsl_rng_mt19937, 1);
+    move.propagate(1, { &particles[0], &particles[1] }, { &rng });
+
+    // The second particle was built from the tree of the first
+    std::vector<std::string> leaves = particles[1].tree().getLeavesNames();
+    leaves.erase(std::find(leaves.begin(), leaves.end(), "t3"));
+    EXPECT_EQ(std::vector<std::string>({ "t0", "t1", "t2" }), leaves);
+    EXPECT_EQ(4u, particles[0].tree().getNumberOfLeaves());
+}
+
+}}} // namespaces
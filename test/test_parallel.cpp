@@ -0,0 +1,43 @@
+#include "gtest/gtest.h"
+
+#include "parallel.h"
+
+#include <stdexcept>
+#include <vector>
+
+namespace sts { namespace test { namespace parallel {
+
+using namespace sts::online;
+
+TEST(Parallel, ItemsRunOnceOnTheirWorker)
+{
+    const size_t count = 103, threads = 4;
+    std::vector<int> calls(count, 0);
+    std::vector<size_t> workers(count, threads);
+    parallelFor(count, threads, [&](size_t i) {
+        calls[i]++;
+        workers[i] = currentWorker();
+    });
+    for(size_t i = 0; i < count; i++) {
+        ASSERT_EQ(1, calls[i]) << "at " << i;
+        ASSERT_EQ(i % threads, workers[i]) << "at " << i;
+    }
+    ASSERT_EQ(0u, currentWorker());
+}
+
+TEST(Parallel, SingleThreadRunsInOrder)
+{
+    std::vector<size_t> order;
+    parallelFor(5, 1, [&](size_t i) { order.push_back(i); });
+    ASSERT_EQ(std::vector<size_t>({0, 1, 2, 3, 4}), order);
+}
+
+TEST(Parallel, ExceptionsAreRethrown)
+{
+    ASSERT_THROW(parallelFor(10, 3, [](size_t i) {
+        if(i == 7)
+            throw std::runtime_error("failed");
+    }), std::runtime_error);
+}
+
+}}} // namespaces
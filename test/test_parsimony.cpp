@@ -73,6 +73,8 @@ TEST(STSFlexibleParsimony, TestAddTaxa)
     Node* father = aNode->getFather();
     double score2 = p.getScore(*tree, *aNode, sequences->getSequence(2).getName());
     ASSERT_EQ(score2, 806);
+    // Taxa can also be referred to by their index in the alignment
+    ASSERT_EQ(score2, p.getScore(*tree, *aNode, static_cast<size_t>(2)));
     
     Node* new_leaf2 = new Node(2, sequences->getSequence(2).getName());
     Node* temp = new Node(counter++, "leaf2dad");
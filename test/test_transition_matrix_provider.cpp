@@ -0,0 +1,84 @@
+#include "gtest/gtest.h"
+
+#include <memory>
+#include <vector>
+
+#include <Bpp/Seq/Alphabet/DNA.h>
+#include <Bpp/Phyl/Model/Nucleotide/JCnuc.h>
+
+#include "transition_matrix_provider.h"
+
+namespace sts { namespace test { namespace transition_matrix_provider {
+
+using namespace sts::online;
+
+const double TOLERANCE = 1e-12;
+
+const bpp::DNA dna;
+
+void expectMatrixNear(const bpp::Matrix<double>& expected, const std::vector<double>& actual)
+{
+    for(size_t i = 0; i < 4; i++) {
+        for(size_t j = 0; j < 4; j++)
+            ASSERT_NEAR(expected(i, j), actual[i * 4 + j], TOLERANCE) << "at " << i << "," << j;
+    }
+}
+
+TEST(TransitionMatrixProvider, ClosedFormJC69)
+{
+    bpp::JCnuc model(&dna);
+    TransitionMatrixProvider provider;
+    provider.setModel(model);
+    ASSERT_TRUE(provider.closedForm());
+
+    std::vector<double> matrix(16), d1(16), d2(16);
+    for(double t : { 0.0, 0.003, 0.1, 2.5 }) {
+        provider.transitionMatrix(t, matrix.data());
+        expectMatrixNear(model.getPij_t(t), matrix);
+        provider.transitionMatrixDerivatives(t, d1.data(), d2.data());
+        expectMatrixNear(model.getdPij_dt(t), d1);
+        expectMatrixNear(model.getd2Pij_dt2(t), d2);
+    }
+    ASSERT_EQ(0u, provider.misses());
+}
+
+TEST(TransitionMatrixProvider, Cache)
+{
+    bpp::JCnuc model(&dna);
+    TransitionMatrixProvider provider(2, false);
+    provider.setModel(model);
+    ASSERT_FALSE(provider.closedForm());
+
+    std::vector<double> matrix(16);
+    provider.transitionMatrix(0.1, matrix.data());
+    provider.transitionMatrix(0.1, matrix.data());
+    expectMatrixNear(model.getPij_t(0.1), matrix);
+    ASSERT_EQ(1u, provider.misses());
+    ASSERT_EQ(1u, provider.hits());
+
+    // 0.1 is the least recently used matrix when 0.3 comes in
+    provider.transitionMatrix(0.2, matrix.data());
+    provider.transitionMatrix(0.3, matrix.data());
+    provider.transitionMatrix(0.2, matrix.data());
+    expectMatrixNear(model.getPij_t(0.2), matrix);
+    ASSERT_EQ(1u + 2u, provider.misses());
+    ASSERT_EQ(2u, provider.hits());
+    provider.transitionMatrix(0.1, matrix.data());
+    expectMatrixNear(model.getPij_t(0.1), matrix);
+    ASSERT_EQ(4u, provider.misses());
+}
+
+TEST(TransitionMatrixProvider, RevisionFollowsParameters)
+{
+    bpp::JCnuc model(&dna);
+    std::unique_ptr<bpp::SubstitutionModel> clone(model.clone());
+    TransitionMatrixProvider provider;
+    provider.setModel(model);
+    const size_t revision = provider.revision();
+
+    // Clones share the matrices of the original
+    provider.setModel(*clone);
+    ASSERT_EQ(revision, provider.revision());
+}
+
+}}} // namespaces
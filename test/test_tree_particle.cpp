@@ -0,0 +1,57 @@
+#include "gtest/gtest.h"
+
+#include <memory>
+
+#include <Bpp/Phyl/Model/RateDistribution/ConstantRateDistribution.h>
+#include <Bpp/Phyl/Model/Nucleotide/JCnuc.h>
+#include <Bpp/Phyl/TreeTemplate.h>
+#include <Bpp/Seq/Alphabet/DNA.h>
+
+#include "tree_particle.h"
+
+namespace sts { namespace test { namespace tree_particle {
+
+using namespace bpp;
+using namespace sts::online;
+
+const DNA dna;
+
+TreeParticle makeParticle()
+{
+    Node* root = new Node(2);
+    Node* a = new Node(0, "a");
+    Node* b = new Node(1, "b");
+    root->addSon(a);
+    root->addSon(b);
+    a->setDistanceToFather(0.1);
+    b->setDistanceToFather(0.2);
+    return TreeParticle(std::unique_ptr<SubstitutionModel>(new JCnuc(&dna)),
+                        std::unique_ptr<TreeTemplate<Node>>(new TreeTemplate<Node>(root)),
+                        std::unique_ptr<DiscreteDistribution>(new ConstantRateDistribution()),
+                        nullptr);
+}
+
+TEST(TreeParticle, CopiesShareUntilWritten)
+{
+    TreeParticle original = makeParticle();
+    TreeParticle copy = original;
+    ASSERT_EQ(&original.tree(), &copy.tree());
+    ASSERT_EQ(&original.model(), &copy.model());
+    ASSERT_TRUE(copy.sharesTree());
+
+    copy.mutableTree().getRootNode()->getSon(0)->setDistanceToFather(0.5);
+    ASSERT_NE(&original.tree(), &copy.tree());
+    ASSERT_EQ(&original.model(), &copy.model());
+    ASSERT_EQ(0.1, original.tree().getRootNode()->getSon(0)->getDistanceToFather());
+    ASSERT_EQ(0.5, copy.tree().getRootNode()->getSon(0)->getDistanceToFather());
+    ASSERT_FALSE(original.sharesTree());
+}
+
+TEST(TreeParticle, UnsharedTreeIsNotCloned)
+{
+    TreeParticle particle = makeParticle();
+    const TreeTemplate<Node>* tree = &particle.tree();
+    ASSERT_EQ(tree, &particle.mutableTree());
+}
+
+}}} // namespaces
@@ -0,0 +1,36 @@
+#ifndef STS_TEST_TEST_TREES_H
+#define STS_TEST_TEST_TREES_H
+
+#include <string>
+#include <vector>
+
+#include <Bpp/Phyl/TreeTemplate.h>
+
+namespace sts { namespace test {
+
+/// \brief ((t0,t1),(t2,t3)), rooted as the particles are: the branch above (t2,t3) has length 0
+///
+/// \param rootID ID of the root, followed below by those of (t0,t1) and (t2,t3)
+/// \param leafLengths Branch lengths above t0 to t3
+/// \param innerLength Branch length above (t0,t1)
+inline bpp::TreeTemplate<bpp::Node>* makeQuartet(int rootID, const std::vector<double>& leafLengths,
+                                                 double innerLength)
+{
+    bpp::Node* root = new bpp::Node(rootID);
+    bpp::Node* left = new bpp::Node(rootID - 1);
+    bpp::Node* right = new bpp::Node(rootID - 2);
+    root->addSon(left);
+    root->addSon(right);
+    for(int i = 0; i < 4; i++) {
+        bpp::Node* leaf = new bpp::Node(i, "t" + std::to_string(i));
+        (i < 2 ? left : right)->addSon(leaf);
+        leaf->setDistanceToFather(leafLengths.at(i));
+    }
+    left->setDistanceToFather(innerLength);
+    right->setDistanceToFather(0.0);
+    return new bpp::TreeTemplate<bpp::Node>(root);
+}
+
+}} // namespaces
+
+#endif // STS_TEST_TEST_TREES_H